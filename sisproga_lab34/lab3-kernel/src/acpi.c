@@ -8,8 +8,7 @@ static void s_putc(char c, void* ctx) { (void)ctx; serial_putc(c); }
 static void logf(const char* fmt, ...) {
   __builtin_va_list ap;
   __builtin_va_start(ap, fmt);
-  void** va = (void**)&ap;
-  mini_vprintf(s_putc, 0, fmt, va);
+  mini_vprintf(s_putc, 0, fmt, ap);
   __builtin_va_end(ap);
 }
 
@@ -76,6 +75,73 @@ const madt_t* acpi_find_madt_via_rsdt(const rsdp_t* rsdp) {
   return 0;
 }
 
+// Root table entries are 4 bytes in the RSDT and 8 in the XSDT; an i386
+// kernel without paging skips anything above 4 GiB.
+static const acpi_sdt_header_t* find_in_root(const acpi_sdt_header_t* root, uint32_t esz, const char* sig) {
+  if (root->length < sizeof(acpi_sdt_header_t)) return 0;
+
+  uint32_t n = (root->length - (uint32_t)sizeof(acpi_sdt_header_t)) / esz;
+  const uint8_t* ent = (const uint8_t*)root + sizeof(acpi_sdt_header_t);
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t addr = (esz == 8) ? *(const uint64_t*)(ent + i * 8) : *(const uint32_t*)(ent + i * 4);
+    if (!addr || (sizeof(uintptr_t) == 4 && addr >> 32)) continue;
+    const acpi_sdt_header_t* h = (const acpi_sdt_header_t*)(uintptr_t)addr;
+    if (sig4(h->signature, sig)) return h;
+  }
+  return 0;
+}
+
+const acpi_sdt_header_t* acpi_find_table(const rsdp_t* rsdp, const char* sig) {
+  if (!rsdp) return 0;
+
+  const acpi_sdt_header_t* h = 0;
+  if (rsdp->revision >= 2 && rsdp->xsdt_address &&
+      !(sizeof(uintptr_t) == 4 && rsdp->xsdt_address >> 32)) {
+    const acpi_sdt_header_t* xsdt = (const acpi_sdt_header_t*)(uintptr_t)rsdp->xsdt_address;
+    if (sig4(xsdt->signature, "XSDT")) h = find_in_root(xsdt, 8, sig);
+  }
+  if (!h) {
+    const acpi_sdt_header_t* rsdt = rsdt_from_rsdp(rsdp);
+    if (rsdt && sig4(rsdt->signature, "RSDT")) h = find_in_root(rsdt, 4, sig);
+  }
+  if (h && checksum8(h, h->length) != 0) {
+    logf("[ACPI][WARN] %.4s checksum != 0\n", sig);
+  }
+  return h;
+}
+
+static void list_root(const acpi_sdt_header_t* root, uint32_t esz) {
+  uint32_t n = (root->length - (uint32_t)sizeof(acpi_sdt_header_t)) / esz;
+  const uint8_t* ent = (const uint8_t*)root + sizeof(acpi_sdt_header_t);
+  logf("[ACPI] %.4s @ %x: %u tables\n", root->signature, (uint32_t)(uintptr_t)root, n);
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t addr = (esz == 8) ? *(const uint64_t*)(ent + i * 8) : *(const uint32_t*)(ent + i * 4);
+    if (!addr || (sizeof(uintptr_t) == 4 && addr >> 32)) {
+      logf("[ACPI]  [%u] %lx (not addressable)\n", i, addr);
+      continue;
+    }
+    const acpi_sdt_header_t* h = (const acpi_sdt_header_t*)(uintptr_t)addr;
+    logf("[ACPI]  [%u] %.4s @ %x len=%u rev=%u oem=%.6s/%.8s%s\n", i, h->signature,
+         (uint32_t)addr, h->length, (uint32_t)h->revision, h->oemid, h->oem_table_id,
+         checksum8(h, h->length) ? " BAD CHECKSUM" : "");
+  }
+}
+
+void acpi_list_tables(const rsdp_t* rsdp) {
+  if (!rsdp) return;
+  if (rsdp->revision >= 2 && rsdp->xsdt_address &&
+      !(sizeof(uintptr_t) == 4 && rsdp->xsdt_address >> 32)) {
+    const acpi_sdt_header_t* xsdt = (const acpi_sdt_header_t*)(uintptr_t)rsdp->xsdt_address;
+    if (sig4(xsdt->signature, "XSDT") && xsdt->length >= sizeof(acpi_sdt_header_t)) {
+      list_root(xsdt, 8);
+      return;
+    }
+  }
+  const acpi_sdt_header_t* rsdt = rsdt_from_rsdp(rsdp);
+  if (rsdt && sig4(rsdt->signature, "RSDT") && rsdt->length >= sizeof(acpi_sdt_header_t)) list_root(rsdt, 4);
+  else logf("[ACPI][ERR] no usable RSDT/XSDT\n");
+}
+
 static void dump_bytes(const void* p, uint32_t n) {
   const uint8_t* b = (const uint8_t*)p;
   for (uint32_t i=0;i<n;i++) {
@@ -33,6 +33,77 @@ typedef struct __attribute__((packed)) {
   uint8_t  entries[];
 } madt_t;
 
+// MCFG: one entry per PCI segment group with ECAM config space.
+typedef struct __attribute__((packed)) {
+  uint64_t base;
+  uint16_t segment;
+  uint8_t  start_bus;
+  uint8_t  end_bus;
+  uint32_t reserved;
+} mcfg_entry_t;
+
+typedef struct __attribute__((packed)) {
+  acpi_sdt_header_t hdr;
+  uint64_t     reserved;
+  mcfg_entry_t entries[];
+} mcfg_t;
+
+// SRAT: which proximity domain each CPU and memory range belongs to.
+typedef struct __attribute__((packed)) {
+  acpi_sdt_header_t hdr;
+  uint32_t reserved1;
+  uint64_t reserved2;
+  uint8_t  entries[];
+} srat_t;
+
+#define SRAT_CPU_APIC    0      // 16 bytes
+#define SRAT_MEMORY      1      // 40 bytes
+#define SRAT_CPU_X2APIC  2      // 24 bytes
+#define SRAT_ENABLED     (1u << 0)
+
+typedef struct __attribute__((packed)) {
+  uint8_t  type, length;
+  uint8_t  domain_lo;
+  uint8_t  apic_id;
+  uint32_t flags;
+  uint8_t  sapic_eid;
+  uint8_t  domain_hi[3];
+  uint32_t clock_domain;
+} srat_cpu_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t  type, length;
+  uint32_t domain;
+  uint16_t reserved1;
+  uint64_t base;
+  uint64_t len;
+  uint32_t reserved2;
+  uint32_t flags;
+  uint64_t reserved3;
+} srat_mem_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t  type, length;
+  uint16_t reserved1;
+  uint32_t domain;
+  uint32_t x2apic_id;
+  uint32_t flags;
+  uint32_t clock_domain;
+  uint32_t reserved2;
+} srat_x2apic_t;
+
+// SLIT: relative distance between domains, row-major, 10 = local.
+typedef struct __attribute__((packed)) {
+  acpi_sdt_header_t hdr;
+  uint64_t localities;
+  uint8_t  entries[];
+} slit_t;
+
 void acpi_dump_rsdp(const rsdp_t* rsdp);
+// Any table by signature: through the XSDT when the RSDP has one the kernel
+// can address, the RSDT otherwise. 0 when absent.
+const acpi_sdt_header_t* acpi_find_table(const rsdp_t* rsdp, const char* sig);
+// Every table the root table points at, with its checksum checked.
+void acpi_list_tables(const rsdp_t* rsdp);
 const madt_t* acpi_find_madt_via_rsdt(const rsdp_t* rsdp);
 void acpi_dump_madt(const madt_t* madt);
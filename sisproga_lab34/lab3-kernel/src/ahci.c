@@ -0,0 +1,376 @@
+#include "ata.h"
+#include "blk.h"
+#include "pci.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "serial.h"
+
+// AHCI, polled. Each queued request takes a command slot; one issue call
+// fills as many slots as it can and starts them with a single PxCI write
+// (and PxSACT, for NCQ). With NCQ the disk reorders them itself; without
+// it the HBA still runs the slots back to back.
+
+#define HBA_CAP    0x00
+#define HBA_GHC    0x04
+#define HBA_PI     0x0C
+#define HBA_VS     0x10
+
+#define CAP_S64A   (1u << 31)
+#define CAP_SNCQ   (1u << 30)
+#define GHC_AE     (1u << 31)
+
+#define PX_CLB     0x00
+#define PX_CLBU    0x04
+#define PX_FB      0x08
+#define PX_FBU     0x0C
+#define PX_IS      0x10
+#define PX_IE      0x14
+#define PX_CMD     0x18
+#define PX_TFD     0x20
+#define PX_SIG     0x24
+#define PX_SSTS    0x28
+#define PX_SERR    0x30
+#define PX_SACT    0x34
+#define PX_CI      0x38
+
+#define PXCMD_ST   (1u << 0)
+#define PXCMD_FRE  (1u << 4)
+#define PXCMD_FR   (1u << 14)
+#define PXCMD_CR   (1u << 15)
+#define PXIS_TFES  (1u << 30)
+
+#define SIG_ATA    0x00000101u
+#define FIS_H2D    0x27
+
+#define AHCI_MAX_PORTS 4
+#define AHCI_SLOTS     32
+#define AHCI_MAX_PRD   BLK_MAX_SEGS
+#define AHCI_TABLE     (0x80 + AHCI_MAX_PRD * 16)   // 640 bytes, 128-aligned
+
+typedef struct __attribute__((packed)) {
+  uint16_t flags;           // CFL in dwords, W, ...
+  uint16_t prdtl;
+  uint32_t prdbc;
+  uint32_t ctba;
+  uint32_t ctbau;
+  uint32_t reserved[4];
+} ahci_hdr_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t dba;
+  uint32_t dbau;
+  uint32_t reserved;
+  uint32_t dbc;             // byte count - 1; bit 31: interrupt
+} ahci_prd_t;
+
+typedef struct {
+  blk_dev_t   blk;
+  volatile uint8_t* port;
+  int         ncq;
+  uint32_t    slots;        // usable command slots
+  uint32_t    busy;         // slots issued, not yet reaped
+  uint32_t    failed;       // of which never started: a buffer out of reach
+  ahci_hdr_t* list;
+  uint8_t*    table[AHCI_SLOTS];
+  blk_req_t*  req[AHCI_SLOTS];
+} ahci_port_t;
+
+static ahci_port_t s_ports[AHCI_MAX_PORTS];
+static uint32_t    s_nports;
+static int         s_s64a;
+
+static volatile uint32_t* reg(volatile uint8_t* base, uint32_t off) {
+  return (volatile uint32_t*)(base + off);
+}
+
+static int wait_clear(volatile uint8_t* port, uint32_t off, uint32_t bits) {
+  for (uint32_t spin = 0; spin < 1000000; ++spin) {
+    if (!(*reg(port, off) & bits)) return 0;
+    cpu_pause();
+  }
+  return -1;
+}
+
+static int port_stop(volatile uint8_t* port) {
+  *reg(port, PX_CMD) &= ~PXCMD_ST;
+  if (wait_clear(port, PX_CMD, PXCMD_CR) < 0) return -1;
+  *reg(port, PX_CMD) &= ~PXCMD_FRE;
+  return wait_clear(port, PX_CMD, PXCMD_FR);
+}
+
+static int port_start(volatile uint8_t* port) {
+  *reg(port, PX_SERR) = 0xFFFFFFFFu;
+  *reg(port, PX_IS)   = 0xFFFFFFFFu;
+  *reg(port, PX_CMD) |= PXCMD_FRE;
+  if (wait_clear(port, PX_TFD, ATA_SR_BSY | ATA_SR_DRQ) < 0) return -1;
+  *reg(port, PX_CMD) |= PXCMD_ST;
+  return 0;
+}
+
+static int dma_ok(uint64_t addr, uint32_t len) {
+  return s_s64a || addr + len <= 0x100000000ull;
+}
+
+// Fills slot `slot` with an H2D register FIS for `cmd` over the segments.
+static void build(ahci_port_t* p, uint32_t slot, uint8_t cmd, uint64_t lba, uint32_t count,
+                  const blk_seg_t* seg, uint32_t nseg) {
+  uint8_t* t = p->table[slot];
+  for (uint32_t i = 0; i < 0x80; ++i) t[i] = 0;
+
+  t[0] = FIS_H2D;
+  t[1] = 0x80;              // command, not control
+  t[2] = cmd;
+  t[4] = (uint8_t)lba;
+  t[5] = (uint8_t)(lba >> 8);
+  t[6] = (uint8_t)(lba >> 16);
+  t[7] = ATA_DEV_LBA;
+  t[8] = (uint8_t)(lba >> 24);
+  t[9] = (uint8_t)(lba >> 32);
+  t[10] = (uint8_t)(lba >> 40);
+  if (cmd == ATA_CMD_READ_FPDMA) {
+    t[3]  = (uint8_t)count;         // FPDMA: count in features, tag in count
+    t[11] = (uint8_t)(count >> 8);
+    t[12] = (uint8_t)(slot << 3);
+  } else {
+    t[12] = (uint8_t)count;
+    t[13] = (uint8_t)(count >> 8);
+  }
+  if (cmd == ATA_CMD_IDENTIFY) t[7] = 0;
+
+  ahci_prd_t* prd = (ahci_prd_t*)(t + 0x80);
+  for (uint32_t i = 0; i < nseg; ++i) {
+    prd[i].dba      = (uint32_t)seg[i].addr;
+    prd[i].dbau     = (uint32_t)(seg[i].addr >> 32);
+    prd[i].reserved = 0;
+    prd[i].dbc      = seg[i].len - 1;
+  }
+
+  ahci_hdr_t* h = &p->list[slot];
+  h->flags = 5;             // FIS length in dwords, device-to-host
+  h->prdtl = (uint16_t)nseg;
+  h->prdbc = 0;
+}
+
+static uint32_t ahci_issue(blk_dev_t* b, blk_req_t* const* reqs, uint32_t n) {
+  ahci_port_t* p = (ahci_port_t*)b->priv;
+  uint32_t mask = 0, took = 0;
+
+  for (uint32_t slot = 0; slot < p->slots && took < n; ++slot) {
+    if ((p->busy | mask) & (1u << slot)) continue;
+    blk_req_t* r = reqs[took];
+    int ok = 1;
+    for (uint32_t s = 0; s < r->nseg; ++s) ok &= dma_ok(r->seg[s].addr, r->seg[s].len);
+    p->req[slot] = r;
+    took++;
+    if (!ok) {
+      // Takes the slot without starting it; the next poll fails it.
+      serial_printf("[AHCI][ERR] %s: buffer of lba %lu out of DMA reach\n", b->name, r->lba);
+      p->failed |= 1u << slot;
+      continue;
+    }
+    build(p, slot, p->ncq ? ATA_CMD_READ_FPDMA : ATA_CMD_READ_DMA_EXT, r->lba, r->count, r->seg, r->nseg);
+    mask |= 1u << slot;
+  }
+  p->busy |= p->failed;
+  if (!mask) return took;
+
+  __asm__ volatile ("" ::: "memory");
+  if (p->ncq) *reg(p->port, PX_SACT) = mask;
+  *reg(p->port, PX_CI) = mask;
+  p->busy |= mask;
+  b->cmds++;
+  return took;
+}
+
+// Restarts the port and fails every outstanding slot; -1 when the port
+// would not stop or start again.
+static int fail_all(blk_dev_t* b, ahci_port_t* p) {
+  int rc = port_stop(p->port);
+  if (rc == 0) rc = port_start(p->port);
+  for (uint32_t slot = 0; slot < AHCI_SLOTS; ++slot) {
+    if (p->busy & (1u << slot)) blk_complete(b, p->req[slot], -1);
+  }
+  p->busy = 0;
+  p->failed = 0;
+  return rc;
+}
+
+static void ahci_poll(blk_dev_t* b) {
+  ahci_port_t* p = (ahci_port_t*)b->priv;
+  if (!p->busy) return;
+
+  if (p->failed) {
+    for (uint32_t slot = 0; slot < AHCI_SLOTS; ++slot) {
+      if (p->failed & (1u << slot)) blk_complete(b, p->req[slot], -1);
+    }
+    p->busy &= ~p->failed;
+    p->failed = 0;
+    if (!p->busy) return;
+  }
+
+  uint32_t is = *reg(p->port, PX_IS);
+  if (is & PXIS_TFES) {
+    // A failed command stops the port; everything outstanding is lost.
+    serial_printf("[AHCI][ERR] %s: task file %x, failing slots %x\n", b->name,
+                  *reg(p->port, PX_TFD), p->busy);
+    fail_all(b, p);
+    return;
+  }
+
+  uint32_t pending = *reg(p->port, PX_CI);
+  if (p->ncq) pending |= *reg(p->port, PX_SACT);
+  uint32_t done = p->busy & ~pending;
+  if (!done) return;
+  *reg(p->port, PX_IS) = is;
+  p->busy &= ~done;
+  for (uint32_t slot = 0; done; ++slot, done >>= 1) {
+    if (done & 1) blk_complete(b, p->req[slot], 0);
+  }
+}
+
+static int ahci_abort(blk_dev_t* b) {
+  ahci_port_t* p = (ahci_port_t*)b->priv;
+  if (!p->busy) return 0;
+  serial_printf("[AHCI] %s: aborting slots %x\n", b->name, p->busy);
+  return fail_all(b, p);
+}
+
+static const blk_ops_t ahci_ops = { "ahci", ahci_issue, ahci_poll, ahci_abort };
+
+// Command list and FIS area share a page; command tables are packed six to
+// a page so none straddles two. On failure port_free() returns what was
+// taken.
+static int port_memory(ahci_port_t* p) {
+  p->list = 0;
+  for (uint32_t slot = 0; slot < AHCI_SLOTS; ++slot) p->table[slot] = 0;
+
+  uint64_t page = pmm_alloc();
+  if (page && !dma_ok(page, PMM_PAGE)) {
+    pmm_free(page);
+    page = 0;
+  }
+  if (!page) return -1;
+  uint8_t* mem = (uint8_t*)(uintptr_t)page;
+  for (uint32_t i = 0; i < PMM_PAGE; ++i) mem[i] = 0;
+  p->list = (ahci_hdr_t*)mem;
+
+  volatile uint8_t* port = p->port;
+  *reg(port, PX_CLB)  = (uint32_t)page;
+  *reg(port, PX_CLBU) = (uint32_t)(page >> 32);
+  *reg(port, PX_FB)   = (uint32_t)(page + 1024);
+  *reg(port, PX_FBU)  = (uint32_t)((page + 1024) >> 32);
+
+  uint8_t* tp = 0;
+  uint32_t used = PMM_PAGE;
+  for (uint32_t slot = 0; slot < p->slots; ++slot) {
+    if (used + AHCI_TABLE > PMM_PAGE) {
+      uint64_t pg = pmm_alloc();
+      if (pg && !dma_ok(pg, PMM_PAGE)) pmm_free(pg);
+      if (!pg || !dma_ok(pg, PMM_PAGE)) return -1;
+      tp = (uint8_t*)(uintptr_t)pg;
+      used = 0;
+    }
+    p->table[slot] = tp + used;
+    uint64_t ct = (uintptr_t)(tp + used);
+    p->list[slot].ctba  = (uint32_t)ct;
+    p->list[slot].ctbau = (uint32_t)(ct >> 32);
+    used += AHCI_TABLE;
+  }
+  return 0;
+}
+
+// The port must be stopped: the HBA writes received FISes into the list page.
+static void port_free(ahci_port_t* p) {
+  for (uint32_t slot = 0; slot < AHCI_SLOTS; ++slot) {
+    uintptr_t t = (uintptr_t)p->table[slot];
+    if (t && !(t & (PMM_PAGE - 1))) pmm_free(t);
+  }
+  if (p->list) pmm_free((uintptr_t)p->list);
+  p->list = 0;
+}
+
+static int identify(ahci_port_t* p, uint16_t* id) {
+  blk_seg_t seg = { (uintptr_t)id, 512 };
+  build(p, 0, ATA_CMD_IDENTIFY, 0, 0, &seg, 1);
+  *reg(p->port, PX_CI) = 1;
+  for (uint32_t spin = 0; spin < 10000000; ++spin) {
+    if (*reg(p->port, PX_IS) & PXIS_TFES) return -1;
+    if (!(*reg(p->port, PX_CI) & 1)) {
+      *reg(p->port, PX_IS) = 0xFFFFFFFFu;
+      return 0;
+    }
+    cpu_pause();
+  }
+  return -1;
+}
+
+int ahci_init(void) {
+  const pci_dev_t* pci = pci_find_class(0x01, 0x06, 0);
+  if (!pci || pci->prog_if != 0x01) return 0;
+  const pci_bar_t* bar = &pci->bar[5];
+  if (!bar->size || (bar->flags & PCI_BAR_IO) ||
+      (sizeof(uintptr_t) == 4 && bar->base + bar->size > 0x100000000ull)) {
+    serial_printf("[AHCI] ABAR not addressable\n");
+    return 0;
+  }
+  pci_enable(pci, PCI_CMD_MEM | PCI_CMD_MASTER | PCI_CMD_INTX_OFF);
+
+  volatile uint8_t* abar = (volatile uint8_t*)(uintptr_t)bar->base;
+  *reg(abar, HBA_GHC) |= GHC_AE;
+  uint32_t cap = *reg(abar, HBA_CAP);
+  uint32_t pi  = *reg(abar, HBA_PI);
+  s_s64a = (cap & CAP_S64A) != 0 && sizeof(uintptr_t) == 8;
+  uint32_t slots = ((cap >> 8) & 31) + 1;
+  serial_printf("[AHCI] %x:%x.%u version %x, ports %x, %u slots%s\n",
+                (uint32_t)pci->bus, (uint32_t)pci->dev, (uint32_t)pci->fn,
+                *reg(abar, HBA_VS), pi, slots, (cap & CAP_SNCQ) ? ", ncq" : "");
+
+  static uint16_t id[256] __attribute__((aligned(16)));
+  for (uint32_t i = 0; i < 32 && s_nports < AHCI_MAX_PORTS; ++i) {
+    if (!(pi & (1u << i))) continue;
+    volatile uint8_t* port = abar + 0x100 + i * 0x80;
+    if ((*reg(port, PX_SSTS) & 0xF) != 3 || *reg(port, PX_SIG) != SIG_ATA) continue;
+
+    ahci_port_t* p = &s_ports[s_nports];
+    p->port  = port;
+    p->slots = slots;
+    p->busy  = 0;
+    p->failed = 0;
+    p->list  = 0;
+    *reg(port, PX_IE) = 0;
+    if (port_stop(port) < 0) {
+      serial_printf("[AHCI] port %u did not stop, skipped\n", i);
+      continue;
+    }
+    if (port_memory(p) < 0 || port_start(port) < 0 || identify(p, id) < 0) {
+      serial_printf("[AHCI] port %u did not come up\n", i);
+      if (port_stop(port) == 0) port_free(p);
+      continue;
+    }
+
+    ata_ident_t ai;
+    ata_parse_identify(id, &ai);
+    if (!ai.lba48) {
+      serial_printf("[AHCI] port %u '%s' without LBA48 skipped\n", i, ai.model);
+      if (port_stop(port) == 0) port_free(p);
+      continue;
+    }
+    p->ncq = ai.ncq && (cap & CAP_SNCQ);
+    if (p->ncq && ai.ncq_depth < p->slots) p->slots = ai.ncq_depth;
+
+    blk_dev_t* b = &p->blk;
+    b->name[0] = 's';
+    b->name[1] = 'd';
+    b->name[2] = (char)('a' + s_nports);
+    b->name[3] = 0;
+    b->ops     = &ahci_ops;
+    b->priv    = p;
+    b->sectors = ai.sectors;
+    b->depth   = p->slots;
+    serial_printf("[AHCI] %s: port %u '%s', %s, %u slots\n", b->name, i, ai.model,
+                  p->ncq ? "ncq" : "no ncq", p->slots);
+    blk_register(b);
+    s_nports++;
+  }
+  return (int)s_nports;
+}
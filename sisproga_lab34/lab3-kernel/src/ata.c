@@ -0,0 +1,22 @@
+#include "ata.h"
+
+void ata_parse_identify(const uint16_t* id, ata_ident_t* out) {
+  out->lba48 = (id[83] & (1u << 10)) != 0;
+  if (out->lba48) {
+    out->sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                   ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+  } else {
+    out->sectors = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+  }
+  out->ncq       = (id[76] & (1u << 8)) != 0;
+  out->ncq_depth = (id[75] & 31u) + 1;
+
+  // Words 27..46, two characters per word, high byte first.
+  uint32_t n = 0;
+  for (uint32_t w = 27; w <= 46; ++w) {
+    out->model[n++] = (char)(id[w] >> 8);
+    out->model[n++] = (char)id[w];
+  }
+  while (n && out->model[n - 1] == ' ') n--;
+  out->model[n] = 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+
+// What the AHCI and IDE drivers share: ATA commands and IDENTIFY parsing.
+
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_READ_FPDMA    0x60
+#define ATA_CMD_IDENTIFY      0xEC
+
+#define ATA_SR_ERR   0x01
+#define ATA_SR_DRQ   0x08
+#define ATA_SR_DF    0x20
+#define ATA_SR_BSY   0x80
+
+#define ATA_DEV_LBA  0x40
+
+typedef struct {
+  uint64_t sectors;
+  int      lba48;
+  int      ncq;
+  uint32_t ncq_depth;
+  char     model[41];
+} ata_ident_t;
+
+void ata_parse_identify(const uint16_t* id, ata_ident_t* out);
+
+int ahci_init(void);    // disks registered
+int ide_init(void);
@@ -0,0 +1,200 @@
+#include "bcache.h"
+#include "pmm.h"
+#include "serial.h"
+
+#define BC_MAX   1024u
+#define BC_HASH  2048u
+
+enum { BC_FREE, BC_LOADING, BC_VALID };
+
+typedef struct bc_ent bc_ent_t;
+struct bc_ent {
+  uint64_t  block;
+  uint64_t  page;
+  uint8_t   state;
+  uint8_t   ra;           // loaded by read-ahead, not used yet
+  uint8_t   pin;          // the demand block while read-ahead is issued
+  bc_ent_t* prev;         // LRU, most recent after s_lru
+  bc_ent_t* next;
+  bc_ent_t* hnext;
+  blk_req_t req;
+};
+
+static blk_dev_t* s_dev;
+static bc_ent_t   s_ents[BC_MAX];
+static bc_ent_t*  s_hash[BC_HASH];
+static bc_ent_t   s_lru;          // sentinel
+static uint32_t   s_n;
+static uint64_t   s_blocks;       // on the device
+static uint64_t   s_last = ~0ull; // previous block read
+static uint64_t   s_ra_next;      // first block read-ahead has not asked for
+static bcache_stats_t s_st;
+
+#define SPB (BCACHE_BLOCK / BLK_SECTOR)
+
+static void lru_unlink(bc_ent_t* e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+static void lru_front(bc_ent_t* e) {
+  e->next = s_lru.next;
+  e->prev = &s_lru;
+  s_lru.next->prev = e;
+  s_lru.next = e;
+}
+
+static bc_ent_t** bucket(uint64_t block) {
+  return &s_hash[(uint32_t)block & (BC_HASH - 1)];
+}
+
+static bc_ent_t* lookup(uint64_t block) {
+  for (bc_ent_t* e = *bucket(block); e; e = e->hnext) {
+    if (e->block == block) return e;
+  }
+  return 0;
+}
+
+static void unhash(bc_ent_t* e) {
+  for (bc_ent_t** pp = bucket(e->block); *pp; pp = &(*pp)->hnext) {
+    if (*pp == e) {
+      *pp = e->hnext;
+      break;
+    }
+  }
+  e->state = BC_FREE;
+}
+
+// A finished read-ahead becomes valid (or is dropped) when next looked at.
+static void settle(bc_ent_t* e) {
+  if (e->state != BC_LOADING || !e->req.done) return;
+  if (e->req.status == 0) {
+    e->state = BC_VALID;
+  } else {
+    unhash(e);
+  }
+}
+
+// Least recently used entry that is not in flight or pinned, unhashed.
+static bc_ent_t* evict(void) {
+  for (bc_ent_t* e = s_lru.prev; e != &s_lru; e = e->prev) {
+    settle(e);
+    if (e->state == BC_LOADING || e->pin) continue;
+    if (e->state == BC_VALID) unhash(e);
+    return e;
+  }
+  return 0;
+}
+
+static bc_ent_t* start_load(uint64_t block) {
+  bc_ent_t* e = evict();
+  if (!e) return 0;
+  e->block = block;
+  e->state = BC_LOADING;
+  e->ra    = 0;
+  e->hnext = *bucket(block);
+  *bucket(block) = e;
+
+  e->req.lba = block * SPB;
+  blk_req_set_buf(&e->req, e->page, SPB);
+  blk_submit(s_dev, &e->req);
+  return e;
+}
+
+static void read_ahead(uint64_t block) {
+  if (s_ra_next <= block) s_ra_next = block + 1;
+  if (s_ra_next > block + 1 + BCACHE_RA / 2) return;
+
+  uint64_t end = block + 1 + BCACHE_RA;
+  if (end > s_blocks) end = s_blocks;
+  for (; s_ra_next < end; ++s_ra_next) {
+    if (lookup(s_ra_next)) continue;
+    bc_ent_t* e = start_load(s_ra_next);
+    if (!e) break;
+    e->ra = 1;
+    lru_unlink(e);
+    lru_front(e);
+    s_st.ra_issued++;
+  }
+}
+
+void bcache_init(blk_dev_t* d, uint32_t blocks) {
+  if (blocks > BC_MAX) blocks = BC_MAX;
+  s_lru.next = s_lru.prev = &s_lru;
+  s_dev    = d;
+  s_blocks = d->sectors / SPB;
+  for (s_n = 0; s_n < blocks; ++s_n) {
+    bc_ent_t* e = &s_ents[s_n];
+    e->page = pmm_alloc();
+    if (!e->page) break;
+    e->state = BC_FREE;
+    lru_front(e);
+  }
+  serial_printf("[BLK] cache: %u blocks of %u bytes on %s, read-ahead %u blocks\n",
+                s_n, BCACHE_BLOCK, d->name, BCACHE_RA);
+}
+
+int bcache_read(uint64_t block, void* dst) {
+  if (!s_n || block >= s_blocks) return -1;
+
+  bc_ent_t* e = lookup(block);
+  if (e) {
+    settle(e);
+    s_st.hits++;
+    if (e->ra) s_st.ra_hits++;
+    if (e->state == BC_LOADING) s_st.waits++;
+  } else {
+    s_st.misses++;
+    e = start_load(block);
+    if (!e) return -1;
+  }
+  e->ra = 0;
+  lru_unlink(e);
+  lru_front(e);
+
+  // A cache smaller than the read-ahead window would otherwise recycle
+  // the caller's entry for one of the blocks after it.
+  if (block == s_last + 1) {
+    e->pin = 1;
+    read_ahead(block);
+    e->pin = 0;
+  }
+  s_last = block;
+
+  // The demand read was queued first, so it goes out ahead of the
+  // read-ahead batch that follows it.
+  blk_poll(s_dev);
+  if (e->state == BC_LOADING) {
+    blk_wait(s_dev, &e->req);
+    settle(e);
+    if (e->state != BC_VALID) return -1;
+  }
+
+  const uint32_t* src = (const uint32_t*)(uintptr_t)e->page;
+  uint32_t* out = (uint32_t*)dst;
+  for (uint32_t i = 0; i < BCACHE_BLOCK / 4; ++i) out[i] = src[i];
+  return 0;
+}
+
+void bcache_invalidate(void) {
+  for (uint32_t i = 0; i < s_n; ++i) {
+    bc_ent_t* e = &s_ents[i];
+    // On a timeout blk_wait() aborts the device, which fails the read and
+    // stops its DMA, so the page is safe to reuse either way.
+    if (e->state == BC_LOADING) blk_wait(s_dev, &e->req);
+    e->state = BC_FREE;
+    e->ra = 0;
+  }
+  for (uint32_t i = 0; i < BC_HASH; ++i) s_hash[i] = 0;
+  s_last = ~0ull;
+  s_ra_next = 0;
+  bcache_reset_stats();
+}
+
+void bcache_reset_stats(void) {
+  s_st.hits = s_st.ra_hits = s_st.waits = s_st.misses = s_st.ra_issued = 0;
+}
+
+void bcache_get_stats(bcache_stats_t* out) {
+  *out = s_st;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include "blk.h"
+
+// Block cache in front of one disk: 4 KiB blocks in pmm pages, a hash for
+// lookup and an LRU list for eviction. Two consecutive block numbers start
+// read-ahead: the next BCACHE_RA blocks are queued as one batch and topped
+// up once the reader is halfway through them, so a sequential scan mostly
+// finds its blocks already loaded or in flight.
+
+#define BCACHE_BLOCK          4096u
+#define BCACHE_DEFAULT_BLOCKS 1024u     // 4 MiB
+#define BCACHE_RA             32u       // 128 KiB
+
+typedef struct {
+  uint64_t hits;
+  uint64_t ra_hits;     // of which the block came from read-ahead
+  uint64_t waits;       // of which the block was still in flight
+  uint64_t misses;
+  uint64_t ra_issued;
+} bcache_stats_t;
+
+void bcache_init(blk_dev_t* d, uint32_t blocks);
+// Copies block `block` (BCACHE_BLOCK bytes) to dst; 0, or -1 on a read error.
+int  bcache_read(uint64_t block, void* dst);
+// Waits for reads in flight and empties the cache; clears the statistics.
+void bcache_invalidate(void);
+void bcache_reset_stats(void);
+void bcache_get_stats(bcache_stats_t* out);
@@ -0,0 +1,266 @@
+#include "blk.h"
+#include "ata.h"
+#include "bcache.h"
+#include "pmm.h"
+#include "serial.h"
+#include "tsc.h"
+#include "cpu.h"
+
+#define BLK_TIMEOUT_MS 5000ull
+
+static blk_dev_t* s_devs[BLK_MAX_DEVS];
+static uint32_t   s_count;
+
+void blk_register(blk_dev_t* d) {
+  if (s_count == BLK_MAX_DEVS) {
+    serial_printf("[BLK][WARN] %s ignored, table full\n", d->name);
+    return;
+  }
+  d->inflight = 0;
+  d->head = d->tail = 0;
+  d->reqs = d->cmds = 0;
+  d->dead = 0;
+  s_devs[s_count++] = d;
+  serial_printf("[BLK] %s: %lu sectors (%lu MiB) via %s, depth %u\n", d->name, d->sectors,
+                d->sectors >> 11, d->ops->name, d->depth);
+}
+
+uint32_t blk_count(void) {
+  return s_count;
+}
+
+blk_dev_t* blk_get(uint32_t i) {
+  return i < s_count ? s_devs[i] : 0;
+}
+
+void blk_req_set_buf(blk_req_t* r, uint64_t buf, uint32_t count) {
+  uint64_t left = (uint64_t)count * BLK_SECTOR;
+  r->count = count;
+  r->nseg  = 0;
+  while (left && r->nseg < BLK_MAX_SEGS) {
+    uint32_t len = PMM_PAGE - (uint32_t)(buf & (PMM_PAGE - 1));
+    if (len > left) len = (uint32_t)left;
+    r->seg[r->nseg].addr = buf;
+    r->seg[r->nseg].len  = len;
+    r->nseg++;
+    buf  += len;
+    left -= len;
+  }
+}
+
+void blk_submit(blk_dev_t* d, blk_req_t* r) {
+  r->done   = 0;
+  r->status = 0;
+  r->next   = 0;
+  if (d->dead) {
+    r->status = -1;
+    r->done   = 1;
+    return;
+  }
+  if (d->tail) d->tail->next = r;
+  else         d->head = r;
+  d->tail = r;
+}
+
+void blk_complete(blk_dev_t* d, blk_req_t* r, int status) {
+  r->status = status;
+  r->done   = 1;
+  d->inflight--;
+  d->reqs++;
+}
+
+// Reaps, then gives the driver everything queued that fits its depth in one
+// issue call, which is where it gets to batch.
+void blk_poll(blk_dev_t* d) {
+  if (d->dead) return;
+  d->ops->poll(d);
+
+  blk_req_t* batch[64];
+  uint32_t n = 0;
+  for (blk_req_t* r = d->head; r && d->inflight + n < d->depth && n < 64; r = r->next) batch[n++] = r;
+  if (!n) return;
+
+  uint32_t took = d->ops->issue(d, batch, n);
+  d->inflight += took;
+  while (took--) {
+    d->head = d->head->next;
+    if (!d->head) d->tail = 0;
+  }
+}
+
+int blk_wait(blk_dev_t* d, blk_req_t* r) {
+  uint64_t until = rdtsc() + (uint64_t)g_tsc_khz * BLK_TIMEOUT_MS;
+  while (!r->done) {
+    blk_poll(d);
+    if (rdtsc() > until) {
+      serial_printf("[BLK][ERR] %s: read of lba %lu timed out\n", d->name, r->lba);
+      blk_abort(d);
+      return -1;
+    }
+  }
+  return r->status;
+}
+
+void blk_abort(blk_dev_t* d) {
+  if (!d->dead && d->ops->abort(d) < 0) {
+    serial_printf("[BLK][ERR] %s: device did not stop, no further I/O\n", d->name);
+    d->dead = 1;
+  }
+  // The driver has failed what it held; what never reached it fails here.
+  while (d->head) {
+    blk_req_t* r = d->head;
+    d->head   = r->next;
+    r->status = -1;
+    r->done   = 1;
+    d->reqs++;
+  }
+  d->tail = 0;
+}
+
+int blk_read(blk_dev_t* d, uint64_t lba, uint32_t count, void* buf) {
+  // An unaligned buffer can need one segment more than its pages.
+  if ((uint64_t)count * BLK_SECTOR > (uint64_t)(BLK_MAX_SEGS - 1) * PMM_PAGE) return -1;
+  if (lba + count > d->sectors) return -1;
+
+  blk_req_t r;
+  r.lba = lba;
+  blk_req_set_buf(&r, (uintptr_t)buf, count);
+  blk_submit(d, &r);
+  return blk_wait(d, &r);
+}
+
+void blk_init(void) {
+  if (!ahci_init()) ide_init();
+  if (!s_count) {
+    serial_printf("[BLK] no disks\n");
+    return;
+  }
+  bcache_init(s_devs[0], BCACHE_DEFAULT_BLOCKS);
+}
+
+// ---- benchmark ---------------------------------------------------------------
+
+#define BENCH_SEQ_BLOCKS   4096u            // 16 MiB
+#define BENCH_RAND_OPS     2048u
+#define BENCH_RAND_SPAN    262144u          // blocks: 1 GiB
+#define BENCH_HOT_SPAN     512u             // fits in the cache
+#define BENCH_QD           32u
+
+static uint32_t s_rng;
+
+static uint32_t rng(void) {
+  s_rng ^= s_rng << 13;
+  s_rng ^= s_rng >> 17;
+  s_rng ^= s_rng << 5;
+  return s_rng;
+}
+
+static void report(const char* what, uint32_t ops, uint64_t cycles) {
+  serial_printf("[BLK] bench %s: %u reads in %lu us, %lu IOPS, %lu MB/s\n", what, ops,
+                tsc_cycles_to_us(cycles), tsc_per_second(ops, cycles),
+                tsc_per_second((uint64_t)ops * BCACHE_BLOCK, cycles) >> 20);
+}
+
+static void report_cache(void) {
+  bcache_stats_t st;
+  bcache_get_stats(&st);
+  serial_printf("[BLK]   cache: %lu hits (%lu read ahead, %lu waited for), %lu misses, %lu read ahead issued\n",
+                st.hits, st.ra_hits, st.waits, st.misses, st.ra_issued);
+}
+
+// Random 4 KiB reads with up to BENCH_QD outstanding, refilled as they
+// complete; the driver sees them in batches.
+static uint64_t rand_queued(blk_dev_t* d, uint64_t* pages, uint32_t span) {
+  static blk_req_t reqs[BENCH_QD];
+  int reaped[BENCH_QD];
+  uint32_t qd = d->depth < BENCH_QD ? d->depth : BENCH_QD;
+  uint32_t issued = 0, done = 0;
+  uint64_t t0 = rdtsc();
+
+  for (uint32_t i = 0; i < qd && issued < BENCH_RAND_OPS; ++i, ++issued) {
+    reqs[i].lba = (uint64_t)(rng() % span) * (BCACHE_BLOCK / BLK_SECTOR);
+    blk_req_set_buf(&reqs[i], pages[i], BCACHE_BLOCK / BLK_SECTOR);
+    blk_submit(d, &reqs[i]);
+    reaped[i] = 0;
+  }
+  uint64_t until = rdtsc() + (uint64_t)g_tsc_khz * BLK_TIMEOUT_MS;
+  while (done < issued) {
+    blk_poll(d);
+    for (uint32_t i = 0; i < qd; ++i) {
+      if (i >= issued || reaped[i] || !reqs[i].done) continue;
+      done++;
+      reaped[i] = 1;
+      until = rdtsc() + (uint64_t)g_tsc_khz * BLK_TIMEOUT_MS;
+      if (issued < BENCH_RAND_OPS) {
+        reqs[i].lba = (uint64_t)(rng() % span) * (BCACHE_BLOCK / BLK_SECTOR);
+        blk_submit(d, &reqs[i]);
+        reaped[i] = 0;
+        issued++;
+      }
+    }
+    if (rdtsc() > until) {
+      serial_printf("[BLK][ERR] queued reads stalled at %u of %u\n", done, issued);
+      blk_abort(d);
+      break;
+    }
+  }
+  return rdtsc() - t0;
+}
+
+// The cached runs go through bcache, which sits on the first disk.
+void blk_bench(blk_dev_t* d) {
+  if (!d) return;
+
+  uint64_t pages[BENCH_QD];
+  for (uint32_t i = 0; i < BENCH_QD; ++i) {
+    pages[i] = pmm_alloc();
+    if (!pages[i]) {
+      while (i--) pmm_free(pages[i]);
+      serial_printf("[BLK] bench: out of memory\n");
+      return;
+    }
+  }
+  void* buf = (void*)(uintptr_t)pages[0];
+  uint32_t spb = BCACHE_BLOCK / BLK_SECTOR;
+  uint64_t blocks = d->sectors / (BCACHE_BLOCK / BLK_SECTOR);
+  uint32_t seq  = blocks < BENCH_SEQ_BLOCKS ? (uint32_t)blocks : BENCH_SEQ_BLOCKS;
+  uint32_t span = blocks < BENCH_RAND_SPAN ? (uint32_t)blocks : BENCH_RAND_SPAN;
+  uint32_t hot  = span < BENCH_HOT_SPAN ? span : BENCH_HOT_SPAN;
+  uint64_t cmds0 = d->cmds, reqs0 = d->reqs;
+
+  uint64_t t0 = rdtsc();
+  for (uint32_t i = 0; i < seq; ++i) blk_read(d, (uint64_t)i * spb, spb, buf);
+  report("seq, no cache", seq, rdtsc() - t0);
+
+  bcache_invalidate();
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < seq; ++i) bcache_read(i, buf);
+  report("seq, cache", seq, rdtsc() - t0);
+  report_cache();
+
+  s_rng = 0x12345678u;
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < BENCH_RAND_OPS; ++i) blk_read(d, (uint64_t)(rng() % span) * spb, spb, buf);
+  report("random, no cache, qd 1", BENCH_RAND_OPS, rdtsc() - t0);
+
+  s_rng = 0x12345678u;
+  report("random, no cache, queued", BENCH_RAND_OPS, rand_queued(d, pages, span));
+
+  bcache_invalidate();
+  s_rng = 0x12345678u;
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < BENCH_RAND_OPS; ++i) bcache_read(rng() % span, buf);
+  report("random, cache", BENCH_RAND_OPS, rdtsc() - t0);
+  report_cache();
+
+  // A working set that fits: one pass to warm it, then the measured one.
+  for (uint32_t i = 0; i < hot; ++i) bcache_read(i, buf);
+  bcache_reset_stats();
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < BENCH_RAND_OPS; ++i) bcache_read(rng() % hot, buf);
+  report("random in 2 MiB, cache", BENCH_RAND_OPS, rdtsc() - t0);
+  report_cache();
+
+  serial_printf("[BLK] bench: %lu requests took %lu commands\n", d->reqs - reqs0, d->cmds - cmds0);
+  for (uint32_t i = 0; i < BENCH_QD; ++i) pmm_free(pages[i]);
+}
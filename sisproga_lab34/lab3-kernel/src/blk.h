@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+
+// Block devices and their request queues. A request names a sector range
+// and the physical segments to DMA it into; blk_submit() only queues it,
+// and blk_poll() hands queued requests to the driver as far as its depth
+// allows (the driver batches or merges them into commands) and reaps the
+// completions. Everything is polled on the boot CPU. Read-only: nothing in
+// the kernel writes a disk yet.
+
+#define BLK_SECTOR    512
+#define BLK_MAX_DEVS  4
+#define BLK_MAX_SEGS  32        // 128 KiB in pages
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;                 // a multiple of BLK_SECTOR, never crossing a page
+} blk_seg_t;
+
+typedef struct blk_req blk_req_t;
+struct blk_req {
+  uint64_t     lba;
+  uint32_t     count;           // sectors
+  uint32_t     nseg;
+  blk_seg_t    seg[BLK_MAX_SEGS];
+  volatile int done;
+  int          status;          // 0, or -1 on a device error, timeout or abort
+  blk_req_t*   next;
+};
+
+typedef struct blk_dev blk_dev_t;
+
+typedef struct {
+  const char* name;
+  // Starts as many of reqs[0..n) as the device has room for, in order, and
+  // returns how many it took.
+  uint32_t (*issue)(blk_dev_t* d, blk_req_t* const* reqs, uint32_t n);
+  // Calls blk_complete() for every finished request.
+  void     (*poll)(blk_dev_t* d);
+  // Stops whatever the device is doing and completes every request it
+  // holds with -1; returns -1 when the device would not stop, in which
+  // case it may still write into those requests' buffers.
+  int      (*abort)(blk_dev_t* d);
+} blk_ops_t;
+
+struct blk_dev {
+  char             name[16];
+  const blk_ops_t* ops;
+  void*            priv;
+  uint64_t         sectors;
+  uint32_t         depth;       // requests the driver can hold at once
+  uint32_t         inflight;
+  blk_req_t*       head;        // queued, not yet with the driver
+  blk_req_t*       tail;
+  uint64_t         reqs, cmds;  // completed requests, commands they took
+  int              dead;        // would not stop after a timeout: no more I/O
+};
+
+void       blk_register(blk_dev_t* d);
+uint32_t   blk_count(void);
+blk_dev_t* blk_get(uint32_t i);
+
+void blk_submit(blk_dev_t* d, blk_req_t* r);
+void blk_poll(blk_dev_t* d);
+int  blk_wait(blk_dev_t* d, blk_req_t* r);
+// After a timeout: stops the device and fails everything issued or queued,
+// so no request stays reachable from the queue or under DMA.
+void blk_abort(blk_dev_t* d);
+// Synchronous read into a physically contiguous buffer.
+int  blk_read(blk_dev_t* d, uint64_t lba, uint32_t count, void* buf);
+
+// Drivers: a request is finished.
+void blk_complete(blk_dev_t* d, blk_req_t* r, int status);
+// Fills r->seg for `count` sectors at the physical address `buf`.
+void blk_req_set_buf(blk_req_t* r, uint64_t buf, uint32_t count);
+
+void blk_init(void);          // AHCI first, IDE bus-master DMA otherwise
+void blk_bench(blk_dev_t* d);
@@ -0,0 +1,27 @@
+#include "cpu.h"
+
+uint32_t g_cpu_features = 0;
+
+static void enable_sse(void) {
+  uintptr_t cr0, cr4;
+  __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+  cr0 &= ~(1u << 2);            // EM
+  cr0 |=  (1u << 1);            // MP
+  __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0));
+
+  __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+  cr4 |= (1u << 9) | (1u << 10); // OSFXSR | OSXMMEXCPT
+  __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4));
+}
+
+void cpu_init(void) {
+  uint32_t a, b, c, d;
+  cpuid(1, 0, &a, &b, &c, &d);
+
+  if (d & (1u << 26)) {
+    enable_sse();
+    g_cpu_features |= CPU_FEAT_SSE2;
+  }
+  if (d & (1u << 9)) g_cpu_features |= CPU_FEAT_APIC;
+  if (c & (1u << 3)) g_cpu_features |= CPU_FEAT_MWAIT;
+}
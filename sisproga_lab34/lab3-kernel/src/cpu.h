@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+static inline void outb(uint16_t port, uint8_t val) {
+  __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+static inline uint8_t inb(uint16_t port) {
+  uint8_t ret;
+  __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t val) {
+  __asm__ volatile ("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+static inline uint16_t inw(uint16_t port) {
+  uint16_t ret;
+  __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+static inline void outl(uint16_t port, uint32_t val) {
+  __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+static inline uint32_t inl(uint16_t port) {
+  uint32_t ret;
+  __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t sub,
+                         uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+  __asm__ volatile ("cpuid"
+                    : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                    : "a"(leaf), "c"(sub));
+}
+
+static inline void cpu_pause(void) {
+  __asm__ volatile ("pause" ::: "memory");
+}
+
+#define CPU_FEAT_SSE2  (1u << 0)
+#define CPU_FEAT_APIC  (1u << 1)
+#define CPU_FEAT_MWAIT (1u << 2)
+
+extern uint32_t g_cpu_features;
+
+void cpu_init(void);
@@ -1,18 +1,236 @@
 #include "fb.h"
+#include "fb_rows.h"
+#include "cpu.h"
+#include "hist.h"
 
-static inline uint32_t pack_rgb(fb_t* fb, uint32_t rgb) {
-  if (!fb->is_rgb || fb->bpp != 32) return rgb;
+// Span/pixel stores, one set per bytes-per-pixel. Packed values are already
+// in framebuffer byte order (byte 0 in bits 0..7).
+
+static inline void put2(uint8_t* p, uint32_t v) { *(uint16_t*)p = (uint16_t)v; }
+static inline void put3(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16);
+}
+static inline void put4(uint8_t* p, uint32_t v) { *(uint32_t*)p = v; }
+
+static inline uint32_t get2(const uint8_t* p) { return *(const uint16_t*)p; }
+static inline uint32_t get3(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+static inline uint32_t get4(const uint8_t* p) { return *(const uint32_t*)p; }
+
+static inline void span2(uint8_t* p, uint32_t n, uint32_t v) {
+  __asm__ volatile ("rep stosw" : "+D"(p), "+c"(n) : "a"(v) : "memory");
+}
+
+static inline void span3(uint8_t* p, uint32_t n, uint32_t v) {
+  // 4 pixels = 12 bytes = 3 dwords with a rotating byte pattern.
+  uint32_t w0 = v | (v << 24);
+  uint32_t w1 = (v >> 8) | (v << 16);
+  uint32_t w2 = (v >> 16) | (v << 8);
+  for (; n >= 4; n -= 4, p += 12) {
+    ((uint32_t*)p)[0] = w0;
+    ((uint32_t*)p)[1] = w1;
+    ((uint32_t*)p)[2] = w2;
+  }
+  for (; n; --n, p += 3) put3(p, v);
+}
+
+static inline void span4(uint8_t* p, uint32_t n, uint32_t v) {
+  __asm__ volatile ("rep stosl" : "+D"(p), "+c"(n) : "a"(v) : "memory");
+}
+
+// Packers: 0x00RRGGBB -> native pixel value.
+
+static inline uint32_t pk_xrgb8888(const fb_t* fb, uint32_t rgb) {
+  (void)fb;
+  return rgb & 0x00FFFFFFu;
+}
+
+static inline uint32_t pk_xbgr8888(const fb_t* fb, uint32_t rgb) {
+  (void)fb;
+  return ((rgb >> 16) & 0xFFu) | (rgb & 0xFF00u) | ((rgb & 0xFFu) << 16);
+}
+
+static inline uint32_t pk_rgb565(const fb_t* fb, uint32_t rgb) {
+  (void)fb;
+  return ((rgb >> 8) & 0xF800u) | ((rgb >> 5) & 0x07E0u) | ((rgb >> 3) & 0x001Fu);
+}
+
+static inline uint32_t pk_generic(const fb_t* fb, uint32_t rgb) {
+  if (!fb->is_rgb) return rgb;
   uint32_t r = (rgb >> 16) & 0xFF;
   uint32_t g = (rgb >>  8) & 0xFF;
   uint32_t b = (rgb >>  0) & 0xFF;
 
   uint32_t v = 0;
-  v |= (r & ((1u<<fb->rsize)-1)) << fb->rpos;
-  v |= (g & ((1u<<fb->gsize)-1)) << fb->gpos;
-  v |= (b & ((1u<<fb->bsize)-1)) << fb->bpos;
+  v |= (r >> (8 - fb->rsize)) << fb->rpos;
+  v |= (g >> (8 - fb->gsize)) << fb->gpos;
+  v |= (b >> (8 - fb->bsize)) << fb->bpos;
   return v;
 }
 
+// Unpackers: native pixel value -> 0x00RRGGBB, for read-modify-write ops.
+
+static inline uint32_t up_xrgb8888(const fb_t* fb, uint32_t v) {
+  return pk_xrgb8888(fb, v);
+}
+
+static inline uint32_t up_xbgr8888(const fb_t* fb, uint32_t v) {
+  return pk_xbgr8888(fb, v);
+}
+
+static inline uint32_t up_rgb565(const fb_t* fb, uint32_t v) {
+  (void)fb;
+  uint32_t r = (v >> 11) & 0x1F, g = (v >> 5) & 0x3F, b = v & 0x1F;
+  return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+}
+
+static inline uint32_t expand8(uint32_t v, uint8_t pos, uint8_t size) {
+  if (size == 0) return 0;
+  uint32_t c = (v >> pos) & ((1u << size) - 1);
+  c <<= (8 - size);
+  return c | (c >> size);
+}
+
+static inline uint32_t up_generic(const fb_t* fb, uint32_t v) {
+  if (!fb->is_rgb) return v;
+  return (expand8(v, fb->rpos, fb->rsize) << 16) |
+         (expand8(v, fb->gpos, fb->gsize) << 8) |
+          expand8(v, fb->bpos, fb->bsize);
+}
+
+// Backends are stamped out per (format, bytes-per-pixel) so the packer and
+// the store width are resolved at compile time. Inputs are pre-clipped.
+#define FB_DEFINE_BACKEND(NAME, BYPP, PACK, UNPACK)                              \
+  static uint32_t NAME##_pack(const fb_t* fb, uint32_t rgb) {                   \
+    return PACK(fb, rgb);                                                       \
+  }                                                                             \
+  static void NAME##_rect(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,         \
+                          uint32_t h, uint32_t rgb) {                           \
+    uint32_t v = PACK(fb, rgb);                                                 \
+    uint8_t* row = fb->base + y * fb->pitch + x * BYPP;                         \
+    for (uint32_t i = 0; i < h; ++i, row += fb->pitch) span##BYPP(row, w, v);   \
+  }                                                                             \
+  static void NAME##_fill(fb_t* fb, uint32_t rgb) {                             \
+    if (fb->pitch == fb->width * BYPP) {                                        \
+      span##BYPP(fb->base, fb->width * fb->height, PACK(fb, rgb));              \
+    } else {                                                                    \
+      NAME##_rect(fb, 0, 0, fb->width, fb->height, rgb);                        \
+    }                                                                           \
+  }                                                                             \
+  static void NAME##_hline(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,        \
+                           uint32_t rgb) {                                      \
+    span##BYPP(fb->base + y * fb->pitch + x * BYPP, w, PACK(fb, rgb));          \
+  }                                                                             \
+  static void NAME##_vline(fb_t* fb, uint32_t x, uint32_t y, uint32_t h,        \
+                           uint32_t rgb) {                                      \
+    uint32_t v = PACK(fb, rgb);                                                 \
+    uint8_t* p = fb->base + y * fb->pitch + x * BYPP;                           \
+    for (uint32_t i = 0; i < h; ++i, p += fb->pitch) put##BYPP(p, v);           \
+  }                                                                             \
+  static void NAME##_blit(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,         \
+                          uint32_t h, const uint32_t* src, uint32_t stride) {   \
+    uint8_t* row = fb->base + y * fb->pitch + x * BYPP;                         \
+    for (uint32_t i = 0; i < h; ++i, row += fb->pitch, src += stride) {         \
+      uint8_t* p = row;                                                         \
+      for (uint32_t j = 0; j < w; ++j, p += BYPP) put##BYPP(p, PACK(fb, src[j])); \
+    }                                                                           \
+  }                                                                             \
+  static void NAME##_blit_alpha(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,   \
+                                uint32_t h, const uint32_t* src, uint32_t stride) { \
+    uint8_t* row = fb->base + y * fb->pitch + x * BYPP;                         \
+    for (uint32_t i = 0; i < h; ++i, row += fb->pitch, src += stride) {         \
+      uint8_t* p = row;                                                         \
+      for (uint32_t j = 0; j < w; ++j, p += BYPP) {                             \
+        uint32_t s = src[j];                                                    \
+        if ((s >> 24) == 0) continue;                                           \
+        uint32_t d = (s >> 24) == 0xFF ? 0 : UNPACK(fb, get##BYPP(p));          \
+        put##BYPP(p, PACK(fb, fb_px_over(s, d)));                               \
+      }                                                                         \
+    }                                                                           \
+  }                                                                             \
+  static void NAME##_blit_colorkey(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, \
+                                   uint32_t h, const uint32_t* src,             \
+                                   uint32_t stride, uint32_t key) {             \
+    uint8_t* row = fb->base + y * fb->pitch + x * BYPP;                         \
+    key &= 0x00FFFFFFu;                                                         \
+    for (uint32_t i = 0; i < h; ++i, row += fb->pitch, src += stride) {         \
+      uint8_t* p = row;                                                         \
+      for (uint32_t j = 0; j < w; ++j, p += BYPP) {                             \
+        uint32_t s = src[j] & 0x00FFFFFFu;                                      \
+        if (s != key) put##BYPP(p, PACK(fb, s));                                \
+      }                                                                         \
+    }                                                                           \
+  }                                                                             \
+  static const fb_ops_t NAME##_ops = {                                          \
+    #NAME, NAME##_pack, NAME##_fill, NAME##_rect,                               \
+    NAME##_hline, NAME##_vline, NAME##_blit,                                    \
+    NAME##_blit_alpha, NAME##_blit_colorkey                                     \
+  };
+
+FB_DEFINE_BACKEND(xrgb8888,  4, pk_xrgb8888, up_xrgb8888)
+FB_DEFINE_BACKEND(xbgr8888,  4, pk_xbgr8888, up_xbgr8888)
+FB_DEFINE_BACKEND(rgb888,    3, pk_xrgb8888, up_xrgb8888)
+FB_DEFINE_BACKEND(bgr888,    3, pk_xbgr8888, up_xbgr8888)
+FB_DEFINE_BACKEND(rgb565,    2, pk_rgb565,   up_rgb565)
+FB_DEFINE_BACKEND(generic32, 4, pk_generic,  up_generic)
+FB_DEFINE_BACKEND(generic24, 3, pk_generic,  up_generic)
+FB_DEFINE_BACKEND(generic16, 2, pk_generic,  up_generic)
+
+// xrgb8888 matches the source pixel layout, so its blits run the SSE2 row
+// kernels directly; opaque rows go out with streaming stores.
+
+#define XRGB_ROW(fb, x, y) ((uint32_t*)((fb)->base + (y) * (fb)->pitch) + (x))
+
+static void xrgb8888_sse2_blit(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,
+                               uint32_t h, const uint32_t* src, uint32_t stride) {
+  for (uint32_t i = 0; i < h; ++i, src += stride) fb_row_copy_nt_sse2(XRGB_ROW(fb, x, y + i), src, w);
+  fb_rows_fence();
+}
+
+static void xrgb8888_sse2_blit_alpha(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,
+                                     uint32_t h, const uint32_t* src, uint32_t stride) {
+  for (uint32_t i = 0; i < h; ++i, src += stride) fb_row_over_sse2(XRGB_ROW(fb, x, y + i), src, w);
+}
+
+static void xrgb8888_sse2_blit_colorkey(fb_t* fb, uint32_t x, uint32_t y, uint32_t w,
+                                        uint32_t h, const uint32_t* src, uint32_t stride,
+                                        uint32_t key) {
+  for (uint32_t i = 0; i < h; ++i, src += stride) fb_row_colorkey_sse2(XRGB_ROW(fb, x, y + i), src, w, key);
+}
+
+static const fb_ops_t xrgb8888_sse2_ops = {
+  "xrgb8888-sse2", xrgb8888_pack, xrgb8888_fill, xrgb8888_rect,
+  xrgb8888_hline, xrgb8888_vline, xrgb8888_sse2_blit,
+  xrgb8888_sse2_blit_alpha, xrgb8888_sse2_blit_colorkey
+};
+
+static int layout_is(const fb_t* fb, uint8_t rp, uint8_t rs, uint8_t gp, uint8_t gs,
+                     uint8_t bp, uint8_t bs) {
+  return fb->rpos == rp && fb->rsize == rs &&
+         fb->gpos == gp && fb->gsize == gs &&
+         fb->bpos == bp && fb->bsize == bs;
+}
+
+static const fb_ops_t* select_backend(const fb_t* fb) {
+  if (fb->is_rgb) {
+    if (fb->bpp == 32 && layout_is(fb, 16, 8, 8, 8, 0, 8))
+      return (g_cpu_features & CPU_FEAT_SSE2) ? &xrgb8888_sse2_ops : &xrgb8888_ops;
+    if (fb->bpp == 32 && layout_is(fb, 0, 8, 8, 8, 16, 8)) return &xbgr8888_ops;
+    if (fb->bpp == 24 && layout_is(fb, 16, 8, 8, 8, 0, 8)) return &rgb888_ops;
+    if (fb->bpp == 24 && layout_is(fb, 0, 8, 8, 8, 16, 8)) return &bgr888_ops;
+    if (fb->bpp == 16 && layout_is(fb, 11, 5, 5, 6, 0, 5)) return &rgb565_ops;
+    if (fb->rsize > 8 || fb->gsize > 8 || fb->bsize > 8) return 0;
+  }
+  switch (fb->bpp) {
+    case 32: return &generic32_ops;
+    case 24: return &generic24_ops;
+    case 16:
+    case 15: return &generic16_ops;
+    default: return 0;
+  }
+}
+
 int fb_init_from_mb2(fb_t* fb,
                      uint64_t addr, uint32_t pitch, uint32_t w, uint32_t h,
                      uint8_t bpp, uint8_t type,
@@ -26,23 +244,75 @@ int fb_init_from_mb2(fb_t* fb,
   fb->rpos=rpos; fb->rsize=rsz;
   fb->gpos=gpos; fb->gsize=gsz;
   fb->bpos=bpos; fb->bsize=bsz;
-  return (addr != 0 && w != 0 && h != 0 && pitch != 0);
+  fb->ops = select_backend(fb);
+  ticket_lock_init(&fb->lock, 0);
+  return (addr != 0 && w != 0 && h != 0 && pitch != 0 && fb->ops != 0);
 }
 
+// Clip a w x h box at (x, y) to the surface; returns 0 if nothing is left.
+static int clip(const fb_t* fb, uint32_t x, uint32_t y, uint32_t* w, uint32_t* h) {
+  if (!fb->base || !fb->ops) return 0;
+  if (x >= fb->width || y >= fb->height) return 0;
+  if (*w > fb->width - x)  *w = fb->width - x;
+  if (*h > fb->height - y) *h = fb->height - y;
+  return *w != 0 && *h != 0;
+}
+
+// Cycles per fb_fill() call, lock wait included.
+static hist_t s_fill_hist = HIST_INIT("fb_fill");
+
 void fb_fill(fb_t* fb, uint32_t rgb) {
-  if (!fb->base) return;
-  uint32_t color = pack_rgb(fb, rgb);
-  for (uint32_t y = 0; y < fb->height; ++y) {
-    uint32_t* row = (uint32_t*)(fb->base + y * fb->pitch);
-    for (uint32_t x = 0; x < fb->width; ++x) row[x] = color;
-  }
+  if (!fb->base || !fb->ops) return;
+  uint64_t t0 = rdtsc();
+  ticket_lock(&fb->lock);
+  fb->ops->fill(fb, rgb);
+  ticket_unlock(&fb->lock);
+  hist_record(&s_fill_hist, rdtsc() - t0);
 }
 
 void fb_rect(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t rgb) {
-  if (!fb->base) return;
-  uint32_t color = pack_rgb(fb, rgb);
-  for (uint32_t yy = y; yy < y + h && yy < fb->height; ++yy) {
-    uint32_t* row = (uint32_t*)(fb->base + yy * fb->pitch);
-    for (uint32_t xx = x; xx < x + w && xx < fb->width; ++xx) row[xx] = color;
-  }
+  if (!clip(fb, x, y, &w, &h)) return;
+  ticket_lock(&fb->lock);
+  fb->ops->rect(fb, x, y, w, h, rgb);
+  ticket_unlock(&fb->lock);
+}
+
+void fb_hline(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t rgb) {
+  uint32_t h = 1;
+  if (!clip(fb, x, y, &w, &h)) return;
+  ticket_lock(&fb->lock);
+  fb->ops->hline(fb, x, y, w, rgb);
+  ticket_unlock(&fb->lock);
+}
+
+void fb_vline(fb_t* fb, uint32_t x, uint32_t y, uint32_t h, uint32_t rgb) {
+  uint32_t w = 1;
+  if (!clip(fb, x, y, &w, &h)) return;
+  ticket_lock(&fb->lock);
+  fb->ops->vline(fb, x, y, h, rgb);
+  ticket_unlock(&fb->lock);
+}
+
+void fb_blit(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+             const uint32_t* src, uint32_t src_stride) {
+  if (!src || !clip(fb, x, y, &w, &h)) return;
+  ticket_lock(&fb->lock);
+  fb->ops->blit(fb, x, y, w, h, src, src_stride);
+  ticket_unlock(&fb->lock);
+}
+
+void fb_blit_alpha(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                   const uint32_t* src, uint32_t src_stride) {
+  if (!src || !clip(fb, x, y, &w, &h)) return;
+  ticket_lock(&fb->lock);
+  fb->ops->blit_alpha(fb, x, y, w, h, src, src_stride);
+  ticket_unlock(&fb->lock);
+}
+
+void fb_blit_colorkey(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                      const uint32_t* src, uint32_t src_stride, uint32_t key) {
+  if (!src || !clip(fb, x, y, &w, &h)) return;
+  ticket_lock(&fb->lock);
+  fb->ops->blit_colorkey(fb, x, y, w, h, src, src_stride, key);
+  ticket_unlock(&fb->lock);
 }
@@ -1,8 +1,29 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include "spinlock.h"
 
+typedef struct fb fb_t;
+
+// Per-format backend. Colors are passed as 0x00RRGGBB and packed by the
+// backend; blit sources are rows of 0xAARRGGBB pixels (alpha premultiplied,
+// ignored by the opaque and color-key blits). Strides are in pixels.
 typedef struct {
+  const char* name;
+  uint32_t (*pack)(const fb_t* fb, uint32_t rgb);
+  void (*fill)(fb_t* fb, uint32_t rgb);
+  void (*rect)(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t rgb);
+  void (*hline)(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t rgb);
+  void (*vline)(fb_t* fb, uint32_t x, uint32_t y, uint32_t h, uint32_t rgb);
+  void (*blit)(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+               const uint32_t* src, uint32_t src_stride);
+  void (*blit_alpha)(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                     const uint32_t* src, uint32_t src_stride);
+  void (*blit_colorkey)(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                        const uint32_t* src, uint32_t src_stride, uint32_t key);
+} fb_ops_t;
+
+struct fb {
   uint8_t*  base;
   uint32_t  pitch;
   uint32_t  width;
@@ -10,7 +31,9 @@ typedef struct {
   uint8_t   bpp;
   uint8_t   is_rgb;
   uint8_t   rpos, rsize, gpos, gsize, bpos, bsize;
-} fb_t;
+  const fb_ops_t* ops;
+  ticket_lock_t   lock;     // serializes drawing through the fb_* API
+};
 
 int fb_init_from_mb2(fb_t* fb,
                      uint64_t addr, uint32_t pitch, uint32_t w, uint32_t h,
@@ -19,3 +42,14 @@ int fb_init_from_mb2(fb_t* fb,
 
 void fb_fill(fb_t* fb, uint32_t rgb);
 void fb_rect(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t rgb);
+void fb_hline(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t rgb);
+void fb_vline(fb_t* fb, uint32_t x, uint32_t y, uint32_t h, uint32_t rgb);
+void fb_blit(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+             const uint32_t* src, uint32_t src_stride);
+void fb_blit_alpha(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                   const uint32_t* src, uint32_t src_stride);
+void fb_blit_colorkey(fb_t* fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                      const uint32_t* src, uint32_t src_stride, uint32_t key);
+
+void fb_bench_formats(void);
+void fb_bench_blit(fb_t* fb);
@@ -0,0 +1,203 @@
+#include "fb.h"
+#include "fb_tile.h"
+#include "smp.h"
+#include "serial.h"
+#include "tsc.h"
+#include "util.h"
+#include "cpu.h"
+
+// Off-screen surfaces in RAM, one per backend, so every format is measured
+// regardless of which mode the firmware actually handed us.
+
+#define BENCH_W 320u
+#define BENCH_H 240u
+#define BLIT_W  64u
+#define BLIT_H  64u
+
+static uint8_t  s_surface[BENCH_W * BENCH_H * 4] __attribute__((aligned(64)));
+static uint32_t s_sprite[BLIT_W * BLIT_H] __attribute__((aligned(64)));
+static uint32_t s_sprite_a[BLIT_W * BLIT_H] __attribute__((aligned(64)));
+
+#define COLOR_KEY 0x00FF00FFu
+
+typedef struct {
+  uint8_t bpp;
+  uint8_t rpos, rsz, gpos, gsz, bpos, bsz;
+} bench_fmt_t;
+
+static const bench_fmt_t k_formats[] = {
+  { 32, 16, 8, 8, 8,  0, 8 },
+  { 32,  0, 8, 8, 8, 16, 8 },
+  { 24, 16, 8, 8, 8,  0, 8 },
+  { 24,  0, 8, 8, 8, 16, 8 },
+  { 16, 11, 5, 5, 6,  0, 5 },
+  { 16, 10, 5, 5, 5,  0, 5 },
+};
+
+static void report(const char* backend, const char* op, uint64_t pixels, uint64_t cycles) {
+  uint64_t pps = tsc_per_second(pixels, cycles);
+  serial_printf("[FBBENCH] %s %s: %lu px in %lu cyc, %lu Mpx/s\n",
+                backend, op, pixels, cycles, udiv64(pps, 1000000u));
+}
+
+static void bench_one(const bench_fmt_t* f) {
+  fb_t fb;
+  uint32_t bypp = (uint32_t)(f->bpp + 7) / 8;
+  if (!fb_init_from_mb2(&fb, (uint64_t)(uintptr_t)s_surface, BENCH_W * bypp, BENCH_W, BENCH_H,
+                        f->bpp, 1, f->rpos, f->rsz, f->gpos, f->gsz, f->bpos, f->bsz)) {
+    serial_printf("[FBBENCH] bpp=%u: no backend\n", (uint32_t)f->bpp);
+    return;
+  }
+  const char* name = fb.ops->name;
+  uint64_t t0, t1;
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 16; ++i) fb_fill(&fb, i * 0x010203u);
+  t1 = rdtsc();
+  report(name, "fill ", 16ull * BENCH_W * BENCH_H, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 256; ++i) fb_rect(&fb, i % 200, i % 140, 100, 80, 0x00AA00);
+  t1 = rdtsc();
+  report(name, "rect ", 256ull * 100 * 80, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 4096; ++i) fb_hline(&fb, 0, i % BENCH_H, BENCH_W, 0xFFFFFF);
+  t1 = rdtsc();
+  report(name, "hline", 4096ull * BENCH_W, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 4096; ++i) fb_vline(&fb, i % BENCH_W, 0, BENCH_H, 0xFF0000);
+  t1 = rdtsc();
+  report(name, "vline", 4096ull * BENCH_H, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 256; ++i)
+    fb_blit(&fb, (i * 7) % (BENCH_W - BLIT_W), (i * 5) % (BENCH_H - BLIT_H),
+            BLIT_W, BLIT_H, s_sprite, BLIT_W);
+  t1 = rdtsc();
+  report(name, "blit ", 256ull * BLIT_W * BLIT_H, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 256; ++i)
+    fb_blit_alpha(&fb, (i * 7) % (BENCH_W - BLIT_W), (i * 5) % (BENCH_H - BLIT_H),
+                  BLIT_W, BLIT_H, s_sprite_a, BLIT_W);
+  t1 = rdtsc();
+  report(name, "alpha", 256ull * BLIT_W * BLIT_H, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t i = 0; i < 256; ++i)
+    fb_blit_colorkey(&fb, (i * 7) % (BENCH_W - BLIT_W), (i * 5) % (BENCH_H - BLIT_H),
+                     BLIT_W, BLIT_H, s_sprite, BLIT_W, COLOR_KEY);
+  t1 = rdtsc();
+  report(name, "ckey ", 256ull * BLIT_W * BLIT_H, t1 - t0);
+}
+
+static void make_sprites(void) {
+  for (uint32_t y = 0; y < BLIT_H; ++y) {
+    for (uint32_t x = 0; x < BLIT_W; ++x) {
+      uint32_t i = y * BLIT_W + x;
+      s_sprite[i] = ((x ^ y) & 8) ? COLOR_KEY : i * 0x00010307u;
+
+      // Premultiplied horizontal alpha ramp with fully clear and opaque runs.
+      uint32_t a = (x < 8) ? 0 : (x >= 56) ? 255 : (x - 8) * 5;
+      uint32_t r = (0xFF * a) / 255, g = (y * 4 * a) / 255, b = (0x80 * a) / 255;
+      s_sprite_a[i] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+  }
+}
+
+void fb_bench_formats(void) {
+  make_sprites();
+
+  serial_printf("[FBBENCH] %ux%u off-screen, tsc=%u kHz\n", BENCH_W, BENCH_H, g_tsc_khz);
+  for (uint32_t i = 0; i < sizeof(k_formats) / sizeof(k_formats[0]); ++i) {
+    bench_one(&k_formats[i]);
+  }
+}
+
+// Same blits against the live framebuffer, which is usually uncached or
+// write-combined and behaves very differently from the RAM surfaces above.
+void fb_bench_blit(fb_t* fb) {
+  if (!fb->base || !fb->ops || fb->width < BLIT_W || fb->height < BLIT_H) return;
+  make_sprites();
+
+  uint32_t cols = fb->width / BLIT_W, rows = fb->height / BLIT_H;
+  uint64_t px = (uint64_t)cols * rows * BLIT_W * BLIT_H;
+  uint64_t t0, t1;
+
+  t0 = rdtsc();
+  for (uint32_t y = 0; y < rows; ++y)
+    for (uint32_t x = 0; x < cols; ++x)
+      fb_blit(fb, x * BLIT_W, y * BLIT_H, BLIT_W, BLIT_H, s_sprite, BLIT_W);
+  t1 = rdtsc();
+  report(fb->ops->name, "live blit ", px, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t y = 0; y < rows; ++y)
+    for (uint32_t x = 0; x < cols; ++x)
+      fb_blit_alpha(fb, x * BLIT_W, y * BLIT_H, BLIT_W, BLIT_H, s_sprite_a, BLIT_W);
+  t1 = rdtsc();
+  report(fb->ops->name, "live alpha", px, t1 - t0);
+
+  t0 = rdtsc();
+  for (uint32_t y = 0; y < rows; ++y)
+    for (uint32_t x = 0; x < cols; ++x)
+      fb_blit_colorkey(fb, x * BLIT_W, y * BLIT_H, BLIT_W, BLIT_H, s_sprite, BLIT_W, COLOR_KEY);
+  t1 = rdtsc();
+  report(fb->ops->name, "live ckey ", px, t1 - t0);
+}
+
+static fb_dl_t s_scene;
+
+static void split100(uint64_t v, uint32_t* whole, uint32_t* frac) {
+  uint64_t q = udiv64(v, 100);
+  *whole = (uint32_t)q;
+  *frac  = (uint32_t)(v - q * 100);
+}
+
+static void build_scene(fb_t* fb, uint32_t frame) {
+  fb_dl_reset(&s_scene);
+  fb_dl_fill(&s_scene, fb, 0x001030);
+  for (uint32_t i = 0; i < 64; ++i) {
+    uint32_t x = (i * 97 + frame * 13) % fb->width;
+    uint32_t y = (i * 57 + frame * 7) % fb->height;
+    fb_dl_rect(&s_scene, x, y, 160, 90, 0x102030u * (i + 1));
+  }
+  for (uint32_t i = 0; i < 48; ++i) {
+    uint32_t x = (i * 151 + frame * 5) % fb->width;
+    uint32_t y = (i * 83 + frame * 3) % fb->height;
+    if (i % 3 == 0)      fb_dl_blit(&s_scene, x, y, BLIT_W, BLIT_H, s_sprite, BLIT_W);
+    else if (i % 3 == 1) fb_dl_blit_alpha(&s_scene, x, y, BLIT_W, BLIT_H, s_sprite_a, BLIT_W);
+    else                 fb_dl_blit_colorkey(&s_scene, x, y, BLIT_W, BLIT_H, s_sprite, BLIT_W, COLOR_KEY);
+  }
+}
+
+// Frames per second of a synthetic scene on the live framebuffer as more
+// CPUs take tiles.
+void fb_bench_tiles(fb_t* fb) {
+  if (!fb->base || !fb->ops) return;
+  make_sprites();
+
+  const uint32_t frames = 16;
+  uint64_t fps1 = 0;
+  for (uint32_t n = 1; n <= g_cpu_count; ++n) {
+    if (!g_cpus[n - 1].online) continue;
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t f = 0; f < frames; ++f) {
+      build_scene(fb, f);
+      fb_tile_render(fb, &s_scene, n);
+    }
+    uint64_t t1 = rdtsc();
+
+    uint64_t fps100 = tsc_per_second(frames * 100ull, t1 - t0);
+    if (n == 1) fps1 = fps100;
+    uint32_t fps_i, fps_f, sp_i, sp_f;
+    split100(fps100, &fps_i, &fps_f);
+    split100(fps1 ? udiv64(fps100 * 100u, fps1) : 0, &sp_i, &sp_f);
+    serial_printf("[TILE] %ux%u cpus=%u fps=%u.%u%u speedup=%u.%u%u\n",
+                  fb->width, fb->height, n,
+                  fps_i, fps_f / 10, fps_f % 10, sp_i, sp_f / 10, sp_f % 10);
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Row kernels shared by the framebuffer backends. Sources are 0xAARRGGBB,
+// alpha is premultiplied; destinations are xrgb8888 rows.
+
+static inline uint32_t fb_mul255(uint32_t x, uint32_t a) {
+  uint32_t t = x * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t fb_px_over(uint32_t s, uint32_t d) {
+  uint32_t inv = 255 - (s >> 24);
+  uint32_t out = 0;
+  for (int sh = 0; sh < 24; sh += 8) {
+    uint32_t c = ((s >> sh) & 0xFF) + fb_mul255((d >> sh) & 0xFF, inv);
+    if (c > 255) c = 255;
+    out |= c << sh;
+  }
+  return out;
+}
+
+void fb_row_copy_nt_sse2(uint32_t* dst, const uint32_t* src, uint32_t n);
+void fb_row_over_sse2(uint32_t* dst, const uint32_t* src, uint32_t n);
+void fb_row_colorkey_sse2(uint32_t* dst, const uint32_t* src, uint32_t n, uint32_t key);
+void fb_rows_fence(void);
@@ -0,0 +1,97 @@
+#include "fb_rows.h"
+
+typedef long long      v2di   __attribute__((vector_size(16)));
+typedef long long      v2di_u __attribute__((vector_size(16), aligned(1)));
+typedef int            v4si   __attribute__((vector_size(16)));
+typedef unsigned       v4su   __attribute__((vector_size(16)));
+typedef short          v8hi   __attribute__((vector_size(16)));
+typedef unsigned short v8hu   __attribute__((vector_size(16)));
+typedef char           v16qi  __attribute__((vector_size(16)));
+
+// The kernel stack is only 4-byte aligned; realign for spilled xmm locals.
+#define SSE2_FN __attribute__((target("sse2"), force_align_arg_pointer))
+
+#define RGB_MASK 0x00FFFFFFu
+
+SSE2_FN void fb_row_copy_nt_sse2(uint32_t* dst, const uint32_t* src, uint32_t n) {
+  const v4su m = { RGB_MASK, RGB_MASK, RGB_MASK, RGB_MASK };
+
+  for (; n && ((uintptr_t)dst & 15u); --n) *dst++ = *src++ & RGB_MASK;
+  for (; n >= 4; n -= 4, dst += 4, src += 4) {
+    v4su s = (v4su)*(const v2di_u*)src;
+    __builtin_ia32_movntdq((v2di*)dst, (v2di)(s & m));
+  }
+  for (; n; --n) *dst++ = *src++ & RGB_MASK;
+}
+
+SSE2_FN void fb_row_over_sse2(uint32_t* dst, const uint32_t* src, uint32_t n) {
+  const v16qi zero = { 0 };
+  const v8hu k255 = { 255, 255, 255, 255, 255, 255, 255, 255 };
+  const v8hu k128 = { 128, 128, 128, 128, 128, 128, 128, 128 };
+  const v4su m = { RGB_MASK, RGB_MASK, RGB_MASK, RGB_MASK };
+
+  for (; n >= 4; n -= 4, dst += 4, src += 4) {
+    v16qi s = (v16qi)*(const v2di_u*)src;
+    v4su  a = (v4su)s >> 24;
+
+    int opaque = __builtin_ia32_pmovmskb128((v16qi)(a == 255));
+    if (opaque == 0xFFFF) {
+      *(v2di_u*)dst = (v2di)((v4su)s & m);
+      continue;
+    }
+    v4su  clear = (v4su)(a == 0);
+    if (__builtin_ia32_pmovmskb128((v16qi)clear) == 0xFFFF) continue;
+
+    v16qi d = (v16qi)*(const v2di_u*)dst;
+
+    v8hu d_lo = (v8hu)__builtin_ia32_punpcklbw128(d, zero);
+    v8hu d_hi = (v8hu)__builtin_ia32_punpckhbw128(d, zero);
+    v8hi s_lo = (v8hi)__builtin_ia32_punpcklbw128(s, zero);
+    v8hi s_hi = (v8hi)__builtin_ia32_punpckhbw128(s, zero);
+
+    // Broadcast each pixel's alpha word (3 and 7) to its four channels.
+    v8hu a_lo = (v8hu)__builtin_ia32_pshufhw(__builtin_ia32_pshuflw(s_lo, 0xFF), 0xFF);
+    v8hu a_hi = (v8hu)__builtin_ia32_pshufhw(__builtin_ia32_pshuflw(s_hi, 0xFF), 0xFF);
+
+    v8hu t_lo = d_lo * (k255 - a_lo) + k128;
+    v8hu t_hi = d_hi * (k255 - a_hi) + k128;
+    t_lo = (t_lo + (t_lo >> 8)) >> 8;
+    t_hi = (t_hi + (t_hi >> 8)) >> 8;
+
+    v16qi out = __builtin_ia32_packuswb128((v8hi)t_lo, (v8hi)t_hi);
+    out = __builtin_ia32_paddusb128(out, s);
+    // Fully transparent pixels keep dst as-is, matching the scalar path.
+    *(v2di_u*)dst = (v2di)(((v4su)out & m & ~clear) | ((v4su)d & clear));
+  }
+  for (; n; --n, ++dst, ++src) {
+    if ((*src >> 24) != 0) *dst = fb_px_over(*src, *dst);
+  }
+}
+
+SSE2_FN void fb_row_colorkey_sse2(uint32_t* dst, const uint32_t* src, uint32_t n, uint32_t key) {
+  const v4su m = { RGB_MASK, RGB_MASK, RGB_MASK, RGB_MASK };
+  key &= RGB_MASK;
+  const v4su k = { key, key, key, key };
+
+  for (; n >= 4; n -= 4, dst += 4, src += 4) {
+    v4su s  = (v4su)*(const v2di_u*)src & m;
+    v4su eq = (v4su)(s == k);
+
+    int skip = __builtin_ia32_pmovmskb128((v16qi)eq);
+    if (skip == 0xFFFF) continue;
+    if (skip == 0) {
+      *(v2di_u*)dst = (v2di)s;
+      continue;
+    }
+    v4su d = (v4su)*(const v2di_u*)dst;
+    *(v2di_u*)dst = (v2di)((d & eq) | (s & ~eq));
+  }
+  for (; n; --n, ++dst, ++src) {
+    uint32_t s = *src & RGB_MASK;
+    if (s != key) *dst = s;
+  }
+}
+
+SSE2_FN void fb_rows_fence(void) {
+  __builtin_ia32_sfence();
+}
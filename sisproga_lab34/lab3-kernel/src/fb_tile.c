@@ -0,0 +1,123 @@
+#include "fb_tile.h"
+#include "smp.h"
+
+typedef struct {
+  fb_t*           fb;
+  const fb_dl_t*  dl;
+  uint32_t        tile_w, tile_h;
+  uint32_t        tiles_x, tiles;
+  uint32_t        next;
+} tile_job_t;
+
+static fb_cmd_t* push(fb_dl_t* dl, uint32_t op, uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+  if (dl->count >= FB_DL_MAX_CMDS) {
+    dl->dropped++;
+    return 0;
+  }
+  fb_cmd_t* c = &dl->cmds[dl->count++];
+  c->op = op;
+  c->x = x; c->y = y; c->w = w; c->h = h;
+  c->color = 0;
+  c->src = 0;
+  c->stride = 0;
+  return c;
+}
+
+void fb_dl_reset(fb_dl_t* dl) {
+  dl->count = 0;
+  dl->dropped = 0;
+}
+
+void fb_dl_fill(fb_dl_t* dl, const fb_t* fb, uint32_t rgb) {
+  fb_cmd_t* c = push(dl, FB_CMD_RECT, 0, 0, fb->width, fb->height);
+  if (c) c->color = rgb;
+}
+
+void fb_dl_rect(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t rgb) {
+  fb_cmd_t* c = push(dl, FB_CMD_RECT, x, y, w, h);
+  if (c) c->color = rgb;
+}
+
+void fb_dl_blit(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                const uint32_t* src, uint32_t src_stride) {
+  fb_cmd_t* c = push(dl, FB_CMD_BLIT, x, y, w, h);
+  if (c) { c->src = src; c->stride = src_stride; }
+}
+
+void fb_dl_blit_alpha(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                      const uint32_t* src, uint32_t src_stride) {
+  fb_cmd_t* c = push(dl, FB_CMD_BLIT_ALPHA, x, y, w, h);
+  if (c) { c->src = src; c->stride = src_stride; }
+}
+
+void fb_dl_blit_colorkey(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                         const uint32_t* src, uint32_t src_stride, uint32_t key) {
+  fb_cmd_t* c = push(dl, FB_CMD_BLIT_COLORKEY, x, y, w, h);
+  if (c) { c->src = src; c->stride = src_stride; c->color = key; }
+}
+
+static void raster_tile(const tile_job_t* job, uint32_t t) {
+  fb_t* fb = job->fb;
+  uint32_t tx0 = (t % job->tiles_x) * job->tile_w;
+  uint32_t ty0 = (t / job->tiles_x) * job->tile_h;
+  uint32_t tx1 = tx0 + job->tile_w; if (tx1 > fb->width)  tx1 = fb->width;
+  uint32_t ty1 = ty0 + job->tile_h; if (ty1 > fb->height) ty1 = fb->height;
+
+  for (uint32_t i = 0; i < job->dl->count; i++) {
+    const fb_cmd_t* c = &job->dl->cmds[i];
+
+    // Intersect in 64-bit so that x + w cannot wrap.
+    uint64_t cx1 = (uint64_t)c->x + c->w, cy1 = (uint64_t)c->y + c->h;
+    uint32_t x0 = c->x > tx0 ? c->x : tx0;
+    uint32_t y0 = c->y > ty0 ? c->y : ty0;
+    uint32_t x1 = cx1 < tx1 ? (uint32_t)cx1 : tx1;
+    uint32_t y1 = cy1 < ty1 ? (uint32_t)cy1 : ty1;
+    if (x0 >= x1 || y0 >= y1) continue;
+
+    const uint32_t* src = c->src ? c->src + (y0 - c->y) * c->stride + (x0 - c->x) : 0;
+    switch (c->op) {
+      case FB_CMD_RECT:
+        fb->ops->rect(fb, x0, y0, x1 - x0, y1 - y0, c->color);
+        break;
+      case FB_CMD_BLIT:
+        fb->ops->blit(fb, x0, y0, x1 - x0, y1 - y0, src, c->stride);
+        break;
+      case FB_CMD_BLIT_ALPHA:
+        fb->ops->blit_alpha(fb, x0, y0, x1 - x0, y1 - y0, src, c->stride);
+        break;
+      case FB_CMD_BLIT_COLORKEY:
+        fb->ops->blit_colorkey(fb, x0, y0, x1 - x0, y1 - y0, src, c->stride, c->color);
+        break;
+    }
+  }
+}
+
+static void tile_worker(uint32_t cpu, void* arg) {
+  (void)cpu;
+  tile_job_t* job = (tile_job_t*)arg;
+  for (;;) {
+    uint32_t t = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (t >= job->tiles) break;
+    raster_tile(job, t);
+  }
+}
+
+void fb_tile_render(fb_t* fb, const fb_dl_t* dl, uint32_t ncpus) {
+  if (!fb->base || !fb->ops || dl->count == 0) return;
+
+  uint32_t bypp = (uint32_t)(fb->bpp + 7) / 8;
+  tile_job_t job;
+  job.fb = fb;
+  job.dl = dl;
+  job.tile_w = FB_TILE_W;
+  job.tile_h = FB_TILE_BYTES / (FB_TILE_W * bypp);
+  job.tiles_x = (fb->width + job.tile_w - 1) / job.tile_w;
+  job.tiles = job.tiles_x * ((fb->height + job.tile_h - 1) / job.tile_h);
+  job.next = 0;
+
+  // Workers write disjoint tiles through the backend directly; the surface
+  // lock keeps fb_* callers out for the whole frame.
+  ticket_lock(&fb->lock);
+  smp_run(ncpus, tile_worker, &job);
+  ticket_unlock(&fb->lock);
+}
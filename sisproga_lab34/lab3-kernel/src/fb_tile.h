@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+#include "fb.h"
+
+// Display list + tile renderer. Draw calls are recorded first, then the
+// surface is cut into cache-sized tiles that CPUs rasterize independently.
+
+#define FB_DL_MAX_CMDS   256
+#define FB_TILE_BYTES    32768u
+#define FB_TILE_W        128u
+
+enum {
+  FB_CMD_RECT = 1,
+  FB_CMD_BLIT,
+  FB_CMD_BLIT_ALPHA,
+  FB_CMD_BLIT_COLORKEY,
+};
+
+typedef struct {
+  uint32_t        op;
+  uint32_t        x, y, w, h;
+  uint32_t        color;      // rect color or color key
+  const uint32_t* src;
+  uint32_t        stride;
+} fb_cmd_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t dropped;
+  fb_cmd_t cmds[FB_DL_MAX_CMDS];
+} fb_dl_t;
+
+void fb_dl_reset(fb_dl_t* dl);
+void fb_dl_fill(fb_dl_t* dl, const fb_t* fb, uint32_t rgb);
+void fb_dl_rect(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t rgb);
+void fb_dl_blit(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                const uint32_t* src, uint32_t src_stride);
+void fb_dl_blit_alpha(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                      const uint32_t* src, uint32_t src_stride);
+void fb_dl_blit_colorkey(fb_dl_t* dl, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                         const uint32_t* src, uint32_t src_stride, uint32_t key);
+
+// Rasterize dl on up to ncpus CPUs; returns when every tile is done.
+void fb_tile_render(fb_t* fb, const fb_dl_t* dl, uint32_t ncpus);
+
+void fb_bench_tiles(fb_t* fb);
@@ -0,0 +1,126 @@
+#include "hist.h"
+#include "spinlock.h"
+#include "tsc.h"
+#include "util.h"
+#include "serial.h"
+
+static hist_t* volatile s_registry = 0;
+
+static void hist_register(hist_t* h) {
+  if (__atomic_exchange_n(&h->registered, 1, __ATOMIC_ACQ_REL)) return;
+  hist_t* head = __atomic_load_n(&s_registry, __ATOMIC_ACQUIRE);
+  do {
+    h->next = head;
+  } while (!__atomic_compare_exchange_n(&s_registry, &head, h, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+// No 64-bit clz without libgcc in the i386 build.
+static uint32_t msb64(uint64_t v) {
+  uint32_t hi = (uint32_t)(v >> 32);
+  return hi ? 63u - (uint32_t)__builtin_clz(hi) : 31u - (uint32_t)__builtin_clz((uint32_t)v);
+}
+
+uint32_t hist_bucket(uint64_t value) {
+  if (value < HIST_SUB) return (uint32_t)value;
+  uint32_t e = msb64(value);
+  if (e >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+  uint32_t sub = (uint32_t)(value >> (e - HIST_SUB_BITS)) - HIST_SUB;
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+uint64_t hist_bucket_low(uint32_t bucket) {
+  if (bucket < HIST_SUB) return bucket;
+  uint32_t group = bucket >> HIST_SUB_BITS;
+  uint32_t sub   = bucket & (HIST_SUB - 1);
+  return (uint64_t)(HIST_SUB + sub) << (group - 1);
+}
+
+uint64_t hist_bucket_high(uint32_t bucket) {
+  if (bucket < HIST_SUB) return bucket;
+  return hist_bucket_low(bucket) + (1ull << ((bucket >> HIST_SUB_BITS) - 1)) - 1;
+}
+
+// One add on memory cannot be split by an interrupt, and no other CPU
+// writes this slot. max is two stores on i386; a reader may see it torn.
+void hist_record_cpu(hist_t* h, uint32_t cpu, uint64_t value) {
+  if (cpu >= SMP_MAX_CPUS) return;
+  if (!h->registered) hist_register(h);
+  hist_cpu_t* c = &h->cpu[cpu];
+  __asm__ volatile ("addl $1, %0" : "+m"(c->counts[hist_bucket(value)]));
+  if (value > c->max) c->max = value;
+}
+
+void hist_record(hist_t* h, uint64_t value) {
+  hist_record_cpu(h, smp_cpu_id(), value);
+}
+
+void hist_merge(const hist_t* h, hist_snap_t* out) {
+  out->total = 0;
+  out->max   = 0;
+  for (uint32_t b = 0; b < HIST_BUCKETS; ++b) out->counts[b] = 0;
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    const hist_cpu_t* c = &h->cpu[cpu];
+    for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+      uint32_t n = __atomic_load_n(&c->counts[b], __ATOMIC_RELAXED);
+      out->counts[b] += n;
+      out->total     += n;
+    }
+    if (c->max > out->max) out->max = c->max;
+  }
+}
+
+uint64_t hist_percentile(const hist_snap_t* s, uint32_t permille) {
+  if (!s->total) return 0;
+  uint64_t rank = udiv64(s->total * permille + 999, 1000);
+  if (!rank) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+    seen += s->counts[b];
+    if (seen >= rank) {
+      uint64_t v = hist_bucket_high(b);
+      return v < s->max ? v : s->max;
+    }
+  }
+  return s->max;
+}
+
+void hist_reset(hist_t* h) {
+  for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+    hist_cpu_t* c = &h->cpu[cpu];
+    for (uint32_t b = 0; b < HIST_BUCKETS; ++b) __atomic_store_n(&c->counts[b], 0, __ATOMIC_RELAXED);
+    c->max = 0;
+  }
+}
+
+// ---- dump --------------------------------------------------------------------
+
+static ticket_lock_t s_dump_lock = TICKET_LOCK_INIT(0);
+static hist_snap_t   s_snap;        // ~5 KiB, kept off the stack
+
+static void dump_one(const hist_t* h) {
+  hist_snap_t* s = &s_snap;
+  hist_merge(h, s);
+  serial_printf("[HIST] %s n=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu ns\n", h->name, s->total,
+                tsc_cycles_to_ns(hist_percentile(s, 500)), tsc_cycles_to_ns(hist_percentile(s, 900)),
+                tsc_cycles_to_ns(hist_percentile(s, 990)), tsc_cycles_to_ns(hist_percentile(s, 999)),
+                tsc_cycles_to_ns(s->max));
+
+  serial_printf("[HISTD] %s khz=%u sub=%u max=%lu", h->name, g_tsc_khz, HIST_SUB_BITS, s->max);
+  for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+    if (s->counts[b]) serial_printf(" %u:%lu", b, s->counts[b]);
+  }
+  serial_printf("\n");
+}
+
+void hist_dump(const char* name) {
+  int any = 0;
+  ticket_lock(&s_dump_lock);
+  for (hist_t* h = __atomic_load_n(&s_registry, __ATOMIC_ACQUIRE); h; h = h->next) {
+    if (name && !streq(h->name, name)) continue;
+    any = 1;
+    dump_one(h);
+  }
+  ticket_unlock(&s_dump_lock);
+  if (!any) serial_printf("[HIST] no histogram %s\n", name ? name : "recorded yet");
+}
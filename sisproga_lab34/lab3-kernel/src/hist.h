@@ -0,0 +1,61 @@
+#pragma once
+#include <stdint.h>
+#include "smp.h"
+
+// Log-linear latency histograms in fixed memory (HdrHistogram layout):
+// values below HIST_SUB are counted exactly, every power of two above is
+// split into HIST_SUB equal buckets, so a bucket is never wider than
+// 1/HIST_SUB of its values (6.25%). Values are TSC cycles; anything from
+// 2^HIST_MAX_BITS up lands in the last bucket, but max stays exact.
+//
+// Each CPU records into its own slot with plain single-instruction
+// increments, so recording takes no lock and no bus-locked instruction and
+// is safe against an interrupt handler on the same CPU recording too.
+// Readers merge the slots as they go; a histogram registers itself on the
+// first record, like the lock statistics.
+//
+//   static hist_t s_h = HIST_INIT("fb_fill");
+//   uint64_t t0 = rdtsc(); ...; hist_record(&s_h, rdtsc() - t0);
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40          // ~6 minutes at 3 GHz
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+  uint32_t counts[HIST_BUCKETS];
+  uint64_t max;
+} __attribute__((aligned(64))) hist_cpu_t;
+
+typedef struct hist {
+  const char*       name;
+  struct hist*      next;
+  volatile uint32_t registered;
+  hist_cpu_t        cpu[SMP_MAX_CPUS];
+} hist_t;
+
+// All CPUs summed.
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} hist_snap_t;
+
+#define HIST_INIT(nm) { .name = (nm) }
+
+void     hist_record(hist_t* h, uint64_t value);
+void     hist_record_cpu(hist_t* h, uint32_t cpu, uint64_t value);
+void     hist_merge(const hist_t* h, hist_snap_t* out);
+// Smallest bucket upper bound that covers `permille` of the values (999 for
+// p99.9), capped at max; 0 for an empty histogram.
+uint64_t hist_percentile(const hist_snap_t* s, uint32_t permille);
+void     hist_reset(hist_t* h);
+
+uint32_t hist_bucket(uint64_t value);
+uint64_t hist_bucket_low(uint32_t bucket);
+uint64_t hist_bucket_high(uint32_t bucket);
+
+// Per histogram (all, or only those called `name`) a [HIST] summary line
+// in ns and a [HISTD] line with the raw buckets for tools/histview:
+//   [HISTD] <name> khz=<tsc kHz> sub=<HIST_SUB_BITS> max=<cycles> <bucket>:<count> ...
+void     hist_dump(const char* name);
@@ -0,0 +1,262 @@
+#include "ata.h"
+#include "blk.h"
+#include "pci.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "serial.h"
+
+// Legacy IDE (QEMU's PIIX for -hda) with bus-master DMA. A channel runs one
+// command at a time, so batching here means merging: queued requests for
+// consecutive sectors go out as one READ DMA EXT with one PRD table.
+
+#define IDE_COMPAT_CMD0  0x1F0
+#define IDE_COMPAT_CTL0  0x3F6
+#define IDE_COMPAT_CMD1  0x170
+#define IDE_COMPAT_CTL1  0x376
+
+#define ATA_DATA     0
+#define ATA_COUNT    2
+#define ATA_LBA0     3
+#define ATA_LBA1     4
+#define ATA_LBA2     5
+#define ATA_DEVSEL   6
+#define ATA_CMD      7      // status on read
+
+#define ATA_CTL_NIEN 0x02
+#define ATA_CTL_SRST 0x04
+
+#define BM_CMD       0
+#define BM_STATUS    2
+#define BM_PRDT      4
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08   // device to memory
+#define BM_ST_ACTIVE 0x01
+#define BM_ST_ERR    0x02
+#define BM_ST_IRQ    0x04
+
+#define IDE_MAX_PRD    128        // one page of PRD table holds 512
+#define IDE_MAX_MERGE  32         // requests per command
+#define IDE_MAX_SECTORS 65536u    // LBA48 count
+
+typedef struct __attribute__((packed)) {
+  uint32_t addr;
+  uint16_t bytes;           // 0 means 64 KiB
+  uint16_t flags;           // bit 15: last entry
+} ide_prd_t;
+
+typedef struct {
+  blk_dev_t  blk;
+  uint16_t   cmd, ctl, bm;
+  uint8_t    slave;
+  ide_prd_t* prdt;
+  blk_req_t* active[IDE_MAX_MERGE];
+  uint32_t   nactive;
+  int        failed;        // active[0] could not be started
+} ide_disk_t;
+
+static ide_disk_t s_disks[2];   // one per channel
+static uint32_t   s_ndisks;
+
+static void delay400(ide_disk_t* d) {
+  for (int i = 0; i < 4; ++i) (void)inb(d->ctl);
+}
+
+static int wait_not_busy(ide_disk_t* d) {
+  for (uint32_t spin = 0; spin < 1000000; ++spin) {
+    uint8_t st = inb(d->cmd + ATA_CMD);
+    if (!(st & ATA_SR_BSY)) return st;
+  }
+  return -1;
+}
+
+// PIO IDENTIFY; 0 for an ATA disk, -1 for nothing or ATAPI.
+static int identify(ide_disk_t* d, uint16_t* id) {
+  outb(d->cmd + ATA_DEVSEL, (uint8_t)(0xA0 | (d->slave << 4)));
+  delay400(d);
+  outb(d->cmd + ATA_COUNT, 0);
+  outb(d->cmd + ATA_LBA0, 0);
+  outb(d->cmd + ATA_LBA1, 0);
+  outb(d->cmd + ATA_LBA2, 0);
+  outb(d->cmd + ATA_CMD, ATA_CMD_IDENTIFY);
+  delay400(d);
+
+  uint8_t st = inb(d->cmd + ATA_CMD);
+  if (st == 0 || st == 0xFF) return -1;
+  if (wait_not_busy(d) < 0) return -1;
+  if (inb(d->cmd + ATA_LBA1) || inb(d->cmd + ATA_LBA2)) return -1;   // ATAPI signature
+
+  for (uint32_t spin = 0; spin < 1000000; ++spin) {
+    st = inb(d->cmd + ATA_CMD);
+    if (st & ATA_SR_ERR) return -1;
+    if (st & ATA_SR_DRQ) break;
+  }
+  if (!(st & ATA_SR_DRQ)) return -1;
+  for (uint32_t i = 0; i < 256; ++i) id[i] = inw(d->cmd + ATA_DATA);
+  return 0;
+}
+
+// PRD entries hold 32-bit addresses.
+static int dma32(const blk_req_t* r) {
+  for (uint32_t s = 0; s < r->nseg; ++s) {
+    if (r->seg[s].addr + r->seg[s].len > 0x100000000ull) return 0;
+  }
+  return 1;
+}
+
+static uint32_t ide_issue(blk_dev_t* b, blk_req_t* const* reqs, uint32_t n) {
+  ide_disk_t* d = (ide_disk_t*)b->priv;
+  if (d->nactive) return 0;
+
+  if (!dma32(reqs[0])) {
+    d->active[0] = reqs[0];
+    d->nactive = 1;
+    d->failed  = 1;
+    return 1;
+  }
+
+  // Merge while the next request starts where the previous one ends.
+  uint64_t lba = reqs[0]->lba;
+  uint32_t count = 0, nprd = 0, took = 0;
+  for (; took < n && took < IDE_MAX_MERGE; ++took) {
+    const blk_req_t* r = reqs[took];
+    if (r->lba != lba + count || count + r->count > IDE_MAX_SECTORS ||
+        nprd + r->nseg > IDE_MAX_PRD || !dma32(r)) break;
+    for (uint32_t s = 0; s < r->nseg; ++s) {
+      d->prdt[nprd].addr  = (uint32_t)r->seg[s].addr;
+      d->prdt[nprd].bytes = (uint16_t)r->seg[s].len;
+      d->prdt[nprd].flags = 0;
+      nprd++;
+    }
+    count += r->count;
+    d->active[took] = reqs[took];
+  }
+  d->prdt[nprd - 1].flags = 0x8000;
+  d->nactive = took;
+
+  uint16_t bm = d->bm;
+  outb(bm + BM_CMD, 0);
+  outl(bm + BM_PRDT, (uint32_t)(uintptr_t)d->prdt);
+  outb(bm + BM_STATUS, inb(bm + BM_STATUS) | BM_ST_ERR | BM_ST_IRQ);
+  outb(bm + BM_CMD, BM_CMD_READ);
+
+  outb(d->cmd + ATA_DEVSEL, (uint8_t)(ATA_DEV_LBA | (d->slave << 4)));
+  uint32_t c = (count == IDE_MAX_SECTORS) ? 0 : count;
+  outb(d->cmd + ATA_COUNT, (uint8_t)(c >> 8));
+  outb(d->cmd + ATA_LBA0, (uint8_t)(lba >> 24));
+  outb(d->cmd + ATA_LBA1, (uint8_t)(lba >> 32));
+  outb(d->cmd + ATA_LBA2, (uint8_t)(lba >> 40));
+  outb(d->cmd + ATA_COUNT, (uint8_t)c);
+  outb(d->cmd + ATA_LBA0, (uint8_t)lba);
+  outb(d->cmd + ATA_LBA1, (uint8_t)(lba >> 8));
+  outb(d->cmd + ATA_LBA2, (uint8_t)(lba >> 16));
+  outb(d->cmd + ATA_CMD, ATA_CMD_READ_DMA_EXT);
+  outb(bm + BM_CMD, BM_CMD_READ | BM_CMD_START);
+
+  b->cmds++;
+  return took;
+}
+
+static void ide_poll(blk_dev_t* b) {
+  ide_disk_t* d = (ide_disk_t*)b->priv;
+  if (!d->nactive) return;
+  if (d->failed) {
+    d->failed  = 0;
+    d->nactive = 0;
+    blk_complete(b, d->active[0], -1);
+    return;
+  }
+
+  uint8_t bst = inb(d->bm + BM_STATUS);
+  if ((bst & BM_ST_ACTIVE) && !(bst & (BM_ST_IRQ | BM_ST_ERR))) return;
+  uint8_t st = inb(d->ctl);
+  if (st & ATA_SR_BSY) return;
+
+  outb(d->bm + BM_CMD, 0);
+  st = inb(d->cmd + ATA_CMD);     // also acknowledges the device
+  outb(d->bm + BM_STATUS, bst | BM_ST_ERR | BM_ST_IRQ);
+
+  int status = ((bst & BM_ST_ERR) || (st & (ATA_SR_ERR | ATA_SR_DF))) ? -1 : 0;
+  if (status) serial_printf("[IDE][ERR] %s: status %x, bus master %x\n", b->name, (uint32_t)st, (uint32_t)bst);
+  uint32_t n = d->nactive;
+  d->nactive = 0;
+  for (uint32_t i = 0; i < n; ++i) blk_complete(b, d->active[i], status);
+}
+
+// Stopping the bus master ends the DMA into memory; a software reset then
+// drops the command so the channel takes new ones.
+static int ide_abort(blk_dev_t* b) {
+  ide_disk_t* d = (ide_disk_t*)b->priv;
+  if (!d->nactive) return 0;
+  serial_printf("[IDE] %s: aborting %u requests\n", b->name, d->nactive);
+
+  outb(d->bm + BM_CMD, 0);
+  outb(d->bm + BM_STATUS, inb(d->bm + BM_STATUS) | BM_ST_ERR | BM_ST_IRQ);
+  outb(d->ctl, ATA_CTL_NIEN | ATA_CTL_SRST);
+  delay400(d);
+  outb(d->ctl, ATA_CTL_NIEN);
+  int rc = wait_not_busy(d) < 0 ? -1 : 0;
+
+  uint32_t n = d->nactive;
+  d->nactive = 0;
+  d->failed  = 0;
+  for (uint32_t i = 0; i < n; ++i) blk_complete(b, d->active[i], -1);
+  return rc;
+}
+
+static const blk_ops_t ide_ops = { "ide dma", ide_issue, ide_poll, ide_abort };
+
+int ide_init(void) {
+  const pci_dev_t* p = pci_find_class(0x01, 0x01, 0);
+  if (!p) return 0;
+  if (!(p->prog_if & 0x80) || !p->bar[4].size || !(p->bar[4].flags & PCI_BAR_IO)) {
+    serial_printf("[IDE] %x:%x.%u has no bus-master DMA\n",
+                  (uint32_t)p->bus, (uint32_t)p->dev, (uint32_t)p->fn);
+    return 0;
+  }
+  pci_enable(p, PCI_CMD_IO | PCI_CMD_MASTER);
+
+  static uint16_t id[256];
+  for (uint32_t ch = 0; ch < 2; ++ch) {
+    // prog_if bits 0/2: the channel is in native mode and has its own BARs.
+    int native = (p->prog_if >> (ch * 2)) & 1;
+    uint16_t cmd = native ? (uint16_t)p->bar[ch * 2].base : (ch ? IDE_COMPAT_CMD1 : IDE_COMPAT_CMD0);
+    uint16_t ctl = native ? (uint16_t)(p->bar[ch * 2 + 1].base + 2) : (ch ? IDE_COMPAT_CTL1 : IDE_COMPAT_CTL0);
+
+    for (uint8_t slave = 0; slave < 2; ++slave) {
+      ide_disk_t* d = &s_disks[s_ndisks];
+      d->cmd = cmd;
+      d->ctl = ctl;
+      d->bm  = (uint16_t)(p->bar[4].base + ch * 8);
+      d->slave = slave;
+      outb(ctl, ATA_CTL_NIEN);      // polled
+      if (identify(d, id) < 0) continue;
+
+      ata_ident_t ai;
+      ata_parse_identify(id, &ai);
+      if (!ai.lba48) {
+        serial_printf("[IDE] %s without LBA48 skipped\n", ai.model);
+        continue;
+      }
+      uint64_t page = pmm_alloc();
+      if (!page || page >= 0x100000000ull) return (int)s_ndisks;
+      d->prdt = (ide_prd_t*)(uintptr_t)page;
+      d->nactive = 0;
+      d->failed  = 0;
+
+      blk_dev_t* b = &d->blk;
+      b->name[0] = 'h';
+      b->name[1] = 'd';
+      b->name[2] = (char)('a' + ch * 2 + slave);
+      b->name[3] = 0;
+      b->ops     = &ide_ops;
+      b->priv    = d;
+      b->sectors = ai.sectors;
+      b->depth   = IDE_MAX_MERGE;
+      serial_printf("[IDE] %s: '%s', channel %u %s\n", b->name, ai.model, ch, slave ? "slave" : "master");
+      blk_register(b);
+      s_ndisks++;
+      break;      // the channel runs one command at a time: one disk each
+    }
+  }
+  return (int)s_ndisks;
+}
@@ -0,0 +1,127 @@
+#include "idle.h"
+#include "idt.h"
+#include "lapic.h"
+#include "smp.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "util.h"
+#include "serial.h"
+
+enum { IDLE_HLT = 0, IDLE_MWAIT = 1 };
+
+// kick counts wake requests, so every kick changes it and wakes the
+// monitor; kick_tsc holds the low 32 TSC bits of the latest one for the
+// latency accounting. Both share the monitored line.
+typedef struct {
+  volatile uint32_t kick;
+  volatile uint32_t kick_tsc;
+  volatile uint32_t sleeping;
+} __attribute__((aligned(64))) idle_line_t;
+
+typedef struct {
+  uint64_t entries;
+  uint64_t residency;
+  uint64_t wakeups;
+  uint64_t lat_sum;
+  uint32_t lat_max;
+} __attribute__((aligned(64))) idle_stats_t;
+
+static idle_line_t  s_line[SMP_MAX_CPUS];
+static idle_stats_t s_stats[SMP_MAX_CPUS];
+static int          s_method = IDLE_HLT;
+
+static inline void monitor(const volatile void* p) {
+  __asm__ volatile ("monitor" : : "a"(p), "c"(0), "d"(0) : "memory");
+}
+
+static void wake_ipi(isr_frame_t* f) {
+  (void)f;
+}
+
+void idle_init(void) {
+  s_method = (g_cpu_features & CPU_FEAT_MWAIT) ? IDLE_MWAIT : IDLE_HLT;
+  idt_set_handler(IDT_VEC_IDLE_WAKE, wake_ipi);
+}
+
+uint32_t idle_token(uint32_t cpu) {
+  return __atomic_load_n(&s_line[cpu].kick, __ATOMIC_ACQUIRE);
+}
+
+void idle_wait(uint32_t cpu, uint32_t token) {
+  idle_line_t*  l  = &s_line[cpu];
+  idle_stats_t* st = &s_stats[cpu];
+  uint32_t flags = irq_save();
+
+  uint64_t t0 = rdtsc();
+  if (s_method == IDLE_MWAIT) {
+    monitor(&l->kick);
+    if (l->kick == token) __asm__ volatile ("sti; mwait" : : "a"(0), "c"(0) : "memory");
+  } else {
+    __atomic_store_n(&l->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&l->kick, __ATOMIC_SEQ_CST) == token) __asm__ volatile ("sti; hlt" ::: "memory");
+    __atomic_store_n(&l->sleeping, 0, __ATOMIC_RELAXED);
+  }
+  __asm__ volatile ("cli" ::: "memory");
+  uint64_t t1 = rdtsc();
+
+  st->entries++;
+  st->residency += t1 - t0;
+
+  if (l->kick != token) {
+    uint32_t lat = (uint32_t)t1 - __atomic_load_n(&l->kick_tsc, __ATOMIC_ACQUIRE);
+    st->wakeups++;
+    st->lat_sum += lat;
+    if (lat > st->lat_max) st->lat_max = lat;
+  }
+
+  irq_restore(flags);
+}
+
+int idle_kick(uint32_t cpu) {
+  idle_line_t* l = &s_line[cpu];
+  __atomic_store_n(&l->kick_tsc, (uint32_t)rdtsc(), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&l->kick, 1, __ATOMIC_SEQ_CST);
+  if (s_method == IDLE_HLT && __atomic_load_n(&l->sleeping, __ATOMIC_SEQ_CST)) {
+    lapic_send_ipi(g_cpus[cpu].apic_id, LAPIC_ICR_ASSERT | IDT_VEC_IDLE_WAKE);
+    return 1;
+  }
+  return 0;
+}
+
+void idle_loop(void) {
+  uint32_t cpu = smp_cpu_id();
+  for (;;) {
+    uint32_t tok = idle_token(cpu);
+    if (!smp_poll(cpu)) idle_wait(cpu, tok);
+  }
+}
+
+static void probe_nop(uint32_t cpu, void* arg) {
+  (void)cpu; (void)arg;
+}
+
+// Bounce every AP through idle so the wakeup latency columns have data.
+void idle_probe(uint32_t rounds) {
+  for (uint32_t i = 0; i < rounds; i++) {
+    smp_run(g_cpu_count, probe_nop, 0);
+    tsc_delay_us(50);
+  }
+}
+
+void idle_dump(void) {
+  uint64_t now = rdtsc() - g_tsc_boot;
+
+  serial_printf("[IDLE] method=%s uptime=%lu us\n",
+                s_method == IDLE_MWAIT ? "mwait" : "hlt", tsc_cycles_to_us(now));
+  for (uint32_t i = 0; i < g_cpu_count; i++) {
+    const idle_stats_t* st = &s_stats[i];
+    if (!g_cpus[i].online) continue;
+
+    uint64_t pct10 = now ? udiv64(st->residency * 1000u, now) : 0;
+    uint64_t avg = st->wakeups ? udiv64(st->lat_sum, st->wakeups) : 0;
+    serial_printf("[IDLE] cpu%u entries=%lu resid=%lu us (%u.%u%%) wakeups=%lu lat avg=%lu ns max=%lu ns\n",
+                  i, st->entries, tsc_cycles_to_us(st->residency),
+                  (uint32_t)udiv64(pct10, 10), (uint32_t)(pct10 - udiv64(pct10, 10) * 10),
+                  st->wakeups, tsc_cycles_to_ns(avg), tsc_cycles_to_ns(st->lat_max));
+  }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+// Idle with per-CPU accounting. A CPU sleeps in MONITOR/MWAIT on its own
+// wake line when the CPU supports it, otherwise in sti;hlt. idle_kick()
+// wakes a CPU with a single store (plus an IPI only for a hlt sleeper).
+//
+// Usage on the idle side:
+//   uint32_t tok = idle_token(cpu);
+//   if (!have_work()) idle_wait(cpu, tok);
+
+void     idle_init(void);
+uint32_t idle_token(uint32_t cpu);
+void     idle_wait(uint32_t cpu, uint32_t token);
+int      idle_kick(uint32_t cpu);      // 1 when it took an IPI
+void     idle_dump(void);
+void     idle_probe(uint32_t rounds);
+
+__attribute__((noreturn)) void idle_loop(void);
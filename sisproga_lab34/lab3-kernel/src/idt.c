@@ -0,0 +1,72 @@
+#include "idt.h"
+#include "lapic.h"
+#include "cpu.h"
+#include "serial.h"
+
+typedef struct __attribute__((packed)) {
+  uint16_t off_lo;
+  uint16_t sel;
+  uint8_t  zero;
+  uint8_t  type_attr;
+  uint16_t off_hi;
+} idt_entry_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t limit;
+  uint32_t base;
+} idt_desc_t;
+
+extern uint32_t isr_stub_table[256];
+
+static idt_entry_t   s_idt[256] __attribute__((aligned(8)));
+static isr_handler_t s_handlers[256];
+
+static const char* const k_exc_names[32] = {
+  "#DE", "#DB", "NMI", "#BP", "#OF", "#BR", "#UD", "#NM",
+  "#DF", "CSO", "#TS", "#NP", "#SS", "#GP", "#PF", "?15",
+  "#MF", "#AC", "#MC", "#XM", "#VE", "#CP", "?22", "?23",
+  "?24", "?25", "?26", "?27", "?28", "?29", "#SX", "?31",
+};
+
+void isr_dispatch(isr_frame_t* f) {
+  uint32_t v = f->vector;
+
+  if (s_handlers[v]) {
+    s_handlers[v](f);
+  } else if (v < 32) {
+    serial_panic_printf("\n[IDT][FATAL] exception %u %s err=%x eip=%x cs=%x eflags=%x\n",
+                  v, k_exc_names[v], f->error, f->eip, f->cs, f->eflags);
+    for (;;) __asm__ volatile("cli; hlt");
+  }
+
+  if (v >= 32 && v != IDT_VEC_SPURIOUS) lapic_eoi();
+}
+
+void idt_set_handler(uint8_t vector, isr_handler_t fn) {
+  s_handlers[vector] = fn;
+}
+
+void idt_load(void) {
+  idt_desc_t d = { (uint16_t)(sizeof(s_idt) - 1), (uint32_t)(uintptr_t)s_idt };
+  __asm__ volatile ("lidt %0" : : "m"(d));
+}
+
+void idt_init(void) {
+  uint16_t cs;
+  __asm__ volatile ("mov %%cs, %0" : "=r"(cs));
+
+  for (int i = 0; i < 256; i++) {
+    uint32_t a = isr_stub_table[i];
+    s_idt[i].off_lo    = (uint16_t)(a & 0xFFFF);
+    s_idt[i].sel       = cs;
+    s_idt[i].zero      = 0;
+    s_idt[i].type_attr = 0x8E;   // present, ring 0, 32-bit interrupt gate
+    s_idt[i].off_hi    = (uint16_t)(a >> 16);
+  }
+
+  // Mask the legacy 8259 pair; everything we take goes through the LAPIC.
+  outb(0x21, 0xFF);
+  outb(0xA1, 0xFF);
+
+  idt_load();
+}
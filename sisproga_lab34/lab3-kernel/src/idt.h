@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+#define IDT_VEC_COM1       0x24     // ISA IRQ 4 through the I/O APIC
+#define IDT_VEC_IDLE_WAKE  0xF0
+#define IDT_VEC_SPURIOUS   0xFF
+
+typedef struct __attribute__((packed)) {
+  uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+  uint32_t vector;
+  uint32_t error;
+  uint32_t eip, cs, eflags;
+} isr_frame_t;
+
+typedef void (*isr_handler_t)(isr_frame_t* f);
+
+void idt_init(void);
+void idt_load(void);
+void idt_set_handler(uint8_t vector, isr_handler_t fn);
+
+static inline uint32_t irq_save(void) {
+  uintptr_t flags;
+  __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+  return (uint32_t)flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+  if (flags & (1u << 9)) __asm__ volatile ("sti" ::: "memory");
+}
@@ -0,0 +1,144 @@
+#include "ioapic.h"
+#include "serial.h"
+
+#define IOAPIC_MAX 4
+#define ISO_MAX    16
+
+#define IOREGSEL   0x00
+#define IOWIN      0x10
+#define IOAPIC_VER 0x01
+#define IOAPIC_RED 0x10     // two registers per entry
+
+#define RED_LOW_ACTIVE (1u << 13)
+#define RED_LEVEL      (1u << 15)
+#define RED_MASKED     (1u << 16)
+
+// MPS INTI flags of an override: polarity in bits 0-1, trigger in 2-3,
+// 0 meaning "as the bus says" (high and edge for ISA).
+#define ISO_POL_MASK   0x3
+#define ISO_POL_LOW    0x3
+#define ISO_TRIG_MASK  0xC
+#define ISO_TRIG_LEVEL 0xC
+
+typedef struct {
+  uint8_t            id;
+  volatile uint32_t* base;
+  uint32_t           gsi_base;
+  uint32_t           entries;
+} ioapic_t;
+
+typedef struct {
+  uint8_t  irq;
+  uint32_t gsi;
+  uint16_t flags;
+} iso_t;
+
+static ioapic_t s_ioapic[IOAPIC_MAX];
+static uint32_t s_nioapic;
+static iso_t    s_iso[ISO_MAX];
+static uint32_t s_niso;
+
+static uint32_t rd(const ioapic_t* a, uint32_t reg) {
+  a->base[IOREGSEL / 4] = reg;
+  return a->base[IOWIN / 4];
+}
+
+static void wr(const ioapic_t* a, uint32_t reg, uint32_t v) {
+  a->base[IOREGSEL / 4] = reg;
+  a->base[IOWIN / 4] = v;
+}
+
+static const ioapic_t* ioapic_for(uint32_t gsi) {
+  for (uint32_t i = 0; i < s_nioapic; ++i) {
+    const ioapic_t* a = &s_ioapic[i];
+    if (gsi >= a->gsi_base && gsi < a->gsi_base + a->entries) return a;
+  }
+  return 0;
+}
+
+static const iso_t* iso_for(uint32_t irq) {
+  for (uint32_t i = 0; i < s_niso; ++i) {
+    if (s_iso[i].irq == irq) return &s_iso[i];
+  }
+  return 0;
+}
+
+static void add_ioapic(const uint8_t* e) {
+  if (s_nioapic == IOAPIC_MAX) {
+    serial_printf("[IOAPIC][WARN] more than %u I/O APICs, id %u ignored\n", IOAPIC_MAX, (uint32_t)e[2]);
+    return;
+  }
+  ioapic_t* a = &s_ioapic[s_nioapic++];
+  a->id       = e[2];
+  a->base     = (volatile uint32_t*)(uintptr_t)*(const uint32_t*)(e + 4);
+  a->gsi_base = *(const uint32_t*)(e + 8);
+  a->entries  = ((rd(a, IOAPIC_VER) >> 16) & 0xFF) + 1;
+
+  for (uint32_t i = 0; i < a->entries; ++i) {
+    wr(a, IOAPIC_RED + 2 * i, RED_MASKED);
+    wr(a, IOAPIC_RED + 2 * i + 1, 0);
+  }
+}
+
+static void add_iso(const uint8_t* e) {
+  if (e[2] != 0 || s_niso == ISO_MAX) return;    // bus 0 is ISA
+  iso_t* o = &s_iso[s_niso++];
+  o->irq   = e[3];
+  o->gsi   = *(const uint32_t*)(e + 4);
+  o->flags = *(const uint16_t*)(e + 8);
+}
+
+void ioapic_init(const madt_t* madt) {
+  const uint8_t* p   = madt->entries;
+  const uint8_t* end = (const uint8_t*)madt + madt->hdr.length;
+  while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+    if (p[0] == 1 && p[1] >= 12) add_ioapic(p);
+    else if (p[0] == 2 && p[1] >= 10) add_iso(p);
+    p += p[1];
+  }
+  if (!s_nioapic) serial_printf("[IOAPIC] none in the MADT\n");
+  else ioapic_dump();
+}
+
+int ioapic_route_isa(uint32_t irq, uint8_t vector, uint32_t apic_id) {
+  const iso_t* o = iso_for(irq);
+  uint32_t gsi = o ? o->gsi : irq;
+  const ioapic_t* a = ioapic_for(gsi);
+  if (!a) {
+    serial_printf("[IOAPIC][ERR] no I/O APIC for IRQ %u (GSI %u)\n", irq, gsi);
+    return -1;
+  }
+
+  uint32_t low = vector;
+  if (o && (o->flags & ISO_POL_MASK) == ISO_POL_LOW)     low |= RED_LOW_ACTIVE;
+  if (o && (o->flags & ISO_TRIG_MASK) == ISO_TRIG_LEVEL) low |= RED_LEVEL;
+
+  uint32_t pin = gsi - a->gsi_base;
+  wr(a, IOAPIC_RED + 2 * pin + 1, apic_id << 24);
+  wr(a, IOAPIC_RED + 2 * pin, low);
+  serial_printf("[IOAPIC] IRQ %u -> GSI %u (ioapic %u pin %u) -> vector %x on apic %u%s%s\n",
+                irq, gsi, (uint32_t)a->id, pin, (uint32_t)vector, apic_id,
+                (low & RED_LOW_ACTIVE) ? ", active low" : "", (low & RED_LEVEL) ? ", level" : "");
+  return 0;
+}
+
+void ioapic_mask_isa(uint32_t irq) {
+  const iso_t* o = iso_for(irq);
+  uint32_t gsi = o ? o->gsi : irq;
+  const ioapic_t* a = ioapic_for(gsi);
+  if (!a) return;
+  uint32_t reg = IOAPIC_RED + 2 * (gsi - a->gsi_base);
+  wr(a, reg, rd(a, reg) | RED_MASKED);
+}
+
+void ioapic_dump(void) {
+  for (uint32_t i = 0; i < s_nioapic; ++i) {
+    const ioapic_t* a = &s_ioapic[i];
+    serial_printf("[IOAPIC] id %u at %x: GSI %u-%u\n", (uint32_t)a->id, (uint32_t)(uintptr_t)a->base,
+                  a->gsi_base, a->gsi_base + a->entries - 1);
+  }
+  for (uint32_t i = 0; i < s_niso; ++i) {
+    serial_printf("[IOAPIC] ISA IRQ %u -> GSI %u flags %x\n", (uint32_t)s_iso[i].irq, s_iso[i].gsi,
+                  (uint32_t)s_iso[i].flags);
+  }
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include "acpi.h"
+
+// I/O APICs and ISA interrupt source overrides from the MADT. Every
+// redirection entry starts masked; a driver routes the ISA IRQ it needs to
+// a LAPIC vector on one CPU. Without an override an ISA IRQ is the GSI of
+// the same number, edge-triggered and active high.
+
+void ioapic_init(const madt_t* madt);
+// 0, or -1 when no I/O APIC covers the IRQ's GSI.
+int  ioapic_route_isa(uint32_t irq, uint8_t vector, uint32_t apic_id);
+void ioapic_mask_isa(uint32_t irq);
+void ioapic_dump(void);
@@ -0,0 +1,234 @@
+#include "smp.h"
+#include "queue.h"
+#include "hist.h"
+#include "tsc.h"
+#include "util.h"
+#include "cpu.h"
+#include "serial.h"
+
+#define PING_ROUNDS   2000u
+#define STREAM_MSGS   20000u
+#define RING_SIZE     256u
+#define CALL_ROUNDS   256u
+#define CALL_BURST    32u
+#define CELL_WIDTH    11u       // a 10-digit u32 and a space
+
+enum { MODE_PING, MODE_SPSC, MODE_MPMC };
+
+typedef struct {
+  uint32_t a, b;        // a sends, b answers or receives
+  uint32_t mode;
+  uint64_t cycles;
+  uint32_t errors;
+} pair_job_t;
+
+static spsc_t      s_ab, s_ba;
+static qmsg_t      s_ab_slots[RING_SIZE], s_ba_slots[RING_SIZE];
+static mpmc_t      s_mq;
+static mpmc_cell_t s_mq_cells[RING_SIZE];
+
+static volatile uint32_t s_arrived;
+static uint32_t          s_result[SMP_MAX_CPUS][SMP_MAX_CPUS];
+
+static hist_t s_call_rtt = HIST_INIT("smp_call_rtt");
+
+static void start_barrier(void) {
+  __atomic_fetch_add(&s_arrived, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&s_arrived, __ATOMIC_ACQUIRE) < 2) cpu_pause();
+}
+
+static void push(pair_job_t* job, spsc_t* q, uint32_t v) {
+  qmsg_t m = { v, 0 };
+  if (job->mode == MODE_MPMC) {
+    while (mpmc_push(&s_mq, m)) cpu_pause();
+  } else {
+    while (spsc_push(q, m)) cpu_pause();
+  }
+}
+
+static uint32_t pop(pair_job_t* job, spsc_t* q) {
+  qmsg_t m;
+  if (job->mode == MODE_MPMC) {
+    while (mpmc_pop(&s_mq, &m)) cpu_pause();
+  } else {
+    while (spsc_pop(q, &m)) cpu_pause();
+  }
+  return (uint32_t)m.w0;
+}
+
+static void side_a(pair_job_t* job) {
+  start_barrier();
+  uint64_t t0 = rdtsc();
+  if (job->mode == MODE_PING) {
+    for (uint32_t i = 0; i < PING_ROUNDS; ++i) {
+      push(job, &s_ab, i);
+      if (pop(job, &s_ba) != i) job->errors++;
+    }
+    job->cycles = rdtsc() - t0;
+  } else {
+    for (uint32_t i = 0; i < STREAM_MSGS; ++i) push(job, &s_ab, i);
+  }
+}
+
+static void side_b(pair_job_t* job) {
+  start_barrier();
+  uint64_t t0 = rdtsc();
+  if (job->mode == MODE_PING) {
+    for (uint32_t i = 0; i < PING_ROUNDS; ++i) push(job, &s_ba, pop(job, &s_ab));
+  } else {
+    for (uint32_t i = 0; i < STREAM_MSGS; ++i) {
+      if (pop(job, &s_ab) != i) job->errors++;
+    }
+    job->cycles = rdtsc() - t0;
+  }
+}
+
+static void pair_on(uint32_t cpu, void* arg) {
+  pair_job_t* job = (pair_job_t*)arg;
+  if (cpu == job->a) side_a(job);
+  else if (cpu == job->b) side_b(job);
+}
+
+static int run_pair(pair_job_t* job) {
+  spsc_init(&s_ab, s_ab_slots, RING_SIZE);
+  spsc_init(&s_ba, s_ba_slots, RING_SIZE);
+  mpmc_init(&s_mq, s_mq_cells, RING_SIZE);
+  s_arrived = 0;
+  job->cycles = 0;
+  job->errors = 0;
+  smp_run((job->a > job->b ? job->a : job->b) + 1, pair_on, job);
+  return job->errors == 0;
+}
+
+// ---- report ------------------------------------------------------------------
+
+// Right-aligned in CELL_WIDTH; longer text is cut so that a row never
+// outgrows the line buffer.
+static void put_cell(char* line, uint32_t* n, const char* text) {
+  uint32_t len = 0;
+  while (text[len] && len < CELL_WIDTH - 1) len++;
+  for (uint32_t i = len; i < CELL_WIDTH; ++i) line[(*n)++] = ' ';
+  for (uint32_t i = 0; i < len; ++i) line[(*n)++] = text[i];
+}
+
+static void put_u32(char* line, uint32_t* n, uint32_t v) {
+  char buf[12];
+  uint32_t i = sizeof(buf) - 1;
+  buf[i] = 0;
+  do {
+    buf[--i] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  put_cell(line, n, buf + i);
+}
+
+static void put_cpu(char* line, uint32_t* n, uint32_t cpu) {
+  char buf[12] = "cpu";
+  uint32_t i = 3;
+  if (cpu >= 10) buf[i++] = (char)('0' + cpu / 10);
+  buf[i++] = (char)('0' + cpu % 10);
+  buf[i] = 0;
+  put_cell(line, n, buf);
+}
+
+// Rows are senders, columns receivers; ~0u marks a pair that did not run.
+static void print_matrix(const char* title) {
+  char line[(SMP_MAX_CPUS + 1) * CELL_WIDTH + 1];
+  uint32_t n = 0;
+
+  serial_printf("[IPC] %s\n", title);
+  put_cell(line, &n, "");
+  for (uint32_t b = 0; b < g_cpu_count; ++b) put_cpu(line, &n, b);
+  line[n] = 0;
+  serial_printf("[IPC] %s\n", line);
+
+  for (uint32_t a = 0; a < g_cpu_count; ++a) {
+    n = 0;
+    put_cpu(line, &n, a);
+    for (uint32_t b = 0; b < g_cpu_count; ++b) {
+      if (s_result[a][b] == ~0u) put_cell(line, &n, "-");
+      else put_u32(line, &n, s_result[a][b]);
+    }
+    line[n] = 0;
+    serial_printf("[IPC] %s\n", line);
+  }
+}
+
+static void run_matrix(uint32_t mode, const char* title) {
+  for (uint32_t a = 0; a < g_cpu_count; ++a) {
+    for (uint32_t b = 0; b < g_cpu_count; ++b) {
+      s_result[a][b] = ~0u;
+      if (a == b || !g_cpus[a].online || !g_cpus[b].online) continue;
+
+      pair_job_t job = { a, b, mode, 0, 0 };
+      if (!run_pair(&job)) {
+        serial_printf("[IPC][ERR] cpu%u -> cpu%u: %u messages out of order\n", a, b, job.errors);
+        continue;
+      }
+      if (mode == MODE_PING) {
+        s_result[a][b] = (uint32_t)udiv64(tsc_cycles_to_ns(job.cycles), 2 * PING_ROUNDS);
+      } else {
+        s_result[a][b] = (uint32_t)udiv64(tsc_per_second(STREAM_MSGS, job.cycles), 1000);
+      }
+    }
+  }
+  print_matrix(title);
+}
+
+// ---- smp_call ----------------------------------------------------------------
+
+static void call_nop(uint32_t cpu, void* arg) {
+  (void)cpu; (void)arg;
+}
+
+static void call_count(uint32_t cpu, void* arg) {
+  (void)cpu;
+  __atomic_fetch_add((volatile uint32_t*)arg, 1, __ATOMIC_RELEASE);
+}
+
+// From the BSP to each AP while the AP sleeps, so every round trip
+// includes its wakeup; then a burst of async calls, which should cost one
+// wakeup in total. The burst is counted once the AP has run all of it,
+// with no further call that would add a wakeup of its own.
+static void call_bench(void) {
+  hist_reset(&s_call_rtt);
+  for (uint32_t cpu = 1; cpu < g_cpu_count; ++cpu) {
+    if (!g_cpus[cpu].online) continue;
+
+    uint64_t sum = 0, max = 0;
+    for (uint32_t i = 0; i < CALL_ROUNDS; ++i) {
+      tsc_delay_us(20);
+      uint64_t t0 = rdtsc();
+      smp_call_sync(cpu, call_nop, 0);
+      uint64_t dt = rdtsc() - t0;
+      hist_record(&s_call_rtt, dt);
+      sum += dt;
+      if (dt > max) max = dt;
+    }
+
+    uint32_t c0, w0, i0, c1, w1, i1;
+    volatile uint32_t ran = 0;
+    uint32_t sent = 0;
+    tsc_delay_us(20);
+    smp_call_stats(cpu, &c0, &w0, &i0);
+    for (uint32_t i = 0; i < CALL_BURST; ++i) sent += smp_call(cpu, call_count, (void*)&ran) == 0;
+    while (__atomic_load_n(&ran, __ATOMIC_ACQUIRE) < sent) cpu_pause();
+    smp_call_stats(cpu, &c1, &w1, &i1);
+
+    serial_printf("[IPC] smp_call cpu0 -> cpu%u: round trip avg %lu ns, max %lu ns; burst of %u calls took %u wakeups (%u IPIs)\n",
+                  cpu, tsc_cycles_to_ns(udiv64(sum, CALL_ROUNDS)), tsc_cycles_to_ns(max),
+                  c1 - c0, w1 - w0, i1 - i0);
+  }
+  hist_dump("smp_call_rtt");
+}
+
+void ipc_bench(void) {
+  if (g_cpus_online < 2) {
+    serial_printf("[IPC] one CPU online, benchmarks skipped\n");
+    return;
+  }
+  run_matrix(MODE_PING, "SPSC ping-pong, one-way latency in ns (row sends, column answers)");
+  run_matrix(MODE_SPSC, "SPSC stream, thousand messages per second (row -> column)");
+  run_matrix(MODE_MPMC, "MPMC stream, thousand messages per second (row -> column)");
+  call_bench();
+}
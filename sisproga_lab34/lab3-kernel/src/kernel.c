@@ -6,6 +6,26 @@
 #include "fb.h"
 #include "acpi.h"
 #include "util.h"
+#include "tsc.h"
+#include "cpu.h"
+#include "smp.h"
+#include "fb_tile.h"
+#include "idt.h"
+#include "idle.h"
+#include "spinlock.h"
+#include "timeline.h"
+#include "pmm.h"
+#include "module.h"
+#include "pci.h"
+#include "telemetry.h"
+#include "p9.h"
+#include "blk.h"
+#include "numa.h"
+#include "kexec.h"
+#include "ioapic.h"
+#include "shell.h"
+#include "hist.h"
+#include "param.h"
 
 static void s_write(const char* s) { serial_write(s); }
 
@@ -45,9 +65,12 @@ static int sig4_eq(const char sig[4], const char* lit) {
   return sig[0]==lit[0] && sig[1]==lit[1] && sig[2]==lit[2] && sig[3]==lit[3];
 }
 
+// g_fb drawing goes through g_fb.lock. The boot pointers below are written
+// only by parse_mb2() on the BSP, before smp_init() starts any AP.
 static fb_t   g_fb;
 static int    g_fb_ok = 0;
 static const rsdp_t* g_rsdp_copy_in_mb2 = 0;
+static const mb2_tag_mmap_t* g_mmap_tag = 0;
 
 
 static void k_acpi_dump_rsdp(const rsdp_t* rsdp) {
@@ -219,6 +242,24 @@ static void k_acpi_dump_madt(const madt_t* madt) {
   s_write("[MADT] done\n");
 }
 
+// The command line decides how much parse_mb2() prints, so it is looked up
+// first with a quiet walk; parse_mb2() does the checking and reporting.
+static const char* find_cmdline(uint32_t mb_info_addr) {
+  const mb2_info_t* info = (const mb2_info_t*)(uintptr_t)mb_info_addr;
+  uint32_t total = info->total_size;
+  if (total < sizeof(mb2_info_t) + 8 || total > (16u * 1024u * 1024u)) return 0;
+
+  const uint8_t* p   = (const uint8_t*)info + sizeof(mb2_info_t);
+  const uint8_t* end = (const uint8_t*)info + total;
+  while (p + sizeof(mb2_tag_t) <= end) {
+    const mb2_tag_t* tag = (const mb2_tag_t*)p;
+    if (tag->size < 8 || tag->type == MB2_TAG_END) break;
+    if (tag->type == MB2_TAG_CMDLINE && tag->size > sizeof(mb2_tag_t)) return (const char*)(tag + 1);
+    p += (tag->size + 7u) & ~7u;
+  }
+  return 0;
+}
+
 static void parse_mb2(uint32_t mb_info_addr) {
   if ((mb_info_addr & 7u) != 0) {
     s_write("[MB2][WARN] mb_info is not 8-byte aligned: ");
@@ -253,13 +294,15 @@ static void parse_mb2(uint32_t mb_info_addr) {
       break;
     }
 
-    s_write("[MB2] tag type="); s_u32(tag->type);
-    s_write(" size="); s_u32(tag->size);
-    s_write(" @ "); s_hex32((uint32_t)(uintptr_t)p);
-    s_nl();
+    if (g_loglevel >= LOG_DEBUG) {
+      s_write("[MB2] tag type="); s_u32(tag->type);
+      s_write(" size="); s_u32(tag->size);
+      s_write(" @ "); s_hex32((uint32_t)(uintptr_t)p);
+      s_nl();
+    }
 
     if (tag->type == MB2_TAG_END) {
-      s_write("[MB2] END tag\n");
+      if (g_loglevel >= LOG_DEBUG) s_write("[MB2] END tag\n");
       break;
     }
 
@@ -284,13 +327,51 @@ static void parse_mb2(uint32_t mb_info_addr) {
       );
 
       if (g_fb_ok) {
-        fb_fill(&g_fb, 0x001030);                
-        fb_rect(&g_fb, 20, 20, 360, 50, 0x00AA00);
+        ticket_lock_init(&g_fb.lock, "fb");
+        s_write("[FB] backend="); s_write(g_fb.ops->name); s_nl();
+        if (g_fb_clear) {
+          fb_fill(&g_fb, 0x001030);
+          fb_rect(&g_fb, 20, 20, 360, 50, 0x00AA00);
+        }
       } else {
         s_write("[MB2][WARN] framebuffer init failed\n");
       }
     }
 
+    if (tag->type == MB2_TAG_MODULE && tag->size >= sizeof(mb2_tag_module_t)) {
+      const mb2_tag_module_t* m = (const mb2_tag_module_t*)tag;
+      serial_printf("[MB2] module %x-%x (%u bytes) \"%s\"\n",
+                    m->mod_start, m->mod_end, m->mod_end - m->mod_start, m->cmdline);
+      module_add(m->mod_start, m->mod_end, m->cmdline);
+    }
+
+    if (tag->type == MB2_TAG_BOOT_TIMELINE) {
+      timeline_set_loader(tag);
+    }
+
+    if (tag->type == MB2_TAG_KEXEC) {
+      timeline_set_kexec(tag);
+    }
+
+    if (tag->type == MB2_TAG_MMAP && tag->size >= sizeof(mb2_tag_mmap_t)) {
+      const mb2_tag_mmap_t* mm = (const mb2_tag_mmap_t*)tag;
+      g_mmap_tag = mm;
+      if (g_loglevel >= LOG_DEBUG && mm->entry_size >= sizeof(mb2_mmap_entry_t)) {
+        uint32_t n = (tag->size - sizeof(*mm)) / mm->entry_size;
+        for (uint32_t i = 0; i < n; ++i) {
+          const mb2_mmap_entry_t* e = (const mb2_mmap_entry_t*)(mm->entries + i * mm->entry_size);
+          serial_printf("[MB2] mmap %lx-%lx type=%u\n", e->base_addr, e->base_addr + e->length, e->type);
+        }
+      }
+    }
+
+    if (tag->type == MB2_TAG_EFI_MMAP && tag->size >= sizeof(mb2_tag_efi_mmap_t)) {
+      const mb2_tag_efi_mmap_t* em = (const mb2_tag_efi_mmap_t*)tag;
+      uint32_t n = em->descr_size ? (tag->size - sizeof(*em)) / em->descr_size : 0;
+      serial_printf("[MB2] efi mmap: %u descriptors, descr_size=%u vers=%u\n",
+                    n, em->descr_size, em->descr_vers);
+    }
+
     if (tag->type == MB2_TAG_ACPI_OLD || tag->type == MB2_TAG_ACPI_NEW) {
       const mb2_tag_acpi_t* at = (const mb2_tag_acpi_t*)tag;
       const rsdp_t* rsdp = (const rsdp_t*)at->rsdp;
@@ -313,10 +394,16 @@ static void parse_mb2(uint32_t mb_info_addr) {
 }
 
 void kmain(uint32_t mb_magic, uint32_t mb_info_addr) {
+  timeline_mark("kernel entry");
   serial_init();
 
   s_write("\n=== LAB3 kernel start ===\n");
 
+  cpu_init();
+  idt_init();
+  idle_init();
+  smp_call_init();
+
   s_write("[RAW] mb_magic="); s_hex32(mb_magic);
   s_write(" mb_info="); s_hex32(mb_info_addr);
   s_nl();
@@ -325,26 +412,108 @@ void kmain(uint32_t mb_magic, uint32_t mb_info_addr) {
     s_write("[BOOT][ERR] wrong multiboot2 magic, expected ");
     s_hex32(MB2_BOOTLOADER_MAGIC);
     s_nl();
-    for (;;) __asm__ volatile("hlt");
+    idle_loop();
   }
 
+  param_init(find_cmdline(mb_info_addr));
+  if (g_loglevel >= LOG_INFO) param_dump();
+
+  tsc_calibrate();
+  s_write("[TSC] "); s_u32(g_tsc_khz); s_write(" kHz"); s_nl();
+  timeline_mark("tsc calibrated");
+
   parse_mb2(mb_info_addr);
+  kexec_init(mb_info_addr);
+  timeline_mark("mb2 parsed, fb up");
+
+  pmm_init(g_mmap_tag, mb_info_addr, ((const mb2_info_t*)(uintptr_t)mb_info_addr)->total_size);
+  if (g_loglevel >= LOG_INFO) pmm_dump();
+  {
+    uint64_t a = pmm_alloc(), b = pmm_alloc();
+    pmm_free(a);
+    uint64_t c = pmm_alloc();
+    serial_printf("[PMM] alloc %lx %lx, free+alloc -> %lx (%s)\n", a, b, c, c == a ? "reused" : "UNEXPECTED");
+    pmm_free(b);
+    pmm_free(c);
+  }
+  timeline_mark("pmm");
+
+  if (g_bench) {
+    fb_bench_formats();
+    if (g_fb_ok) fb_bench_blit(&g_fb);
+    timeline_mark("fb benchmarks");
+  }
 
   if (!g_rsdp_copy_in_mb2) {
     s_write("[ACPI][ERR] no ACPI RSDP tag found (need tag 14 or 15)\n");
-    for (;;) __asm__ volatile("hlt");
+    idle_loop();
   }
 
-  k_acpi_dump_rsdp(g_rsdp_copy_in_mb2);
+  if (g_acpi_dump) k_acpi_dump_rsdp(g_rsdp_copy_in_mb2);
 
   const madt_t* madt = k_acpi_find_madt_via_rsdt(g_rsdp_copy_in_mb2);
   if (!madt) {
     s_write("[ACPI][ERR] MADT/APIC not found\n");
-    for (;;) __asm__ volatile("hlt");
+    idle_loop();
+  }
+
+  if (g_acpi_dump) k_acpi_dump_madt(madt);
+  ioapic_init(madt);
+  timeline_mark("acpi/madt");
+
+  numa_init(g_rsdp_copy_in_mb2);
+  if (numa_node_count() > 1 && g_loglevel >= LOG_INFO) pmm_dump();
+  timeline_mark("numa");
+
+  pci_init(g_rsdp_copy_in_mb2);
+  if (g_loglevel >= LOG_INFO) pci_dump();
+  timeline_mark("pci");
+
+  if (tel_init()) {
+    serial_set_tap(tel_log);
+    if (g_bench) tel_bench();
+    timeline_mark("telemetry");
+  }
+
+  if (p9_init() == 0 && g_bench) {
+    p9_bench("bench.bin");
+    timeline_mark("9p");
+  }
+
+  blk_init();
+  if (blk_count() && g_bench) {
+    blk_bench(blk_get(0));
+    timeline_mark("blk");
+  }
+
+  smp_init(madt);
+  timeline_mark("smp up");
+
+  if (g_bench) {
+    numa_bench();
+    timeline_mark("numa benchmark");
+    if (g_fb_ok) fb_bench_tiles(&g_fb);
+    timeline_mark("tile benchmark");
+
+    lock_bench();
+    if (g_loglevel >= LOG_INFO) {
+      lock_stats_dump(0);
+      hist_dump(0);
+    }
+    timeline_mark("lock benchmark");
+
+    ipc_bench();
+    timeline_mark("ipc benchmark");
+
+    idle_probe(64);
   }
+  if (g_loglevel >= LOG_INFO) idle_dump();
 
-  k_acpi_dump_madt(madt);
+  timeline_mark("halt");
+  if (g_loglevel >= LOG_WARN) timeline_dump();
+  kexec_auto();
 
-  s_write("=== LAB3 done, halting ===\n");
-  for (;;) __asm__ volatile("hlt");
+  s_write("=== LAB3 done ===\n");
+  shell_init(g_rsdp_copy_in_mb2, g_fb_ok ? &g_fb : 0);
+  shell_run();
 }
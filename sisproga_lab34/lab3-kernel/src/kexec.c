@@ -0,0 +1,550 @@
+#include "kexec.h"
+#include "mb2.h"
+#include "module.h"
+#include "pmm.h"
+#include "pci.h"
+#include "smp.h"
+#include "timeline.h"
+#include "tsc.h"
+#include "cpu.h"
+#include "serial.h"
+
+// The trampoline's copy list: page addresses with a flag in the low bits,
+// KX_IND chaining to the next list page (see kexec_tramp.S).
+#define KX_DEST   0x1u
+#define KX_IND    0x2u
+#define KX_DONE   0x4u
+#define KX_SOURCE 0x8u
+
+#define KX_MAX_RANGES  16
+#define KX_INFO_MAX    32768u
+#define KX_HEADER_SCAN 32768u     // the MB2 header must be in the first 32 KiB
+#define KX_MAX_TYPES   16
+
+#define MB2_HEADER_MAGIC       0xE85250D6u
+#define MB2_HTAG_END           0
+#define MB2_HTAG_INFO_REQUEST  1
+#define MB2_HTAG_FRAMEBUFFER   5
+#define MB2_HTAG_MODULE_ALIGN  6
+#define MB2_HTAG_OPTIONAL      1
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint32_t architecture;
+  uint32_t header_length;
+  uint32_t checksum;
+} mb2_header_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t type;
+  uint16_t flags;
+  uint32_t size;
+} mb2_htag_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t  ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint32_t entry;
+  uint32_t phoff;
+  uint32_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+} elf32_ehdr_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t type;
+  uint32_t offset;
+  uint32_t vaddr;
+  uint32_t paddr;
+  uint32_t filesz;
+  uint32_t memsz;
+  uint32_t flags;
+  uint32_t align;
+} elf32_phdr_t;
+
+#define ELF_PT_LOAD  1
+#define ELF_ET_EXEC  2
+#define ELF_EM_386   3
+
+// What the new kernel's MB2 header asks for.
+typedef struct {
+  int      has_request;     // without one, every tag kexec has is sent
+  uint32_t ntypes;
+  uint32_t types[KX_MAX_TYPES];
+} kx_request_t;
+
+typedef struct {
+  uint64_t base;
+  uint64_t end;
+} kx_range_t;
+
+typedef void (*kx_tramp_t)(uint32_t list, uint32_t entry, uint32_t mb_info);
+
+extern const uint8_t kexec_tramp_start[];
+extern const uint8_t kexec_tramp_end[];
+
+static const uint8_t* s_boot_info;
+static kx_range_t s_dest[KX_MAX_RANGES];    // memory the new kernel will occupy
+static uint32_t   s_ndest;
+static uint32_t   s_list_head;
+static uint32_t*  s_list;                   // list page being filled
+static uint32_t   s_list_pos;
+static uint32_t   s_zero;                   // source for pages without file data
+static uint32_t   s_tramp;
+static uint64_t   s_rejected;               // pages inside s_dest, freed after staging
+static uint32_t   s_entry;
+static uint32_t   s_info;
+static int        s_loaded;
+static uint64_t   s_start_tsc;
+static uint8_t    s_info_buf[KX_INFO_MAX] __attribute__((aligned(8)));
+
+void kexec_init(uint32_t mb_info) {
+  s_boot_info = (const uint8_t*)(uintptr_t)mb_info;
+}
+
+// ---- MB2 header ----------------------------------------------------------------
+
+static int can_provide(uint32_t type) {
+  return type == MB2_TAG_CMDLINE || type == MB2_TAG_BOOT_LOADER_NAME || type == MB2_TAG_MODULE ||
+         type == MB2_TAG_MMAP || type == MB2_TAG_FRAMEBUFFER || type == MB2_TAG_ACPI_OLD ||
+         type == MB2_TAG_ACPI_NEW || type == MB2_TAG_EFI_MMAP || type == MB2_TAG_KEXEC;
+}
+
+static int wants(const kx_request_t* req, uint32_t type) {
+  if (!req->has_request) return 1;
+  for (uint32_t i = 0; i < req->ntypes; ++i) {
+    if (req->types[i] == type) return 1;
+  }
+  return 0;
+}
+
+// The rules of ValidateMb2Header in the lab4 loader, with kexec's own list
+// of info tags it can produce.
+static int check_mb2(const uint8_t* img, uint32_t size, kx_request_t* req) {
+  uint32_t max = size < KX_HEADER_SCAN ? size : KX_HEADER_SCAN;
+  req->has_request = 0;
+  req->ntypes = 0;
+
+  for (uint32_t off = 0; off + sizeof(mb2_header_t) <= max; off += 8) {
+    const mb2_header_t* h = (const mb2_header_t*)(img + off);
+    if (h->magic != MB2_HEADER_MAGIC) continue;
+
+    if (h->magic + h->architecture + h->header_length + h->checksum != 0) {
+      serial_printf("[KEXEC][ERR] MB2 header checksum\n");
+      return -1;
+    }
+    if (h->architecture != 0) {
+      serial_printf("[KEXEC][ERR] MB2 architecture %u, need i386\n", h->architecture);
+      return -1;
+    }
+    if (h->header_length < sizeof(*h) || off + h->header_length > max) {
+      serial_printf("[KEXEC][ERR] MB2 header length %u\n", h->header_length);
+      return -1;
+    }
+
+    const uint8_t* t    = (const uint8_t*)h + sizeof(*h);
+    const uint8_t* tend = (const uint8_t*)h + h->header_length;
+    while (t + sizeof(mb2_htag_t) <= tend) {
+      const mb2_htag_t* tag = (const mb2_htag_t*)t;
+      int optional = (tag->flags & MB2_HTAG_OPTIONAL) != 0;
+
+      if (tag->type == MB2_HTAG_END && tag->size == 8) return 0;
+      if (tag->size < sizeof(*tag) || tag->size > (uint32_t)(tend - t)) {
+        serial_printf("[KEXEC][ERR] MB2 header tag %u is malformed\n", (uint32_t)tag->type);
+        return -1;
+      }
+
+      if (tag->type == MB2_HTAG_INFO_REQUEST) {
+        const uint32_t* types = (const uint32_t*)(t + sizeof(*tag));
+        uint32_t n = (tag->size - sizeof(*tag)) / 4;
+        req->has_request = 1;
+        for (uint32_t i = 0; i < n; ++i) {
+          if (!can_provide(types[i])) {
+            serial_printf("[KEXEC] MB2 request for info tag %x not supported%s\n", types[i],
+                          optional ? " (optional)" : "");
+            if (!optional) return -1;
+            continue;
+          }
+          if (req->ntypes < KX_MAX_TYPES) req->types[req->ntypes++] = types[i];
+        }
+      } else if (tag->type != MB2_HTAG_FRAMEBUFFER && tag->type != MB2_HTAG_MODULE_ALIGN && !optional) {
+        // The framebuffer stays in the mode it is in; modules are page-aligned already.
+        serial_printf("[KEXEC][ERR] MB2 header tag %u not supported\n", (uint32_t)tag->type);
+        return -1;
+      }
+      t += (tag->size + 7) & ~7u;
+    }
+    serial_printf("[KEXEC][ERR] MB2 header has no end tag\n");
+    return -1;
+  }
+  serial_printf("[KEXEC][ERR] no MB2 header in the first 32 KiB\n");
+  return -1;
+}
+
+// ---- staging -------------------------------------------------------------------
+
+static void add_dest(uint64_t base, uint64_t end) {
+  if (s_ndest < KX_MAX_RANGES) {
+    s_dest[s_ndest].base = base & ~(uint64_t)(PMM_PAGE - 1);
+    s_dest[s_ndest].end  = (end + PMM_PAGE - 1) & ~(uint64_t)(PMM_PAGE - 1);
+    s_ndest++;
+  }
+}
+
+static int in_dest(uint64_t base, uint64_t end) {
+  for (uint32_t i = 0; i < s_ndest; ++i) {
+    if (base < s_dest[i].end && end > s_dest[i].base) return 1;
+  }
+  return 0;
+}
+
+// A page the copy cannot overwrite before it has been read.
+static uint32_t safe_page(void) {
+  for (;;) {
+    uint64_t p = pmm_alloc();
+    if (!p) return 0;
+    if (p + PMM_PAGE <= 0x100000000ull && !in_dest(p, p + PMM_PAGE)) return (uint32_t)p;
+    *(volatile uint64_t*)(uintptr_t)p = s_rejected;
+    s_rejected = p;
+  }
+}
+
+static void free_rejected(void) {
+  while (s_rejected) {
+    uint64_t p = s_rejected;
+    s_rejected = *(volatile uint64_t*)(uintptr_t)p;
+    pmm_free(p);
+  }
+}
+
+static void zero_page(uint32_t page) {
+  uint32_t* w = (uint32_t*)(uintptr_t)page;
+  for (uint32_t i = 0; i < PMM_PAGE / 4; ++i) w[i] = 0;
+}
+
+// Appends one entry, chaining a new list page when this one is full; the
+// slot of the entry, or 0 when out of memory.
+static uint32_t* emit(uint32_t e) {
+  if (s_list_pos == PMM_PAGE / 4 - 1) {
+    uint32_t next = safe_page();
+    if (!next) return 0;
+    s_list[s_list_pos] = next | KX_IND;
+    s_list = (uint32_t*)(uintptr_t)next;
+    s_list_pos = 0;
+  }
+  s_list[s_list_pos] = e;
+  return &s_list[s_list_pos++];
+}
+
+// Gives back every staged page.
+static void release(void) {
+  if (s_list_head) {
+    s_list[s_list_pos] = KX_DONE;
+    uint32_t* l = (uint32_t*)(uintptr_t)s_list_head;
+    uint32_t i = 0;
+    for (;;) {
+      uint32_t e = l[i++];
+      if (e & KX_DONE) break;
+      if (e & KX_IND) {
+        pmm_free((uintptr_t)l);
+        l = (uint32_t*)(uintptr_t)(e & ~0xFFFu);
+        i = 0;
+      } else if ((e & KX_SOURCE) && (e & ~0xFFFu) != s_zero) {
+        pmm_free(e & ~0xFFFu);
+      }
+    }
+    pmm_free((uintptr_t)l);
+  }
+  if (s_zero) pmm_free(s_zero);
+  if (s_tramp) pmm_free(s_tramp);
+  free_rejected();
+  s_list_head = s_zero = s_tramp = 0;
+  s_loaded = 0;
+}
+
+// One source page per destination page. Segments are in address order
+// (the ELF spec requires it), so two of them can only share the page where
+// one ends and the next begins.
+static int stage_segments(const uint8_t* img, const elf32_ehdr_t* eh) {
+  uint64_t next_dest = 1;           // no page: the first one needs KX_DEST
+  uint64_t last_page = ~0ull;
+  uint32_t* last_slot = 0;
+
+  for (uint32_t i = 0; i < eh->phnum; ++i) {
+    const elf32_phdr_t* ph = (const elf32_phdr_t*)(img + eh->phoff + i * eh->phentsize);
+    if (ph->type != ELF_PT_LOAD || !ph->memsz) continue;
+
+    uint64_t file_end = (uint64_t)ph->paddr + ph->filesz;
+    uint64_t hi = ((uint64_t)ph->paddr + ph->memsz + PMM_PAGE - 1) & ~(uint64_t)(PMM_PAGE - 1);
+    for (uint64_t pg = ph->paddr & ~(PMM_PAGE - 1); pg < hi; pg += PMM_PAGE) {
+      uint64_t a = pg > ph->paddr ? pg : ph->paddr;
+      uint64_t b = pg + PMM_PAGE < file_end ? pg + PMM_PAGE : file_end;
+      int data = a < b;
+
+      uint32_t src;
+      if (pg == last_page) {
+        src = *last_slot & ~0xFFFu;
+        if (data && src == s_zero) {
+          if (!(src = safe_page())) return -1;
+          zero_page(src);
+          *last_slot = src | KX_SOURCE;
+        }
+      } else {
+        if (pg != next_dest && !emit((uint32_t)pg | KX_DEST)) return -1;
+        src = s_zero;
+        if (data) {
+          if (!(src = safe_page())) return -1;
+          zero_page(src);
+        }
+        if (!(last_slot = emit(src | KX_SOURCE))) return -1;
+        last_page = pg;
+        next_dest = pg + PMM_PAGE;
+      }
+
+      if (data) {
+        const uint8_t* from = img + ph->offset + (uint32_t)(a - ph->paddr);
+        uint8_t* to = (uint8_t*)(uintptr_t)src + (uint32_t)(a - pg);
+        for (uint32_t k = 0; k < (uint32_t)(b - a); ++k) to[k] = from[k];
+      }
+    }
+  }
+  return 0;
+}
+
+static int stage_info(uint32_t len) {
+  if (!emit(s_info | KX_DEST)) return -1;
+  for (uint32_t off = 0; off < len; off += PMM_PAGE) {
+    uint32_t src = safe_page();
+    if (!src) return -1;
+    zero_page(src);
+    uint8_t* to = (uint8_t*)(uintptr_t)src;
+    for (uint32_t k = 0; k < PMM_PAGE && off + k < len; ++k) to[k] = s_info_buf[off + k];
+    if (!emit(src | KX_SOURCE)) return -1;
+  }
+  return 0;
+}
+
+// ---- info block ----------------------------------------------------------------
+
+// Appends a tag of `size` bytes (padded to 8) made of `head` and then
+// `tail`; 0 when the buffer is full (room for the end tag is kept).
+static uint8_t* put(uint8_t* p, const void* head, uint32_t head_len, const void* tail, uint32_t size) {
+  uint32_t step = (size + 7) & ~7u;
+  if (p + step + 8 > s_info_buf + KX_INFO_MAX) return 0;
+  for (uint32_t i = 0; i < step; ++i) p[i] = 0;
+  for (uint32_t i = 0; i < head_len; ++i) p[i] = ((const uint8_t*)head)[i];
+  for (uint32_t i = head_len; i < size; ++i) p[i] = ((const uint8_t*)tail)[i - head_len];
+  return p + step;
+}
+
+static uint32_t str_size(const char* s) {
+  uint32_t n = 0;
+  while (s[n]) n++;
+  return n + 1;
+}
+
+// This boot's command line, framebuffer, ACPI and memory map tags as they
+// are, the module table (minus modules the new image would overwrite) and
+// the kexec tag. Returns the size, 0 when it does not fit. `final` is 0 on the
+// sizing pass, which stays quiet.
+static uint32_t build_info(const kx_request_t* req, int final) {
+  uint8_t* p = s_info_buf + sizeof(mb2_info_t);
+
+  if (wants(req, MB2_TAG_BOOT_LOADER_NAME)) {
+    static const char name[] = "lab3 kexec";
+    mb2_tag_t t = { MB2_TAG_BOOT_LOADER_NAME, sizeof(t) + sizeof(name) };
+    if (!(p = put(p, &t, sizeof(t), name, t.size))) return 0;
+  }
+
+  for (uint32_t i = 0; i < module_count() && wants(req, MB2_TAG_MODULE); ++i) {
+    const module_t* m = module_get(i);
+    if (in_dest(m->start, m->end)) {
+      if (final) serial_printf("[KEXEC][WARN] module \"%s\" is in the way of the new image, dropped\n", m->cmdline);
+      continue;
+    }
+    mb2_tag_module_t t = { { MB2_TAG_MODULE, 0 }, (uint32_t)m->start, (uint32_t)m->end };
+    t.tag.size = sizeof(t) + str_size(m->cmdline);
+    if (!(p = put(p, &t, sizeof(t), m->cmdline, t.tag.size))) return 0;
+  }
+
+  const mb2_info_t* old = (const mb2_info_t*)s_boot_info;
+  const uint8_t* q   = s_boot_info + sizeof(mb2_info_t);
+  const uint8_t* end = s_boot_info + old->total_size;
+  while (q + sizeof(mb2_tag_t) <= end) {
+    const mb2_tag_t* t = (const mb2_tag_t*)q;
+    if (t->type == MB2_TAG_END || t->size < 8) break;
+    if ((t->type == MB2_TAG_CMDLINE || t->type == MB2_TAG_MMAP || t->type == MB2_TAG_EFI_MMAP ||
+         t->type == MB2_TAG_FRAMEBUFFER || t->type == MB2_TAG_ACPI_OLD || t->type == MB2_TAG_ACPI_NEW) &&
+        wants(req, t->type)) {
+      if (!(p = put(p, t, t->size, 0, t->size))) return 0;
+    }
+    q += (t->size + 7) & ~7u;
+  }
+
+  if (wants(req, MB2_TAG_KEXEC)) {
+    uint64_t cold;
+    mb2_tag_kexec_t k;
+    k.tag.type       = MB2_TAG_KEXEC;
+    k.tag.size       = sizeof(k);
+    k.tsc_khz        = g_tsc_khz;
+    k.warm_boots     = timeline_boot_info(&cold) + 1;
+    k.cold_entry_tsc = cold;
+    k.start_tsc      = s_start_tsc;
+    if (!(p = put(p, &k, sizeof(k), 0, sizeof(k)))) return 0;
+  }
+
+  mb2_tag_t e = { MB2_TAG_END, 8 };
+  p = put(p, &e, sizeof(e), 0, sizeof(e));
+
+  mb2_info_t* info = (mb2_info_t*)s_info_buf;
+  info->total_size = (uint32_t)(p - s_info_buf);
+  info->reserved   = 0;
+  return info->total_size;
+}
+
+// ---- load / exec ---------------------------------------------------------------
+
+int kexec_load(const void* image, uint32_t size) {
+  const uint8_t* img = (const uint8_t*)image;
+  const elf32_ehdr_t* eh = (const elf32_ehdr_t*)img;
+  s_start_tsc = rdtsc();
+  if (s_loaded) release();
+
+  if (!s_boot_info) {
+    serial_printf("[KEXEC][ERR] no boot info to pass on\n");
+    return -1;
+  }
+  if (size < sizeof(*eh) || img[0] != 0x7F || img[1] != 'E' || img[2] != 'L' || img[3] != 'F' ||
+      img[4] != 1 || img[5] != 1 || eh->type != ELF_ET_EXEC || eh->machine != ELF_EM_386) {
+    serial_printf("[KEXEC][ERR] not an i386 ELF32 executable\n");
+    return -1;
+  }
+  if (eh->phentsize < sizeof(elf32_phdr_t) || eh->phoff > size ||
+      (uint64_t)eh->phnum * eh->phentsize > size - eh->phoff) {
+    serial_printf("[KEXEC][ERR] program headers out of the image\n");
+    return -1;
+  }
+
+  kx_request_t req;
+  if (check_mb2(img, size, &req) < 0) return -1;
+
+  // Where the image goes, its entry point, and the end of the last segment.
+  s_ndest = 0;
+  uint64_t hi = 0, prev_end = 0;
+  uint32_t nseg = 0;
+  s_entry = 0;
+  for (uint32_t i = 0; i < eh->phnum; ++i) {
+    const elf32_phdr_t* ph = (const elf32_phdr_t*)(img + eh->phoff + i * eh->phentsize);
+    if (ph->type != ELF_PT_LOAD || !ph->memsz) continue;
+    uint64_t seg_end = (uint64_t)ph->paddr + ph->memsz;
+    if ((uint64_t)ph->offset + ph->filesz > size || ph->filesz > ph->memsz || seg_end > 0x100000000ull ||
+        ph->paddr < prev_end || s_ndest == KX_MAX_RANGES - 1) {
+      serial_printf("[KEXEC][ERR] segment %u (%x+%x) cannot be loaded\n", i, ph->paddr, ph->memsz);
+      return -1;
+    }
+    add_dest(ph->paddr, seg_end);
+    if (eh->entry >= ph->vaddr && eh->entry - ph->vaddr < ph->memsz) s_entry = eh->entry - ph->vaddr + ph->paddr;
+    prev_end = seg_end;
+    hi = (seg_end + PMM_PAGE - 1) & ~(uint64_t)(PMM_PAGE - 1);
+    nseg++;
+  }
+  if (!nseg || !s_entry) {
+    serial_printf("[KEXEC][ERR] entry point %x is not in a loadable segment\n", eh->entry);
+    return -1;
+  }
+
+  // The info block goes right after the image. Sizing it first tells how
+  // much room it takes; the second pass drops modules in that room too.
+  uint32_t len = build_info(&req, 0);
+  if (len) {
+    s_info = (uint32_t)hi;
+    add_dest(hi, hi + len);
+    len = build_info(&req, 1);
+  }
+  if (!len || hi + len > 0x100000000ull) {
+    serial_printf("[KEXEC][ERR] MB2 info block does not fit\n");
+    return -1;
+  }
+
+  s_list_head = safe_page();
+  s_list      = (uint32_t*)(uintptr_t)s_list_head;
+  s_list_pos  = 0;
+  s_zero      = s_list_head ? safe_page() : 0;
+  s_tramp     = s_zero ? safe_page() : 0;
+  if (s_zero) zero_page(s_zero);
+  if (!s_tramp || stage_segments(img, eh) < 0 || stage_info(len) < 0) {
+    serial_printf("[KEXEC][ERR] out of memory while staging\n");
+    release();
+    return -1;
+  }
+  s_list[s_list_pos] = KX_DONE;
+  free_rejected();
+
+  uint8_t* t = (uint8_t*)(uintptr_t)s_tramp;
+  for (uint32_t i = 0; i < (uint32_t)(kexec_tramp_end - kexec_tramp_start); ++i) t[i] = kexec_tramp_start[i];
+
+  s_loaded = 1;
+  serial_printf("[KEXEC] loaded: %u segments %x-%x, entry %x, info %u bytes at %x, staged in %lu us\n",
+                nseg, (uint32_t)s_dest[0].base, (uint32_t)hi, s_entry, len, s_info,
+                tsc_cycles_to_us(rdtsc() - s_start_tsc));
+  return 0;
+}
+
+void kexec_exec(void) {
+  if (!s_loaded) {
+    serial_printf("[KEXEC][ERR] nothing loaded\n");
+    return;
+  }
+  if (smp_cpu_id() != 0) {
+    serial_printf("[KEXEC][ERR] must run on the BSP\n");
+    return;
+  }
+
+  serial_printf("[KEXEC] stopping APs and DMA, jumping to %x\n", s_entry);
+  smp_stop_aps();
+  pci_quiesce();
+  __asm__ volatile ("cli");
+  ((kx_tramp_t)(uintptr_t)s_tramp)(s_list_head, s_entry, s_info);
+}
+
+// `kexec` or `kexec=N` among the words after the module path; 0 if absent.
+static uint32_t kexec_arg(const char* c) {
+  while (*c && *c != ' ') c++;
+  while (*c) {
+    while (*c == ' ') c++;
+    const char* w = c;
+    while (*c && *c != ' ') c++;
+    if (c - w < 5 || w[0] != 'k' || w[1] != 'e' || w[2] != 'x' || w[3] != 'e' || w[4] != 'c') continue;
+    if (c - w == 5) return 1;
+    if (w[5] != '=') continue;
+    uint32_t n = 0;
+    for (const char* d = w + 6; d < c && *d >= '0' && *d <= '9'; ++d) n = n * 10 + (uint32_t)(*d - '0');
+    return n;
+  }
+  return 0;
+}
+
+void kexec_auto(void) {
+  for (uint32_t i = 0; i < module_count(); ++i) {
+    const module_t* m = module_get(i);
+    uint32_t n = kexec_arg(m->cmdline);
+    if (!n) continue;
+
+    uint64_t cold;
+    uint32_t warm = timeline_boot_info(&cold);
+    if (warm >= n) {
+      serial_printf("[KEXEC] %u of %u warm boots done\n", warm, n);
+      return;
+    }
+    serial_printf("[KEXEC] warm boot %u of %u into \"%s\"\n", warm + 1, n, m->cmdline);
+    if (kexec_load((const void*)(uintptr_t)m->start, (uint32_t)(m->end - m->start)) == 0) kexec_exec();
+    return;
+  }
+}
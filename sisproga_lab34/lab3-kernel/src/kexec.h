@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+// Warm reboot into another kernel image without the firmware and loader.
+// kexec_load() checks an ELF32 image and its MB2 header the way the lab4
+// loader does, then stages everything the new kernel needs (its segments
+// and a fresh MB2 info block built from this boot's framebuffer, ACPI,
+// memory map and module tags) in pages outside the memory the new kernel
+// will occupy. kexec_exec() stops the APs and bus-mastering devices and
+// hands over to a trampoline that copies the staged pages into place and
+// jumps to the entry point with the Multiboot2 magic.
+//
+// The new kernel gets an MB2_TAG_KEXEC tag so that its timeline can put the
+// warm boot time next to the cold one.
+
+void kexec_init(uint32_t mb_info);          // the info block to take tags from
+int  kexec_load(const void* image, uint32_t size);   // 0 or -1
+void kexec_exec(void);                      // returns only if nothing is loaded
+
+// Reboots into the boot module with a `kexec` or `kexec=N` argument, while
+// fewer than N (default 1) warm boots have happened.
+void kexec_auto(void);
@@ -0,0 +1,41 @@
+#include "lapic.h"
+#include "cpu.h"
+
+#define LAPIC_ID       0x020
+#define LAPIC_EOI      0x0B0
+#define LAPIC_SVR      0x0F0
+#define LAPIC_ICR_LO   0x300
+#define LAPIC_ICR_HI   0x310
+
+#define ICR_PENDING    (1u << 12)
+#define SVR_ENABLE     (1u << 8)
+
+volatile uint32_t* g_lapic = 0;
+
+static inline uint32_t rd(uint32_t reg) { return g_lapic[reg / 4]; }
+static inline void wr(uint32_t reg, uint32_t v) { g_lapic[reg / 4] = v; }
+
+void lapic_init(uint32_t base) {
+  g_lapic = (volatile uint32_t*)(uintptr_t)base;
+}
+
+void lapic_enable(void) {
+  if (!g_lapic) return;
+  wr(LAPIC_SVR, rd(LAPIC_SVR) | SVR_ENABLE | 0xFF);
+}
+
+uint32_t lapic_id(void) {
+  if (!g_lapic) return 0;
+  return rd(LAPIC_ID) >> 24;
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low) {
+  while (rd(LAPIC_ICR_LO) & ICR_PENDING) cpu_pause();
+  wr(LAPIC_ICR_HI, apic_id << 24);
+  wr(LAPIC_ICR_LO, icr_low);
+  while (rd(LAPIC_ICR_LO) & ICR_PENDING) cpu_pause();
+}
+
+void lapic_eoi(void) {
+  if (g_lapic) wr(LAPIC_EOI, 0);
+}
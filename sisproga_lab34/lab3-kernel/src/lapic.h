@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+#define LAPIC_ICR_INIT      0x00000500u
+#define LAPIC_ICR_STARTUP   0x00000600u
+#define LAPIC_ICR_ASSERT    0x00004000u
+#define LAPIC_ICR_LEVEL     0x00008000u
+
+extern volatile uint32_t* g_lapic;
+
+void     lapic_init(uint32_t base);
+void     lapic_enable(void);
+uint32_t lapic_id(void);
+void     lapic_send_ipi(uint32_t apic_id, uint32_t icr_low);
+void     lapic_eoi(void);
@@ -0,0 +1,76 @@
+#include "spinlock.h"
+#include "smp.h"
+#include "tsc.h"
+#include "util.h"
+#include "cpu.h"
+#include "serial.h"
+
+#define BENCH_ITERS 20000u
+
+static ticket_lock_t s_ticket = TICKET_LOCK_INIT("bench.ticket");
+static mcs_lock_t    s_mcs    = MCS_LOCK_INIT("bench.mcs");
+static mcs_node_t    s_nodes[SMP_MAX_CPUS];
+
+// Shared data touched inside the critical section: two cache lines.
+static volatile uint32_t s_shared[32] __attribute__((aligned(64)));
+static volatile uint32_t s_arrived;
+static uint32_t          s_ncpus;
+
+static void start_barrier(void) {
+  __atomic_fetch_add(&s_arrived, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&s_arrived, __ATOMIC_ACQUIRE) < s_ncpus) cpu_pause();
+}
+
+static void ticket_worker(uint32_t cpu, void* arg) {
+  (void)cpu; (void)arg;
+  start_barrier();
+  for (uint32_t i = 0; i < BENCH_ITERS; i++) {
+    ticket_lock(&s_ticket);
+    s_shared[0]++;
+    s_shared[16]++;
+    ticket_unlock(&s_ticket);
+  }
+}
+
+static void mcs_worker(uint32_t cpu, void* arg) {
+  (void)arg;
+  mcs_node_t* me = &s_nodes[cpu];
+  start_barrier();
+  for (uint32_t i = 0; i < BENCH_ITERS; i++) {
+    mcs_lock(&s_mcs, me);
+    s_shared[0]++;
+    s_shared[16]++;
+    mcs_unlock(&s_mcs, me);
+  }
+}
+
+static void run(const char* kind, lock_stats_t* st, smp_fn_t fn, uint32_t n) {
+  lock_stats_reset(st);
+  s_shared[0] = 0;
+  s_shared[16] = 0;
+  s_arrived = 0;
+  s_ncpus = n;
+
+  uint64_t t0 = rdtsc();
+  smp_run(n, fn, 0);
+  uint64_t t1 = rdtsc();
+
+  uint64_t ops = (uint64_t)n * BENCH_ITERS;
+  uint64_t per_op = udiv64(t1 - t0, ops);
+  serial_printf("[LOCKBENCH] %s cpus=%u ops=%lu %lu kops/s %lu cyc/op%s\n",
+                kind, n, ops, udiv64(tsc_per_second(ops, t1 - t0), 1000u), per_op,
+                s_shared[0] == ops ? "" : " COUNT MISMATCH");
+  lock_stats_dump(st->name);
+}
+
+// Only counts of online CPUs without holes are benchmarked, since every
+// participant must reach the start barrier.
+void lock_bench(void) {
+  uint32_t n_max = 0;
+  while (n_max < g_cpu_count && g_cpus[n_max].online) n_max++;
+
+  for (uint32_t n = 1; n <= n_max; n++) {
+    run("ticket", &s_ticket.stats, ticket_worker, n);
+    run("mcs   ", &s_mcs.stats, mcs_worker, n);
+  }
+}
@@ -6,9 +6,14 @@
 #define MB2_TAG_END                0
 #define MB2_TAG_CMDLINE            1
 #define MB2_TAG_BOOT_LOADER_NAME   2
+#define MB2_TAG_MODULE             3
+#define MB2_TAG_MMAP               6
 #define MB2_TAG_FRAMEBUFFER        8
 #define MB2_TAG_ACPI_OLD           14
 #define MB2_TAG_ACPI_NEW           15
+#define MB2_TAG_EFI_MMAP           17
+#define MB2_TAG_BOOT_TIMELINE      0x80000001u   // vendor tag from the lab4 loader
+#define MB2_TAG_KEXEC              0x80000002u   // vendor tag from kexec.c
 
 typedef struct __attribute__((packed)) {
   uint32_t total_size;
@@ -42,3 +47,68 @@ typedef struct __attribute__((packed)) {
   mb2_tag_t tag;
   uint8_t rsdp[];
 } mb2_tag_acpi_t;
+
+typedef struct __attribute__((packed)) {
+  mb2_tag_t tag;
+  uint32_t  mod_start;
+  uint32_t  mod_end;        // exclusive
+  char      cmdline[];      // NUL-terminated
+} mb2_tag_module_t;
+
+#define MB2_MMAP_AVAILABLE         1
+#define MB2_MMAP_RESERVED          2
+#define MB2_MMAP_ACPI_RECLAIMABLE  3
+#define MB2_MMAP_NVS               4
+#define MB2_MMAP_BADRAM            5
+
+typedef struct __attribute__((packed)) {
+  uint64_t base_addr;
+  uint64_t length;
+  uint32_t type;
+  uint32_t zero;
+} mb2_mmap_entry_t;
+
+typedef struct __attribute__((packed)) {
+  mb2_tag_t tag;
+  uint32_t  entry_size;
+  uint32_t  entry_version;
+  uint8_t   entries[];      // entry_size apart
+} mb2_tag_mmap_t;
+
+// Raw EFI memory map; descriptor layout as in the UEFI spec.
+typedef struct __attribute__((packed)) {
+  uint32_t type;
+  uint32_t pad;
+  uint64_t phys_start;
+  uint64_t virt_start;
+  uint64_t num_pages;
+  uint64_t attribute;
+} mb2_efi_desc_t;
+
+typedef struct __attribute__((packed)) {
+  mb2_tag_t tag;
+  uint32_t  descr_size;
+  uint32_t  descr_vers;
+  uint8_t   descr[];        // descr_size apart
+} mb2_tag_efi_mmap_t;
+
+// Loader stage stamps, one per stage in the order the lab4 bootloader runs
+// them (entry .. trampoline jump); 0 means the stage was not reached.
+#define MB2_BL_STAGE_COUNT 9
+
+typedef struct __attribute__((packed)) {
+  mb2_tag_t tag;
+  uint32_t  tsc_khz;
+  uint32_t  count;
+  uint64_t  tsc[MB2_BL_STAGE_COUNT];
+} mb2_tag_timeline_t;
+
+// Passed by kexec instead of the loader timeline. The TSC is not reset by a
+// warm reboot, so both stamps are on the same clock as the new kernel's.
+typedef struct __attribute__((packed)) {
+  mb2_tag_t tag;
+  uint32_t  tsc_khz;
+  uint32_t  warm_boots;     // including this one
+  uint64_t  cold_entry_tsc; // kernel entry on the cold boot, i.e. time since reset
+  uint64_t  start_tsc;      // the previous kernel started loading this one
+} mb2_tag_kexec_t;
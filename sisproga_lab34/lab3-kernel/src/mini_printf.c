@@ -27,35 +27,67 @@ static void out_u32(putc_cb_t cb, void* ctx, uint32_t v) {
   while (i--) cb(buf[i], ctx);
 }
 
-void mini_printf(putc_cb_t cb, void* ctx, const char* fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
+static void out_u64(putc_cb_t cb, void* ctx, uint64_t v) {
+  static const uint64_t P10[20] = {
+    10000000000000000000ull, 1000000000000000000ull, 100000000000000000ull,
+    10000000000000000ull, 1000000000000000ull, 100000000000000ull,
+    10000000000000ull, 1000000000000ull, 100000000000ull, 10000000000ull,
+    1000000000ull, 100000000ull, 10000000ull, 1000000ull, 100000ull,
+    10000ull, 1000ull, 100ull, 10ull, 1ull
+  };
+  int started = 0;
+  for (int i=0;i<20;++i) {
+    char d = '0';
+    while (v >= P10[i]) { v -= P10[i]; ++d; }
+    if (d != '0' || started || i == 19) { cb(d, ctx); started = 1; }
+  }
+}
 
+void mini_vprintf(putc_cb_t cb, void* ctx, const char* fmt, va_list ap) {
   for (; *fmt; ++fmt) {
     if (*fmt != '%') { cb(*fmt, ctx); continue; }
 
     ++fmt;
     if (!*fmt) break;
 
-    while (*fmt == '.' || (*fmt >= '0' && *fmt <= '9')) ++fmt;
+    uint32_t prec = 0;
+    int has_prec = 0;
+    while (*fmt >= '0' && *fmt <= '9') ++fmt;
+    if (*fmt == '.') {
+      has_prec = 1;
+      if (*++fmt == '*') { prec = (uint32_t)va_arg(ap,int); ++fmt; }
+      for (; *fmt >= '0' && *fmt <= '9'; ++fmt) prec = prec*10 + (uint32_t)(*fmt - '0');
+    }
 
     if (*fmt == '%') { cb('%', ctx); continue; }
     if (*fmt == 'c') { cb((char)va_arg(ap,int), ctx); continue; }
-    if (*fmt == 's') { out_str(cb, ctx, va_arg(ap,const char*)); continue; }
+    if (*fmt == 's') {
+      const char* str = va_arg(ap,const char*);
+      if (has_prec && str) { for (uint32_t i=0;i<prec && str[i];++i) cb(str[i], ctx); }
+      else out_str(cb, ctx, str);
+      continue;
+    }
     if (*fmt == 'u') { out_u32(cb, ctx, va_arg(ap,uint32_t)); continue; }
+    if (*fmt == 'd') {
+      int32_t v = va_arg(ap,int32_t);
+      if (v < 0) { cb('-', ctx); out_u32(cb, ctx, (uint32_t)0 - (uint32_t)v); }
+      else out_u32(cb, ctx, (uint32_t)v);
+      continue;
+    }
     if (*fmt == 'x' || *fmt == 'p') { out_hex32(cb, ctx, va_arg(ap,uint32_t)); continue; }
     if (*fmt == 'l') {
       ++fmt;
       if (*fmt=='x') { out_hex64(cb, ctx, va_arg(ap,uint64_t)); continue; }
+      if (*fmt=='u') { out_u64(cb, ctx, va_arg(ap,uint64_t)); continue; }
     }
 
     cb('?', ctx);
   }
-
-  va_end(ap);
 }
 
-void mini_vprintf(putc_cb_t cb, void* ctx, const char* fmt, void** va) {
-  (void)va;
-  out_str(cb, ctx, "[mini_vprintf DISABLED]\n");
+void mini_printf(putc_cb_t cb, void* ctx, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  mini_vprintf(cb, ctx, fmt, ap);
+  va_end(ap);
 }
@@ -0,0 +1,34 @@
+#include "module.h"
+#include "serial.h"
+
+static module_t s_modules[MODULE_MAX];
+static uint32_t s_count;
+
+void module_add(uint64_t start, uint64_t end, const char* cmdline) {
+  if (s_count == MODULE_MAX) {
+    serial_printf("[MOD][WARN] table full, dropping %lx-%lx\n", start, end);
+    return;
+  }
+  s_modules[s_count].start   = start;
+  s_modules[s_count].end     = end;
+  s_modules[s_count].cmdline = cmdline ? cmdline : "";
+  s_count++;
+}
+
+uint32_t module_count(void) {
+  return s_count;
+}
+
+const module_t* module_get(uint32_t i) {
+  return i < s_count ? &s_modules[i] : 0;
+}
+
+const module_t* module_find(const char* path) {
+  for (uint32_t i = 0; i < s_count; ++i) {
+    const char* c = s_modules[i].cmdline;
+    const char* p = path;
+    while (*p && *c == *p) { c++; p++; }
+    if (*p == 0 && (*c == 0 || *c == ' ')) return &s_modules[i];
+  }
+  return 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+// Boot modules from the MB2 module tags (type 3), in the order the loader
+// was given them. The contents stay where the loader put them; the pages
+// are kept out of the physical allocator by pmm_init().
+
+#define MODULE_MAX 16
+
+typedef struct {
+  uint64_t    start;
+  uint64_t    end;          // exclusive
+  const char* cmdline;      // points into the MB2 info block
+} module_t;
+
+void            module_add(uint64_t start, uint64_t end, const char* cmdline);
+uint32_t        module_count(void);
+const module_t* module_get(uint32_t i);
+const module_t* module_find(const char* path);   // by the first cmdline word
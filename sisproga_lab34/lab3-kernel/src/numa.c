@@ -0,0 +1,256 @@
+#include "numa.h"
+#include "pmm.h"
+#include "smp.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "serial.h"
+
+#define NUMA_MAX_MEM 32
+#define NO_NODE      0xFF
+
+typedef struct {
+  uint64_t base;
+  uint64_t end;
+  uint32_t node;
+} numa_mem_t;
+
+static uint32_t   s_nodes = 1;
+static uint32_t   s_pxm[NUMA_MAX_NODES];          // node -> proximity domain
+static uint8_t    s_apic_node[256];               // NO_NODE: not in the SRAT
+static numa_mem_t s_mem[NUMA_MAX_MEM];
+static uint32_t   s_nmem;
+static uint8_t    s_dist[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+static int sig4(const char sig[4], const char* lit) {
+  return sig[0]==lit[0] && sig[1]==lit[1] && sig[2]==lit[2] && sig[3]==lit[3];
+}
+
+static uint32_t node_for(uint32_t pxm) {
+  for (uint32_t n = 0; n < s_nodes; ++n) {
+    if (s_pxm[n] == pxm) return n;
+  }
+  if (s_nodes == NUMA_MAX_NODES) {
+    serial_printf("[NUMA][WARN] domain %u folded into node 0, too many nodes\n", pxm);
+    return 0;
+  }
+  s_pxm[s_nodes] = pxm;
+  return s_nodes++;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t pxm) {
+  if (apic_id >= 256) {
+    serial_printf("[NUMA][WARN] x2APIC id %u not supported, left on node 0\n", apic_id);
+    return;
+  }
+  s_apic_node[apic_id] = (uint8_t)node_for(pxm);
+}
+
+static void add_mem(uint64_t base, uint64_t len, uint32_t pxm) {
+  uint32_t node = node_for(pxm);
+  if (s_nmem < NUMA_MAX_MEM) {
+    s_mem[s_nmem].base = base;
+    s_mem[s_nmem].end  = base + len;
+    s_mem[s_nmem].node = node;
+    s_nmem++;
+  }
+  pmm_set_node(base, base + len, node);
+}
+
+static void parse_srat(const srat_t* srat) {
+  const uint8_t* p   = srat->entries;
+  const uint8_t* end = (const uint8_t*)srat + srat->hdr.length;
+  while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+    if (p[0] == SRAT_CPU_APIC && p[1] >= sizeof(srat_cpu_t)) {
+      const srat_cpu_t* c = (const srat_cpu_t*)p;
+      uint32_t pxm = c->domain_lo | ((uint32_t)c->domain_hi[0] << 8) |
+                     ((uint32_t)c->domain_hi[1] << 16) | ((uint32_t)c->domain_hi[2] << 24);
+      if (c->flags & SRAT_ENABLED) add_cpu(c->apic_id, pxm);
+    } else if (p[0] == SRAT_CPU_X2APIC && p[1] >= sizeof(srat_x2apic_t)) {
+      const srat_x2apic_t* c = (const srat_x2apic_t*)p;
+      if (c->flags & SRAT_ENABLED) add_cpu(c->x2apic_id, c->domain);
+    } else if (p[0] == SRAT_MEMORY && p[1] >= sizeof(srat_mem_t)) {
+      const srat_mem_t* m = (const srat_mem_t*)p;
+      if ((m->flags & SRAT_ENABLED) && m->len) add_mem(m->base, m->len, m->domain);
+    }
+    p += p[1];
+  }
+}
+
+static void parse_slit(const slit_t* slit) {
+  uint64_t n = slit->localities;
+  if (!n || sizeof(slit_t) + n * n > slit->hdr.length) {
+    serial_printf("[NUMA][WARN] SLIT for %lu localities is truncated, ignored\n", n);
+    return;
+  }
+  for (uint32_t a = 0; a < s_nodes; ++a) {
+    for (uint32_t b = 0; b < s_nodes; ++b) {
+      if (s_pxm[a] < n && s_pxm[b] < n) s_dist[a][b] = slit->entries[s_pxm[a] * n + s_pxm[b]];
+    }
+  }
+}
+
+void numa_init(const rsdp_t* rsdp) {
+  for (uint32_t a = 0; a < 256; ++a) s_apic_node[a] = NO_NODE;
+
+  const acpi_sdt_header_t* srat = acpi_find_table(rsdp, "SRAT");
+  if (srat && sig4(srat->signature, "SRAT")) {
+    s_nodes = 0;
+    parse_srat((const srat_t*)srat);
+    if (!s_nodes) s_nodes = 1;
+  }
+
+  for (uint32_t a = 0; a < s_nodes; ++a) {
+    for (uint32_t b = 0; b < s_nodes; ++b) s_dist[a][b] = a == b ? 10 : 20;
+  }
+  const acpi_sdt_header_t* slit = acpi_find_table(rsdp, "SLIT");
+  if (srat && slit) parse_slit((const slit_t*)slit);
+
+  if (!srat) {
+    serial_printf("[NUMA] no SRAT, one node\n");
+    return;
+  }
+  for (uint32_t n = 0; n < s_nodes; ++n) {
+    serial_printf("[NUMA] node %u: domain %u, cpus (apic id)", n, s_pxm[n]);
+    for (uint32_t a = 0; a < 256; ++a) {
+      if (s_apic_node[a] == n) serial_printf(" %u", a);
+    }
+    serial_printf("\n");
+    for (uint32_t i = 0; i < s_nmem; ++i) {
+      if (s_mem[i].node != n) continue;
+      serial_printf("[NUMA]   memory %lx-%lx (%lu MiB)\n", s_mem[i].base, s_mem[i].end,
+                    (s_mem[i].end - s_mem[i].base) >> 20);
+    }
+  }
+  serial_printf("[NUMA] distances%s:\n", slit ? "" : " (no SLIT)");
+  for (uint32_t a = 0; a < s_nodes; ++a) {
+    serial_printf("[NUMA]  ");
+    for (uint32_t b = 0; b < s_nodes; ++b) serial_printf(" %u", (uint32_t)s_dist[a][b]);
+    serial_printf("\n");
+  }
+}
+
+uint32_t numa_node_count(void) {
+  return s_nodes;
+}
+
+uint32_t numa_node_of_apic(uint32_t apic_id) {
+  if (apic_id >= 256 || s_apic_node[apic_id] == NO_NODE) return 0;
+  return s_apic_node[apic_id];
+}
+
+uint32_t numa_node_of_cpu(uint32_t cpu) {
+  return cpu < g_cpu_count ? g_cpus[cpu].node : 0;
+}
+
+uint32_t numa_node_of_addr(uint64_t addr) {
+  for (uint32_t i = 0; i < s_nmem; ++i) {
+    if (addr >= s_mem[i].base && addr < s_mem[i].end) return s_mem[i].node;
+  }
+  return 0;
+}
+
+// CPUID's initial APIC id needs no LAPIC mapping, so this works at any time.
+uint32_t numa_this_node(void) {
+  uint32_t a, b, c, d;
+  cpuid(1, 0, &a, &b, &c, &d);
+  return numa_node_of_apic(b >> 24);
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to) {
+  if (from >= s_nodes || to >= s_nodes) return 0;
+  return s_dist[from][to];
+}
+
+uint64_t numa_alloc_local(void) {
+  return pmm_alloc_near(numa_this_node());
+}
+
+// ---- benchmark ---------------------------------------------------------------
+
+#define BENCH_PAGES     16384u    // 64 MiB per node, past any LLC we run on
+#define BENCH_MIN_PAGES 1024u
+
+typedef struct {
+  uint32_t        cpu;
+  const uint64_t* pages;
+  uint32_t        npages;
+  uint64_t        read_cycles;
+  uint64_t        write_cycles;
+} bench_job_t;
+
+// One load per cache line; the hardware prefetcher streams the rest of the page.
+static void read_page(const uint8_t* p) {
+  uint32_t n = PMM_PAGE / 256;
+  __asm__ volatile ("1:\n\t"
+                    "mov (%0), %%eax\n\t"
+                    "mov 64(%0), %%eax\n\t"
+                    "mov 128(%0), %%eax\n\t"
+                    "mov 192(%0), %%eax\n\t"
+                    "add $256, %0\n\t"
+                    "dec %1\n\t"
+                    "jnz 1b"
+                    : "+r"(p), "+r"(n) : : "eax", "memory");
+}
+
+static void write_page(uint8_t* p) {
+  uint32_t n = PMM_PAGE / 4;
+  __asm__ volatile ("rep stosl" : "+D"(p), "+c"(n) : "a"(0) : "memory");
+}
+
+static void bench_on(uint32_t cpu, void* arg) {
+  bench_job_t* job = (bench_job_t*)arg;
+  if (cpu != job->cpu) return;
+
+  for (uint32_t i = 0; i < job->npages; ++i) write_page((uint8_t*)(uintptr_t)job->pages[i]);
+
+  uint64_t t0 = rdtsc();
+  for (uint32_t i = 0; i < job->npages; ++i) read_page((const uint8_t*)(uintptr_t)job->pages[i]);
+  uint64_t t1 = rdtsc();
+  for (uint32_t i = 0; i < job->npages; ++i) write_page((uint8_t*)(uintptr_t)job->pages[i]);
+  job->read_cycles  = t1 - t0;
+  job->write_cycles = rdtsc() - t1;
+}
+
+static uint32_t first_cpu_on(uint32_t node) {
+  for (uint32_t c = 0; c < g_cpu_count; ++c) {
+    if (g_cpus[c].online && g_cpus[c].node == node) return c;
+  }
+  return ~0u;
+}
+
+// For each memory node a buffer of its own pages, then every node's first
+// online CPU reads and writes it; the diagonal is local access.
+void numa_bench(void) {
+  static uint64_t pages[BENCH_PAGES];
+
+  for (uint32_t mem = 0; mem < s_nodes; ++mem) {
+    uint32_t n = 0;
+    while (n < BENCH_PAGES) {
+      uint64_t pg = pmm_alloc_near(mem);
+      if (!pg) break;
+      if (numa_node_of_addr(pg) != mem && s_nodes > 1) {
+        pmm_free(pg);
+        break;
+      }
+      pages[n++] = pg;
+    }
+    if (n < BENCH_MIN_PAGES) {
+      serial_printf("[NUMA] bench: node %u has %u free pages, skipped\n", mem, n);
+    } else {
+      for (uint32_t from = 0; from < s_nodes; ++from) {
+        bench_job_t job = { first_cpu_on(from), pages, n, 0, 0 };
+        if (job.cpu == ~0u) {
+          serial_printf("[NUMA] bench: node %u has no online CPU\n", from);
+          continue;
+        }
+        smp_run(job.cpu + 1, bench_on, &job);
+        uint64_t bytes = (uint64_t)n * PMM_PAGE;
+        serial_printf("[NUMA] bench cpu%u (node %u) -> memory node %u, distance %u: read %lu MB/s, write %lu MB/s\n",
+                      job.cpu, from, mem, numa_distance(from, mem),
+                      tsc_per_second(bytes, job.read_cycles) >> 20,
+                      tsc_per_second(bytes, job.write_cycles) >> 20);
+      }
+    }
+    while (n--) pmm_free(pages[n]);
+  }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include "acpi.h"
+
+// NUMA topology from the ACPI SRAT (which proximity domain each CPU and
+// memory range is in) and SLIT (distances between them). Domains are
+// numbered densely as nodes in the order the SRAT mentions them. Without
+// an SRAT everything is node 0.
+//
+// numa_init() runs before smp_init(), which records the node of each CPU
+// in g_cpus, and labels the pmm ranges so that pmm_alloc_near() can hand
+// out node-local pages.
+
+#define NUMA_MAX_NODES 8
+
+void     numa_init(const rsdp_t* rsdp);
+uint32_t numa_node_count(void);
+uint32_t numa_node_of_cpu(uint32_t cpu);    // index into g_cpus
+uint32_t numa_node_of_apic(uint32_t apic_id);
+uint32_t numa_node_of_addr(uint64_t addr);
+// Node of the calling CPU; usable before smp_init().
+uint32_t numa_this_node(void);
+// SLIT distance, 10 for a node to itself; 20 between nodes without a SLIT.
+uint32_t numa_distance(uint32_t from, uint32_t to);
+
+// A page on the caller's node when there is one left (0 when out of memory).
+uint64_t numa_alloc_local(void);
+
+// Read and write bandwidth from a CPU of each node to memory of each node.
+void     numa_bench(void);
@@ -0,0 +1,529 @@
+#include "p9.h"
+#include "virtio.h"
+#include "pmm.h"
+#include "serial.h"
+#include "tsc.h"
+#include "cpu.h"
+
+#define P9_DEVICE_MODERN  0x1049
+#define P9_DEVICE_LEGACY  0x1009
+#define VIRTIO_9P_MOUNT_TAG (1ull << 0)
+
+#define P9_RLERROR    7
+#define P9_TLOPEN     12
+#define P9_RLOPEN     13
+#define P9_TGETATTR   24
+#define P9_RGETATTR   25
+#define P9_TVERSION   100
+#define P9_RVERSION   101
+#define P9_TATTACH    104
+#define P9_RATTACH    105
+#define P9_TWALK      110
+#define P9_RWALK      111
+#define P9_TREAD      116
+#define P9_RREAD      117
+#define P9_TCLUNK     120
+#define P9_RCLUNK     121
+
+#define P9_NOTAG      0xFFFF
+#define P9_NOFID      0xFFFFFFFFu
+#define P9_GETATTR_SIZE 0x200ull
+#define P9_MAXWELEM   16
+
+#define P9_HDR        7         // size[4] type[1] tag[2]
+#define P9_RREAD_HDR  11        // + count[4]
+#define P9_IOHDRSZ    24        // room kept for the Tread/Rread header, as Linux does
+#define P9_MSIZE      (128u * 1024 + P9_IOHDRSZ)
+
+#define P9_SLOTS      4         // requests in flight, one tag each
+#define P9_BUF        4096      // request and small-reply buffer per slot
+#define P9_MAX_SG     (2 + (P9_MSIZE - P9_IOHDRSZ) / PMM_PAGE)
+#define P9_TIMEOUT_MS 5000ull
+
+#define ENOENT    2
+#define EIO       5
+#define ENOMEM    12
+#define ENAMETOOLONG 36
+#define EPROTO    71
+#define ETIMEDOUT 110
+
+typedef struct {
+  int      busy, done;
+  uint32_t len;                 // bytes the device wrote
+  uint64_t off;                 // Tread: file offset and byte count
+  uint32_t count;
+  virtq_buf_t in[P9_MAX_SG];
+} p9_slot_t;
+
+static uint8_t   s_tx[P9_SLOTS][P9_BUF] __attribute__((aligned(4096)));
+static uint8_t   s_rx[P9_SLOTS][P9_BUF] __attribute__((aligned(4096)));
+static p9_slot_t s_slots[P9_SLOTS];
+
+static virtio_dev_t s_dev;
+static virtq_t      s_vq;
+static int          s_up;
+static uint32_t     s_msize;
+static uint32_t     s_next_fid = 1;   // 0 is the root
+static char         s_tag[64];
+
+// ---- messages ----------------------------------------------------------------
+
+typedef struct {
+  uint8_t* p;
+  uint32_t n;
+  int      over;
+} p9_msg_t;
+
+static void put8(p9_msg_t* m, uint8_t v) {
+  if (m->n + 1 > P9_BUF) { m->over = 1; return; }
+  m->p[m->n++] = v;
+}
+static void put16(p9_msg_t* m, uint16_t v) { put8(m, (uint8_t)v); put8(m, (uint8_t)(v >> 8)); }
+static void put32(p9_msg_t* m, uint32_t v) { put16(m, (uint16_t)v); put16(m, (uint16_t)(v >> 16)); }
+static void put64(p9_msg_t* m, uint64_t v) { put32(m, (uint32_t)v); put32(m, (uint32_t)(v >> 32)); }
+
+static void putstr(p9_msg_t* m, const char* s, uint32_t len) {
+  put16(m, (uint16_t)len);
+  for (uint32_t i = 0; i < len; ++i) put8(m, (uint8_t)s[i]);
+}
+
+static p9_msg_t begin(uint32_t slot, uint8_t type, uint16_t tag) {
+  p9_msg_t m = { s_tx[slot], 4, 0 };
+  put8(&m, type);
+  put16(&m, tag);
+  return m;
+}
+
+static uint32_t finish(p9_msg_t* m) {
+  uint32_t n = m->n;
+  m->n = 0;
+  put32(m, n);
+  m->n = n;
+  return n;
+}
+
+static uint16_t get16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t get32(const uint8_t* p) { return get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static uint64_t get64(const uint8_t* p) { return get32(p) | ((uint64_t)get32(p + 4) << 32); }
+
+// ---- transport ---------------------------------------------------------------
+
+static uint64_t deadline(void) {
+  return rdtsc() + (uint64_t)g_tsc_khz * P9_TIMEOUT_MS;
+}
+
+static int submit(uint32_t slot, uint32_t tx_len, uint32_t nin) {
+  p9_slot_t* s = &s_slots[slot];
+  virtq_buf_t out = { (uintptr_t)s_tx[slot], tx_len };
+  if (virtq_add(&s_vq, &out, 1, s->in, nin, s) < 0) return -1;
+  s->busy = 1;
+  s->done = 0;
+  return 0;
+}
+
+// A request that timed out may still complete at any time, into its
+// slot's buffers and the caller's pages, and a slot reused under it would
+// be overwritten. So nothing more is sent once one times out: the
+// transport stays down and later calls fail with -EIO.
+static void transport_dead(void) {
+  if (s_up) serial_printf("[9P][ERR] request timed out, no further requests to the device\n");
+  s_up = 0;
+}
+
+// Reaps one completion, whichever slot it belongs to.
+static p9_slot_t* reap(uint64_t until) {
+  for (;;) {
+    uint32_t len;
+    p9_slot_t* s = (p9_slot_t*)virtq_get(&s_vq, &len);
+    if (s) {
+      s->done = 1;
+      s->len  = len;
+      return s;
+    }
+    if (rdtsc() > until) return 0;
+    cpu_pause();
+  }
+}
+
+// 0, or the server's error for this slot's reply.
+static int check(uint32_t slot, uint8_t rtype) {
+  const uint8_t* r = s_rx[slot];
+  p9_slot_t* s = &s_slots[slot];
+  if (s->len < P9_HDR || get16(r + 5) != get16(s_tx[slot] + 5)) return -EPROTO;
+  if (r[4] == P9_RLERROR) return s->len >= P9_HDR + 4 ? -(int)get32(r + P9_HDR) : -EPROTO;
+  return r[4] == rtype ? 0 : -EPROTO;
+}
+
+static int wait_slot(p9_slot_t* s) {
+  uint64_t until = deadline();
+  while (!s->done) {
+    if (!reap(until)) {
+      transport_dead();
+      return -ETIMEDOUT;
+    }
+  }
+  s->busy = 0;
+  return 0;
+}
+
+// One request on slot 0 with the whole reply in s_rx[0].
+static int rpc(p9_msg_t* m, uint8_t rtype) {
+  if (m->over) return -ENAMETOOLONG;
+  uint32_t len = finish(m);
+  p9_slot_t* s = &s_slots[0];
+  s->in[0].addr = (uintptr_t)s_rx[0];
+  s->in[0].len  = P9_BUF;
+  if (submit(0, len, 1) < 0) return -EIO;
+  virtq_kick(&s_vq);
+
+  if (wait_slot(s) < 0) {
+    serial_printf("[9P][ERR] request %u timed out\n", (uint32_t)s_tx[0][4]);
+    return -ETIMEDOUT;
+  }
+  return check(0, rtype);
+}
+
+// ---- protocol ----------------------------------------------------------------
+
+int p9_init(void) {
+  const pci_dev_t* pci = pci_find(VIRTIO_VENDOR, P9_DEVICE_MODERN, 0);
+  if (!pci) pci = pci_find(VIRTIO_VENDOR, P9_DEVICE_LEGACY, 0);
+  if (!pci) {
+    serial_printf("[9P] no virtio-9p device\n");
+    return -1;
+  }
+  if (virtio_init(&s_dev, pci, VIRTIO_9P_MOUNT_TAG | VIRTIO_F_EVENT_IDX) < 0) return -1;
+  if (virtio_queue_init(&s_dev, &s_vq, 0) < 0) {
+    serial_printf("[9P][ERR] request queue setup failed\n");
+    return -1;
+  }
+  virtio_ready(&s_dev);
+
+  if (s_dev.features & VIRTIO_9P_MOUNT_TAG) {
+    uint32_t n = virtio_cfg_read8(&s_dev, 0) | ((uint32_t)virtio_cfg_read8(&s_dev, 1) << 8);
+    if (n > sizeof(s_tag) - 1) n = sizeof(s_tag) - 1;
+    for (uint32_t i = 0; i < n; ++i) s_tag[i] = (char)virtio_cfg_read8(&s_dev, 2 + i);
+    s_tag[n] = 0;
+  }
+
+  p9_msg_t m = begin(0, P9_TVERSION, P9_NOTAG);
+  put32(&m, P9_MSIZE);
+  putstr(&m, "9P2000.L", 8);
+  int rc = rpc(&m, P9_RVERSION);
+  const uint8_t* r = s_rx[0];
+  int same = rc == 0 && get16(r + P9_HDR + 4) == 8;
+  for (uint32_t i = 0; same && i < 8; ++i) same = r[P9_HDR + 6 + i] == (uint8_t)"9P2000.L"[i];
+  if (!same) {
+    serial_printf("[9P][ERR] server does not speak 9P2000.L (%d)\n", rc);
+    return -1;
+  }
+  s_msize = get32(r + P9_HDR);
+  if (s_msize > P9_MSIZE) s_msize = P9_MSIZE;
+  if (s_msize < P9_IOHDRSZ + PMM_PAGE) {
+    serial_printf("[9P][ERR] msize %u too small\n", s_msize);
+    return -1;
+  }
+
+  m = begin(0, P9_TATTACH, 0);
+  put32(&m, 0);
+  put32(&m, P9_NOFID);
+  putstr(&m, "", 0);
+  putstr(&m, "", 0);
+  put32(&m, 0);
+  if ((rc = rpc(&m, P9_RATTACH)) < 0) {
+    serial_printf("[9P][ERR] attach failed (%d)\n", rc);
+    return -1;
+  }
+
+  s_up = 1;
+  serial_printf("[9P] attached '%s', msize %u, %u-entry queue, %u requests in flight\n",
+                s_tag, s_msize, (uint32_t)s_vq.size, (uint32_t)P9_SLOTS);
+  return 0;
+}
+
+int p9_walk(const char* path) {
+  if (!s_up) return -EIO;
+  uint32_t fid = s_next_fid++;
+  uint32_t from = 0;
+
+  // At most P9_MAXWELEM names per Twalk; the first one clones the root.
+  do {
+    p9_msg_t m = begin(0, P9_TWALK, 0);
+    put32(&m, from);
+    put32(&m, fid);
+    uint32_t count_at = m.n;
+    put16(&m, 0);
+
+    uint16_t n = 0;
+    while (*path && n < P9_MAXWELEM) {
+      while (*path == '/') path++;
+      uint32_t len = 0;
+      while (path[len] && path[len] != '/') len++;
+      if (!len) break;
+      putstr(&m, path, len);
+      path += len;
+      n++;
+    }
+    while (*path == '/') path++;
+    m.p[count_at] = (uint8_t)n;
+    m.p[count_at + 1] = 0;
+
+    int rc = rpc(&m, P9_RWALK);
+    if (rc == 0 && get16(s_rx[0] + P9_HDR) != n) rc = -ENOENT;
+    if (rc < 0) {
+      if (from == fid) p9_clunk(fid);
+      return rc;
+    }
+    from = fid;
+  } while (*path);
+
+  return (int)fid;
+}
+
+int p9_open(uint32_t fid, uint64_t* size, uint32_t* iounit) {
+  if (!s_up) return -EIO;
+  p9_msg_t m = begin(0, P9_TLOPEN, 0);
+  put32(&m, fid);
+  put32(&m, 0);                 // O_RDONLY
+  int rc = rpc(&m, P9_RLOPEN);
+  if (rc < 0) return rc;
+  if (iounit) *iounit = get32(s_rx[0] + P9_HDR + 13);
+
+  if (size) {
+    m = begin(0, P9_TGETATTR, 0);
+    put32(&m, fid);
+    put64(&m, P9_GETATTR_SIZE);
+    if ((rc = rpc(&m, P9_RGETATTR)) < 0) return rc;
+    // valid[8] qid[13] mode[4] uid[4] gid[4] nlink[8] rdev[8] size[8]
+    *size = get64(s_rx[0] + P9_HDR + 8 + 13 + 4 + 4 + 4 + 8 + 8);
+  }
+  return 0;
+}
+
+void p9_clunk(uint32_t fid) {
+  if (!s_up) return;
+  p9_msg_t m = begin(0, P9_TCLUNK, 0);
+  put32(&m, fid);
+  rpc(&m, P9_RCLUNK);
+}
+
+// Largest Tread payload: what msize leaves after the header, capped by the
+// server's iounit and by what one chain can scatter into, in whole pages.
+static uint32_t read_chunk(uint32_t iounit) {
+  uint32_t c = s_msize - P9_IOHDRSZ;
+  if (iounit && iounit < c) c = iounit;
+  if (c > (uint32_t)(s_vq.size - 2) * PMM_PAGE) c = (uint32_t)(s_vq.size - 2) * PMM_PAGE;
+  c &= ~(PMM_PAGE - 1);
+  return c ? c : PMM_PAGE;
+}
+
+static void put_tread(p9_msg_t* m, uint32_t fid, uint64_t off, uint32_t count) {
+  put32(m, fid);
+  put64(m, off);
+  put32(m, count);
+}
+
+// A Tread on `slot` into a buffer, waited for. Completions of other slots
+// reaped meanwhile stay marked done for their owner.
+static int64_t read_on(uint32_t slot, uint32_t fid, uint64_t off, void* buf, uint32_t len) {
+  uint32_t max = read_chunk(0);
+  if (len > max) len = max;
+
+  p9_msg_t m = begin(slot, P9_TREAD, (uint16_t)slot);
+  put_tread(&m, fid, off, len);
+  uint32_t tx = finish(&m);
+
+  // Identity mapped, so the buffer is one descriptor however long it is.
+  p9_slot_t* s = &s_slots[slot];
+  s->in[0].addr = (uintptr_t)s_rx[slot];
+  s->in[0].len  = P9_RREAD_HDR;
+  s->in[1].addr = (uintptr_t)buf;
+  s->in[1].len  = len;
+  if (submit(slot, tx, 2) < 0) return -EIO;
+  virtq_kick(&s_vq);
+
+  if (wait_slot(s) < 0) return -ETIMEDOUT;
+  int rc = check(slot, P9_RREAD);
+  if (rc < 0) return rc;
+  uint32_t got = get32(s_rx[slot] + P9_HDR);
+  return got <= len ? (int64_t)got : -EPROTO;
+}
+
+int64_t p9_read(uint32_t fid, uint64_t off, void* buf, uint32_t len) {
+  if (!s_up) return -EIO;
+  return read_on(0, fid, off, buf, len);
+}
+
+// Finishes a short Tread page by page, synchronously, on its own slot.
+static int read_pages_sync(uint32_t slot, uint32_t fid, const uint64_t* pages, uint64_t off, uint64_t len) {
+  while (len) {
+    uint32_t po = (uint32_t)(off & (PMM_PAGE - 1));
+    uint32_t n  = PMM_PAGE - po;
+    if (n > len) n = (uint32_t)len;
+    int64_t got = read_on(slot, fid, off, (void*)(uintptr_t)(pages[off >> PMM_PAGE_SHIFT] + po), n);
+    if (got < 0) return (int)got;
+    if (got == 0) return -EIO;  // the file shrank under us
+    off += (uint64_t)got;
+    len -= (uint64_t)got;
+  }
+  return 0;
+}
+
+// Queues a Tread for [off, off + count) scattering into the pages that
+// back it; -1 when the ring has no room for the chain right now.
+static int queue_read(uint32_t slot, uint32_t fid, const uint64_t* pages, uint64_t off, uint32_t count) {
+  p9_slot_t* s = &s_slots[slot];
+  p9_msg_t m = begin(slot, P9_TREAD, (uint16_t)slot);
+  put_tread(&m, fid, off, count);
+
+  uint32_t n = 0;
+  s->in[n].addr = (uintptr_t)s_rx[slot];
+  s->in[n++].len = P9_RREAD_HDR;
+  for (uint32_t left = count, k = (uint32_t)(off >> PMM_PAGE_SHIFT); left; ++k) {
+    uint32_t l = left < PMM_PAGE ? left : PMM_PAGE;
+    s->in[n].addr  = pages[k];
+    s->in[n++].len = l;
+    left -= l;
+  }
+  s->off   = off;
+  s->count = count;
+  return submit(slot, finish(&m), n);
+}
+
+// A finished read slot: one reaped earlier by read_on() or the next one.
+static p9_slot_t* next_done(void) {
+  for (uint32_t i = 0; i < P9_SLOTS; ++i) {
+    if (s_slots[i].busy && s_slots[i].done) return &s_slots[i];
+  }
+  p9_slot_t* s = reap(deadline());
+  if (!s) transport_dead();
+  return s;
+}
+
+int64_t p9_read_file(const char* path, uint64_t* pages, uint32_t max_pages) {
+  int fid = p9_walk(path);
+  if (fid < 0) return fid;
+
+  uint64_t size = 0;
+  uint32_t iounit = 0;
+  int rc = p9_open((uint32_t)fid, &size, &iounit);
+  if (rc < 0) {
+    p9_clunk((uint32_t)fid);
+    return rc;
+  }
+
+  uint64_t want = size;
+  if (want > (uint64_t)max_pages * PMM_PAGE) want = (uint64_t)max_pages * PMM_PAGE;
+  uint32_t npages = (uint32_t)((want + PMM_PAGE - 1) >> PMM_PAGE_SHIFT);
+  for (uint32_t i = 0; i < npages; ++i) {
+    pages[i] = pmm_alloc();
+    if (!pages[i]) {
+      while (i--) pmm_free(pages[i]);
+      p9_clunk((uint32_t)fid);
+      return -ENOMEM;
+    }
+  }
+
+  // Chunks are page multiples, so every Tread starts on a page boundary.
+  // The ring is refilled after each completion and kicked once per refill.
+  uint32_t chunk = read_chunk(iounit);
+  uint64_t next = 0;
+  uint32_t inflight = 0;
+  while ((next < want || inflight) && rc == 0) {
+    for (uint32_t slot = 0; slot < P9_SLOTS && next < want; ++slot) {
+      if (s_slots[slot].busy) continue;
+      uint32_t count = (want - next < chunk) ? (uint32_t)(want - next) : chunk;
+      if (queue_read(slot, (uint32_t)fid, pages, next, count) < 0) break;
+      next += count;
+      inflight++;
+    }
+    virtq_kick(&s_vq);
+
+    p9_slot_t* s = next_done();
+    if (!s) {
+      rc = -ETIMEDOUT;
+      break;
+    }
+    inflight--;
+    s->busy = 0;
+    uint32_t slot = (uint32_t)(s - s_slots);
+    rc = check(slot, P9_RREAD);
+    if (rc == 0) {
+      uint32_t got = get32(s_rx[slot] + P9_HDR);
+      if (got > s->count)      rc = -EPROTO;
+      else if (got < s->count) rc = read_pages_sync(slot, (uint32_t)fid, pages, s->off + got, s->count - got);
+    }
+  }
+
+  // The device may still be writing into the pages of requests in flight;
+  // after a timeout it may do so at any time, so the pages are never freed
+  // and the fid is not clunked under it.
+  while (inflight && s_up) {
+    p9_slot_t* s = next_done();
+    if (!s) break;
+    s->busy = 0;
+    inflight--;
+  }
+  if (!s_up) {
+    serial_printf("[9P][ERR] %s: read timed out, leaking its %u pages\n", path, npages);
+    return rc < 0 ? rc : -ETIMEDOUT;
+  }
+  p9_clunk((uint32_t)fid);
+
+  if (rc < 0) {
+    for (uint32_t i = 0; i < npages; ++i) pmm_free(pages[i]);
+    return rc;
+  }
+  return (int64_t)want;
+}
+
+// ---- benchmark ---------------------------------------------------------------
+
+#define P9_BENCH_PAGES 16384    // 64 MiB
+#define P9_BENCH_SMALL (4u << 20)
+
+static uint64_t s_bench_pages[P9_BENCH_PAGES];
+
+void p9_bench(const char* path) {
+  if (!s_up) return;
+
+  uint64_t kicks0 = s_vq.kicks, skipped0 = s_vq.kicks_skipped;
+  uint64_t t0 = rdtsc();
+  int64_t n = p9_read_file(path, s_bench_pages, P9_BENCH_PAGES);
+  uint64_t cycles = rdtsc() - t0;
+  if (n < 0) {
+    serial_printf("[9P] bench: cannot read '%s' from the share (%d)\n", path, (int)n);
+    return;
+  }
+
+  uint32_t sum = 0x811C9DC5u;
+  uint32_t npages = (uint32_t)(((uint64_t)n + PMM_PAGE - 1) >> PMM_PAGE_SHIFT);
+  for (uint32_t i = 0; i < npages; ++i) {
+    const uint8_t* p = (const uint8_t*)(uintptr_t)s_bench_pages[i];
+    uint32_t len = (i + 1 < npages) ? PMM_PAGE : (uint32_t)((uint64_t)n - (uint64_t)i * PMM_PAGE);
+    for (uint32_t j = 0; j < len; ++j) sum = (sum ^ p[j]) * 0x01000193u;
+  }
+  serial_printf("[9P] bench: %s %lu bytes in %lu us, %lu MB/s, fnv1a %x, %u kicks (%u skipped)\n",
+                path, (uint64_t)n, tsc_cycles_to_us(cycles), tsc_per_second((uint64_t)n, cycles) >> 20,
+                sum, (uint32_t)(s_vq.kicks - kicks0), (uint32_t)(s_vq.kicks_skipped - skipped0));
+
+  // The same start of the file one page per round trip, for comparison.
+  uint64_t small = ((uint64_t)n < P9_BENCH_SMALL) ? (uint64_t)n : P9_BENCH_SMALL;
+  int fid = p9_walk(path);
+  if (fid >= 0 && p9_open((uint32_t)fid, 0, 0) == 0 && small) {
+    void* buf = (void*)(uintptr_t)s_bench_pages[0];
+    t0 = rdtsc();
+    uint64_t off = 0;
+    while (off < small) {
+      int64_t got = p9_read((uint32_t)fid, off, buf, PMM_PAGE);
+      if (got <= 0) break;
+      off += (uint64_t)got;
+    }
+    cycles = rdtsc() - t0;
+    serial_printf("[9P] bench: 4 KiB reads, one at a time: %lu bytes in %lu us, %lu MB/s\n",
+                  off, tsc_cycles_to_us(cycles), tsc_per_second(off, cycles) >> 20);
+  }
+  if (fid >= 0) p9_clunk((uint32_t)fid);
+
+  for (uint32_t i = 0; i < npages; ++i) pmm_free(s_bench_pages[i]);
+}
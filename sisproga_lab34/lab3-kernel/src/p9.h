@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+// 9P2000.L client over virtio-9p (vm-pci.sh exports $HOSTDIR with mount tag
+// "hostshare"). One session attached at the share root, polled, boot CPU
+// only. Paths are relative to the root, '/'-separated. Errors come back as
+// negative Linux errno values, as the server reports them in Rlerror.
+
+int p9_init(void);    // 0 when the share is attached
+
+int     p9_walk(const char* path);                               // new fid
+int     p9_open(uint32_t fid, uint64_t* size, uint32_t* iounit); // read-only
+int64_t p9_read(uint32_t fid, uint64_t off, void* buf, uint32_t len);
+void    p9_clunk(uint32_t fid);
+
+// Reads the file straight into freshly allocated pmm pages, several Treads
+// in flight, each one scattering into its pages. Stops after max_pages;
+// returns the bytes read (pages[] holds ceil(n / PMM_PAGE) pages the caller
+// frees) or a negative errno with nothing left allocated.
+int64_t p9_read_file(const char* path, uint64_t* pages, uint32_t max_pages);
+
+// Reads `path` from the share both ways and logs MB/s ([9P] bench).
+void p9_bench(const char* path);
@@ -0,0 +1,153 @@
+#include "param.h"
+#include "serial.h"
+
+#define CMDLINE_MAX 256
+
+enum { PARAM_BOOL, PARAM_UINT, PARAM_ENUM };
+
+typedef struct {
+  const char*        key;
+  uint8_t            type;
+  uint32_t*          var;
+  uint32_t           max;       // PARAM_UINT, PARAM_ENUM: largest value
+  const char* const* names;     // PARAM_ENUM: names[v] spells value v
+} param_t;
+
+uint32_t g_loglevel    = LOG_INFO;
+uint32_t g_acpi_dump   = 1;
+uint32_t g_fb_clear    = 1;
+uint32_t g_smp_maxcpus = 0;
+uint32_t g_bench       = 1;
+
+static const char* const k_levels[] = { "err", "warn", "info", "debug" };
+
+static const param_t k_params[] = {
+  { "loglevel",    PARAM_ENUM, &g_loglevel,    LOG_DEBUG, k_levels },
+  { "acpi.dump",   PARAM_BOOL, &g_acpi_dump,   1,         0 },
+  { "fb.clear",    PARAM_BOOL, &g_fb_clear,    1,         0 },
+  { "smp.maxcpus", PARAM_UINT, &g_smp_maxcpus, 0xFFFFu,   0 },
+  { "bench",       PARAM_BOOL, &g_bench,       1,         0 },
+};
+
+#define NPARAMS (sizeof(k_params) / sizeof(k_params[0]))
+
+static char s_cmdline[CMDLINE_MAX];
+
+// s[0..n) against a NUL-terminated word.
+static int word_eq(const char* s, uint32_t n, const char* w) {
+  uint32_t i = 0;
+  for (; i < n; ++i) {
+    if (w[i] != s[i]) return 0;
+  }
+  return w[i] == 0;
+}
+
+// Decimal or 0x hex; fails on anything else and on overflow past max.
+static int parse_uint(const char* s, uint32_t n, uint32_t max, uint32_t* out) {
+  uint32_t base = 10, i = 0;
+  uint64_t v = 0;
+  if (n > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    i = 2;
+  }
+  if (i == n) return 0;
+  for (; i < n; ++i) {
+    char c = s[i];
+    uint32_t d;
+    if (c >= '0' && c <= '9') d = (uint32_t)(c - '0');
+    else if (base == 16 && c >= 'a' && c <= 'f') d = (uint32_t)(c - 'a' + 10);
+    else if (base == 16 && c >= 'A' && c <= 'F') d = (uint32_t)(c - 'A' + 10);
+    else return 0;
+    v = v * base + d;
+    if (v > max) return 0;
+  }
+  *out = (uint32_t)v;
+  return 1;
+}
+
+static int parse_value(const param_t* p, const char* s, uint32_t n, uint32_t* out) {
+  switch (p->type) {
+  case PARAM_BOOL:
+    if (word_eq(s, n, "1") || word_eq(s, n, "on") || word_eq(s, n, "yes") || word_eq(s, n, "true")) {
+      *out = 1;
+      return 1;
+    }
+    if (word_eq(s, n, "0") || word_eq(s, n, "off") || word_eq(s, n, "no") || word_eq(s, n, "false")) {
+      *out = 0;
+      return 1;
+    }
+    return 0;
+  case PARAM_ENUM:
+    for (uint32_t v = 0; v <= p->max; ++v) {
+      if (word_eq(s, n, p->names[v])) {
+        *out = v;
+        return 1;
+      }
+    }
+    return parse_uint(s, n, p->max, out);
+  default:
+    return parse_uint(s, n, p->max, out);
+  }
+}
+
+static void set_word(const char* w, uint32_t n) {
+  uint32_t k = 0;
+  while (k < n && w[k] != '=') k++;
+
+  const param_t* p = 0;
+  for (uint32_t i = 0; i < NPARAMS && !p; ++i) {
+    if (word_eq(w, k, k_params[i].key)) p = &k_params[i];
+  }
+  if (!p) {
+    serial_printf("[PARAM][WARN] unknown parameter '%.*s'\n", (int)n, w);
+    return;
+  }
+
+  uint32_t v;
+  if (k == n) {
+    if (p->type != PARAM_BOOL) {
+      serial_printf("[PARAM][WARN] %s needs a value\n", p->key);
+      return;
+    }
+    v = 1;
+  } else if (!parse_value(p, w + k + 1, n - k - 1, &v)) {
+    serial_printf("[PARAM][WARN] bad value '%.*s' for %s, keeping %u\n",
+                  (int)(n - k - 1), w + k + 1, p->key, *p->var);
+    return;
+  }
+  *p->var = v;
+}
+
+void param_init(const char* cmdline) {
+  if (!cmdline) return;
+
+  uint32_t len = 0;
+  while (cmdline[len] && len < CMDLINE_MAX - 1) {
+    s_cmdline[len] = cmdline[len];
+    len++;
+  }
+  s_cmdline[len] = 0;
+  if (cmdline[len]) serial_printf("[PARAM][WARN] command line cut at %u bytes\n", len);
+
+  const char* s = s_cmdline;
+  for (;;) {
+    while (*s == ' ' || *s == '\t') s++;
+    if (!*s) break;
+    const char* w = s;
+    while (*s && *s != ' ' && *s != '\t') s++;
+    set_word(w, (uint32_t)(s - w));
+  }
+}
+
+const char* param_cmdline(void) {
+  return s_cmdline;
+}
+
+void param_dump(void) {
+  serial_printf("[PARAM] cmdline \"%s\"\n", s_cmdline);
+  for (uint32_t i = 0; i < NPARAMS; ++i) {
+    const param_t* p = &k_params[i];
+    if (p->type == PARAM_ENUM) serial_printf("[PARAM] %s=%s\n", p->key, p->names[*p->var]);
+    else serial_printf("[PARAM] %s=%u\n", p->key, *p->var);
+  }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+// Kernel parameters from the MB2 command line tag (type 1): space-separated
+// key=value words, parsed once by param_init() into the globals below, which
+// the rest of the kernel reads directly. Unknown keys and bad values are
+// reported and leave the default in place; a bare boolean key means =1.
+
+#define LOG_ERR    0        // errors and warnings only
+#define LOG_WARN   1        // plus one-line summaries
+#define LOG_INFO   2        // plus the boot dumps (default)
+#define LOG_DEBUG  3        // plus every MB2 tag and memory map entry
+
+extern uint32_t g_loglevel;       // loglevel=     0..3 or err, warn, info, debug
+extern uint32_t g_acpi_dump;      // acpi.dump=    RSDP and MADT dumps
+extern uint32_t g_fb_clear;       // fb.clear=     clear the framebuffer at boot
+extern uint32_t g_smp_maxcpus;    // smp.maxcpus=  CPUs to run, BSP included; 0 = all
+extern uint32_t g_bench;          // bench=        boot benchmarks
+
+void        param_init(const char* cmdline);     // 0 when there is no tag
+const char* param_cmdline(void);
+void        param_dump(void);
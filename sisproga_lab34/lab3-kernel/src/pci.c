@@ -0,0 +1,353 @@
+#include "pci.h"
+#include "cpu.h"
+#include "serial.h"
+#include "spinlock.h"
+#include "tsc.h"
+
+#define PCI_CF8 0xCF8
+#define PCI_CFC 0xCFC
+
+// Config space backend, picked once in pci_init(). Width is 1, 2 or 4 and
+// the offset is naturally aligned for it.
+typedef struct {
+  const char* name;
+  uint32_t (*read)(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint8_t width);
+  void     (*write)(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint8_t width, uint32_t v);
+} pci_cfg_ops_t;
+
+static uintptr_t s_ecam;          // config space of bus s_ecam_bus0
+static uint8_t   s_ecam_bus0, s_ecam_bus1;
+
+static ticket_lock_t s_cf8_lock = TICKET_LOCK_INIT("pci cf8");
+
+static const pci_cfg_ops_t* s_ops;
+static pci_dev_t s_devs[PCI_MAX_DEVS];
+static uint32_t  s_count;
+static uint8_t   s_by_id[PCI_MAX_DEVS];      // indices sorted by vendor, device
+static uint8_t   s_by_class[PCI_MAX_DEVS];   // indices sorted by class, subclass
+
+// ---- ECAM ------------------------------------------------------------------
+
+static volatile void* ecam_addr(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off) {
+  return (volatile void*)(s_ecam + ((uintptr_t)(bus - s_ecam_bus0) << 20) +
+                          ((uintptr_t)dev << 15) + ((uintptr_t)fn << 12) + off);
+}
+
+static uint32_t ecam_read(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint8_t width) {
+  if (bus < s_ecam_bus0 || bus > s_ecam_bus1 || off >= 4096) return 0xFFFFFFFFu >> (32 - 8 * width);
+  volatile void* p = ecam_addr(bus, dev, fn, off);
+  if (width == 4) return *(volatile uint32_t*)p;
+  if (width == 2) return *(volatile uint16_t*)p;
+  return *(volatile uint8_t*)p;
+}
+
+static void ecam_write(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint8_t width, uint32_t v) {
+  if (bus < s_ecam_bus0 || bus > s_ecam_bus1 || off >= 4096) return;
+  volatile void* p = ecam_addr(bus, dev, fn, off);
+  if (width == 4)      *(volatile uint32_t*)p = v;
+  else if (width == 2) *(volatile uint16_t*)p = (uint16_t)v;
+  else                 *(volatile uint8_t*)p  = (uint8_t)v;
+}
+
+static const pci_cfg_ops_t ecam_ops = { "ecam", ecam_read, ecam_write };
+
+// ---- 0xCF8/0xCFC -----------------------------------------------------------
+
+static uint32_t cf8_addr(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off) {
+  return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) |
+         ((uint32_t)fn << 8) | (off & 0xFCu);
+}
+
+static uint32_t cf8_read(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint8_t width) {
+  if (off >= 256) return 0xFFFFFFFFu >> (32 - 8 * width);
+
+  uint32_t flags = ticket_lock_irqsave(&s_cf8_lock);
+  outl(PCI_CF8, cf8_addr(bus, dev, fn, off));
+  uint32_t v;
+  if (width == 4)      v = inl(PCI_CFC);
+  else if (width == 2) v = inw(PCI_CFC + (off & 2));
+  else                 v = inb(PCI_CFC + (off & 3));
+  ticket_unlock_irqrestore(&s_cf8_lock, flags);
+  return v;
+}
+
+static void cf8_write(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint8_t width, uint32_t v) {
+  if (off >= 256) return;
+
+  uint32_t flags = ticket_lock_irqsave(&s_cf8_lock);
+  outl(PCI_CF8, cf8_addr(bus, dev, fn, off));
+  if (width == 4)      outl(PCI_CFC, v);
+  else if (width == 2) outw(PCI_CFC + (off & 2), (uint16_t)v);
+  else                 outb(PCI_CFC + (off & 3), (uint8_t)v);
+  ticket_unlock_irqrestore(&s_cf8_lock, flags);
+}
+
+static const pci_cfg_ops_t cf8_ops = { "port io", cf8_read, cf8_write };
+
+// ---- enumeration -------------------------------------------------------------
+
+// Writes all ones to each BAR to learn its size, with decoding switched off
+// so the device never answers at the probe address.
+static void size_bars(const pci_cfg_ops_t* ops, pci_dev_t* d, uint32_t nbars) {
+  uint8_t b = d->bus, s = d->dev, f = d->fn;
+  uint16_t cmd = (uint16_t)ops->read(b, s, f, PCI_COMMAND, 2);
+  ops->write(b, s, f, PCI_COMMAND, 2, cmd & ~(PCI_CMD_IO | PCI_CMD_MEM));
+
+  for (uint32_t i = 0; i < nbars; ++i) {
+    uint16_t off = (uint16_t)(PCI_BAR0 + i * 4);
+    uint32_t orig = ops->read(b, s, f, off, 4);
+    ops->write(b, s, f, off, 4, 0xFFFFFFFFu);
+    uint32_t mask = ops->read(b, s, f, off, 4);
+    ops->write(b, s, f, off, 4, orig);
+
+    pci_bar_t* bar = &d->bar[i];
+    if (orig & 1u) {
+      mask &= ~3u;
+      if (!mask) continue;
+      bar->flags = PCI_BAR_IO;
+      bar->base  = orig & ~3u;
+      bar->size  = (uint16_t)(~mask + 1);
+      continue;
+    }
+
+    uint64_t base  = orig & ~0xFu;
+    uint64_t mask64 = mask & ~0xFu;
+    if (orig & 8u) bar->flags |= PCI_BAR_PREFETCH;
+    if (((orig >> 1) & 3u) == 2 && i + 1 < nbars) {
+      uint32_t hi = ops->read(b, s, f, off + 4, 4);
+      ops->write(b, s, f, off + 4, 4, 0xFFFFFFFFu);
+      uint32_t mhi = ops->read(b, s, f, off + 4, 4);
+      ops->write(b, s, f, off + 4, 4, hi);
+      base   |= (uint64_t)hi << 32;
+      mask64 |= (uint64_t)mhi << 32;
+      bar->flags |= PCI_BAR_64;
+      i++;
+    } else {
+      mask64 |= 0xFFFFFFFF00000000ull;
+    }
+    if ((uint32_t)mask64 == 0 && (mask64 >> 32) == 0xFFFFFFFFu) {
+      bar->flags = 0;
+      continue;
+    }
+    bar->base = base;
+    bar->size = ~mask64 + 1;
+  }
+
+  ops->write(b, s, f, PCI_COMMAND, 2, cmd);
+}
+
+static void read_function(const pci_cfg_ops_t* ops, uint8_t bus, uint8_t dev, uint8_t fn, uint32_t id, pci_dev_t* d) {
+  uint32_t cr = ops->read(bus, dev, fn, PCI_CLASS_REV, 4);
+  uint32_t ir = ops->read(bus, dev, fn, PCI_IRQ_LINE, 4);
+
+  for (uint32_t i = 0; i < sizeof(*d); ++i) ((uint8_t*)d)[i] = 0;
+  d->bus = bus; d->dev = dev; d->fn = fn;
+  d->vendor      = (uint16_t)id;
+  d->device      = (uint16_t)(id >> 16);
+  d->revision    = (uint8_t)cr;
+  d->prog_if     = (uint8_t)(cr >> 8);
+  d->subclass    = (uint8_t)(cr >> 16);
+  d->class_code  = (uint8_t)(cr >> 24);
+  d->header_type = (uint8_t)ops->read(bus, dev, fn, PCI_HEADER, 1) & 0x7Fu;
+  d->irq_line    = (uint8_t)ir;
+  d->irq_pin     = (uint8_t)(ir >> 8);
+
+  // Type 0 has six BARs, a PCI-to-PCI bridge two, CardBus none.
+  uint32_t nbars = d->header_type == 0 ? 6 : d->header_type == 1 ? 2 : 0;
+  size_bars(ops, d, nbars);
+}
+
+// Brute-force scan of [bus0, bus1]; no bridge walking, so buses behind
+// bridges the firmware numbered are found like any other.
+static uint32_t scan(const pci_cfg_ops_t* ops, uint32_t bus0, uint32_t bus1, pci_dev_t* out, uint32_t max) {
+  uint32_t n = 0;
+  for (uint32_t bus = bus0; bus <= bus1; ++bus) {
+    for (uint8_t dev = 0; dev < 32; ++dev) {
+      uint32_t id = ops->read((uint8_t)bus, dev, 0, PCI_VENDOR_ID, 4);
+      if ((id & 0xFFFFu) == 0xFFFFu) continue;
+
+      uint8_t nfn = (ops->read((uint8_t)bus, dev, 0, PCI_HEADER, 1) & 0x80u) ? 8 : 1;
+      for (uint8_t fn = 0; fn < nfn; ++fn) {
+        if (fn) id = ops->read((uint8_t)bus, dev, fn, PCI_VENDOR_ID, 4);
+        if ((id & 0xFFFFu) == 0xFFFFu) continue;
+        if (n == max) {
+          serial_printf("[PCI][WARN] device table full at %x:%x.%u\n", bus, (uint32_t)dev, (uint32_t)fn);
+          return n;
+        }
+        read_function(ops, (uint8_t)bus, dev, fn, id, &out[n++]);
+      }
+    }
+  }
+  return n;
+}
+
+static uint32_t key_id(const pci_dev_t* d)    { return ((uint32_t)d->vendor << 16) | d->device; }
+static uint32_t key_class(const pci_dev_t* d) { return ((uint32_t)d->class_code << 8) | d->subclass; }
+
+// Insertion sort keeps equal keys in scan order, so nth follows bus order.
+static void build_index(uint8_t* idx, uint32_t (*key)(const pci_dev_t*)) {
+  for (uint32_t i = 0; i < s_count; ++i) {
+    uint8_t v = (uint8_t)i;
+    uint32_t j = i;
+    while (j > 0 && key(&s_devs[idx[j - 1]]) > key(&s_devs[v])) {
+      idx[j] = idx[j - 1];
+      j--;
+    }
+    idx[j] = v;
+  }
+}
+
+static const pci_dev_t* lookup(const uint8_t* idx, uint32_t (*key)(const pci_dev_t*), uint32_t k, uint32_t nth) {
+  uint32_t lo = 0, hi = s_count;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (key(&s_devs[idx[mid]]) < k) lo = mid + 1;
+    else hi = mid;
+  }
+  lo += nth;
+  if (lo < s_count && key(&s_devs[idx[lo]]) == k) return &s_devs[idx[lo]];
+  return 0;
+}
+
+// ECAM is only usable when the kernel can address it: below 4 GiB in the
+// i386 build, anywhere the loader mapped in the x86-64 one.
+static int ecam_from_mcfg(const rsdp_t* rsdp) {
+  const mcfg_t* mcfg = (const mcfg_t*)acpi_find_table(rsdp, "MCFG");
+  if (!mcfg) {
+    serial_printf("[PCI] no MCFG table\n");
+    return 0;
+  }
+
+  uint32_t n = (mcfg->hdr.length - (uint32_t)sizeof(mcfg_t)) / sizeof(mcfg_entry_t);
+  for (uint32_t i = 0; i < n; ++i) {
+    const mcfg_entry_t* e = &mcfg->entries[i];
+    serial_printf("[PCI] MCFG segment %u buses %u-%u ecam %lx\n",
+                  (uint32_t)e->segment, (uint32_t)e->start_bus, (uint32_t)e->end_bus, e->base);
+    if (e->segment != 0 || e->end_bus < e->start_bus) continue;
+
+    uint64_t end = e->base + ((uint64_t)(e->end_bus - e->start_bus + 1) << 20);
+    if (sizeof(uintptr_t) == 4 && end > 0x100000000ull) continue;
+
+    s_ecam      = (uintptr_t)e->base;
+    s_ecam_bus0 = e->start_bus;
+    s_ecam_bus1 = e->end_bus;
+    return 1;
+  }
+  return 0;
+}
+
+void pci_init(const rsdp_t* rsdp) {
+  static pci_dev_t other[PCI_MAX_DEVS];
+  int have_ecam = ecam_from_mcfg(rsdp);
+
+  // The same scan through both mechanisms, port I/O first so the result
+  // kept is the one from the backend that stays in use.
+  uint64_t t0 = rdtsc();
+  uint32_t n_cf8 = scan(&cf8_ops, 0, 255, have_ecam ? other : s_devs, PCI_MAX_DEVS);
+  uint64_t us_cf8 = tsc_cycles_to_us(rdtsc() - t0);
+
+  s_ops   = &cf8_ops;
+  s_count = n_cf8;
+  if (have_ecam) {
+    t0 = rdtsc();
+    s_count = scan(&ecam_ops, s_ecam_bus0, s_ecam_bus1, s_devs, PCI_MAX_DEVS);
+    uint64_t us_ecam = tsc_cycles_to_us(rdtsc() - t0);
+    s_ops = &ecam_ops;
+
+    serial_printf("[PCI] scan: ecam %u functions in %lu us, port io %u functions in %lu us\n",
+                  s_count, us_ecam, n_cf8, us_cf8);
+    if (s_count != n_cf8) serial_printf("[PCI][WARN] ecam and port io disagree\n");
+  } else {
+    serial_printf("[PCI] scan: port io %u functions in %lu us\n", s_count, us_cf8);
+  }
+
+  build_index(s_by_id, key_id);
+  build_index(s_by_class, key_class);
+}
+
+void pci_dump(void) {
+  for (uint32_t i = 0; i < s_count; ++i) {
+    const pci_dev_t* d = &s_devs[i];
+    serial_printf("[PCI] %x:%x.%u %x:%x class %x/%x/%x rev %u hdr %u irq %u pin %u\n",
+                  (uint32_t)d->bus, (uint32_t)d->dev, (uint32_t)d->fn,
+                  (uint32_t)d->vendor, (uint32_t)d->device,
+                  (uint32_t)d->class_code, (uint32_t)d->subclass, (uint32_t)d->prog_if,
+                  (uint32_t)d->revision, (uint32_t)d->header_type,
+                  (uint32_t)d->irq_line, (uint32_t)d->irq_pin);
+    for (uint32_t b = 0; b < PCI_BAR_COUNT; ++b) {
+      const pci_bar_t* bar = &d->bar[b];
+      if (!bar->size) continue;
+      serial_printf("[PCI]   bar%u %s%s%s %lx size %lx\n", b,
+                    (bar->flags & PCI_BAR_IO) ? "io" : "mem",
+                    (bar->flags & PCI_BAR_64) ? "64" : "",
+                    (bar->flags & PCI_BAR_PREFETCH) ? " pf" : "",
+                    bar->base, bar->size);
+    }
+  }
+  serial_printf("[PCI] %u functions, config via %s\n", s_count, s_ops ? s_ops->name : "none");
+}
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off) {
+  return s_ops->read(bus, dev, fn, off & ~3u, 4);
+}
+
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off) {
+  return (uint16_t)s_ops->read(bus, dev, fn, off & ~1u, 2);
+}
+
+uint8_t pci_read8(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off) {
+  return (uint8_t)s_ops->read(bus, dev, fn, off, 1);
+}
+
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint32_t v) {
+  s_ops->write(bus, dev, fn, off & ~3u, 4, v);
+}
+
+void pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint16_t v) {
+  s_ops->write(bus, dev, fn, off & ~1u, 2, v);
+}
+
+uint32_t pci_count(void) {
+  return s_count;
+}
+
+const pci_dev_t* pci_get(uint32_t i) {
+  return i < s_count ? &s_devs[i] : 0;
+}
+
+const pci_dev_t* pci_find(uint16_t vendor, uint16_t device, uint32_t nth) {
+  return lookup(s_by_id, key_id, ((uint32_t)vendor << 16) | device, nth);
+}
+
+const pci_dev_t* pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t nth) {
+  return lookup(s_by_class, key_class, ((uint32_t)class_code << 8) | subclass, nth);
+}
+
+void pci_enable(const pci_dev_t* d, uint16_t cmd_bits) {
+  uint16_t cmd = pci_read16(d->bus, d->dev, d->fn, PCI_COMMAND);
+  pci_write16(d->bus, d->dev, d->fn, PCI_COMMAND, cmd | cmd_bits);
+}
+
+void pci_quiesce(void) {
+  for (uint32_t i = 0; i < pci_count(); ++i) {
+    const pci_dev_t* d = pci_get(i);
+    if (d->class_code == 0x06) continue;
+    uint16_t cmd = pci_read16(d->bus, d->dev, d->fn, PCI_COMMAND);
+    if (cmd & PCI_CMD_MASTER) pci_write16(d->bus, d->dev, d->fn, PCI_COMMAND, cmd & ~PCI_CMD_MASTER);
+  }
+}
+
+uint8_t pci_find_cap(const pci_dev_t* d, uint8_t cap_id, uint8_t after) {
+  if (!(pci_read16(d->bus, d->dev, d->fn, PCI_STATUS) & PCI_STATUS_CAPS)) return 0;
+
+  uint8_t off = after ? pci_read8(d->bus, d->dev, d->fn, after + 1)
+                      : pci_read8(d->bus, d->dev, d->fn, PCI_CAP_PTR);
+  // 48 is the most entries that fit in the 192 bytes after the header; a
+  // longer walk means the list loops.
+  for (uint32_t guard = 0; off >= 0x40 && guard < 48; ++guard) {
+    off &= ~3u;
+    if (pci_read8(d->bus, d->dev, d->fn, off) == cap_id) return off;
+    off = pci_read8(d->bus, d->dev, d->fn, off + 1);
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include "acpi.h"
+
+// PCI configuration space and the functions found at boot. Config space is
+// reached through ECAM when ACPI has an MCFG table (4 KiB per function, one
+// MMIO access each) and through the 0xCF8/0xCFC ports otherwise (first
+// 256 bytes, address and data accesses serialized by a lock). pci_init()
+// scans every bus once, sizes the BARs and keeps the functions in a table
+// that is searched by vendor/device or by class.
+
+#define PCI_MAX_DEVS   64
+#define PCI_BAR_COUNT  6
+
+#define PCI_VENDOR_ID  0x00
+#define PCI_DEVICE_ID  0x02
+#define PCI_COMMAND    0x04
+#define PCI_STATUS     0x06
+#define PCI_CLASS_REV  0x08
+#define PCI_HEADER     0x0E
+#define PCI_BAR0       0x10
+#define PCI_CAP_PTR    0x34
+#define PCI_IRQ_LINE   0x3C
+#define PCI_IRQ_PIN    0x3D
+
+#define PCI_CMD_IO     (1u << 0)
+#define PCI_CMD_MEM    (1u << 1)
+#define PCI_CMD_MASTER (1u << 2)
+#define PCI_CMD_INTX_OFF (1u << 10)
+
+#define PCI_STATUS_CAPS  (1u << 4)
+
+#define PCI_CAP_MSI      0x05
+#define PCI_CAP_VENDOR   0x09
+#define PCI_CAP_MSIX     0x11
+
+#define PCI_BAR_IO       (1u << 0)
+#define PCI_BAR_64       (1u << 1)
+#define PCI_BAR_PREFETCH (1u << 2)
+
+typedef struct {
+  uint64_t base;
+  uint64_t size;            // 0: not implemented (or the upper half of a 64-bit BAR)
+  uint8_t  flags;
+} pci_bar_t;
+
+typedef struct {
+  uint8_t   bus, dev, fn;
+  uint8_t   header_type;    // without the multi-function bit
+  uint16_t  vendor, device;
+  uint8_t   class_code, subclass, prog_if, revision;
+  uint8_t   irq_line, irq_pin;
+  pci_bar_t bar[PCI_BAR_COUNT];
+} pci_dev_t;
+
+void pci_init(const rsdp_t* rsdp);
+void pci_dump(void);
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off);
+uint16_t pci_read16(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off);
+uint8_t  pci_read8(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off);
+void     pci_write32(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint32_t v);
+void     pci_write16(uint8_t bus, uint8_t dev, uint8_t fn, uint16_t off, uint16_t v);
+
+uint32_t         pci_count(void);
+const pci_dev_t* pci_get(uint32_t i);
+// The nth match (0-based), in bus/device/function order; 0 when none.
+const pci_dev_t* pci_find(uint16_t vendor, uint16_t device, uint32_t nth);
+const pci_dev_t* pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t nth);
+
+// Config offset of the first capability with this id after `after` (0 to
+// start at the head of the list); 0 when there is none.
+uint8_t pci_find_cap(const pci_dev_t* d, uint8_t cap_id, uint8_t after);
+
+// Sets bits in the command register (PCI_CMD_*).
+void pci_enable(const pci_dev_t* d, uint16_t cmd_bits);
+
+// Clears bus mastering on every function except bridges, so that nothing
+// DMAs into memory the next kernel is about to own.
+void pci_quiesce(void);
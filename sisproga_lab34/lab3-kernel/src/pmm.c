@@ -0,0 +1,225 @@
+#include "pmm.h"
+#include "mb2.h"
+#include "module.h"
+#include "serial.h"
+#include "spinlock.h"
+#include "numa.h"
+
+#define PMM_MAX_RANGES 64
+#define PMM_MAX_HOLES  (3 + MODULE_MAX)
+
+typedef struct {
+  uint64_t base;
+  uint64_t end;
+  uint64_t next;           // next fresh page
+  uint32_t node;
+} range_t;
+
+extern char _kernel_end[];
+
+static range_t  s_ranges[PMM_MAX_RANGES];
+static uint32_t s_range_count;
+static range_t  s_holes[PMM_MAX_HOLES];
+static uint32_t s_hole_count;
+
+static uint64_t s_free_list[NUMA_MAX_NODES];   // freed pages, linked through their first qword
+static uint64_t s_total;
+static uint64_t s_free;
+
+static ticket_lock_t s_lock = TICKET_LOCK_INIT("pmm");
+
+// Highest address + 1 the kernel can touch: 4 GiB without paging, all of
+// RAM under the loader's identity map in the x86-64 build.
+static uint64_t addr_limit(void) {
+  return sizeof(uintptr_t) == 4 ? 0x100000000ull : ~0ull;
+}
+
+static void add_hole(uint64_t base, uint64_t end) {
+  if (s_hole_count < PMM_MAX_HOLES && end > base) {
+    s_holes[s_hole_count].base = base;
+    s_holes[s_hole_count].end  = end;
+    s_hole_count++;
+  }
+}
+
+// Adds [base, end) minus the holes from index `hole` on, page-aligned inward.
+static void add_range(uint64_t base, uint64_t end, uint32_t hole) {
+  for (; hole < s_hole_count; ++hole) {
+    const range_t* h = &s_holes[hole];
+    if (end <= h->base || base >= h->end) continue;
+    if (base < h->base) add_range(base, h->base, hole + 1);
+    base = h->end;
+    if (base >= end) return;
+  }
+
+  base = (base + PMM_PAGE - 1) & ~(uint64_t)(PMM_PAGE - 1);
+  end &= ~(uint64_t)(PMM_PAGE - 1);
+  if (end <= base) return;
+
+  if (s_range_count == PMM_MAX_RANGES) {
+    serial_printf("[PMM][WARN] range table full, dropping %lx-%lx\n", base, end);
+    return;
+  }
+  s_ranges[s_range_count].base = base;
+  s_ranges[s_range_count].end  = end;
+  s_ranges[s_range_count].next = base;
+  s_ranges[s_range_count].node = 0;
+  s_range_count++;
+  s_total += (end - base) >> PMM_PAGE_SHIFT;
+}
+
+void pmm_init(const void* mmap_tag, uintptr_t info, uint32_t info_size) {
+  const mb2_tag_mmap_t* t = (const mb2_tag_mmap_t*)mmap_tag;
+  if (!t || t->entry_size < sizeof(mb2_mmap_entry_t)) {
+    serial_printf("[PMM][ERR] no usable memory map tag\n");
+    return;
+  }
+
+  add_hole(0, 0x100000);
+  add_hole(0x100000, (uintptr_t)_kernel_end);
+  add_hole(info, (uint64_t)info + info_size);
+  for (uint32_t i = 0; i < module_count(); ++i) {
+    const module_t* m = module_get(i);
+    add_hole(m->start, m->end);
+  }
+
+  uint64_t limit = addr_limit();
+  uint32_t n     = (t->tag.size - sizeof(*t)) / t->entry_size;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    const mb2_mmap_entry_t* e = (const mb2_mmap_entry_t*)(t->entries + i * t->entry_size);
+    if (e->type != MB2_MMAP_AVAILABLE || e->base_addr >= limit) continue;
+
+    uint64_t end = e->base_addr + e->length;
+    if (end > limit || end < e->base_addr) end = limit;
+    add_range(e->base_addr, end, 0);
+  }
+
+  s_free = s_total;
+}
+
+static uint32_t node_of(uint64_t addr) {
+  for (uint32_t i = 0; i < s_range_count; ++i) {
+    if (addr >= s_ranges[i].base && addr < s_ranges[i].end) return s_ranges[i].node;
+  }
+  return 0;
+}
+
+// Freed pages first, then fresh ones; PMM_NODE_ANY takes the first it finds.
+// Called with the lock held.
+static uint64_t take(uint32_t node) {
+  for (uint32_t n = 0; n < NUMA_MAX_NODES; ++n) {
+    if (node != PMM_NODE_ANY && n != node) continue;
+    uint64_t page = s_free_list[n];
+    if (page) {
+      s_free_list[n] = *(volatile uint64_t*)(uintptr_t)page;
+      return page;
+    }
+  }
+  for (uint32_t i = 0; i < s_range_count; ++i) {
+    range_t* r = &s_ranges[i];
+    if ((node == PMM_NODE_ANY || r->node == node) && r->next < r->end) {
+      uint64_t page = r->next;
+      r->next += PMM_PAGE;
+      return page;
+    }
+  }
+  return 0;
+}
+
+uint64_t pmm_alloc_near(uint32_t node) {
+  if (node >= NUMA_MAX_NODES) node = PMM_NODE_ANY;
+  uint32_t flags = ticket_lock_irqsave(&s_lock);
+
+  uint64_t page = take(node);
+  if (!page && node != PMM_NODE_ANY) page = take(PMM_NODE_ANY);
+  if (page) s_free--;
+
+  ticket_unlock_irqrestore(&s_lock, flags);
+  return page;
+}
+
+uint64_t pmm_alloc(void) {
+  return pmm_alloc_near(PMM_NODE_ANY);
+}
+
+void pmm_free(uint64_t addr) {
+  if (!addr || (addr & (PMM_PAGE - 1))) return;
+
+  uint32_t flags = ticket_lock_irqsave(&s_lock);
+  uint32_t node = node_of(addr);
+  *(volatile uint64_t*)(uintptr_t)addr = s_free_list[node];
+  s_free_list[node] = addr;
+  s_free++;
+  ticket_unlock_irqrestore(&s_lock, flags);
+}
+
+// Range i becomes [base, at) and [at, end) is inserted after it.
+static int split(uint32_t i, uint64_t at) {
+  if (s_range_count == PMM_MAX_RANGES) {
+    serial_printf("[PMM][WARN] range table full, %lx keeps its node\n", at);
+    return 0;
+  }
+  for (uint32_t j = s_range_count; j > i + 1; --j) s_ranges[j] = s_ranges[j - 1];
+  s_range_count++;
+
+  range_t* lo = &s_ranges[i];
+  range_t* hi = &s_ranges[i + 1];
+  *hi = *lo;
+  hi->base = at;
+  if (hi->next < at) hi->next = at;
+  lo->end = at;
+  if (lo->next > at) lo->next = at;
+  return 1;
+}
+
+void pmm_set_node(uint64_t base, uint64_t end, uint32_t node) {
+  if (node >= NUMA_MAX_NODES) return;
+  base = (base + PMM_PAGE - 1) & ~(uint64_t)(PMM_PAGE - 1);
+  end &= ~(uint64_t)(PMM_PAGE - 1);
+
+  uint32_t flags = ticket_lock_irqsave(&s_lock);
+  for (uint32_t i = 0; i < s_range_count; ++i) {
+    range_t* r = &s_ranges[i];
+    if (end <= r->base || base >= r->end) continue;
+    // The part below `base` keeps its node; the rest is range i + 1.
+    if (base > r->base) {
+      split(i, base);
+      continue;
+    }
+    if (end < r->end && !split(i, end)) continue;
+    s_ranges[i].node = node;
+  }
+
+  // Pages freed before the ranges were labelled may sit on the wrong list.
+  uint64_t all = 0;
+  for (uint32_t n = 0; n < NUMA_MAX_NODES; ++n) {
+    while (s_free_list[n]) {
+      uint64_t page = s_free_list[n];
+      s_free_list[n] = *(volatile uint64_t*)(uintptr_t)page;
+      *(volatile uint64_t*)(uintptr_t)page = all;
+      all = page;
+    }
+  }
+  while (all) {
+    uint64_t page = all;
+    uint32_t n = node_of(page);
+    all = *(volatile uint64_t*)(uintptr_t)page;
+    *(volatile uint64_t*)(uintptr_t)page = s_free_list[n];
+    s_free_list[n] = page;
+  }
+  ticket_unlock_irqrestore(&s_lock, flags);
+}
+
+uint64_t pmm_free_pages(void) {
+  return s_free;
+}
+
+void pmm_dump(void) {
+  for (uint32_t i = 0; i < s_range_count; ++i) {
+    serial_printf("[PMM] %lx-%lx  %lu pages, node %u\n", s_ranges[i].base, s_ranges[i].end,
+                  (s_ranges[i].end - s_ranges[i].base) >> PMM_PAGE_SHIFT, s_ranges[i].node);
+  }
+  serial_printf("[PMM] %u ranges, %lu pages (%lu MiB) usable, %lu free\n",
+                s_range_count, s_total, s_total >> 8, s_free);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+// Physical page allocator over the usable RAM of the MB2 memory map (tag 6).
+// Memory below 1 MiB, the kernel image, the MB2 info block and the boot
+// modules are never handed out, nor is anything the kernel cannot address (above 4 GiB in the
+// i386 build, which runs without paging). Freed pages go on a free list
+// threaded through the pages themselves; fresh ones are carved off the
+// ranges in address order. Safe to call from any CPU.
+//
+// Each range belongs to a NUMA node (0 until numa.c labels them from the
+// SRAT) and each node keeps its own free list, so an allocation can ask
+// for a node and only falls back to the others when that one is empty.
+
+#define PMM_PAGE       4096u
+#define PMM_PAGE_SHIFT 12
+#define PMM_NODE_ANY   0xFFFFFFFFu
+
+void     pmm_init(const void* mmap_tag, uintptr_t info, uint32_t info_size);
+uint64_t pmm_alloc(void);         // 0 when out of memory
+// A page from `node` if it has one, from any node otherwise.
+uint64_t pmm_alloc_near(uint32_t node);
+void     pmm_free(uint64_t addr);
+// Labels [base, end) as belonging to `node`, splitting ranges as needed.
+void     pmm_set_node(uint64_t base, uint64_t end, uint32_t node);
+uint64_t pmm_free_pages(void);
+void     pmm_dump(void);
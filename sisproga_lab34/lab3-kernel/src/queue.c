@@ -0,0 +1,86 @@
+#include "queue.h"
+
+// ---- SPSC ------------------------------------------------------------------
+
+void spsc_init(spsc_t* q, qmsg_t* slots, uint32_t size) {
+  q->prod.head       = 0;
+  q->prod.tail_cache = 0;
+  q->cons.tail       = 0;
+  q->cons.head_cache = 0;
+  q->slots = slots;
+  q->mask  = size - 1;
+}
+
+int spsc_push(spsc_t* q, qmsg_t m) {
+  uint32_t head = q->prod.head;
+  if (head - q->prod.tail_cache > q->mask) {
+    q->prod.tail_cache = __atomic_load_n(&q->cons.tail, __ATOMIC_ACQUIRE);
+    if (head - q->prod.tail_cache > q->mask) return -1;
+  }
+  q->slots[head & q->mask] = m;
+  __atomic_store_n(&q->prod.head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int spsc_pop(spsc_t* q, qmsg_t* out) {
+  uint32_t tail = q->cons.tail;
+  if (tail == q->cons.head_cache) {
+    q->cons.head_cache = __atomic_load_n(&q->prod.head, __ATOMIC_ACQUIRE);
+    if (tail == q->cons.head_cache) return -1;
+  }
+  *out = q->slots[tail & q->mask];
+  __atomic_store_n(&q->cons.tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// ---- MPMC ------------------------------------------------------------------
+
+// Cell i starts with seq i (free for the push at position i). A push at
+// pos publishes seq pos + 1 (full for the pop at pos); that pop hands the
+// cell back with seq pos + size, free for the push one lap later.
+
+void mpmc_init(mpmc_t* q, mpmc_cell_t* cells, uint32_t size) {
+  for (uint32_t i = 0; i < size; ++i) cells[i].seq = i;
+  q->cells = cells;
+  q->mask  = size - 1;
+  q->enq   = 0;
+  q->deq   = 0;
+}
+
+int mpmc_push(mpmc_t* q, qmsg_t m) {
+  uint32_t pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+  mpmc_cell_t* c;
+  for (;;) {
+    c = &q->cells[pos & q->mask];
+    int32_t diff = (int32_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->enq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    }
+  }
+  c->msg = m;
+  __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int mpmc_pop(mpmc_t* q, qmsg_t* out) {
+  uint32_t pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+  mpmc_cell_t* c;
+  for (;;) {
+    c = &q->cells[pos & q->mask];
+    int32_t diff = (int32_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    }
+  }
+  *out = c->msg;
+  __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+
+// Bounded lock-free queues of two-word messages over caller-provided
+// storage whose size is a power of two. The indices each side writes sit
+// on their own cache lines.
+//
+// spsc_t: one producer CPU and one consumer CPU. Each side keeps a cached
+// copy of the other's index and only rereads it when the cached one says
+// full (or empty), so a steady stream costs one shared-line miss per batch
+// instead of one per message.
+//
+// mpmc_t: any number of producers and consumers (Vyukov's bounded queue).
+// Every cell carries a sequence number that tells whose turn it is, so a
+// push or pop is one CAS on the shared index plus the cell itself, and
+// neither side ever waits for another in the middle of an operation.
+
+typedef struct {
+  uintptr_t w0;
+  uintptr_t w1;
+} qmsg_t;
+
+typedef struct {
+  struct {
+    volatile uint32_t head;     // next slot to write
+    uint32_t          tail_cache;
+  } __attribute__((aligned(64))) prod;
+  struct {
+    volatile uint32_t tail;     // next slot to read
+    uint32_t          head_cache;
+  } __attribute__((aligned(64))) cons;
+  qmsg_t*  slots;
+  uint32_t mask;
+} __attribute__((aligned(64))) spsc_t;
+
+typedef struct {
+  volatile uint32_t seq;
+  qmsg_t            msg;
+} mpmc_cell_t;
+
+typedef struct {
+  mpmc_cell_t* cells;
+  uint32_t     mask;
+  volatile uint32_t enq __attribute__((aligned(64)));
+  volatile uint32_t deq __attribute__((aligned(64)));
+} __attribute__((aligned(64))) mpmc_t;
+
+void spsc_init(spsc_t* q, qmsg_t* slots, uint32_t size);
+int  spsc_push(spsc_t* q, qmsg_t m);          // 0, or -1 when full
+int  spsc_pop(spsc_t* q, qmsg_t* out);        // 0, or -1 when empty
+
+void mpmc_init(mpmc_t* q, mpmc_cell_t* cells, uint32_t size);
+int  mpmc_push(mpmc_t* q, qmsg_t m);          // 0, or -1 when full
+int  mpmc_pop(mpmc_t* q, qmsg_t* out);        // 0, or -1 when empty
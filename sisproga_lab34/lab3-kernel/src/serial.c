@@ -1,15 +1,41 @@
 #include "serial.h"
+#include "cpu.h"
+#include "idt.h"
+#include "spinlock.h"
+#include "hist.h"
+#include "mini_printf.h"
 
-static inline void outb(uint16_t port, uint8_t val) {
-  __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
-}
-static inline uint8_t inb(uint16_t port) {
-  uint8_t ret;
-  __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
-  return ret;
+#define COM1 0x3F8
+
+#define LSR_DATA  0x01
+#define IER_RX    0x01
+#define RX_RING   256u      // power of two
+
+// One lock for the whole sink: every public writer holds it for the full
+// string so that lines from different CPUs do not interleave mid-message.
+static ticket_lock_t s_lock = TICKET_LOCK_INIT("serial");
+static serial_tap_t  s_tap;
+
+// Output bound for the tap is collected per call and handed over in pieces
+// of up to this many bytes, still under the serial lock, so the tap sees
+// the same interleaving as the UART.
+#define TAP_CHUNK 128
+
+typedef struct {
+  char     buf[TAP_CHUNK];
+  uint32_t n;
+} tap_buf_t;
+
+static void tap_flush(tap_buf_t* t) {
+  if (t->n && s_tap) s_tap(t->buf, t->n);
+  t->n = 0;
 }
 
-#define COM1 0x3F8
+static void tap_put(tap_buf_t* t, char c) {
+  if (!s_tap) return;
+  t->buf[t->n++] = c;
+  if (t->n == TAP_CHUNK) tap_flush(t);
+}
 
 void serial_init(void) {
   outb(COM1 + 1, 0x00);
@@ -22,37 +48,165 @@ void serial_init(void) {
   (void)inb(COM1);
 }
 
+// ---- receive -----------------------------------------------------------------
+
+static volatile uint8_t  s_rx[RX_RING];
+static volatile uint32_t s_rx_head, s_rx_tail;
+static uint32_t          s_rx_irqs, s_rx_dropped;
+
+// Moves whatever the FIFO holds into the ring; interrupts off.
+static void rx_drain(void) {
+  while (inb(COM1 + 5) & LSR_DATA) {
+    uint8_t c = inb(COM1);
+    if (s_rx_head - s_rx_tail < RX_RING) s_rx[s_rx_head++ & (RX_RING - 1)] = c;
+    else s_rx_dropped++;
+  }
+}
+
+static void rx_isr(isr_frame_t* f) {
+  (void)f;
+  s_rx_irqs++;
+  rx_drain();
+}
+
+void serial_rx_enable(uint8_t vector) {
+  idt_set_handler(vector, rx_isr);
+  uint32_t f = irq_save();
+  rx_drain();
+  outb(COM1 + 1, IER_RX);
+  irq_restore(f);
+}
+
+int serial_getc(void) {
+  uint32_t f = irq_save();
+  rx_drain();
+  int c = -1;
+  if (s_rx_tail != s_rx_head) c = s_rx[s_rx_tail++ & (RX_RING - 1)];
+  irq_restore(f);
+  return c;
+}
+
+int serial_rx_pending(void) {
+  uint32_t f = irq_save();
+  rx_drain();
+  int n = s_rx_tail != s_rx_head;
+  irq_restore(f);
+  return n;
+}
+
+void serial_rx_stats(uint32_t* irqs, uint32_t* dropped) {
+  *irqs    = s_rx_irqs;
+  *dropped = s_rx_dropped;
+}
+
+// ---- transmit ----------------------------------------------------------------
+
+// Cycles each byte waited for room in the transmit FIFO. Every byte goes
+// out under s_lock, which already serializes the writers, so they all
+// share slot 0 instead of looking up their CPU per byte.
+static hist_t s_tx_wait = HIST_INIT("serial_tx_wait");
+
 static int tx_ready(void) {
   return (inb(COM1 + 5) & 0x20) != 0;
 }
 
-void serial_putc(char c) {
+static void putc_raw(char c) {
+  uint64_t t0 = rdtsc();
   while (!tx_ready()) { }
+  hist_record_cpu(&s_tx_wait, 0, rdtsc() - t0);
   outb(COM1, (uint8_t)c);
 }
 
-void serial_write(const char* s) {
+static void put_tapped(tap_buf_t* t, char c) {
+  putc_raw(c);
+  tap_put(t, c);
+}
+
+static void write_raw(tap_buf_t* t, const char* s) {
   while (*s) {
-    if (*s == '\n') serial_putc('\r');
-    serial_putc(*s++);
+    if (*s == '\n') putc_raw('\r');
+    put_tapped(t, *s++);
   }
 }
 
+void serial_set_tap(serial_tap_t tap) {
+  uint32_t f = ticket_lock_irqsave(&s_lock);
+  s_tap = tap;
+  ticket_unlock_irqrestore(&s_lock, f);
+}
+
+void serial_putc(char c) {
+  tap_buf_t t = { .n = 0 };
+  uint32_t f = ticket_lock_irqsave(&s_lock);
+  put_tapped(&t, c);
+  tap_flush(&t);
+  ticket_unlock_irqrestore(&s_lock, f);
+}
+
+void serial_write(const char* s) {
+  tap_buf_t t = { .n = 0 };
+  uint32_t f = ticket_lock_irqsave(&s_lock);
+  write_raw(&t, s);
+  tap_flush(&t);
+  ticket_unlock_irqrestore(&s_lock, f);
+}
+
 static char hex_digit(uint8_t v) {
   return (v < 10) ? (char)('0' + v) : (char)('A' + (v - 10));
 }
 
 void serial_write_hex32(uint32_t v) {
-  serial_write("0x");
+  tap_buf_t t = { .n = 0 };
+  uint32_t f = ticket_lock_irqsave(&s_lock);
+  write_raw(&t, "0x");
   for (int i = 7; i >= 0; --i) {
     uint8_t n = (v >> (i * 4)) & 0xF;
-    serial_putc(hex_digit(n));
+    put_tapped(&t, hex_digit(n));
   }
+  tap_flush(&t);
+  ticket_unlock_irqrestore(&s_lock, f);
 }
 void serial_write_hex64(uint64_t v) {
-  serial_write("0x");
+  tap_buf_t t = { .n = 0 };
+  uint32_t f = ticket_lock_irqsave(&s_lock);
+  write_raw(&t, "0x");
   for (int i = 15; i >= 0; --i) {
     uint8_t n = (v >> (i * 4)) & 0xF;
-    serial_putc(hex_digit(n));
+    put_tapped(&t, hex_digit(n));
+  }
+  tap_flush(&t);
+  ticket_unlock_irqrestore(&s_lock, f);
+}
+
+static void panic_putc(char c, void* ctx) {
+  (void)ctx;
+  if (c == '\n') {
+    while (!tx_ready()) { }
+    outb(COM1, '\r');
   }
+  while (!tx_ready()) { }
+  outb(COM1, (uint8_t)c);
+}
+
+void serial_panic_printf(const char* fmt, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(ap, fmt);
+  mini_vprintf(panic_putc, 0, fmt, ap);
+  __builtin_va_end(ap);
+}
+
+static void printf_putc(char c, void* ctx) {
+  if (c == '\n') putc_raw('\r');
+  put_tapped((tap_buf_t*)ctx, c);
+}
+
+void serial_printf(const char* fmt, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(ap, fmt);
+  tap_buf_t t = { .n = 0 };
+  uint32_t f = ticket_lock_irqsave(&s_lock);
+  mini_vprintf(printf_putc, &t, fmt, ap);
+  tap_flush(&t);
+  ticket_unlock_irqrestore(&s_lock, f);
+  __builtin_va_end(ap);
 }
@@ -6,3 +6,22 @@ void serial_putc(char c);
 void serial_write(const char* s);
 void serial_write_hex32(uint32_t v);
 void serial_write_hex64(uint64_t v);
+void serial_printf(const char* fmt, ...);
+// Straight to the UART without the serial lock, the tap or the TX histogram,
+// for fatal paths: the code that faulted may hold the lock on this CPU or
+// be the tap itself. Can interleave with another CPU's output.
+void serial_panic_printf(const char* fmt, ...);
+
+// Receive side: a ring filled from the UART, by the IRQ handler once
+// serial_rx_enable() has turned on the receive interrupt for `vector`, and
+// by serial_getc() itself (so polling works without an interrupt).
+// One reader at a time.
+void serial_rx_enable(uint8_t vector);
+int  serial_getc(void);               // -1 when nothing is waiting
+int  serial_rx_pending(void);
+void serial_rx_stats(uint32_t* irqs, uint32_t* dropped);
+
+// Copy of everything written, without the CR the UART gets before each LF.
+// Called with the serial lock held, so the tap must not print.
+typedef void (*serial_tap_t)(const char* s, uint32_t len);
+void serial_set_tap(serial_tap_t tap);
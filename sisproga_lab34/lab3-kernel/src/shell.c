@@ -0,0 +1,328 @@
+#include "shell.h"
+#include "serial.h"
+#include "idt.h"
+#include "idle.h"
+#include "ioapic.h"
+#include "smp.h"
+#include "numa.h"
+#include "pmm.h"
+#include "timeline.h"
+#include "spinlock.h"
+#include "hist.h"
+#include "blk.h"
+#include "bcache.h"
+#include "tsc.h"
+#include "cpu.h"
+#include "util.h"
+#include "param.h"
+
+#define LINE_MAX  128
+#define HISTORY   8         // power of two
+#define PROMPT    "lab3> "
+#define COM1_IRQ  4
+
+typedef struct {
+  const char* name;
+  const char* help;
+  shell_fn_t  fn;
+} shell_cmd_t;
+
+typedef struct {
+  char     buf[LINE_MAX];
+  uint32_t len;
+} line_t;
+
+static shell_cmd_t   s_cmds[SHELL_MAX_CMDS];
+static uint32_t      s_ncmds;
+static const rsdp_t* s_rsdp;
+static fb_t*         s_fb;
+static int           s_irq;               // receive interrupt routed to the BSP
+
+// Line i of the session is in s_hist[i % HISTORY] while i >= s_nhist - HISTORY.
+static char          s_hist[HISTORY][LINE_MAX];
+static uint32_t      s_nhist;
+
+void shell_register(const char* name, const char* help, shell_fn_t fn) {
+  for (uint32_t i = 0; i < s_ncmds; ++i) {
+    if (streq(s_cmds[i].name, name)) {
+      s_cmds[i].help = help;
+      s_cmds[i].fn   = fn;
+      return;
+    }
+  }
+  if (s_ncmds == SHELL_MAX_CMDS) {
+    serial_printf("[SHELL][WARN] command table full, '%s' dropped\n", name);
+    return;
+  }
+  s_cmds[s_ncmds].name = name;
+  s_cmds[s_ncmds].help = help;
+  s_cmds[s_ncmds].fn   = fn;
+  s_ncmds++;
+}
+
+// ---- input -------------------------------------------------------------------
+
+// Sleeps with interrupts off between the check and idle_wait()'s sti;hlt,
+// so a key that arrives in between still wakes us.
+static int wait_key(void) {
+  for (;;) {
+    int c = serial_getc();
+    if (c >= 0) return c;
+    uint32_t cpu = smp_cpu_id();
+    uint32_t tok = idle_token(cpu);
+    if (smp_poll(cpu)) continue;
+    if (!s_irq) {
+      cpu_pause();
+      continue;
+    }
+    uint32_t f = irq_save();
+    if (!serial_rx_pending()) idle_wait(cpu, tok);
+    irq_restore(f);
+  }
+}
+
+static void erase(line_t* l, uint32_t n) {
+  while (n-- && l->len) {
+    l->buf[--l->len] = 0;
+    serial_write("\b \b");
+  }
+}
+
+static void set_line(line_t* l, const char* s) {
+  erase(l, l->len);
+  while (*s && l->len < LINE_MAX - 1) l->buf[l->len++] = *s++;
+  l->buf[l->len] = 0;
+  serial_write(l->buf);
+}
+
+static void kill_word(line_t* l) {
+  uint32_t n = 0;
+  while (n < l->len && l->buf[l->len - 1 - n] == ' ') n++;
+  while (n < l->len && l->buf[l->len - 1 - n] != ' ') n++;
+  erase(l, n);
+}
+
+static void read_line(line_t* l) {
+  static int last_cr;
+  uint32_t hist = s_nhist;                    // == s_nhist: the line being typed
+  uint32_t oldest = s_nhist > HISTORY ? s_nhist - HISTORY : 0;
+  int esc = 0;
+
+  l->len = 0;
+  l->buf[0] = 0;
+  serial_write(PROMPT);
+
+  for (;;) {
+    int c = wait_key();
+    int cr = c == '\r';
+    if (c == '\n' && last_cr) {
+      last_cr = 0;
+      continue;
+    }
+    last_cr = cr;
+
+    if (esc == 1) {
+      esc = c == '[' ? 2 : 0;
+      continue;
+    }
+    if (esc == 2) {
+      esc = 0;
+      if (c == 'A' && hist > oldest) {
+        set_line(l, s_hist[--hist & (HISTORY - 1)]);
+      } else if (c == 'B' && hist < s_nhist) {
+        ++hist;
+        set_line(l, hist == s_nhist ? "" : s_hist[hist & (HISTORY - 1)]);
+      }
+      continue;
+    }
+
+    switch (c) {
+    case '\r':
+    case '\n':
+      serial_write("\n");
+      return;
+    case 0x08:
+    case 0x7F:
+      erase(l, 1);
+      break;
+    case 0x15:                                // ^U
+      erase(l, l->len);
+      break;
+    case 0x17:                                // ^W
+      kill_word(l);
+      break;
+    case 0x03:                                // ^C
+      serial_write("^C\n");
+      l->len = 0;
+      l->buf[0] = 0;
+      return;
+    case 0x0C:                                // ^L
+      serial_write("\x1b[2J\x1b[H" PROMPT);
+      serial_write(l->buf);
+      break;
+    case 0x1B:
+      esc = 1;
+      break;
+    default:
+      if (c >= 0x20 && c < 0x7F && l->len < LINE_MAX - 1) {
+        l->buf[l->len++] = (char)c;
+        l->buf[l->len] = 0;
+        serial_putc((char)c);
+      }
+      break;
+    }
+  }
+}
+
+static void remember(const line_t* l) {
+  if (s_nhist && streq(s_hist[(s_nhist - 1) & (HISTORY - 1)], l->buf)) return;
+  char* h = s_hist[s_nhist & (HISTORY - 1)];
+  for (uint32_t i = 0; i <= l->len; ++i) h[i] = l->buf[i];
+  s_nhist++;
+}
+
+static int split(char* s, char** argv) {
+  int argc = 0;
+  for (;;) {
+    while (*s == ' ') *s++ = 0;
+    if (!*s || argc == SHELL_MAX_ARGS) return argc;
+    argv[argc++] = s;
+    while (*s && *s != ' ') s++;
+  }
+}
+
+static void execute(line_t* l) {
+  char* argv[SHELL_MAX_ARGS];
+  int argc = split(l->buf, argv);
+  if (!argc) return;
+
+  for (uint32_t i = 0; i < s_ncmds; ++i) {
+    if (streq(s_cmds[i].name, argv[0])) {
+      s_cmds[i].fn(argc, argv);
+      return;
+    }
+  }
+  serial_printf("%s: unknown command, try 'help'\n", argv[0]);
+}
+
+// ---- built-in commands -------------------------------------------------------
+
+static void cmd_help(int argc, char** argv) {
+  (void)argc; (void)argv;
+  for (uint32_t i = 0; i < s_ncmds; ++i) serial_printf("  %s - %s\n", s_cmds[i].name, s_cmds[i].help);
+}
+
+static void cmd_cpus(int argc, char** argv) {
+  (void)argc; (void)argv;
+  serial_printf("[SHELL] %u cpus in the MADT, %u online, %u NUMA nodes\n",
+                g_cpu_count, g_cpus_online, numa_node_count());
+  for (uint32_t i = 0; i < g_cpu_count; ++i) {
+    const smp_cpu_t* c = &g_cpus[i];
+    serial_printf("[SHELL] cpu%u: acpi id %u, apic id %u, node %u%s%s\n", i, (uint32_t)c->acpi_id,
+                  (uint32_t)c->apic_id, (uint32_t)c->node, i == 0 ? ", BSP" : "",
+                  c->online ? "" : ", offline");
+  }
+  ioapic_dump();
+}
+
+static void cmd_acpi(int argc, char** argv) {
+  (void)argc; (void)argv;
+  if (!s_rsdp) {
+    serial_printf("[SHELL] no RSDP\n");
+    return;
+  }
+  acpi_list_tables(s_rsdp);
+}
+
+static void cmd_mem(int argc, char** argv) {
+  (void)argc; (void)argv;
+  pmm_dump();
+}
+
+static void cmd_fb(int argc, char** argv) {
+  (void)argc; (void)argv;
+  if (!s_fb) {
+    serial_printf("[SHELL] no framebuffer\n");
+    return;
+  }
+  serial_printf("[SHELL] fb %lx: %ux%u, pitch %u, %u bpp, backend %s\n",
+                (uint64_t)(uintptr_t)s_fb->base, s_fb->width, s_fb->height, s_fb->pitch,
+                (uint32_t)s_fb->bpp, s_fb->ops->name);
+  if (s_fb->is_rgb) {
+    serial_printf("[SHELL] fb red %u:%u green %u:%u blue %u:%u\n",
+                  (uint32_t)s_fb->rpos, (uint32_t)s_fb->rsize, (uint32_t)s_fb->gpos,
+                  (uint32_t)s_fb->gsize, (uint32_t)s_fb->bpos, (uint32_t)s_fb->bsize);
+  }
+  fb_bench_blit(s_fb);
+}
+
+static void cmd_perf(int argc, char** argv) {
+  timeline_dump();
+  idle_dump();
+  lock_stats_dump(argc > 1 ? argv[1] : 0);
+  hist_dump(0);
+  if (blk_count()) {
+    bcache_stats_t st;
+    bcache_get_stats(&st);
+    serial_printf("[BCACHE] hits %lu (read-ahead %lu, in flight %lu), misses %lu, read-ahead issued %lu\n",
+                  st.hits, st.ra_hits, st.waits, st.misses, st.ra_issued);
+  }
+  uint32_t irqs, dropped;
+  serial_rx_stats(&irqs, &dropped);
+  serial_printf("[SHELL] rx interrupts %u, bytes dropped %u\n", irqs, dropped);
+}
+
+static void cmd_params(int argc, char** argv) {
+  (void)argc; (void)argv;
+  param_dump();
+}
+
+// PCI reset control register first, then the keyboard controller's reset
+// line, and a triple fault when neither takes.
+static void cmd_reset(int argc, char** argv) {
+  (void)argc; (void)argv;
+  serial_printf("[SHELL] reset\n");
+  outb(0xCF9, 0x02);
+  outb(0xCF9, 0x06);
+  tsc_delay_us(100000);
+
+  for (uint32_t i = 0; i < 100000 && (inb(0x64) & 0x02); ++i) cpu_pause();
+  outb(0x64, 0xFE);
+  tsc_delay_us(100000);
+
+  serial_printf("[SHELL][WARN] 0xCF9 and the 8042 did not reset, triple faulting\n");
+  struct __attribute__((packed)) { uint16_t limit; uintptr_t base; } none = { 0, 0 };
+  __asm__ volatile ("cli; lidt %0; int3" : : "m"(none));
+}
+
+void shell_init(const rsdp_t* rsdp, fb_t* fb) {
+  s_rsdp = rsdp;
+  s_fb   = fb;
+
+  shell_register("help",  "list commands", cmd_help);
+  shell_register("cpus",  "CPUs and I/O APICs from the MADT", cmd_cpus);
+  shell_register("acpi",  "ACPI tables", cmd_acpi);
+  shell_register("mem",   "physical memory ranges and free pages", cmd_mem);
+  shell_register("fb",    "framebuffer mode and blit benchmark", cmd_fb);
+  shell_register("perf",  "boot timeline, idle, lock [name], latency histograms and cache counters", cmd_perf);
+  shell_register("params", "kernel command line and parameter values", cmd_params);
+  shell_register("reset", "reboot the machine", cmd_reset);
+
+  if (ioapic_route_isa(COM1_IRQ, IDT_VEC_COM1, g_cpus[0].apic_id) == 0) {
+    serial_rx_enable(IDT_VEC_COM1);
+    s_irq = 1;
+  }
+}
+
+void shell_run(void) {
+  static line_t line;
+
+  serial_printf("[SHELL] COM1 shell (%s), 'help' lists commands\n",
+                s_irq ? "receive interrupt" : "polling");
+  for (;;) {
+    read_line(&line);
+    if (!line.len) continue;
+    remember(&line);
+    execute(&line);
+  }
+}
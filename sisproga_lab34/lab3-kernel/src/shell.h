@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include "acpi.h"
+#include "fb.h"
+
+// Debug shell on COM1, run by the BSP once boot is done. Input comes from
+// the UART receive interrupt (ISA IRQ 4 routed through the I/O APIC) and
+// the BSP sleeps in idle_wait() between keys; without an I/O APIC the
+// shell polls. The line editor handles backspace, ^U (kill line), ^W
+// (kill word), ^C (drop line), ^L (redraw) and up/down through the last
+// few lines.
+
+#define SHELL_MAX_CMDS 32
+#define SHELL_MAX_ARGS 8
+
+typedef void (*shell_fn_t)(int argc, char** argv);
+
+// name and help must stay valid; later registrations of a name win.
+void shell_register(const char* name, const char* help, shell_fn_t fn);
+
+// rsdp and fb are what the built-in commands report on; fb may be 0.
+void shell_init(const rsdp_t* rsdp, fb_t* fb);
+__attribute__((noreturn)) void shell_run(void);
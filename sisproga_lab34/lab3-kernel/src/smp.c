@@ -0,0 +1,194 @@
+#include "smp.h"
+#include "lapic.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "serial.h"
+#include "idt.h"
+#include "idle.h"
+#include "numa.h"
+#include "param.h"
+
+#define AP_TRAMP_BASE   0x8000u
+#define AP_STACK_SIZE   16384u
+#define AP_BOOT_TIMEOUT_US 200000u
+
+extern uint8_t  ap_tramp_start[];
+extern uint8_t  ap_tramp_end[];
+extern uint32_t ap_tramp_stack;
+extern uint32_t ap_tramp_cpu;
+extern uint32_t ap_tramp_entry;
+
+smp_cpu_t g_cpus[SMP_MAX_CPUS];
+uint32_t  g_cpu_count = 0;
+uint32_t  g_cpus_online = 0;
+
+static uint8_t s_ap_stacks[SMP_MAX_CPUS][AP_STACK_SIZE] __attribute__((aligned(16)));
+
+// One work slot per CPU; an AP runs the slot when its generation changes.
+typedef struct {
+  volatile smp_fn_t fn;
+  void* volatile    arg;
+  volatile uint32_t gen;
+} __attribute__((aligned(64))) smp_slot_t;
+
+static smp_slot_t        s_slots[SMP_MAX_CPUS];
+static volatile uint32_t s_run_done = 0;
+
+#define TRAMP_VAR(sym) (*(volatile uint32_t*)(uintptr_t)(AP_TRAMP_BASE + \
+                        ((uint8_t*)&(sym) - ap_tramp_start)))
+
+static void collect_cpus(const madt_t* madt) {
+  uint32_t lapic_base = madt->local_apic_addr;
+  uint32_t off = (uint32_t)sizeof(madt_t);
+
+  while (off + 2 <= madt->hdr.length) {
+    const uint8_t* e = ((const uint8_t*)madt) + off;
+    uint8_t type = e[0];
+    uint8_t len  = e[1];
+    if (len < 2 || off + len > madt->hdr.length) break;
+
+    if (type == 0 && len >= 8) {
+      uint32_t flags = *(const uint32_t*)(e + 4);
+      if ((flags & 1u) && g_cpu_count < SMP_MAX_CPUS) {
+        g_cpus[g_cpu_count].acpi_id = e[2];
+        g_cpus[g_cpu_count].apic_id = e[3];
+        g_cpus[g_cpu_count].online  = 0;
+        g_cpus[g_cpu_count].node    = (uint8_t)numa_node_of_apic(e[3]);
+        g_cpu_count++;
+      }
+    } else if (type == 5 && len >= 12) {
+      uint64_t a = *(const uint64_t*)(e + 4);
+      if (a < 0x100000000ull) lapic_base = (uint32_t)a;
+    }
+    off += len;
+  }
+
+  lapic_init(lapic_base);
+}
+
+uint32_t smp_cpu_id(void) {
+  uint32_t id = lapic_id();
+  for (uint32_t i = 0; i < g_cpu_count; i++) {
+    if (g_cpus[i].apic_id == id) return i;
+  }
+  return 0;
+}
+
+static void ap_main(uint32_t cpu) {
+  cpu_init();
+  idt_load();
+  lapic_enable();
+
+  uint32_t seen = s_slots[cpu].gen;
+  __atomic_store_n(&g_cpus[cpu].online, 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&g_cpus_online, 1, __ATOMIC_SEQ_CST);
+
+  for (;;) {
+    uint32_t tok = idle_token(cpu);
+    if (smp_poll(cpu)) continue;
+    if (s_slots[cpu].gen == seen) {
+      idle_wait(cpu, tok);
+      continue;
+    }
+    seen = s_slots[cpu].gen;
+    s_slots[cpu].fn(cpu, s_slots[cpu].arg);
+    __atomic_fetch_add(&s_run_done, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static int boot_ap(uint32_t cpu) {
+  TRAMP_VAR(ap_tramp_stack) = (uint32_t)(uintptr_t)(s_ap_stacks[cpu] + AP_STACK_SIZE);
+  TRAMP_VAR(ap_tramp_cpu)   = cpu;
+  TRAMP_VAR(ap_tramp_entry) = (uint32_t)(uintptr_t)ap_main;
+
+  uint32_t apic = g_cpus[cpu].apic_id;
+  lapic_send_ipi(apic, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+  tsc_delay_us(10000);
+  for (int i = 0; i < 2; i++) {
+    lapic_send_ipi(apic, LAPIC_ICR_STARTUP | (AP_TRAMP_BASE >> 12));
+    tsc_delay_us(200);
+    if (__atomic_load_n(&g_cpus[cpu].online, __ATOMIC_ACQUIRE)) return 1;
+  }
+
+  uint64_t deadline = rdtsc() + (uint64_t)g_tsc_khz * (AP_BOOT_TIMEOUT_US / 1000u);
+  while (rdtsc() < deadline) {
+    if (__atomic_load_n(&g_cpus[cpu].online, __ATOMIC_ACQUIRE)) return 1;
+    cpu_pause();
+  }
+  return 0;
+}
+
+void smp_init(const madt_t* madt) {
+  g_cpu_count = 0;
+  collect_cpus(madt);
+
+  if (!(g_cpu_features & CPU_FEAT_APIC) || g_cpu_count == 0) {
+    g_cpus[0].apic_id = 0;
+    g_cpus[0].online  = 1;
+    g_cpus[0].node    = (uint8_t)numa_this_node();
+    g_cpu_count = g_cpus_online = 1;
+    serial_printf("[SMP] no usable LAPIC, running on the BSP only\n");
+    return;
+  }
+
+  lapic_enable();
+
+  // Put the BSP first so that CPU 0 is always the caller of smp_run().
+  uint32_t bsp = lapic_id();
+  for (uint32_t i = 1; i < g_cpu_count; i++) {
+    if (g_cpus[i].apic_id == bsp) {
+      smp_cpu_t t = g_cpus[0]; g_cpus[0] = g_cpus[i]; g_cpus[i] = t;
+      break;
+    }
+  }
+  g_cpus[0].online = 1;
+  g_cpus_online = 1;
+
+  uint32_t tramp_size = (uint32_t)(ap_tramp_end - ap_tramp_start);
+  uint8_t* dst = (uint8_t*)(uintptr_t)AP_TRAMP_BASE;
+  for (uint32_t i = 0; i < tramp_size; i++) dst[i] = ap_tramp_start[i];
+
+  for (uint32_t i = 1; i < g_cpu_count; i++) {
+    if (g_smp_maxcpus && i >= g_smp_maxcpus) {
+      serial_printf("[SMP] cpu%u apic_id=%u left offline (smp.maxcpus=%u)\n", i,
+                    (uint32_t)g_cpus[i].apic_id, g_smp_maxcpus);
+      continue;
+    }
+    int ok = boot_ap(i);
+    serial_printf("[SMP] cpu%u apic_id=%u acpi_id=%u node %u %s\n", i,
+                  (uint32_t)g_cpus[i].apic_id, (uint32_t)g_cpus[i].acpi_id, (uint32_t)g_cpus[i].node,
+                  ok ? "online" : "FAILED to start");
+  }
+  serial_printf("[SMP] %u/%u CPUs online (BSP apic_id=%u)\n",
+                g_cpus_online, g_cpu_count, bsp);
+}
+
+void smp_stop_aps(void) {
+  for (uint32_t i = 1; i < g_cpu_count; i++) {
+    if (!g_cpus[i].online) continue;
+    lapic_send_ipi(g_cpus[i].apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    g_cpus[i].online = 0;
+  }
+  tsc_delay_us(10000);
+  g_cpus_online = 1;
+}
+
+void smp_run(uint32_t ncpus, smp_fn_t fn, void* arg) {
+  if (ncpus == 0) ncpus = 1;
+  if (ncpus > g_cpu_count) ncpus = g_cpu_count;
+
+  uint32_t started = 0;
+  __atomic_store_n(&s_run_done, 0, __ATOMIC_SEQ_CST);
+  for (uint32_t i = 1; i < ncpus; i++) {
+    if (!g_cpus[i].online) continue;
+    s_slots[i].fn  = fn;
+    s_slots[i].arg = arg;
+    __atomic_fetch_add(&s_slots[i].gen, 1, __ATOMIC_RELEASE);
+    idle_kick(i);
+    started++;
+  }
+
+  fn(0, arg);
+
+  while (__atomic_load_n(&s_run_done, __ATOMIC_ACQUIRE) != started) cpu_pause();
+}
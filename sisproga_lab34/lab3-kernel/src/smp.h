@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include "acpi.h"
+
+#define SMP_MAX_CPUS 16
+
+typedef struct {
+  uint8_t acpi_id;
+  uint8_t apic_id;
+  uint8_t online;
+  uint8_t node;             // NUMA node, from numa_init()
+} smp_cpu_t;
+
+typedef void (*smp_fn_t)(uint32_t cpu, void* arg);
+
+// g_cpus[0] is always the BSP; the rest follow MADT order.
+extern smp_cpu_t g_cpus[SMP_MAX_CPUS];
+extern uint32_t  g_cpu_count;
+extern uint32_t  g_cpus_online;
+
+void     smp_init(const madt_t* madt);
+uint32_t smp_cpu_id(void);
+
+// Run fn on CPUs 0..ncpus-1 (the caller is CPU 0) and wait for all of them.
+void     smp_run(uint32_t ncpus, smp_fn_t fn, void* arg);
+// Puts every AP back into wait-for-SIPI with an INIT IPI (BSP only).
+void     smp_stop_aps(void);
+
+// Cross-CPU calls (smp_call.c): every CPU has a bounded MPMC mailbox that
+// it drains with smp_poll() from its idle loop. smp_call() queues fn(cpu,
+// arg) for `cpu` and wakes it through idle_kick(), which is a store to the
+// MWAIT line or, for a CPU asleep in hlt, an IPI; a target that already
+// has a wakeup outstanding is not woken again. Calls run in the order they
+// were queued, on the target's next pass through its idle loop.
+void     smp_call_init(void);
+int      smp_call(uint32_t cpu, smp_fn_t fn, void* arg);     // 0, or -1 (offline or full)
+int      smp_call_sync(uint32_t cpu, smp_fn_t fn, void* arg);
+uint32_t smp_poll(uint32_t cpu);                              // calls run
+void     smp_call_stats(uint32_t cpu, uint32_t* calls, uint32_t* wakes, uint32_t* ipis);
+
+// Ping-pong latency and queue throughput between every pair of CPUs, and
+// the round trip of smp_call_sync() to an idle CPU (ipc_bench.c).
+void     ipc_bench(void);
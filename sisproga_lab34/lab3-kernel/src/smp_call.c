@@ -0,0 +1,91 @@
+#include "smp.h"
+#include "queue.h"
+#include "idle.h"
+#include "cpu.h"
+#include "serial.h"
+
+#define MAILBOX_SIZE 64u
+
+// pending is set by the sender that finds it clear, which is then the one
+// to wake the target, and cleared by the target right before it drains:
+// while a wakeup is outstanding further calls only enqueue.
+typedef struct {
+  mpmc_t            q;
+  mpmc_cell_t       cells[MAILBOX_SIZE];
+  volatile uint32_t pending __attribute__((aligned(64)));
+  uint32_t          calls;
+  uint32_t          wakes;
+  uint32_t          ipis;
+} smp_mailbox_t;
+
+static smp_mailbox_t s_mbox[SMP_MAX_CPUS];
+
+void smp_call_init(void) {
+  for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) mpmc_init(&s_mbox[i].q, s_mbox[i].cells, MAILBOX_SIZE);
+}
+
+int smp_call(uint32_t cpu, smp_fn_t fn, void* arg) {
+  if (cpu >= g_cpu_count || !g_cpus[cpu].online) return -1;
+  smp_mailbox_t* mb = &s_mbox[cpu];
+  qmsg_t m = { (uintptr_t)fn, (uintptr_t)arg };
+  if (mpmc_push(&mb->q, m)) return -1;
+
+  __atomic_fetch_add(&mb->calls, 1, __ATOMIC_RELAXED);
+  if (!__atomic_exchange_n(&mb->pending, 1, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_add(&mb->wakes, 1, __ATOMIC_RELAXED);
+    if (idle_kick(cpu)) __atomic_fetch_add(&mb->ipis, 1, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+// A call pushed after the last pop finds pending clear again and kicks,
+// so nothing is left behind between here and the caller's next idle_wait().
+uint32_t smp_poll(uint32_t cpu) {
+  smp_mailbox_t* mb = &s_mbox[cpu];
+  if (!__atomic_load_n(&mb->pending, __ATOMIC_ACQUIRE)) return 0;
+  __atomic_store_n(&mb->pending, 0, __ATOMIC_SEQ_CST);
+
+  uint32_t n = 0;
+  qmsg_t m;
+  while (mpmc_pop(&mb->q, &m) == 0) {
+    ((smp_fn_t)m.w0)(cpu, (void*)m.w1);
+    n++;
+  }
+  return n;
+}
+
+typedef struct {
+  smp_fn_t          fn;
+  void*             arg;
+  volatile uint32_t done;
+} sync_call_t;
+
+static void run_sync(uint32_t cpu, void* p) {
+  sync_call_t* s = (sync_call_t*)p;
+  s->fn(cpu, s->arg);
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+}
+
+// The caller keeps serving its own mailbox while it waits, so two CPUs
+// calling each other do not deadlock.
+int smp_call_sync(uint32_t cpu, smp_fn_t fn, void* arg) {
+  uint32_t self = smp_cpu_id();
+  if (cpu == self) {
+    fn(cpu, arg);
+    return 0;
+  }
+  sync_call_t s = { fn, arg, 0 };
+  if (smp_call(cpu, run_sync, &s)) return -1;
+  while (!__atomic_load_n(&s.done, __ATOMIC_ACQUIRE)) {
+    smp_poll(self);
+    cpu_pause();
+  }
+  return 0;
+}
+
+void smp_call_stats(uint32_t cpu, uint32_t* calls, uint32_t* wakes, uint32_t* ipis) {
+  const smp_mailbox_t* mb = &s_mbox[cpu < SMP_MAX_CPUS ? cpu : 0];
+  *calls = __atomic_load_n(&mb->calls, __ATOMIC_RELAXED);
+  *wakes = __atomic_load_n(&mb->wakes, __ATOMIC_RELAXED);
+  *ipis  = __atomic_load_n(&mb->ipis, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,174 @@
+#include "spinlock.h"
+#include "idt.h"
+#include "cpu.h"
+#include "util.h"
+#include "tsc.h"
+#include "serial.h"
+
+static lock_stats_t* volatile s_registry = 0;
+
+static void stats_register(lock_stats_t* st) {
+  if (__atomic_exchange_n(&st->registered, 1, __ATOMIC_ACQ_REL)) return;
+  lock_stats_t* head = __atomic_load_n(&s_registry, __ATOMIC_ACQUIRE);
+  do {
+    st->next = head;
+  } while (!__atomic_compare_exchange_n(&s_registry, &head, st, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+// Called with the lock held, so the 64-bit counters need no atomics.
+static inline void stats_acquired(lock_stats_t* st, uint64_t t0, int contended) {
+#if LOCK_STATS
+  if (!st->name) return;
+  uint64_t now = rdtsc();
+  if (!st->registered) stats_register(st);
+  st->acquisitions++;
+  if (contended) {
+    st->contended++;
+    st->spin_cycles += now - t0;
+  }
+  st->hold_start = now;
+#else
+  (void)st; (void)t0; (void)contended;
+#endif
+}
+
+static inline void stats_release(lock_stats_t* st) {
+#if LOCK_STATS
+  if (!st->name) return;
+  uint64_t hold = rdtsc() - st->hold_start;
+  if (hold > st->max_hold) st->max_hold = hold;
+#else
+  (void)st;
+#endif
+}
+
+static inline uint64_t stats_t0(const lock_stats_t* st) {
+#if LOCK_STATS
+  return st->name ? rdtsc() : 0;
+#else
+  (void)st;
+  return 0;
+#endif
+}
+
+void lock_stats_reset(lock_stats_t* st) {
+  st->acquisitions = 0;
+  st->contended = 0;
+  st->spin_cycles = 0;
+  st->max_hold = 0;
+}
+
+// --- ticket ---
+
+void ticket_lock_init(ticket_lock_t* l, const char* name) {
+  l->next = 0;
+  l->owner = 0;
+  l->stats.name = name;
+  lock_stats_reset(&l->stats);
+}
+
+void ticket_lock(ticket_lock_t* l) {
+  uint64_t t0 = stats_t0(&l->stats);
+  uint32_t me = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+  int contended = 0;
+  while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != me) {
+    contended = 1;
+    cpu_pause();
+  }
+  stats_acquired(&l->stats, t0, contended);
+}
+
+int ticket_trylock(ticket_lock_t* l) {
+  uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+  uint32_t expect = owner;
+  if (!__atomic_compare_exchange_n(&l->next, &expect, owner + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  stats_acquired(&l->stats, 0, 0);
+  return 1;
+}
+
+void ticket_unlock(ticket_lock_t* l) {
+  stats_release(&l->stats);
+  __atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t ticket_lock_irqsave(ticket_lock_t* l) {
+  uint32_t flags = irq_save();
+  ticket_lock(l);
+  return flags;
+}
+
+void ticket_unlock_irqrestore(ticket_lock_t* l, uint32_t flags) {
+  ticket_unlock(l);
+  irq_restore(flags);
+}
+
+// --- MCS ---
+
+void mcs_lock_init(mcs_lock_t* l, const char* name) {
+  l->tail = 0;
+  l->stats.name = name;
+  lock_stats_reset(&l->stats);
+}
+
+void mcs_lock(mcs_lock_t* l, mcs_node_t* me) {
+  uint64_t t0 = stats_t0(&l->stats);
+  me->next = 0;
+  me->locked = 1;
+
+  mcs_node_t* prev = __atomic_exchange_n(&l->tail, me, __ATOMIC_ACQ_REL);
+  int contended = 0;
+  if (prev) {
+    contended = 1;
+    __atomic_store_n(&prev->next, me, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE)) cpu_pause();
+  }
+  stats_acquired(&l->stats, t0, contended);
+}
+
+void mcs_unlock(mcs_lock_t* l, mcs_node_t* me) {
+  stats_release(&l->stats);
+
+  mcs_node_t* next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+  if (!next) {
+    mcs_node_t* expect = me;
+    if (__atomic_compare_exchange_n(&l->tail, &expect, 0, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return;
+    }
+    while (!(next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE))) cpu_pause();
+  }
+  __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+uint32_t mcs_lock_irqsave(mcs_lock_t* l, mcs_node_t* me) {
+  uint32_t flags = irq_save();
+  mcs_lock(l, me);
+  return flags;
+}
+
+void mcs_unlock_irqrestore(mcs_lock_t* l, mcs_node_t* me, uint32_t flags) {
+  mcs_unlock(l, me);
+  irq_restore(flags);
+}
+
+// --- stats dump ---
+
+void lock_stats_dump(const char* name) {
+  int any = 0;
+  for (lock_stats_t* st = __atomic_load_n(&s_registry, __ATOMIC_ACQUIRE); st; st = st->next) {
+    if (name && !streq(st->name, name)) continue;
+    any = 1;
+
+    uint64_t pct10 = st->acquisitions ? udiv64(st->contended * 1000u, st->acquisitions) : 0;
+    uint64_t q = udiv64(pct10, 10);
+    serial_printf("[LOCK] %s acq=%lu contended=%lu (%u.%u%%) spin=%lu us max_hold=%lu ns\n",
+                  st->name, st->acquisitions, st->contended,
+                  (uint32_t)q, (uint32_t)(pct10 - q * 10),
+                  tsc_cycles_to_us(st->spin_cycles), tsc_cycles_to_ns(st->max_hold));
+  }
+  if (!any) serial_printf("[LOCK] no statistics for %s\n", name ? name : "any lock");
+}
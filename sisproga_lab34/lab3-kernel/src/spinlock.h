@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+
+// Ticket and MCS spinlocks. A lock with a name keeps statistics (compiled
+// in unless LOCK_STATS=0); anonymous locks skip all accounting.
+
+#ifndef LOCK_STATS
+#define LOCK_STATS 1
+#endif
+
+typedef struct lock_stats {
+  const char*        name;
+  uint64_t           acquisitions;
+  uint64_t           contended;
+  uint64_t           spin_cycles;
+  uint64_t           max_hold;
+  uint64_t           hold_start;
+  struct lock_stats* next;
+  volatile uint32_t  registered;
+} lock_stats_t;
+
+typedef struct {
+  volatile uint32_t next;
+  volatile uint32_t owner;
+  lock_stats_t      stats;
+} ticket_lock_t;
+
+typedef struct mcs_node {
+  struct mcs_node* volatile next;
+  volatile uint32_t         locked;
+} __attribute__((aligned(64))) mcs_node_t;
+
+typedef struct {
+  mcs_node_t* volatile tail;
+  lock_stats_t         stats;
+} mcs_lock_t;
+
+#define TICKET_LOCK_INIT(nm) { 0, 0, { (nm), 0, 0, 0, 0, 0, 0, 0 } }
+#define MCS_LOCK_INIT(nm)    { 0, { (nm), 0, 0, 0, 0, 0, 0, 0 } }
+
+void     ticket_lock_init(ticket_lock_t* l, const char* name);
+void     ticket_lock(ticket_lock_t* l);
+int      ticket_trylock(ticket_lock_t* l);
+void     ticket_unlock(ticket_lock_t* l);
+uint32_t ticket_lock_irqsave(ticket_lock_t* l);
+void     ticket_unlock_irqrestore(ticket_lock_t* l, uint32_t flags);
+
+void     mcs_lock_init(mcs_lock_t* l, const char* name);
+void     mcs_lock(mcs_lock_t* l, mcs_node_t* me);
+void     mcs_unlock(mcs_lock_t* l, mcs_node_t* me);
+uint32_t mcs_lock_irqsave(mcs_lock_t* l, mcs_node_t* me);
+void     mcs_unlock_irqrestore(mcs_lock_t* l, mcs_node_t* me, uint32_t flags);
+
+// Dump statistics of every named lock, or only those called `name`.
+void     lock_stats_dump(const char* name);
+void     lock_stats_reset(lock_stats_t* st);
+
+void     lock_bench(void);
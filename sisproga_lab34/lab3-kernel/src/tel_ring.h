@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+
+// Telemetry ring in the pci-testdev memory BAR, shared with the host through
+// the BAR's backing file (vm-pci.sh: bar2.bin). Also included by
+// tools/telread.c, so nothing here may depend on the kernel.
+//
+//   tel_ring_hdr_t | data[data_size]
+//
+// One producer (the kernel, serialized by a lock) and one consumer (the host
+// reader). head and tail are byte offsets into data; the producer only moves
+// head, the reader only moves tail, head == tail means empty, and the
+// producer always leaves TEL_REC_ALIGN bytes free so full never looks empty.
+// Records are contiguous and 8-byte aligned. A record that does not fit
+// before the end of data is preceded by a TEL_REC_PAD up to the end, or,
+// when fewer than sizeof(tel_rec_t) bytes are left, by an implicit wrap.
+// A full ring drops the record; seq still advances, so the reader sees the
+// gap.
+
+#define TEL_MAGIC      0x4C45544Bu   // "KTEL"
+#define TEL_VERSION    1
+#define TEL_REC_ALIGN  8u
+
+#define TEL_REC_PAD    0   // no payload, skip to the end of data
+#define TEL_REC_LOG    1   // payload: serial output text, no NUL
+#define TEL_REC_TRACE  2   // payload: tel_trace_t
+#define TEL_REC_BENCH  3   // payload: filler from the throughput test
+
+// tel_trace_t ids
+#define TEL_TRACE_TIMELINE  1   // a0 = mark index, a1 = first 8 bytes of the name
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;               // written last when the producer starts
+  uint32_t version;
+  uint32_t hdr_size;            // data starts here
+  uint32_t data_size;           // multiple of TEL_REC_ALIGN
+  uint64_t epoch;               // producer TSC at start; new on every boot
+  uint32_t tsc_khz;
+  uint32_t reserved0;
+  uint8_t  pad0[32];
+
+  volatile uint32_t head;       // producer's cache line
+  uint32_t reserved1;
+  volatile uint64_t dropped;
+  uint8_t  pad1[48];
+
+  volatile uint32_t tail;       // consumer's cache line
+  uint8_t  pad2[60];
+} tel_ring_hdr_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t len;                 // header + payload, before alignment
+  uint16_t type;
+  uint16_t cpu;
+  uint32_t seq;
+  uint32_t reserved;
+  uint64_t tsc;
+} tel_rec_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t a0;
+  uint64_t a1;
+} tel_trace_t;
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+// Producer side of the telemetry ring (tel_ring.h) in the pci-testdev
+// memory BAR. Every call is a no-op until tel_init() has found the BAR, and
+// none of them ever waits for the host: a full ring drops the record.
+
+int  tel_init(void);    // 1 when the ring is up
+int  tel_active(void);
+
+void tel_write(uint16_t type, const void* payload, uint32_t len);
+void tel_log(const char* s, uint32_t len);
+void tel_trace(uint32_t id, uint64_t a0, uint64_t a1);
+
+// Ring vs COM1 throughput, logged as [TEL] bench.
+void tel_bench(void);
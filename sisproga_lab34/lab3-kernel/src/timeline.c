@@ -0,0 +1,105 @@
+#include "timeline.h"
+#include "mb2.h"
+#include "serial.h"
+#include "tsc.h"
+#include "cpu.h"
+#include "telemetry.h"
+#include "tel_ring.h"
+
+#define TIMELINE_MAX 32
+
+typedef struct {
+  const char* name;
+  uint64_t    tsc;
+} mark_t;
+
+static mark_t   s_marks[TIMELINE_MAX];
+static uint32_t s_count;
+static const mb2_tag_timeline_t* s_loader;
+static const mb2_tag_kexec_t*    s_kexec;
+
+static const char* const k_stage_names[MB2_BL_STAGE_COUNT] = {
+  "bl entry", "bl options parsed", "bl kernel file open", "bl mb2 header valid",
+  "bl elf loaded", "bl gop query", "bl mb2 info built", "bl exit boot services",
+  "bl trampoline jump",
+};
+
+void timeline_mark(const char* name) {
+  if (s_count < TIMELINE_MAX) {
+    s_marks[s_count].name = name;
+    s_marks[s_count].tsc  = rdtsc();
+    uint64_t tag = 0;
+    for (uint32_t i = 0; i < 8 && name[i]; ++i) tag |= (uint64_t)(uint8_t)name[i] << (i * 8);
+    tel_trace(TEL_TRACE_TIMELINE, s_count, tag);
+    s_count++;
+  }
+}
+
+void timeline_set_loader(const void* tag) {
+  const mb2_tag_timeline_t* t = (const mb2_tag_timeline_t*)tag;
+  if (t->tag.size < sizeof(mb2_tag_timeline_t) || t->count > MB2_BL_STAGE_COUNT) {
+    serial_printf("[TIME][WARN] malformed loader timeline tag\n");
+    return;
+  }
+  s_loader = t;
+}
+
+void timeline_set_kexec(const void* tag) {
+  const mb2_tag_kexec_t* t = (const mb2_tag_kexec_t*)tag;
+  if (t->tag.size < sizeof(mb2_tag_kexec_t)) {
+    serial_printf("[TIME][WARN] malformed kexec tag\n");
+    return;
+  }
+  s_kexec = t;
+}
+
+uint32_t timeline_boot_info(uint64_t* cold_entry) {
+  if (s_kexec) {
+    *cold_entry = s_kexec->cold_entry_tsc;
+    return s_kexec->warm_boots;
+  }
+  *cold_entry = s_count ? s_marks[0].tsc : 0;
+  return 0;
+}
+
+static void line(const char* name, uint64_t tsc, uint64_t base, uint64_t* prev) {
+  uint64_t at   = tsc_cycles_to_us(tsc - base);
+  uint64_t step = tsc_cycles_to_us(tsc - *prev);
+  serial_printf("[TIME] %lu us  (+%lu)  %s\n", at, step, name);
+  *prev = tsc;
+}
+
+// Times are relative to the first stamp, normally the loader's entry. The
+// TSC counts from reset, so that first stamp also says how long the
+// firmware took to get there. After a kexec they are relative to the old
+// kernel starting the reboot instead.
+void timeline_dump(void) {
+  uint64_t base = 0;
+  if (s_kexec && s_count) {
+    base = s_kexec->start_tsc;
+    serial_printf("[TIME] warm boot %u: kernel entry %lu us after kexec (cold boot: %lu us after reset)\n",
+                  s_kexec->warm_boots, tsc_cycles_to_us(s_marks[0].tsc - base),
+                  tsc_cycles_to_us(s_kexec->cold_entry_tsc));
+    uint64_t prev = base;
+    for (uint32_t i = 0; i < s_count; ++i) line(s_marks[i].name, s_marks[i].tsc, base, &prev);
+    return;
+  }
+  if (s_loader) {
+    for (uint32_t i = 0; i < s_loader->count && !base; ++i) base = s_loader->tsc[i];
+  }
+  if (!base && s_count) base = s_marks[0].tsc;
+  if (!base) return;
+
+  serial_printf("[TIME] firmware until first stamp: %lu us (loader tsc=%u kHz, kernel tsc=%u kHz)\n",
+                tsc_cycles_to_us(base), s_loader ? s_loader->tsc_khz : 0, g_tsc_khz);
+
+  uint64_t prev = base;
+  if (s_loader) {
+    for (uint32_t i = 0; i < s_loader->count; ++i) {
+      if (s_loader->tsc[i]) line(k_stage_names[i], s_loader->tsc[i], base, &prev);
+    }
+  }
+  for (uint32_t i = 0; i < s_count; ++i) {
+    line(s_marks[i].name, s_marks[i].tsc, base, &prev);
+  }
+}
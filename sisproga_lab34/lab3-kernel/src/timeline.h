@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+
+// One boot timeline from bootloader entry to the kernel going idle. The
+// loader's rdtsc stamps arrive in the MB2 boot timeline tag; the kernel adds
+// its own named marks (BSP only, before and after the APs are up).
+
+void timeline_mark(const char* name);
+void timeline_set_loader(const void* tag);
+void timeline_set_kexec(const void* tag);
+// Warm boots before this kernel; *cold_entry gets the TSC at kernel entry
+// on the cold boot (this boot's entry when it was the cold one).
+uint32_t timeline_boot_info(uint64_t* cold_entry);
+void timeline_dump(void);
@@ -0,0 +1,59 @@
+#include "tsc.h"
+#include "cpu.h"
+#include "util.h"
+
+#define PIT_HZ        1193182u
+#define PIT_CH2       0x42
+#define PIT_CMD       0x43
+#define PIT_GATE_PORT 0x61
+#define CAL_MS        10u
+
+uint32_t g_tsc_khz = 0;
+uint64_t g_tsc_boot = 0;
+
+static uint64_t measure_once(void) {
+  uint16_t count = (uint16_t)(PIT_HZ * CAL_MS / 1000u);
+
+  // Gate low, speaker off; channel 2, lobyte/hibyte, mode 0 (one-shot).
+  outb(PIT_GATE_PORT, (uint8_t)(inb(PIT_GATE_PORT) & ~0x03u));
+  outb(PIT_CMD, 0xB0);
+  outb(PIT_CH2, (uint8_t)(count & 0xFF));
+  outb(PIT_CH2, (uint8_t)(count >> 8));
+
+  outb(PIT_GATE_PORT, (uint8_t)(inb(PIT_GATE_PORT) | 0x01u));
+  uint64_t t0 = rdtsc();
+  while ((inb(PIT_GATE_PORT) & 0x20u) == 0) { }
+  uint64_t t1 = rdtsc();
+
+  outb(PIT_GATE_PORT, (uint8_t)(inb(PIT_GATE_PORT) & ~0x01u));
+  return t1 - t0;
+}
+
+void tsc_calibrate(void) {
+  g_tsc_boot = rdtsc();
+  uint64_t best = ~0ull;
+  for (int i = 0; i < 3; i++) {
+    uint64_t d = measure_once();
+    if (d < best) best = d;
+  }
+  g_tsc_khz = (uint32_t)udiv64(best, CAL_MS);
+  if (g_tsc_khz == 0) g_tsc_khz = 1;
+}
+
+uint64_t tsc_cycles_to_ns(uint64_t cycles) {
+  return udiv64(cycles * 1000000ull, g_tsc_khz ? g_tsc_khz : 1);
+}
+
+uint64_t tsc_cycles_to_us(uint64_t cycles) {
+  return udiv64(cycles * 1000ull, g_tsc_khz ? g_tsc_khz : 1);
+}
+
+void tsc_delay_us(uint32_t us) {
+  uint64_t end = rdtsc() + udiv64((uint64_t)us * g_tsc_khz, 1000u);
+  while (rdtsc() < end) cpu_pause();
+}
+
+uint64_t tsc_per_second(uint64_t count, uint64_t cycles) {
+  if (cycles == 0) return 0;
+  return udiv64(count * (uint64_t)g_tsc_khz * 1000ull, cycles);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+
+extern uint32_t g_tsc_khz;
+extern uint64_t g_tsc_boot;
+
+void tsc_calibrate(void);
+uint64_t tsc_cycles_to_ns(uint64_t cycles);
+uint64_t tsc_cycles_to_us(uint64_t cycles);
+void tsc_delay_us(uint32_t us);
+uint64_t tsc_per_second(uint64_t count, uint64_t cycles);
@@ -15,9 +15,25 @@ int memcmp_s(const void* a, const void* b, size_t n) {
   return 0;
 }
 
+int streq(const char* a, const char* b) {
+  if (!a || !b) return a == b;
+  while (*a && *a == *b) { ++a; ++b; }
+  return *a == *b;
+}
+
 uint32_t checksum8(const void* p, size_t n) {
   const uint8_t* x = (const uint8_t*)p;
   uint32_t sum = 0;
   for (size_t i = 0; i < n; ++i) sum += x[i];
   return sum & 0xFFu;
 }
+
+uint64_t udiv64(uint64_t n, uint64_t d) {
+  if (d == 0) return 0;
+  uint64_t q = 0, r = 0;
+  for (int i = 63; i >= 0; --i) {
+    r = (r << 1) | ((n >> i) & 1u);
+    if (r >= d) { r -= d; q |= (1ull << i); }
+  }
+  return q;
+}
@@ -4,4 +4,6 @@
 
 size_t strnlen_s(const char* s, size_t maxn);
 int memcmp_s(const void* a, const void* b, size_t n);
+int streq(const char* a, const char* b);
 uint32_t checksum8(const void* p, size_t n);
+uint64_t udiv64(uint64_t n, uint64_t d);
@@ -0,0 +1,337 @@
+#include "virtio.h"
+#include "cpu.h"
+#include "serial.h"
+
+#define VIRTIO_STATUS_ACK          1
+#define VIRTIO_STATUS_DRIVER       2
+#define VIRTIO_STATUS_DRIVER_OK    4
+#define VIRTIO_STATUS_FEATURES_OK  8
+#define VIRTIO_STATUS_FAILED       128
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
+
+// Legacy register block in I/O BAR0 (no MSI-X, so device config at 0x14).
+#define VL_DEVICE_FEATURES 0x00
+#define VL_DRIVER_FEATURES 0x04
+#define VL_QUEUE_PFN       0x08
+#define VL_QUEUE_SIZE      0x0C
+#define VL_QUEUE_SELECT    0x0E
+#define VL_QUEUE_NOTIFY    0x10
+#define VL_STATUS          0x12
+#define VL_CONFIG          0x14
+
+// Modern common configuration structure.
+#define VM_DFSELECT     0x00
+#define VM_DF           0x04
+#define VM_GFSELECT     0x08
+#define VM_GF           0x0C
+#define VM_STATUS       0x14
+#define VM_Q_SELECT     0x16
+#define VM_Q_SIZE       0x18
+#define VM_Q_ENABLE     0x1C
+#define VM_Q_NOFF       0x1E
+#define VM_Q_DESCLO     0x20
+#define VM_Q_DESCHI     0x24
+#define VM_Q_AVAILLO    0x28
+#define VM_Q_AVAILHI    0x2C
+#define VM_Q_USEDLO     0x30
+#define VM_Q_USEDHI     0x34
+
+#define VIRTIO_CAP_COMMON  1
+#define VIRTIO_CAP_NOTIFY  2
+#define VIRTIO_CAP_DEVICE  4
+
+#define VQ_ALIGN 4096u
+
+// Legacy layout for every queue (the only one a legacy device accepts):
+// descriptors and avail ring, then the used ring on the next page. Two
+// pages hold it up to VIRTQ_MAX_SIZE entries.
+#define VQ_MEM_SIZE (2 * VQ_ALIGN)
+
+static uint8_t  s_vq_mem[VIRTIO_MAX_QUEUES][VQ_MEM_SIZE] __attribute__((aligned(4096)));
+static uint32_t s_vq_mem_used;
+
+static void mb(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// ---- legacy ------------------------------------------------------------------
+
+static uint8_t leg_get_status(virtio_dev_t* d)            { return inb(d->io + VL_STATUS); }
+static void    leg_set_status(virtio_dev_t* d, uint8_t s) { outb(d->io + VL_STATUS, s); }
+static uint64_t leg_get_features(virtio_dev_t* d)         { return inl(d->io + VL_DEVICE_FEATURES); }
+static void    leg_set_features(virtio_dev_t* d, uint64_t f) { outl(d->io + VL_DRIVER_FEATURES, (uint32_t)f); }
+static uint8_t leg_cfg_read8(virtio_dev_t* d, uint32_t off) { return inb((uint16_t)(d->io + VL_CONFIG + off)); }
+
+static uint16_t leg_queue_max(virtio_dev_t* d, uint16_t index) {
+  outw(d->io + VL_QUEUE_SELECT, index);
+  return inw(d->io + VL_QUEUE_SIZE);
+}
+
+static int leg_queue_setup(virtio_dev_t* d, virtq_t* q) {
+  outw(d->io + VL_QUEUE_SELECT, q->index);
+  outl(d->io + VL_QUEUE_PFN, (uint32_t)((uintptr_t)q->desc / VQ_ALIGN));
+  return 0;
+}
+
+static void leg_notify(virtio_dev_t* d, virtq_t* q) {
+  outw(d->io + VL_QUEUE_NOTIFY, q->index);
+}
+
+static const virtio_ops_t legacy_ops = {
+  "legacy", leg_get_status, leg_set_status, leg_get_features, leg_set_features,
+  leg_cfg_read8, leg_queue_max, leg_queue_setup, leg_notify,
+};
+
+// ---- modern ------------------------------------------------------------------
+
+static volatile uint32_t* c32(virtio_dev_t* d, uint32_t off) { return (volatile uint32_t*)(d->common + off); }
+static volatile uint16_t* c16(virtio_dev_t* d, uint32_t off) { return (volatile uint16_t*)(d->common + off); }
+
+static uint8_t mod_get_status(virtio_dev_t* d)            { return d->common[VM_STATUS]; }
+static void    mod_set_status(virtio_dev_t* d, uint8_t s) { d->common[VM_STATUS] = s; }
+static uint8_t mod_cfg_read8(virtio_dev_t* d, uint32_t off) { return d->device_cfg ? d->device_cfg[off] : 0; }
+
+static uint64_t mod_get_features(virtio_dev_t* d) {
+  *c32(d, VM_DFSELECT) = 0;
+  uint32_t lo = *c32(d, VM_DF);
+  *c32(d, VM_DFSELECT) = 1;
+  uint32_t hi = *c32(d, VM_DF);
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static void mod_set_features(virtio_dev_t* d, uint64_t f) {
+  *c32(d, VM_GFSELECT) = 0;
+  *c32(d, VM_GF) = (uint32_t)f;
+  *c32(d, VM_GFSELECT) = 1;
+  *c32(d, VM_GF) = (uint32_t)(f >> 32);
+}
+
+static uint16_t mod_queue_max(virtio_dev_t* d, uint16_t index) {
+  *c16(d, VM_Q_SELECT) = index;
+  return *c16(d, VM_Q_SIZE);
+}
+
+static int mod_queue_setup(virtio_dev_t* d, virtq_t* q) {
+  uint64_t desc = (uintptr_t)q->desc, avail = (uintptr_t)q->avail, used = (uintptr_t)q->used;
+  *c16(d, VM_Q_SELECT)  = q->index;
+  *c16(d, VM_Q_SIZE)    = q->size;
+  *c32(d, VM_Q_DESCLO)  = (uint32_t)desc;
+  *c32(d, VM_Q_DESCHI)  = (uint32_t)(desc >> 32);
+  *c32(d, VM_Q_AVAILLO) = (uint32_t)avail;
+  *c32(d, VM_Q_AVAILHI) = (uint32_t)(avail >> 32);
+  *c32(d, VM_Q_USEDLO)  = (uint32_t)used;
+  *c32(d, VM_Q_USEDHI)  = (uint32_t)(used >> 32);
+  q->notify_off = *c16(d, VM_Q_NOFF);
+  *c16(d, VM_Q_ENABLE)  = 1;
+  return 0;
+}
+
+static void mod_notify(virtio_dev_t* d, virtq_t* q) {
+  *(volatile uint16_t*)(d->notify_base + (uint32_t)q->notify_off * d->notify_mult) = q->index;
+}
+
+static const virtio_ops_t modern_ops = {
+  "modern", mod_get_status, mod_set_status, mod_get_features, mod_set_features,
+  mod_cfg_read8, mod_queue_max, mod_queue_setup, mod_notify,
+};
+
+// The window a vendor capability points at, or 0 when its BAR is not a
+// memory BAR the kernel can address.
+static volatile uint8_t* cap_window(const pci_dev_t* p, uint8_t cap) {
+  uint8_t  bar = pci_read8(p->bus, p->dev, p->fn, cap + 4);
+  uint32_t off = pci_read32(p->bus, p->dev, p->fn, cap + 8);
+  uint32_t len = pci_read32(p->bus, p->dev, p->fn, cap + 12);
+  if (bar >= PCI_BAR_COUNT) return 0;
+
+  const pci_bar_t* b = &p->bar[bar];
+  if (!b->size || (b->flags & PCI_BAR_IO) || (uint64_t)off + len > b->size) return 0;
+  if (sizeof(uintptr_t) == 4 && b->base + off + len > 0x100000000ull) return 0;
+  return (volatile uint8_t*)(uintptr_t)(b->base + off);
+}
+
+static int modern_probe(virtio_dev_t* d) {
+  const pci_dev_t* p = d->pci;
+  int found = 0;
+
+  for (uint8_t cap = pci_find_cap(p, PCI_CAP_VENDOR, 0); cap; cap = pci_find_cap(p, PCI_CAP_VENDOR, cap)) {
+    uint8_t type = pci_read8(p->bus, p->dev, p->fn, cap + 3);
+    if (type == VIRTIO_CAP_COMMON && !d->common) {
+      d->common = cap_window(p, cap);
+      found |= d->common ? 1 : 8;
+    } else if (type == VIRTIO_CAP_NOTIFY && !d->notify_base) {
+      d->notify_base = cap_window(p, cap);
+      d->notify_mult = pci_read32(p->bus, p->dev, p->fn, cap + 16);
+      found |= d->notify_base ? 2 : 8;
+    } else if (type == VIRTIO_CAP_DEVICE && !d->device_cfg) {
+      d->device_cfg = cap_window(p, cap);
+    }
+  }
+  if (found & 8) serial_printf("[VIRTIO] modern registers not addressable, trying legacy\n");
+  return (found & 3) == 3;
+}
+
+// ---- device ------------------------------------------------------------------
+
+int virtio_init(virtio_dev_t* d, const pci_dev_t* pci, uint64_t wanted) {
+  d->pci = pci;
+  d->common = d->notify_base = d->device_cfg = 0;
+  pci_enable(pci, PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_MASTER | PCI_CMD_INTX_OFF);
+
+  if (modern_probe(d)) {
+    d->ops = &modern_ops;
+    wanted |= VIRTIO_F_VERSION_1;
+  } else if (pci->bar[0].size && (pci->bar[0].flags & PCI_BAR_IO)) {
+    d->ops = &legacy_ops;
+    d->io  = (uint16_t)pci->bar[0].base;
+    wanted &= 0xFFFFFFFFull;
+  } else {
+    serial_printf("[VIRTIO] %x:%x.%u has no usable transport\n",
+                  (uint32_t)pci->bus, (uint32_t)pci->dev, (uint32_t)pci->fn);
+    return -1;
+  }
+
+  d->ops->set_status(d, 0);
+  for (uint32_t spin = 0; d->ops->get_status(d) && spin < 1000000; ++spin) cpu_pause();
+  d->ops->set_status(d, VIRTIO_STATUS_ACK);
+  d->ops->set_status(d, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+  uint64_t offered = d->ops->get_features(d);
+  d->features = offered & wanted;
+  d->ops->set_features(d, d->features);
+
+  if (d->ops == &modern_ops) {
+    d->ops->set_status(d, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+    if (!(d->ops->get_status(d) & VIRTIO_STATUS_FEATURES_OK) || !(d->features & VIRTIO_F_VERSION_1)) {
+      d->ops->set_status(d, VIRTIO_STATUS_FAILED);
+      serial_printf("[VIRTIO] device refused features %lx\n", d->features);
+      return -1;
+    }
+  }
+
+  serial_printf("[VIRTIO] %x:%x.%u %x via %s, features %lx of %lx\n",
+                (uint32_t)pci->bus, (uint32_t)pci->dev, (uint32_t)pci->fn, (uint32_t)pci->device,
+                d->ops->name, d->features, offered);
+  return 0;
+}
+
+int virtio_queue_init(virtio_dev_t* d, virtq_t* q, uint16_t index) {
+  uint16_t max = d->ops->queue_max(d, index);
+  if (!max) return -1;
+
+  uint16_t size = max;
+  if (size > VIRTQ_MAX_SIZE) {
+    if (d->ops == &legacy_ops) {
+      serial_printf("[VIRTIO] legacy queue %u has %u entries, more than %u\n",
+                    (uint32_t)index, (uint32_t)max, (uint32_t)VIRTQ_MAX_SIZE);
+      return -1;
+    }
+    size = VIRTQ_MAX_SIZE;
+  }
+  if (s_vq_mem_used == VIRTIO_MAX_QUEUES) {
+    serial_printf("[VIRTIO] out of queue memory\n");
+    return -1;
+  }
+
+  uint8_t* mem = s_vq_mem[s_vq_mem_used++];
+  for (uint32_t i = 0; i < VQ_MEM_SIZE; ++i) mem[i] = 0;
+
+  uint32_t used_off = (16u * size + 6u + 2u * size + VQ_ALIGN - 1) & ~(VQ_ALIGN - 1);
+  q->dev   = d;
+  q->index = index;
+  q->size  = size;
+  q->desc  = (volatile virtq_desc_t*)mem;
+  q->avail = (volatile virtq_avail_t*)(mem + 16u * size);
+  q->used  = (volatile virtq_used_t*)(mem + used_off);
+  q->free_head = 0;
+  q->num_free  = size;
+  q->avail_idx = q->kicked_idx = q->last_used = 0;
+  q->kicks = q->kicks_skipped = 0;
+  for (uint16_t i = 0; i < size; ++i) q->desc[i].next = (uint16_t)(i + 1);
+
+  // Completions are polled: no interrupts, or with EVENT_IDX a used_event
+  // that always trails what has been reaped.
+  q->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+  q->avail->ring[size] = 0xFFFF;
+
+  return d->ops->queue_setup(d, q);
+}
+
+void virtio_ready(virtio_dev_t* d) {
+  d->ops->set_status(d, d->ops->get_status(d) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+uint8_t virtio_cfg_read8(virtio_dev_t* d, uint32_t off) {
+  return d->ops->cfg_read8(d, off);
+}
+
+// ---- virtqueue ---------------------------------------------------------------
+
+int virtq_add(virtq_t* q, const virtq_buf_t* out, uint32_t nout,
+              const virtq_buf_t* in, uint32_t nin, void* cookie) {
+  uint32_t n = nout + nin;
+  if (!n || n > q->num_free) return -1;
+
+  uint16_t head = q->free_head, cur = head;
+  for (uint32_t i = 0; i < n; ++i) {
+    const virtq_buf_t* b = (i < nout) ? &out[i] : &in[i - nout];
+    volatile virtq_desc_t* dd = &q->desc[cur];
+    dd->addr  = b->addr;
+    dd->len   = b->len;
+    dd->flags = (uint16_t)(((i < nout) ? 0 : VIRTQ_DESC_F_WRITE) | ((i + 1 < n) ? VIRTQ_DESC_F_NEXT : 0));
+    cur = dd->next;
+  }
+  q->free_head = cur;
+  q->num_free  = (uint16_t)(q->num_free - n);
+  q->cookie[head] = cookie;
+
+  q->avail->ring[q->avail_idx % q->size] = head;
+  q->avail_idx++;
+  return 0;
+}
+
+void virtq_kick(virtq_t* q) {
+  if (q->avail_idx == q->kicked_idx) return;
+
+  __asm__ volatile ("" ::: "memory");
+  q->avail->idx = q->avail_idx;
+  mb();   // the idx store must land before the device's hints are read
+
+  int need;
+  if (q->dev->features & VIRTIO_F_EVENT_IDX) {
+    uint16_t event = *(volatile uint16_t*)&q->used->ring[q->size];
+    need = (uint16_t)(q->avail_idx - event - 1) < (uint16_t)(q->avail_idx - q->kicked_idx);
+  } else {
+    need = !(q->used->flags & VRING_USED_F_NO_NOTIFY);
+  }
+  q->kicked_idx = q->avail_idx;
+
+  if (need) {
+    q->dev->ops->notify(q->dev, q);
+    q->kicks++;
+  } else {
+    q->kicks_skipped++;
+  }
+}
+
+void* virtq_get(virtq_t* q, uint32_t* len) {
+  if (q->last_used == __atomic_load_n(&q->used->idx, __ATOMIC_ACQUIRE)) return 0;
+
+  volatile virtq_used_elem_t* e = &q->used->ring[q->last_used % q->size];
+  uint16_t id = (uint16_t)e->id;
+  if (len) *len = e->len;
+
+  uint16_t cur = id, n = 1;
+  while (q->desc[cur].flags & VIRTQ_DESC_F_NEXT) {
+    cur = q->desc[cur].next;
+    n++;
+  }
+  q->desc[cur].next = q->free_head;
+  q->free_head = id;
+  q->num_free  = (uint16_t)(q->num_free + n);
+  q->last_used++;
+
+  if (q->dev->features & VIRTIO_F_EVENT_IDX) q->avail->ring[q->size] = (uint16_t)(q->last_used - 1);
+  return q->cookie[id];
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <stdint.h>
+#include "pci.h"
+
+// virtio over PCI, both transports: modern (virtio 1.0, registers in memory
+// BARs found through vendor capabilities) and legacy (0.9.5, registers in
+// I/O BAR0). A transitional device offers both; modern is used when its
+// BARs are addressable. Split virtqueues only, polled: the driver asks the
+// device not to interrupt and reaps the used ring itself. Boot CPU only,
+// like the rest of the boot-time drivers.
+
+#define VIRTIO_VENDOR   0x1AF4
+
+#define VIRTIO_F_INDIRECT_DESC  (1ull << 28)
+#define VIRTIO_F_EVENT_IDX      (1ull << 29)
+#define VIRTIO_F_VERSION_1      (1ull << 32)
+
+#define VIRTQ_MAX_SIZE  128     // the memory for each queue is static
+#define VIRTIO_MAX_QUEUES 2
+
+#define VIRTQ_DESC_F_NEXT   1
+#define VIRTQ_DESC_F_WRITE  2
+
+typedef struct __attribute__((packed)) {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} virtq_desc_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];              // then used_event
+} virtq_avail_t;
+
+typedef struct __attribute__((packed)) {
+  uint32_t id;
+  uint32_t len;
+} virtq_used_elem_t;
+
+typedef struct __attribute__((packed)) {
+  uint16_t flags;
+  uint16_t idx;
+  virtq_used_elem_t ring[];     // then avail_event
+} virtq_used_t;
+
+typedef struct virtio_dev virtio_dev_t;
+
+typedef struct {
+  virtio_dev_t*           dev;
+  uint16_t                index;
+  uint16_t                size;
+  volatile virtq_desc_t*  desc;
+  volatile virtq_avail_t* avail;
+  volatile virtq_used_t*  used;
+  uint16_t free_head, num_free;
+  uint16_t avail_idx;           // driver's copy, published by virtq_kick()
+  uint16_t kicked_idx;          // avail idx at the last notification
+  uint16_t last_used;
+  uint16_t notify_off;
+  uint32_t kicks, kicks_skipped;
+  void*    cookie[VIRTQ_MAX_SIZE];
+} virtq_t;
+
+typedef struct {
+  const char* name;
+  uint8_t  (*get_status)(virtio_dev_t* d);
+  void     (*set_status)(virtio_dev_t* d, uint8_t s);
+  uint64_t (*get_features)(virtio_dev_t* d);
+  void     (*set_features)(virtio_dev_t* d, uint64_t f);
+  uint8_t  (*cfg_read8)(virtio_dev_t* d, uint32_t off);
+  uint16_t (*queue_max)(virtio_dev_t* d, uint16_t index);
+  int      (*queue_setup)(virtio_dev_t* d, virtq_t* q);
+  void     (*notify)(virtio_dev_t* d, virtq_t* q);
+} virtio_ops_t;
+
+struct virtio_dev {
+  const pci_dev_t*    pci;
+  const virtio_ops_t* ops;
+  uint64_t features;            // negotiated
+  uint16_t io;                  // legacy: I/O BAR0
+  volatile uint8_t* common;     // modern: the capability windows
+  volatile uint8_t* notify_base;
+  volatile uint8_t* device_cfg;
+  uint32_t notify_mult;
+};
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+} virtq_buf_t;
+
+// Resets the device, negotiates `wanted` (VIRTIO_F_VERSION_1 is added for
+// modern) and leaves it waiting for its queues. 0 on success.
+int  virtio_init(virtio_dev_t* d, const pci_dev_t* pci, uint64_t wanted);
+int  virtio_queue_init(virtio_dev_t* d, virtq_t* q, uint16_t index);
+void virtio_ready(virtio_dev_t* d);
+uint8_t virtio_cfg_read8(virtio_dev_t* d, uint32_t off);
+
+// Queues one chain: `out` buffers for the device to read, then `in` buffers
+// for it to write. Nothing is visible to the device until virtq_kick(), so
+// several chains go out with one notification. -1 when descriptors run out.
+int   virtq_add(virtq_t* q, const virtq_buf_t* out, uint32_t nout,
+                const virtq_buf_t* in, uint32_t nin, void* cookie);
+void  virtq_kick(virtq_t* q);
+// Cookie of the next completed chain (len = bytes the device wrote), or 0.
+void* virtq_get(virtq_t* q, uint32_t* len);
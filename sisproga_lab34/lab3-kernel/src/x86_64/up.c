@@ -0,0 +1,98 @@
+#include "idt.h"
+#include "smp.h"
+#include "idle.h"
+#include "numa.h"
+#include "kexec.h"
+#include "ioapic.h"
+#include "module.h"
+#include "serial.h"
+#include "cpu.h"
+
+// Uniprocessor stand-ins for idt.c, smp.c, idle.c, ioapic.c and kexec.c in the
+// x86-64 build.
+// Those modules are tied to the 32-bit gate layout, the pushal ISR frame
+// and the protected-mode AP trampoline; until they are ported the 64-bit
+// kernel runs everything on the BSP with interrupts off.
+
+smp_cpu_t g_cpus[SMP_MAX_CPUS];
+uint32_t  g_cpu_count = 1;
+uint32_t  g_cpus_online = 1;
+
+void idt_init(void) {
+  serial_printf("[IDT] x86-64 build: no IDT, interrupts stay off\n");
+}
+
+void idt_load(void) {}
+
+void idt_set_handler(uint8_t vector, isr_handler_t fn) {
+  (void)vector; (void)fn;
+}
+
+void ioapic_init(const madt_t* madt) {
+  (void)madt;
+}
+
+int ioapic_route_isa(uint32_t irq, uint8_t vector, uint32_t apic_id) {
+  (void)irq; (void)vector; (void)apic_id;
+  return -1;
+}
+
+void ioapic_mask_isa(uint32_t irq) {
+  (void)irq;
+}
+
+void ioapic_dump(void) {}
+
+void smp_init(const madt_t* madt) {
+  (void)madt;
+  g_cpus[0].online = 1;
+  g_cpus[0].node   = (uint8_t)numa_this_node();
+  serial_printf("[SMP] x86-64 build: BSP only\n");
+}
+
+uint32_t smp_cpu_id(void) {
+  return 0;
+}
+
+void smp_run(uint32_t ncpus, smp_fn_t fn, void* arg) {
+  if (ncpus) fn(0, arg);
+}
+
+void smp_stop_aps(void) {}
+
+void kexec_init(uint32_t mb_info) {
+  (void)mb_info;
+}
+
+void kexec_auto(void) {
+  if (module_count()) serial_printf("[KEXEC] x86-64 build: no kexec\n");
+}
+
+void idle_init(void) {}
+
+uint32_t idle_token(uint32_t cpu) {
+  (void)cpu;
+  return 0;
+}
+
+void idle_wait(uint32_t cpu, uint32_t token) {
+  (void)cpu; (void)token;
+  cpu_pause();
+}
+
+int idle_kick(uint32_t cpu) {
+  (void)cpu;
+  return 0;
+}
+
+void idle_probe(uint32_t rounds) {
+  (void)rounds;
+}
+
+void idle_dump(void) {
+  serial_printf("[IDLE] x86-64 build: no idle accounting\n");
+}
+
+void idle_loop(void) {
+  for (;;) __asm__ volatile ("cli; hlt");
+}
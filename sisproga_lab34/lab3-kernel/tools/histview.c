@@ -0,0 +1,187 @@
+// Host-side pretty-printer for the kernel latency histograms (src/hist.h).
+//
+//   histview [-u] [log...]
+//
+// Reads serial logs (stdin without arguments) and prints every [HISTD]
+// line as a table: count, mean, percentiles up to p99.99 and a bar per
+// power of two. Times are in ns from the kernel's TSC frequency; -u keeps
+// raw TSC cycles. A histogram dumped more than once is printed each time.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BUCKETS 4096
+#define BAR_WIDTH   50
+
+typedef struct {
+  char     name[64];
+  uint32_t khz;
+  uint32_t sub_bits;
+  uint64_t max;
+  uint64_t counts[MAX_BUCKETS];
+  uint32_t nbuckets;        // one past the highest bucket seen
+  uint64_t total;
+} hist_t;
+
+static int s_cycles;
+
+// Same layout as hist_bucket_low()/hist_bucket_high() in src/hist.c.
+static uint64_t bucket_low(const hist_t* h, uint32_t b) {
+  uint32_t sub = 1u << h->sub_bits;
+  if (b < sub) return b;
+  return (uint64_t)(sub + (b & (sub - 1))) << ((b >> h->sub_bits) - 1);
+}
+
+static uint64_t bucket_high(const hist_t* h, uint32_t b) {
+  uint32_t sub = 1u << h->sub_bits;
+  if (b < sub) return b;
+  return bucket_low(h, b) + (1ull << ((b >> h->sub_bits) - 1)) - 1;
+}
+
+static double to_unit(const hist_t* h, double cycles) {
+  if (s_cycles || !h->khz) return cycles;
+  return cycles * 1e6 / h->khz;
+}
+
+static const char* unit(const hist_t* h) {
+  return (s_cycles || !h->khz) ? "cyc" : "ns";
+}
+
+static uint64_t percentile(const hist_t* h, double q) {
+  uint64_t rank = (uint64_t)(q * (double)h->total + 0.999999);
+  if (!rank) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < h->nbuckets; ++b) {
+    seen += h->counts[b];
+    if (seen >= rank) {
+      uint64_t v = bucket_high(h, b);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void show(const hist_t* h) {
+  if (!h->total) {
+    printf("%s: empty\n\n", h->name);
+    return;
+  }
+
+  double sum = 0;
+  uint32_t first = 0;
+  while (!h->counts[first]) first++;
+  for (uint32_t b = 0; b < h->nbuckets; ++b) {
+    sum += (double)h->counts[b] * (double)(bucket_low(h, b) + bucket_high(h, b)) / 2;
+  }
+
+  printf("%s: %llu values, %s\n", h->name, (unsigned long long)h->total, unit(h));
+  printf("  min   %12.1f\n", to_unit(h, (double)bucket_low(h, first)));
+  printf("  mean  %12.1f\n", to_unit(h, sum / (double)h->total));
+  static const double k_q[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+  static const char* const k_qn[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+  for (uint32_t i = 0; i < sizeof(k_q) / sizeof(k_q[0]); ++i) {
+    printf("  %-6s%12.1f\n", k_qn[i], to_unit(h, (double)percentile(h, k_q[i])));
+  }
+  printf("  max   %12.1f\n", to_unit(h, (double)h->max));
+
+  // One row per power of two, from the first to the last non-empty one.
+  uint64_t rows[64] = { 0 };
+  uint32_t nrows = 0, row0 = 64;
+  for (uint32_t b = 0; b < h->nbuckets; ++b) {
+    if (!h->counts[b]) continue;
+    uint64_t lo = bucket_low(h, b);
+    uint32_t r = 0;
+    while (r < 63 && (2ull << r) <= lo) r++;
+    rows[r] += h->counts[b];
+    if (r + 1 > nrows) nrows = r + 1;
+    if (r < row0) row0 = r;
+  }
+  uint64_t peak = 0;
+  for (uint32_t r = row0; r < nrows; ++r) if (rows[r] > peak) peak = rows[r];
+
+  // Runs of empty rows between outliers collapse into one "..." line.
+  uint64_t cum = 0;
+  for (uint32_t r = row0; r < nrows; ++r) {
+    if (!rows[r] && r + 1 < nrows && !rows[r + 1]) {
+      while (!rows[r + 1]) r++;
+      printf("  ...\n");
+      continue;
+    }
+    cum += rows[r];
+    double lo = to_unit(h, r ? (double)(1ull << r) : 0.0);
+    double hi = to_unit(h, (double)(2ull << r));
+    int bar = peak ? (int)((rows[r] * BAR_WIDTH + peak - 1) / peak) : 0;
+    printf("  [%10.1f, %10.1f) %10llu %6.2f%% %7.3f%% ", lo, hi, (unsigned long long)rows[r],
+           100.0 * (double)rows[r] / (double)h->total, 100.0 * (double)cum / (double)h->total);
+    for (int i = 0; i < bar; ++i) putchar('#');
+    putchar('\n');
+  }
+  putchar('\n');
+}
+
+// "[HISTD] <name> khz=<k> sub=<s> max=<m> <bucket>:<count> ..."
+static int parse(const char* line, hist_t* h) {
+  const char* p = strstr(line, "[HISTD] ");
+  if (!p) return 0;
+  p += 8;
+
+  memset(h, 0, sizeof(*h));
+  int n = 0;
+  unsigned long long max = 0;
+  if (sscanf(p, "%63s khz=%u sub=%u max=%llu%n", h->name, &h->khz, &h->sub_bits, &max, &n) != 4) {
+    fprintf(stderr, "histview: bad line: %s", line);
+    return 0;
+  }
+  if (h->sub_bits == 0 || h->sub_bits > 16) {
+    fprintf(stderr, "histview: %s: unsupported sub=%u\n", h->name, h->sub_bits);
+    return 0;
+  }
+  h->max = max;
+  p += n;
+
+  unsigned b;
+  unsigned long long c;
+  while (sscanf(p, " %u:%llu%n", &b, &c, &n) == 2) {
+    p += n;
+    if (b >= MAX_BUCKETS) {
+      fprintf(stderr, "histview: %s: bucket %u out of range\n", h->name, b);
+      return 0;
+    }
+    h->counts[b] = c;
+    h->total += c;
+    if (b + 1 > h->nbuckets) h->nbuckets = b + 1;
+  }
+  return 1;
+}
+
+static void scan(FILE* f) {
+  static hist_t h;
+  char line[1 << 16];
+  while (fgets(line, sizeof(line), f)) {
+    if (parse(line, &h)) show(&h);
+  }
+}
+
+int main(int argc, char** argv) {
+  int i = 1;
+  if (i < argc && !strcmp(argv[i], "-u")) {
+    s_cycles = 1;
+    i++;
+  }
+  if (i == argc) {
+    scan(stdin);
+    return 0;
+  }
+  for (; i < argc; ++i) {
+    FILE* f = fopen(argv[i], "r");
+    if (!f) {
+      perror(argv[i]);
+      return 1;
+    }
+    scan(f);
+    fclose(f);
+  }
+  return 0;
+}
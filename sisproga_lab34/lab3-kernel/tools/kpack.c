@@ -0,0 +1,206 @@
+// Host-side packer for the KPK kernel container understood by the lab4
+// bootloader (see lab4-uefi-bootloader/Kpk.h for the layout).
+//
+//   kpack [-s] [-b block_size] in.elf out.kpk
+//
+// The input is cut into independent blocks and each one is LZ4-compressed
+// (block format, greedy matcher). Blocks that do not shrink are stored.
+// -s stores every block, which is handy for checking the bootloader path.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KPK_MAGIC       0x314B504Bu
+#define KPK_ALGO_STORE  0
+#define KPK_ALGO_LZ4    1
+#define KPK_MIN_BLOCK   32768u   // block 0 must cover the MB2 header window
+
+#pragma pack(push,1)
+typedef struct {
+  uint32_t magic;
+  uint16_t algo;
+  uint16_t reserved;
+  uint32_t header_size;
+  uint32_t raw_size;
+  uint32_t block_size;
+  uint32_t block_count;
+  uint32_t checksum;
+} kpk_header_t;
+
+typedef struct {
+  uint32_t comp_size;
+  uint32_t raw_hash;
+} kpk_block_t;
+#pragma pack(pop)
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5     // the format requires the last 5 bytes as literals
+#define MF_LIMIT      12    // and no match may start within the last 12
+#define HASH_BITS     16
+
+static uint32_t fnv1a32(const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  uint32_t h = 0x811C9DC5u;
+  for (size_t i = 0; i < len; ++i) h = (h ^ p[i]) * 0x01000193u;
+  return h;
+}
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t* put_len(uint8_t* op, size_t len) {
+  while (len >= 255) { *op++ = 255; len -= 255; }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static uint8_t* put_seq(uint8_t* op, const uint8_t* lit, size_t nlit, size_t off, size_t mlen) {
+  uint8_t* token = op++;
+  size_t   ml    = mlen ? mlen - MIN_MATCH : 0;
+
+  *token = (uint8_t)(((nlit < 15) ? nlit : 15) << 4);
+  if (nlit >= 15) op = put_len(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+
+  if (mlen) {
+    *op++ = (uint8_t)(off & 0xFF);
+    *op++ = (uint8_t)(off >> 8);
+    *token |= (uint8_t)((ml < 15) ? ml : 15);
+    if (ml >= 15) op = put_len(op, ml - 15);
+  }
+  return op;
+}
+
+// Compresses one block into dst (which must hold at least len + len/255 + 16
+// bytes) and returns the compressed size.
+static size_t lz4_block(const uint8_t* src, size_t len, uint8_t* dst) {
+  static uint32_t table[1u << HASH_BITS];
+  const uint8_t* anchor = src;
+  uint8_t*       op     = dst;
+
+  if (len > MF_LIMIT) {
+    memset(table, 0xFF, sizeof(table));
+    const uint8_t* ip     = src;
+    const uint8_t* mlimit = src + len - MF_LIMIT;
+    const uint8_t* mend   = src + len - LAST_LITERALS;
+
+    while (ip < mlimit) {
+      uint32_t seq = read32(ip);
+      uint32_t h   = hash4(seq);
+      uint32_t ref = table[h];
+      table[h] = (uint32_t)(ip - src);
+
+      if (ref == 0xFFFFFFFFu || (size_t)(ip - src) - ref > 0xFFFF || read32(src + ref) != seq) {
+        ++ip;
+        continue;
+      }
+
+      const uint8_t* m = src + ref;
+      const uint8_t* e = ip + MIN_MATCH;
+      while (e < mend && *e == m[e - ip]) ++e;
+
+      op = put_seq(op, anchor, (size_t)(ip - anchor), (size_t)(ip - m), (size_t)(e - ip));
+      ip = anchor = e;
+    }
+  }
+
+  return (size_t)(put_seq(op, anchor, (size_t)(src + len - anchor), 0, 0) - dst);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: kpack [-s] [-b block_size] in.elf out.kpk\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  int      store = 0;
+  uint32_t bs    = 64u * 1024;
+  int      ai    = 1;
+
+  for (; ai < argc && argv[ai][0] == '-'; ++ai) {
+    if (!strcmp(argv[ai], "-s")) {
+      store = 1;
+    } else if (!strcmp(argv[ai], "-b") && ai + 1 < argc) {
+      bs = (uint32_t)strtoul(argv[++ai], 0, 0);
+      if (bs < KPK_MIN_BLOCK || bs > (16u << 20)) usage();
+    } else {
+      usage();
+    }
+  }
+  if (argc - ai != 2) usage();
+
+  FILE* in = fopen(argv[ai], "rb");
+  if (!in) { perror(argv[ai]); return 1; }
+  fseek(in, 0, SEEK_END);
+  long isz = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  if (isz <= 0 || isz > 0x7FFFFFFFL) { fprintf(stderr, "kpack: bad input size\n"); return 1; }
+
+  uint32_t raw_size = (uint32_t)isz;
+  uint8_t* raw = malloc(raw_size);
+  if (!raw || fread(raw, 1, raw_size, in) != raw_size) { perror("read"); return 1; }
+  fclose(in);
+
+  uint32_t     nblk   = (raw_size + bs - 1) / bs;
+  kpk_block_t* blocks = calloc(nblk, sizeof(*blocks));
+  uint8_t*     out    = malloc((size_t)raw_size + (size_t)nblk * (bs / 255 + 16));
+  uint8_t*     tmp    = malloc((size_t)bs + bs / 255 + 16);
+  if (!blocks || !out || !tmp) { perror("malloc"); return 1; }
+
+  size_t out_len = 0;
+  for (uint32_t k = 0; k < nblk; ++k) {
+    const uint8_t* src = raw + (size_t)k * bs;
+    uint32_t       len = (raw_size - k * bs < bs) ? raw_size - k * bs : bs;
+    size_t         c   = store ? len : lz4_block(src, len, tmp);
+
+    if (c >= len) {
+      memcpy(out + out_len, src, len);
+      c = len;
+    } else {
+      memcpy(out + out_len, tmp, c);
+    }
+    blocks[k].comp_size = (uint32_t)c;
+    blocks[k].raw_hash  = fnv1a32(src, len);
+    out_len += c;
+  }
+
+  kpk_header_t h;
+  memset(&h, 0, sizeof(h));
+  h.magic       = KPK_MAGIC;
+  h.algo        = store ? KPK_ALGO_STORE : KPK_ALGO_LZ4;
+  h.header_size = (uint32_t)(sizeof(h) + nblk * sizeof(kpk_block_t));
+  h.raw_size    = raw_size;
+  h.block_size  = bs;
+  h.block_count = nblk;
+  h.checksum    = fnv1a32(blocks, nblk * sizeof(kpk_block_t));
+
+  FILE* o = fopen(argv[ai + 1], "wb");
+  if (!o) { perror(argv[ai + 1]); return 1; }
+  if (fwrite(&h, sizeof(h), 1, o) != 1 ||
+      fwrite(blocks, sizeof(kpk_block_t), nblk, o) != nblk ||
+      fwrite(out, 1, out_len, o) != out_len) {
+    perror("write");
+    return 1;
+  }
+  fclose(o);
+
+  size_t total = h.header_size + out_len;
+  printf("kpack: %s %u -> %zu bytes (%zu%%), %u blocks of %u\n",
+         store ? "store" : "lz4", raw_size, total, total * 100 / raw_size, nblk, bs);
+
+  free(tmp);
+  free(out);
+  free(blocks);
+  free(raw);
+  return 0;
+}
@@ -0,0 +1,217 @@
+// Host-side reader for the kernel telemetry ring (see src/tel_ring.h).
+//
+//   telread [-n] [-v] bar2.bin
+//
+// Maps the file behind the pci-testdev memory BAR (vm-pci.sh: BAR=...) and
+// follows the ring: log records go to stdout as they were written to COM1,
+// traces are decoded one per line, and lost records are reported from the
+// sequence gaps. A new kernel boot (new epoch) is picked up without
+// restarting. -n drains what is there and exits, -v adds seq/cpu/time for
+// every record on stderr.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/tel_ring.h"
+
+static volatile sig_atomic_t s_stop;
+
+static uint64_t s_records, s_bytes, s_lost, s_bench_records, s_bench_bytes;
+
+static void on_signal(int sig) {
+  (void)sig;
+  s_stop = 1;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: telread [-n] [-v] bar2.bin\n");
+  exit(2);
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t tsc_us(const volatile tel_ring_hdr_t* h, uint64_t tsc) {
+  return h->tsc_khz ? (tsc - h->epoch) * 1000u / h->tsc_khz : 0;
+}
+
+static void flush_bench(void) {
+  if (!s_bench_records) return;
+  fprintf(stderr, "[telread] bench: %llu records, %llu payload bytes\n",
+          (unsigned long long)s_bench_records, (unsigned long long)s_bench_bytes);
+  s_bench_records = s_bench_bytes = 0;
+}
+
+static void show(const volatile tel_ring_hdr_t* h, const tel_rec_t* r,
+                 const uint8_t* payload, uint32_t len, int verbose) {
+  if (verbose) {
+    fflush(stdout);
+    fprintf(stderr, "[telread] #%u cpu%u +%llu us type=%u len=%u\n", r->seq, r->cpu,
+            (unsigned long long)tsc_us(h, r->tsc), r->type, len);
+  }
+  if (r->type != TEL_REC_BENCH) flush_bench();
+
+  switch (r->type) {
+    case TEL_REC_LOG:
+      fwrite(payload, 1, len, stdout);
+      break;
+    case TEL_REC_TRACE: {
+      tel_trace_t t;
+      if (len < sizeof(t)) break;
+      memcpy(&t, payload, sizeof(t));
+      if (t.id == TEL_TRACE_TIMELINE) {
+        char name[9];
+        for (int i = 0; i < 8; ++i) name[i] = (char)(t.a1 >> (i * 8));
+        name[8] = 0;
+        printf("[tel] mark %llu '%s' at %llu us\n", (unsigned long long)t.a0, name,
+               (unsigned long long)tsc_us(h, r->tsc));
+      } else {
+        printf("[tel] trace id=%u a0=%llu a1=%llu at %llu us\n", t.id, (unsigned long long)t.a0,
+               (unsigned long long)t.a1, (unsigned long long)tsc_us(h, r->tsc));
+      }
+      break;
+    }
+    case TEL_REC_BENCH:
+      s_bench_records++;
+      s_bench_bytes += len;
+      break;
+    default:
+      fprintf(stderr, "[telread] unknown record type %u, %u bytes\n", r->type, len);
+      break;
+  }
+}
+
+// Waits for a published ring; 0 when stopped first (or at once with -n).
+static int attach(const volatile tel_ring_hdr_t* h, size_t map_size, int once) {
+  for (;;) {
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == TEL_MAGIC) {
+      if (h->version != TEL_VERSION || h->hdr_size < sizeof(tel_ring_hdr_t) ||
+          (uint64_t)h->hdr_size + h->data_size > map_size || h->data_size % TEL_REC_ALIGN) {
+        fprintf(stderr, "[telread] bad ring header (version %u, hdr %u, data %u)\n",
+                h->version, h->hdr_size, h->data_size);
+        return 0;
+      }
+      return 1;
+    }
+    if (once || s_stop) return 0;
+    usleep(10000);
+  }
+}
+
+int main(int argc, char** argv) {
+  int once = 0, verbose = 0, ai = 1;
+
+  for (; ai < argc && argv[ai][0] == '-'; ++ai) {
+    if (!strcmp(argv[ai], "-n")) {
+      once = 1;
+    } else if (!strcmp(argv[ai], "-v")) {
+      verbose = 1;
+    } else {
+      usage();
+    }
+  }
+  if (argc - ai != 1) usage();
+
+  int fd = open(argv[ai], O_RDWR);
+  if (fd < 0) { perror(argv[ai]); return 1; }
+  struct stat st;
+  if (fstat(fd, &st) < 0) { perror("fstat"); return 1; }
+  if ((size_t)st.st_size < 2 * sizeof(tel_ring_hdr_t)) {
+    fprintf(stderr, "telread: %s is too small for a ring\n", argv[ai]);
+    return 1;
+  }
+  void* map = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) { perror("mmap"); return 1; }
+  close(fd);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  volatile tel_ring_hdr_t* h = (volatile tel_ring_hdr_t*)map;
+  double t0 = now_s();
+
+  while (!s_stop && attach(h, (size_t)st.st_size, once)) {
+    const volatile uint8_t* data = (const volatile uint8_t*)map + h->hdr_size;
+    uint32_t size  = h->data_size;
+    uint64_t epoch = h->epoch;
+    uint32_t tail  = h->tail;
+    uint32_t expect = 0;
+    int      have_seq = 0;
+    fprintf(stderr, "[telread] ring epoch %llx, %u data bytes, tsc %u kHz\n",
+            (unsigned long long)epoch, size, h->tsc_khz);
+
+    for (;;) {
+      if (s_stop) break;
+      if (h->magic != TEL_MAGIC || h->epoch != epoch) {
+        flush_bench();
+        fprintf(stderr, "[telread] producer restarted\n");
+        break;
+      }
+
+      uint32_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+      if (head >= size || head % TEL_REC_ALIGN) {
+        fprintf(stderr, "[telread] bad head %u, waiting for a restart\n", head);
+        usleep(100000);
+        continue;
+      }
+      if (head == tail) {
+        flush_bench();
+        fflush(stdout);
+        if (once) { s_stop = 1; break; }
+        usleep(1000);
+        continue;
+      }
+
+      while (tail != head) {
+        uint32_t to_end = size - tail;
+        if (to_end < sizeof(tel_rec_t)) { tail = 0; continue; }
+
+        tel_rec_t r;
+        memcpy(&r, (const void*)(data + tail), sizeof(r));
+        if (r.len < sizeof(r) || r.len > to_end) {
+          fprintf(stderr, "[telread] corrupt record at %u (len %u), skipping to head\n", tail, r.len);
+          tail = head;
+          break;
+        }
+        if (r.type == TEL_REC_PAD) { tail = 0; continue; }
+
+        if (have_seq && r.seq != expect) {
+          uint32_t lost = r.seq - expect;
+          s_lost += lost;
+          fflush(stdout);
+          fprintf(stderr, "[telread] lost %u records\n", lost);
+        }
+        have_seq = 1;
+        expect   = r.seq + 1;
+
+        uint32_t len = r.len - (uint32_t)sizeof(r);
+        show(h, &r, (const uint8_t*)(data + tail + sizeof(r)), len, verbose);
+        s_records++;
+        s_bytes += r.len;
+
+        tail += (r.len + TEL_REC_ALIGN - 1) & ~(TEL_REC_ALIGN - 1);
+        if (tail == size) tail = 0;
+      }
+      __atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+    }
+  }
+
+  double dt = now_s() - t0;
+  fflush(stdout);
+  fprintf(stderr, "[telread] %llu records, %llu bytes, %llu lost, producer dropped %llu, %.2f MB/s\n",
+          (unsigned long long)s_records, (unsigned long long)s_bytes,
+          (unsigned long long)s_lost, (unsigned long long)h->dropped,
+          dt > 0 ? (double)s_bytes / dt / 1e6 : 0.0);
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/DevicePathLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/PrintLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -12,9 +13,12 @@
 
 #include <Protocol/GraphicsOutput.h>
 #include <Protocol/LoadedImage.h>
+#include <Protocol/MpService.h>
 #include <Protocol/SimpleFileSystem.h>
 
 #include "Elf32.h"
+#include "Elf64.h"
+#include "Kpk.h"
 #include "Mb2.h"
 
 typedef struct {
@@ -27,45 +31,319 @@ extern UINT8 TrampolineStart;
 extern UINT8 TrampolineEnd;
 extern VOID  TrampolineEntry(VOID *Params);
 
+// Params for Trampoline64, used for ELF64 kernels: no drop to protected
+// mode, CR3 is switched to an identity map built by the loader instead.
+typedef struct {
+  UINT64 KernelEntry;
+  UINT64 MbInfo;
+  UINT64 StackTop;
+  UINT64 PageTables;
+} TRAMPOLINE64_PARAMS;
+
+extern UINT8 Trampoline64Start;
+extern UINT8 Trampoline64End;
+
+// Options parsed from the image load options. The first token is the image
+// name itself and is skipped; "dev=<text device path>" pins the volume the
+// kernel is read from, "mp=0" keeps all loader work on the BSP, the first
+// other token is the kernel path and every token after it a boot module.
+// A token in double quotes may contain spaces, so a module can carry a
+// command line: "\initrd.img root=ram". Any other key=value token that is
+// not a path ("loglevel=1", "smp.maxcpus=2") goes to the kernel's own
+// command line, which is passed on in the MB2 cmdline tag.
+#define BL_MAX_MODULES 16
+
+typedef struct {
+  CHAR16 *KernelPath;
+  CHAR16 *DeviceHint;
+  BOOLEAN NoMp;
+  CHAR16 *Modules[BL_MAX_MODULES];   // path, then optional arguments
+  UINTN   ModuleCount;
+  CHAR8   *Cmdline;                  // kernel parameters, space separated
+} BOOT_OPTIONS;
+
 STATIC CHAR16 *
-GetKernelPathFromLoadOptions(EFI_LOADED_IMAGE_PROTOCOL *Loaded)
+DupToken(CONST CHAR16 *s, UINTN len)
 {
-  if (Loaded == NULL || Loaded->LoadOptions == NULL || Loaded->LoadOptionsSize < sizeof(CHAR16)) {
+  CHAR16 *out = AllocateZeroPool((len + 1) * sizeof(CHAR16));
+  if (out == NULL) {
     return NULL;
   }
 
+  CopyMem(out, s, len * sizeof(CHAR16));
+  out[len] = 0;
+  return out;
+}
+
+STATIC BOOLEAN
+TokenHasPrefix(CONST CHAR16 *s, UINTN len, CONST CHAR16 *prefix)
+{
+  UINTN pl = StrLen(prefix);
+  return len >= pl && StrnCmp(s, prefix, pl) == 0;
+}
+
+// Kernel parameters are key=value; a token with a path separator before
+// the '=' is a module or kernel path that happens to contain one.
+STATIC BOOLEAN
+IsKernelParam(CONST CHAR16 *s, UINTN len)
+{
+  for (UINTN i = 0; i < len; i++) {
+    if (s[i] == L'\\' || s[i] == L'/' || s[i] == L' ') {
+      return FALSE;
+    }
+    if (s[i] == L'=') {
+      return i > 0;
+    }
+  }
+  return FALSE;
+}
+
+// The buffer holds the whole option string, so it never overflows.
+STATIC VOID
+AppendKernelParam(CHAR8 *Cmdline, CONST CHAR16 *s, UINTN len)
+{
+  UINTN at = AsciiStrLen(Cmdline);
+  if (at > 0) {
+    Cmdline[at++] = ' ';
+  }
+  for (UINTN i = 0; i < len; i++) {
+    Cmdline[at++] = (s[i] >= 0x20 && s[i] < 0x7F) ? (CHAR8)s[i] : '?';
+  }
+  Cmdline[at] = 0;
+}
+
+STATIC VOID
+ParseLoadOptions(EFI_LOADED_IMAGE_PROTOCOL *Loaded, BOOT_OPTIONS *Opts)
+{
+  ZeroMem(Opts, sizeof(*Opts));
+
+  if (Loaded == NULL || Loaded->LoadOptions == NULL || Loaded->LoadOptionsSize < sizeof(CHAR16)) {
+    return;
+  }
+
   CHAR16 *s = (CHAR16 *)Loaded->LoadOptions;
   UINTN  n  = Loaded->LoadOptionsSize / sizeof(CHAR16);
 
+  Opts->Cmdline = AllocateZeroPool(n + 1);
+
   UINTN i = 0;
-  while (i < n && (s[i] == L' ' || s[i] == L'\t')) {
-    i++;
+  for (UINTN tok = 0; ; tok++) {
+    while (i < n && (s[i] == L' ' || s[i] == L'\t')) {
+      i++;
+    }
+    if (i >= n || s[i] == 0) {
+      break;
+    }
+
+    UINTN start = i;
+    UINTN len;
+    if (s[i] == L'"') {
+      start = ++i;
+      while (i < n && s[i] != 0 && s[i] != L'"') {
+        i++;
+      }
+      len = i - start;
+      if (i < n && s[i] == L'"') {
+        i++;
+      }
+    } else {
+      while (i < n && s[i] != 0 && s[i] != L' ' && s[i] != L'\t') {
+        i++;
+      }
+      len = i - start;
+    }
+
+    if (tok == 0) {
+      continue;
+    }
+    if (TokenHasPrefix(&s[start], len, L"dev=")) {
+      if (Opts->DeviceHint == NULL) {
+        Opts->DeviceHint = DupToken(&s[start + 4], len - 4);
+      }
+    } else if (len == 4 && TokenHasPrefix(&s[start], len, L"mp=0")) {
+      Opts->NoMp = TRUE;
+    } else if (IsKernelParam(&s[start], len)) {
+      if (Opts->Cmdline != NULL) {
+        AppendKernelParam(Opts->Cmdline, &s[start], len);
+      }
+    } else if (Opts->KernelPath == NULL) {
+      Opts->KernelPath = DupToken(&s[start], len);
+    } else if (Opts->ModuleCount < BL_MAX_MODULES) {
+      Opts->Modules[Opts->ModuleCount++] = DupToken(&s[start], len);
+    } else {
+      DEBUG((DEBUG_WARN, "[BL] more than %u modules, ignoring the rest\n", BL_MAX_MODULES));
+    }
   }
-  while (i < n && s[i] != 0 && s[i] != L' ' && s[i] != L'\t') {
-    i++;
+}
+
+// TSC rate measured once against Stall(); only used to print durations.
+STATIC UINT64 mTscKhz;
+
+STATIC UINT64
+TscKhz(VOID)
+{
+  if (mTscKhz == 0) {
+    UINT64 t0 = AsmReadTsc();
+    gBS->Stall(1000);
+    mTscKhz = AsmReadTsc() - t0;
+    if (mTscKhz == 0) {
+      mTscKhz = 1;
+    }
   }
-  while (i < n && (s[i] == L' ' || s[i] == L'\t')) {
-    i++;
+  return mTscKhz;
+}
+
+STATIC UINT64
+TscToUs(UINT64 cycles)
+{
+  return (cycles * 1000) / TscKhz();
+}
+
+// Stage stamps for the kernel. They start out here and move into the MB2
+// timeline tag once BuildMb2InfoBelow4G allocates it, so the stamps taken
+// after that (ExitBootServices, the jump) land directly in the tag.
+STATIC UINT64 mStampsEarly[BL_STAGE_COUNT];
+STATIC UINT64 *mStamps = mStampsEarly;
+
+STATIC VOID
+TimelineMark(UINTN Stage)
+{
+  mStamps[Stage] = AsmReadTsc();
+}
+
+// Work splitting over EFI MP Services. Chunks are claimed from a shared
+// counter by every AP and by the BSP itself; without the protocol (or with
+// mp=0) the BSP runs them all. Chunk functions run on APs, so they must not
+// touch boot services or DEBUG output.
+typedef EFI_STATUS (*PAR_FN)(VOID *Ctx, UINTN Index);
+
+typedef struct {
+  volatile UINT32 Next;
+  UINT32          Count;
+  volatile UINT32 Failed;
+  EFI_STATUS      Status;
+  PAR_FN          Fn;
+  VOID            *Ctx;
+  UINT64          *Busy;    // cycles spent in each chunk
+} PAR_JOB;
+
+STATIC EFI_MP_SERVICES_PROTOCOL *mMp;
+STATIC UINTN                    mMpCpus = 1;
+
+STATIC VOID
+InitMpServices(BOOLEAN Enable)
+{
+  if (!Enable) {
+    DEBUG((DEBUG_INFO, "[BL] MP services disabled by mp=0\n"));
+    return;
   }
 
-  if (i >= n || s[i] == 0) {
-    return NULL;
+  EFI_STATUS st = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID **)&mMp);
+  if (EFI_ERROR(st) || mMp == NULL) {
+    DEBUG((DEBUG_INFO, "[BL] MP services not available: %r, BSP only\n", st));
+    mMp = NULL;
+    return;
   }
 
-  UINTN start = i;
-  while (i < n && s[i] != 0 && s[i] != L' ' && s[i] != L'\t') {
-    i++;
+  UINTN total = 0, enabled = 0;
+  st = mMp->GetNumberOfProcessors(mMp, &total, &enabled);
+  if (EFI_ERROR(st) || enabled < 2) {
+    mMp = NULL;
+    return;
   }
 
-  UINTN len = i - start;
-  CHAR16 *out = AllocateZeroPool((len + 1) * sizeof(CHAR16));
-  if (out == NULL) {
-    return NULL;
+  mMpCpus = enabled;
+  DEBUG((DEBUG_INFO, "[BL] MP services: %u of %u CPUs enabled\n", (UINT32)enabled, (UINT32)total));
+}
+
+STATIC VOID EFIAPI
+ParWorker(VOID *Arg)
+{
+  PAR_JOB *job = (PAR_JOB *)Arg;
+
+  for (;;) {
+    UINT32 i = InterlockedIncrement(&job->Next) - 1;
+    if (i >= job->Count) {
+      break;
+    }
+
+    UINT64 t0 = AsmReadTsc();
+    EFI_STATUS st = job->Fn(job->Ctx, i);
+    job->Busy[i] = AsmReadTsc() - t0;
+
+    if (EFI_ERROR(st) && InterlockedCompareExchange32(&job->Failed, 0, 1) == 0) {
+      job->Status = st;
+    }
   }
+}
 
-  CopyMem(out, &s[start], len * sizeof(CHAR16));
-  out[len] = 0;
-  return out;
+STATIC EFI_STATUS
+ParallelFor(CONST CHAR8 *Name, UINTN Count, PAR_FN Fn, VOID *Ctx)
+{
+  if (Count == 0) {
+    return EFI_SUCCESS;
+  }
+
+  PAR_JOB job;
+  ZeroMem(&job, sizeof(job));
+  job.Count  = (UINT32)Count;
+  job.Fn     = Fn;
+  job.Ctx    = Ctx;
+  job.Status = EFI_SUCCESS;
+  job.Busy   = AllocateZeroPool(Count * sizeof(UINT64));
+  if (job.Busy == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  UINT64  t0      = AsmReadTsc();
+  BOOLEAN onAps   = FALSE;
+  BOOLEAN waitAps = FALSE;
+  EFI_EVENT done  = NULL;
+
+  if (mMp != NULL && Count > 1) {
+    // Non-blocking first so the BSP can take chunks too; some firmware
+    // only supports the blocking form, in which case the BSP just mops up.
+    EFI_STATUS st = gBS->CreateEvent(0, TPL_NOTIFY, NULL, NULL, &done);
+    if (!EFI_ERROR(st)) {
+      st = mMp->StartupAllAPs(mMp, ParWorker, FALSE, done, 0, &job, NULL);
+      if (EFI_ERROR(st)) {
+        gBS->CloseEvent(done);
+        done = NULL;
+      } else {
+        onAps   = TRUE;
+        waitAps = TRUE;
+      }
+    }
+    if (!onAps) {
+      st = mMp->StartupAllAPs(mMp, ParWorker, FALSE, NULL, 0, &job, NULL);
+      onAps = !EFI_ERROR(st);
+    }
+  }
+
+  ParWorker(&job);
+
+  if (waitAps) {
+    UINTN idx = 0;
+    gBS->WaitForEvent(1, &done, &idx);
+    gBS->CloseEvent(done);
+  }
+
+  UINT64 wall = AsmReadTsc() - t0;
+  UINT64 work = 0;
+  for (UINTN i = 0; i < Count; i++) {
+    work += job.Busy[i];
+  }
+  FreePool(job.Busy);
+
+  // Busy time over wall time is how many CPUs were working on average, not
+  // a speedup: chunks slow down when they share memory bandwidth, which
+  // inflates work. The speedup is this wall time against an mp=0 boot's.
+  UINT64 x100 = (wall != 0) ? (work * 100) / wall : 100;
+  DEBUG((DEBUG_INFO, "[BL] MP %a: %u chunks on %u CPUs, wall %lu us, work %lu us, parallelism %u.%02u\n",
+         Name, (UINT32)Count, onAps ? (UINT32)mMpCpus : 1u, TscToUs(wall), TscToUs(work),
+         (UINT32)(x100 / 100), (UINT32)(x100 % 100)));
+
+  return job.Status;
 }
 
 STATIC EFI_STATUS
@@ -101,16 +379,107 @@ GetFileSizeNoGuid(EFI_FILE_PROTOCOL *File, UINTN *OutSize)
 }
 
 STATIC EFI_STATUS
-ReadFileToBufferAnyFs(IN CHAR16 *Path, OUT VOID **OutBuf, OUT UINTN *OutSize)
+OpenFileOnHandle(EFI_HANDLE Handle, CHAR16 *Path,
+                 OUT EFI_FILE_PROTOCOL **OutRoot, OUT EFI_FILE_PROTOCOL **OutFile, OUT UINTN *OutSize)
+{
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Sfs = NULL;
+  EFI_STATUS st = gBS->HandleProtocol(Handle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Sfs);
+  if (EFI_ERROR(st) || Sfs == NULL) {
+    return EFI_UNSUPPORTED;
+  }
+
+  EFI_FILE_PROTOCOL *Root = NULL;
+  st = Sfs->OpenVolume(Sfs, &Root);
+  if (EFI_ERROR(st) || Root == NULL) {
+    return EFI_ERROR(st) ? st : EFI_NOT_FOUND;
+  }
+
+  CHAR16 *Try1 = Path;
+  CHAR16 *Try2 = NULL;
+  if (Path != NULL && Path[0] == L'\\') {
+    Try2 = Path + 1;
+  }
+
+  EFI_FILE_PROTOCOL *File = NULL;
+  st = Root->Open(Root, &File, Try1, EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR(st) && Try2 != NULL) {
+    st = Root->Open(Root, &File, Try2, EFI_FILE_MODE_READ, 0);
+  }
+
+  if (EFI_ERROR(st) || File == NULL) {
+    Root->Close(Root);
+    return EFI_NOT_FOUND;
+  }
+
+  UINTN Size = 0;
+  st = GetFileSizeNoGuid(File, &Size);
+  if (EFI_ERROR(st) || Size == 0) {
+    DEBUG((DEBUG_ERROR, "[BL] GetFileSize failed: %r size=%u\n", st, (UINT32)Size));
+    File->Close(File);
+    Root->Close(Root);
+    return EFI_ERROR(st) ? st : EFI_LOAD_ERROR;
+  }
+
+  *OutRoot = Root;
+  *OutFile = File;
+  *OutSize = Size;
+  return EFI_SUCCESS;
+}
+
+// Lookup order: the volume named by the dev= hint, then the volume this
+// image was loaded from (normally the ESP holding kernel.bin), then every
+// other Simple File System handle.
+STATIC EFI_STATUS
+OpenFileAnyFs(IN EFI_LOADED_IMAGE_PROTOCOL *Loaded, IN CHAR16 *DeviceHint OPTIONAL, IN CHAR16 *Path,
+              OUT EFI_FILE_PROTOCOL **OutRoot, OUT EFI_FILE_PROTOCOL **OutFile, OUT UINTN *OutSize)
 {
-  if (OutBuf == NULL || OutSize == NULL) {
+  if (OutRoot == NULL || OutFile == NULL || OutSize == NULL) {
     return EFI_INVALID_PARAMETER;
   }
 
-  *OutBuf  = NULL;
+  *OutRoot = NULL;
+  *OutFile = NULL;
   *OutSize = 0;
 
   EFI_STATUS st;
+  UINT64     t0    = AsmReadTsc();
+  UINTN      tried = 0;
+
+  EFI_HANDLE HintHandle = NULL;
+  if (DeviceHint != NULL) {
+    EFI_DEVICE_PATH_PROTOCOL *Dp = ConvertTextToDevicePath(DeviceHint);
+    if (Dp != NULL) {
+      EFI_DEVICE_PATH_PROTOCOL *Rem = Dp;
+      st = gBS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &Rem, &HintHandle);
+      if (EFI_ERROR(st)) {
+        HintHandle = NULL;
+      }
+      FreePool(Dp);
+    }
+    if (HintHandle == NULL) {
+      DEBUG((DEBUG_WARN, "[BL] dev=%s does not name a file system, ignoring\n", DeviceHint));
+    } else {
+      tried++;
+      st = OpenFileOnHandle(HintHandle, Path, OutRoot, OutFile, OutSize);
+      if (!EFI_ERROR(st)) {
+        DEBUG((DEBUG_INFO, "[BL] %s found on hinted volume: %u bytes, lookup %lu us\n",
+               Path, (UINT32)*OutSize, TscToUs(AsmReadTsc() - t0)));
+        return EFI_SUCCESS;
+      }
+    }
+  }
+
+  EFI_HANDLE BootHandle = (Loaded != NULL) ? Loaded->DeviceHandle : NULL;
+  if (BootHandle != NULL && BootHandle != HintHandle) {
+    tried++;
+    st = OpenFileOnHandle(BootHandle, Path, OutRoot, OutFile, OutSize);
+    if (!EFI_ERROR(st)) {
+      DEBUG((DEBUG_INFO, "[BL] %s found on boot volume: %u bytes, lookup %lu us\n",
+             Path, (UINT32)*OutSize, TscToUs(AsmReadTsc() - t0)));
+      return EFI_SUCCESS;
+    }
+  }
+
   EFI_HANDLE *Handles     = NULL;
   UINTN      HandleCount  = 0;
 
@@ -126,227 +495,1432 @@ ReadFileToBufferAnyFs(IN CHAR16 *Path, OUT VOID **OutBuf, OUT UINTN *OutSize)
     return st;
   }
 
-  DEBUG((DEBUG_INFO, "[BL] Found %u SimpleFS handles\n", (UINT32)HandleCount));
+  DEBUG((DEBUG_INFO, "[BL] %s not on boot volume, scanning %u SimpleFS handles\n",
+         Path, (UINT32)HandleCount));
 
   for (UINTN hi = 0; hi < HandleCount; hi++) {
-    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Sfs = NULL;
-    st = gBS->HandleProtocol(Handles[hi], &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Sfs);
-    if (EFI_ERROR(st) || Sfs == NULL) {
+    if (Handles[hi] == BootHandle || Handles[hi] == HintHandle) {
       continue;
     }
 
-    EFI_FILE_PROTOCOL *Root = NULL;
-    st = Sfs->OpenVolume(Sfs, &Root);
-    if (EFI_ERROR(st) || Root == NULL) {
-      continue;
+    tried++;
+    st = OpenFileOnHandle(Handles[hi], Path, OutRoot, OutFile, OutSize);
+    if (!EFI_ERROR(st)) {
+      DEBUG((DEBUG_INFO, "[BL] %s found on volume %u: %u bytes, lookup %lu us (%u volumes tried)\n",
+             Path, (UINT32)hi, (UINT32)*OutSize, TscToUs(AsmReadTsc() - t0), (UINT32)tried));
+      FreePool(Handles);
+      return EFI_SUCCESS;
     }
+  }
+
+  DEBUG((DEBUG_ERROR, "[BL] %s not found, lookup %lu us (%u volumes tried)\n",
+         Path, TscToUs(AsmReadTsc() - t0), (UINT32)tried));
+  FreePool(Handles);
+  return EFI_NOT_FOUND;
+}
+
+STATIC VOID
+CloseFileAnyFs(EFI_FILE_PROTOCOL *Root, EFI_FILE_PROTOCOL *File)
+{
+  if (File != NULL) {
+    File->Close(File);
+  }
+  if (Root != NULL) {
+    Root->Close(Root);
+  }
+}
+
+// Reads exactly Len bytes at Offset. The firmware may return short reads, so
+// loop until the request is satisfied or the file ends.
+STATIC EFI_STATUS
+ReadFileAt(EFI_FILE_PROTOCOL *File, UINT64 Offset, VOID *Buf, UINTN Len)
+{
+  EFI_STATUS st = File->SetPosition(File, Offset);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
 
-    CHAR16 *Try1 = Path;
-    CHAR16 *Try2 = NULL;
-    if (Path != NULL && Path[0] == L'\\') {
-      Try2 = Path + 1;
+  UINT8 *p = (UINT8 *)Buf;
+  while (Len > 0) {
+    UINTN chunk = Len;
+    st = File->Read(File, &chunk, p);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+    if (chunk == 0) {
+      return EFI_END_OF_FILE;
     }
+    p   += chunk;
+    Len -= chunk;
+  }
+
+  return EFI_SUCCESS;
+}
 
-    EFI_FILE_PROTOCOL *File = NULL;
-    st = Root->Open(Root, &File, Try1, EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(st) && Try2 != NULL) {
-      st = Root->Open(Root, &File, Try2, EFI_FILE_MODE_READ, 0);
+// Pipelined reads. With a revision 2 file protocol up to BL_IO_DEPTH
+// ReadEx requests of BL_IO_CHUNK bytes are kept in flight, each signalling
+// its own event. Completions are consumed in file order and reported to
+// OnChunk, so the caller can work on what has arrived while the rest is
+// still being read. Firmware without ReadEx gets the same chunks through
+// plain Read, one at a time.
+#define BL_IO_CHUNK (1u * 1024 * 1024)
+#define BL_IO_DEPTH 4
+
+// Done is how many bytes from the start of the request are in memory. An
+// error return stops the read and is passed on to the caller.
+typedef EFI_STATUS (*READ_PROGRESS)(VOID *Ctx, UINTN Done);
+
+typedef struct {
+  EFI_FILE_IO_TOKEN Token;
+  UINTN             Off;      // from the start of the request
+  UINTN             Len;
+} IO_SLOT;
+
+STATIC BOOLEAN
+FileCanReadAsync(CONST EFI_FILE_PROTOCOL *File)
+{
+  return File->Revision >= EFI_FILE_PROTOCOL_REVISION2 && File->ReadEx != NULL;
+}
+
+// Runs the ReadEx queue as far as it gets. Returns with *Done at the end of
+// the last chunk consumed; *Unsupported is set when the very first ReadEx is
+// refused, in which case the caller continues with plain Read.
+STATIC EFI_STATUS
+ReadChunksAsync(EFI_FILE_PROTOCOL *File, UINT64 Offset, UINT8 *Dst, UINTN Len,
+                READ_PROGRESS OnChunk, VOID *Ctx, IN OUT UINTN *Done, OUT BOOLEAN *Unsupported)
+{
+  IO_SLOT slot[BL_IO_DEPTH];
+  ZeroMem(slot, sizeof(slot));
+  *Unsupported = FALSE;
+
+  EFI_STATUS st = EFI_SUCCESS;
+  UINTN ev = 0;
+  for (; ev < BL_IO_DEPTH && !EFI_ERROR(st); ev++) {
+    st = gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &slot[ev].Token.Event);
+  }
+  if (EFI_ERROR(st)) {
+    ev--;
+    *Unsupported = TRUE;
+  }
+
+  UINTN issued = *Done, head = 0, inflight = 0;
+  while (!EFI_ERROR(st) && *Done < Len) {
+    // Keep the queue full.
+    while (inflight < BL_IO_DEPTH && issued < Len) {
+      IO_SLOT *q = &slot[(head + inflight) % BL_IO_DEPTH];
+      q->Off = issued;
+      q->Len = (Len - issued < BL_IO_CHUNK) ? Len - issued : BL_IO_CHUNK;
+      q->Token.Status     = EFI_SUCCESS;
+      q->Token.BufferSize = q->Len;
+      q->Token.Buffer     = Dst + issued;
+
+      st = File->SetPosition(File, Offset + issued);
+      if (!EFI_ERROR(st)) {
+        st = File->ReadEx(File, &q->Token);
+      }
+      if (EFI_ERROR(st)) {
+        *Unsupported = (st == EFI_UNSUPPORTED && inflight == 0 && issued == *Done);
+        break;
+      }
+      inflight++;
+      issued += q->Len;
+    }
+    if (EFI_ERROR(st)) {
+      break;
     }
 
-    if (EFI_ERROR(st) || File == NULL) {
-      Root->Close(Root);
-      continue;
+    IO_SLOT *q = &slot[head];
+    UINTN index;
+    st = gBS->WaitForEvent(1, &q->Token.Event, &index);
+    head = (head + 1) % BL_IO_DEPTH;
+    inflight--;
+    if (!EFI_ERROR(st)) {
+      st = q->Token.Status;
+    }
+    // A short completion is finished synchronously; requests still queued
+    // behind it carry their own positions.
+    if (!EFI_ERROR(st) && q->Token.BufferSize < q->Len) {
+      UINTN got = q->Token.BufferSize;
+      st = ReadFileAt(File, Offset + q->Off + got, Dst + q->Off + got, q->Len - got);
+    }
+    if (!EFI_ERROR(st)) {
+      *Done = q->Off + q->Len;
+      if (OnChunk != NULL) {
+        st = OnChunk(Ctx, *Done);
+      }
     }
+  }
 
-    UINTN Size = 0;
-    st = GetFileSizeNoGuid(File, &Size);
-    if (EFI_ERROR(st) || Size == 0) {
-      DEBUG((DEBUG_ERROR, "[BL] GetFileSize failed: %r size=%u\n", st, (UINT32)Size));
-      File->Close(File);
-      Root->Close(Root);
-      continue;
+  // Whatever is still queued writes into Dst and signals its event; both
+  // must outlive it.
+  for (; inflight > 0; inflight--) {
+    UINTN index;
+    gBS->WaitForEvent(1, &slot[head].Token.Event, &index);
+    head = (head + 1) % BL_IO_DEPTH;
+  }
+  for (UINTN i = 0; i < ev; i++) {
+    gBS->CloseEvent(slot[i].Token.Event);
+  }
+
+  if (*Unsupported) {
+    return EFI_SUCCESS;
+  }
+  return st;
+}
+
+STATIC EFI_STATUS
+ReadFilePipelined(EFI_FILE_PROTOCOL *File, UINT64 Offset, VOID *Buf, UINTN Len,
+                  READ_PROGRESS OnChunk, VOID *Ctx, CONST CHAR8 *What)
+{
+  UINT8 *dst = (UINT8 *)Buf;
+  UINT64 t0  = AsmReadTsc();
+  UINTN done = 0;
+  BOOLEAN async = FileCanReadAsync(File);
+  EFI_STATUS st = EFI_SUCCESS;
+
+  if (async) {
+    BOOLEAN unsupported;
+    st = ReadChunksAsync(File, Offset, dst, Len, OnChunk, Ctx, &done, &unsupported);
+    async = !unsupported;
+  }
+  while (!EFI_ERROR(st) && done < Len) {
+    UINTN n = (Len - done < BL_IO_CHUNK) ? Len - done : BL_IO_CHUNK;
+    st = ReadFileAt(File, Offset + done, dst + done, n);
+    if (!EFI_ERROR(st)) {
+      done += n;
+      if (OnChunk != NULL) {
+        st = OnChunk(Ctx, done);
+      }
     }
+  }
 
-    VOID *Buf = AllocatePool(Size);
-    if (Buf == NULL) {
-      File->Close(File);
-      Root->Close(Root);
-      FreePool(Handles);
-      return EFI_OUT_OF_RESOURCES;
+  UINT64 us = TscToUs(AsmReadTsc() - t0);
+  if (EFI_ERROR(st)) {
+    DEBUG((DEBUG_ERROR, "[BL] read %a: %r after %lu of %lu bytes\n", What, st, (UINT64)done, (UINT64)Len));
+    return st;
+  }
+  UINTN chunks = (Len + BL_IO_CHUNK - 1) / BL_IO_CHUNK;
+  UINTN depth  = !async ? 1 : (chunks < BL_IO_DEPTH) ? chunks : BL_IO_DEPTH;
+  DEBUG((DEBUG_INFO, "[BL] read %a: %lu bytes via %a (%u in flight), %lu us, %lu MB/s\n",
+         What, (UINT64)Len, async ? "ReadEx" : "Read", (UINT32)depth, us,
+         (us != 0) ? (UINT64)Len / us : 0));
+  return EFI_SUCCESS;
+}
+
+// What the kernel's MB2 header asks of the loader.
+#define MB2_REQ_MAX_TYPES 16
+
+typedef struct {
+  BOOLEAN HasInfoRequest;     // without one, every tag the loader has is sent
+  UINTN   TypeCount;
+  UINT32  Types[MB2_REQ_MAX_TYPES];
+  BOOLEAN HasFramebuffer;
+  UINT32  FbWidth;            // 0 = no preference, as in the header tag
+  UINT32  FbHeight;
+  UINT32  FbDepth;
+  BOOLEAN ModuleAlign;
+} MB2_REQUEST;
+
+STATIC BOOLEAN
+Mb2Wants(CONST MB2_REQUEST *Req, UINT32 Type)
+{
+  if (!Req->HasInfoRequest) {
+    return TRUE;
+  }
+  for (UINTN i = 0; i < Req->TypeCount; i++) {
+    if (Req->Types[i] == Type) {
+      return TRUE;
     }
+  }
+  return FALSE;
+}
+
+// Info tags this loader can produce. A non-optional request for anything
+// else means the kernel cannot be booted as asked.
+STATIC BOOLEAN
+Mb2CanProvide(UINT32 Type)
+{
+  return Type == MB2_TAG_TYPE_BOOT_LOADER_NAME || Type == MB2_TAG_TYPE_FRAMEBUFFER ||
+         Type == MB2_TAG_TYPE_ACPI_OLD || Type == MB2_TAG_TYPE_ACPI_NEW ||
+         Type == MB2_TAG_TYPE_MMAP || Type == MB2_TAG_TYPE_EFI_MMAP ||
+         Type == MB2_TAG_TYPE_MODULE || Type == MB2_TAG_TYPE_CMDLINE ||
+         Type == MB2_TAG_BOOT_TIMELINE;
+}
 
-    UINTN ReadSize = Size;
-    st = File->Read(File, &ReadSize, Buf);
+STATIC EFI_STATUS
+ValidateMb2Header(VOID *Kernel, UINTN Size, OUT MB2_REQUEST *Req)
+{
+  UINT8 *p   = (UINT8 *)Kernel;
+  UINTN max  = (Size < 32768) ? Size : 32768;
 
-    File->Close(File);
-    Root->Close(Root);
+  ZeroMem(Req, sizeof(*Req));
 
-    if (EFI_ERROR(st) || ReadSize != Size) {
-      DEBUG((DEBUG_ERROR, "[BL] Read failed: %r read=%u exp=%u\n", st, (UINT32)ReadSize, (UINT32)Size));
-      FreePool(Buf);
+  for (UINTN off = 0; off + sizeof(MB2_HEADER) <= max; off += 8) {
+    MB2_HEADER *h = (MB2_HEADER *)(p + off);
+    if (h->magic != MB2_HEADER_MAGIC) {
       continue;
     }
 
-    DEBUG((DEBUG_INFO, "[BL] kernel.bin read OK: %u bytes\n", (UINT32)Size));
-    *OutBuf  = Buf;
-    *OutSize = Size;
-
-    FreePool(Handles);
+    UINT32 sum = h->magic + h->architecture + h->header_length + h->checksum;
+    if (sum != 0) {
+      return EFI_COMPROMISED_DATA;
+    }
+    if (h->architecture != 0) {
+      return EFI_UNSUPPORTED;
+    }
+    if (h->header_length < sizeof(MB2_HEADER) || off + h->header_length > max) {
+      return EFI_COMPROMISED_DATA;
+    }
+
+    UINT8   *t     = (UINT8 *)h + sizeof(MB2_HEADER);
+    UINT8   *tend  = (UINT8 *)h + h->header_length;
+    BOOLEAN hasEnd = FALSE;
+
+    while (t + sizeof(MB2_HEADER_TAG) <= tend) {
+      MB2_HEADER_TAG *tag = (MB2_HEADER_TAG *)t;
+      BOOLEAN optional = (tag->flags & MB2_HEADER_TAG_OPTIONAL) != 0;
+
+      if (tag->type == MB2_HEADER_TAG_END && tag->size == 8) {
+        hasEnd = TRUE;
+        break;
+      }
+      if (tag->size < sizeof(MB2_HEADER_TAG) || tag->size > (UINTN)(tend - t)) {
+        return EFI_COMPROMISED_DATA;
+      }
+
+      if (tag->type == MB2_HEADER_TAG_INFO_REQUEST) {
+        MB2_HEADER_TAG_INFO_REQ *r = (MB2_HEADER_TAG_INFO_REQ *)tag;
+        UINTN n = (tag->size - sizeof(MB2_HEADER_TAG)) / sizeof(UINT32);
+        Req->HasInfoRequest = TRUE;
+        for (UINTN i = 0; i < n; i++) {
+          UINT32 type = r->mbi_tag_types[i];
+          if (!Mb2CanProvide(type)) {
+            DEBUG((DEBUG_INFO, "[BL] MB2 request for info tag %u not supported%a\n",
+                   type, optional ? " (optional)" : ""));
+            if (!optional) {
+              return EFI_UNSUPPORTED;
+            }
+            continue;
+          }
+          if (Req->TypeCount < MB2_REQ_MAX_TYPES) {
+            Req->Types[Req->TypeCount++] = type;
+          }
+        }
+      } else if (tag->type == MB2_HEADER_TAG_FRAMEBUFFER && tag->size >= sizeof(MB2_HEADER_TAG_FB)) {
+        MB2_HEADER_TAG_FB *fb = (MB2_HEADER_TAG_FB *)tag;
+        Req->HasFramebuffer = TRUE;
+        Req->FbWidth        = fb->width;
+        Req->FbHeight       = fb->height;
+        Req->FbDepth        = fb->depth;
+      } else if (tag->type == MB2_HEADER_TAG_MODULE_ALIGN) {
+        Req->ModuleAlign = TRUE;
+      } else if (!optional) {
+        DEBUG((DEBUG_ERROR, "[BL] MB2 header tag %u not supported\n", (UINT32)tag->type));
+        return EFI_UNSUPPORTED;
+      }
+      t += MB2_ALIGN8(tag->size);
+    }
+
+    if (hasEnd) {
+      DEBUG((DEBUG_INFO, "[BL] MB2 header: %u info tags requested%a, fb %ux%ux%u%a\n",
+             (UINT32)Req->TypeCount, Req->HasInfoRequest ? "" : " (none, sending all)",
+             Req->FbWidth, Req->FbHeight, Req->FbDepth, Req->ModuleAlign ? ", modules page-aligned" : ""));
+    }
+    return hasEnd ? EFI_SUCCESS : EFI_COMPROMISED_DATA;
+  }
+
+  return EFI_NOT_FOUND;
+}
+
+#define PAGE_4K 4096u
+#define ALIGN_DOWN(x,a) ((UINT64)(x) & ~((UINT64)(a)-1))
+#define ALIGN_UP(x,a)   (((UINT64)(x) + ((a)-1)) & ~((UINT64)(a)-1))
+
+// The MB2 header must live in the first 32 KiB of the image, so only that
+// window is read for validation.
+STATIC EFI_STATUS
+ValidateMb2HeaderInFile(EFI_FILE_PROTOCOL *File, UINTN Size, OUT MB2_REQUEST *Req)
+{
+  UINTN max = (Size < 32768) ? Size : 32768;
+  VOID *Head = AllocatePool(max);
+  if (Head == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  EFI_STATUS st = ReadFileAt(File, 0, Head, max);
+  if (!EFI_ERROR(st)) {
+    st = ValidateMb2Header(Head, max, Req);
+  }
+
+  FreePool(Head);
+  return st;
+}
+
+// A PT_LOAD reduced to what the loader needs. ELF32 and ELF64 program
+// headers are both converted to this, so the file and KPK paths do not care
+// about the class.
+typedef struct {
+  UINT64 Offset;
+  UINT64 Paddr;
+  UINT64 FileSz;
+  UINT64 MemSz;
+} LOAD_SEG;
+
+typedef struct {
+  BOOLEAN  Is64;        // ELFCLASS64: entered in long mode, see Trampoline64
+  UINT64   Entry;
+  UINT64   PhOff;
+  UINTN    PhNum;
+  UINTN    PhEntSize;
+  LOAD_SEG *Segs;       // PT_LOAD entries only, freed once loading is done
+  UINTN    SegCount;
+  UINT64   Base;        // page range reserved for the segments
+  UINTN    Pages;
+  MB2_REQUEST Mb2;      // from the image's MB2 header
+} KERNEL_IMAGE;
+
+// Checks the ELF header of either class. Head holds the first HeadLen bytes
+// of an image of Size bytes.
+STATIC EFI_STATUS
+ParseElfHeader(CONST UINT8 *Head, UINTN HeadLen, UINTN Size, IN OUT KERNEL_IMAGE *Kernel)
+{
+  if (HeadLen < sizeof(Elf32_Ehdr)) {
+    return EFI_LOAD_ERROR;
+  }
+  if (Head[0] != 0x7F || Head[1] != 'E' || Head[2] != 'L' || Head[3] != 'F') {
+    return EFI_UNSUPPORTED;
+  }
+  if (Head[5] != ELFDATA2LSB) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (Head[4] == ELFCLASS32) {
+    CONST Elf32_Ehdr *eh = (CONST Elf32_Ehdr *)Head;
+    if (eh->e_machine != EM_386) {
+      return EFI_UNSUPPORTED;
+    }
+    if (eh->e_phentsize < sizeof(Elf32_Phdr)) {
+      return EFI_LOAD_ERROR;
+    }
+    Kernel->Entry     = eh->e_entry;
+    Kernel->PhOff     = eh->e_phoff;
+    Kernel->PhNum     = eh->e_phnum;
+    Kernel->PhEntSize = eh->e_phentsize;
+  } else if (Head[4] == ELFCLASS64) {
+    if (HeadLen < sizeof(Elf64_Ehdr)) {
+      return EFI_LOAD_ERROR;
+    }
+    CONST Elf64_Ehdr *eh = (CONST Elf64_Ehdr *)Head;
+    if (eh->e_machine != EM_X86_64) {
+      return EFI_UNSUPPORTED;
+    }
+    if (eh->e_phentsize < sizeof(Elf64_Phdr)) {
+      return EFI_LOAD_ERROR;
+    }
+    Kernel->Is64      = TRUE;
+    Kernel->Entry     = eh->e_entry;
+    Kernel->PhOff     = eh->e_phoff;
+    Kernel->PhNum     = eh->e_phnum;
+    Kernel->PhEntSize = eh->e_phentsize;
+  } else {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (Kernel->PhNum == 0) {
+    return EFI_LOAD_ERROR;
+  }
+  if (Kernel->PhOff > Size || (UINT64)Kernel->PhNum * Kernel->PhEntSize > Size - Kernel->PhOff) {
+    return EFI_COMPROMISED_DATA;
+  }
+  return EFI_SUCCESS;
+}
+
+// Picks the PT_LOAD entries out of the program headers and checks them
+// against the image size. A 32-bit kernel is entered with paging off, so its
+// segments must sit below 4 GiB; a 64-bit one gets an identity map covering
+// wherever its segments are.
+STATIC EFI_STATUS
+CollectLoadSegments(CONST UINT8 *Phdrs, UINTN Size, IN OUT KERNEL_IMAGE *Kernel)
+{
+  LOAD_SEG *segs = AllocatePool(Kernel->PhNum * sizeof(LOAD_SEG));
+  if (segs == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  UINTN n = 0;
+  for (UINTN i = 0; i < Kernel->PhNum; i++) {
+    CONST UINT8 *p = Phdrs + i * Kernel->PhEntSize;
+    LOAD_SEG    s;
+
+    if (Kernel->Is64) {
+      CONST Elf64_Phdr *ph = (CONST Elf64_Phdr *)p;
+      if (ph->p_type != PT_LOAD) {
+        continue;
+      }
+      s.Offset = ph->p_offset;
+      s.Paddr  = ph->p_paddr;
+      s.FileSz = ph->p_filesz;
+      s.MemSz  = ph->p_memsz;
+    } else {
+      CONST Elf32_Phdr *ph = (CONST Elf32_Phdr *)p;
+      if (ph->p_type != PT_LOAD) {
+        continue;
+      }
+      s.Offset = ph->p_offset;
+      s.Paddr  = ph->p_paddr;
+      s.FileSz = ph->p_filesz;
+      s.MemSz  = ph->p_memsz;
+    }
+
+    if (s.FileSz > s.MemSz || s.Paddr + s.MemSz < s.Paddr ||
+        (!Kernel->Is64 && s.Paddr + s.MemSz > 0xFFFFFFFFull)) {
+      FreePool(segs);
+      return EFI_UNSUPPORTED;
+    }
+    if (s.Offset > Size || s.FileSz > Size - s.Offset) {
+      FreePool(segs);
+      return EFI_COMPROMISED_DATA;
+    }
+
+    DEBUG((DEBUG_INFO, "[ELF] PH%u LOAD paddr=%lx mem=%lx file=%lx off=%lx\n",
+           (UINT32)i, s.Paddr, s.MemSz, s.FileSz, s.Offset));
+    segs[n++] = s;
+  }
+
+  if (n == 0) {
+    FreePool(segs);
+    return EFI_LOAD_ERROR;
+  }
+
+  Kernel->Segs     = segs;
+  Kernel->SegCount = n;
+  return EFI_SUCCESS;
+}
+
+// Reserves the page range covering every PT_LOAD at its link address.
+STATIC EFI_STATUS
+ReserveSegments(IN OUT KERNEL_IMAGE *Kernel)
+{
+  UINT64 minBase = MAX_UINT64;
+  UINT64 maxEnd  = 0;
+
+  for (UINTN i = 0; i < Kernel->SegCount; i++) {
+    CONST LOAD_SEG *s = &Kernel->Segs[i];
+    UINT64 segBase = ALIGN_DOWN(s->Paddr, PAGE_4K);
+    UINT64 segEnd  = ALIGN_UP(s->Paddr + s->MemSz, PAGE_4K);
+
+    if (segBase < minBase) {
+      minBase = segBase;
+    }
+    if (segEnd > maxEnd) {
+      maxEnd = segEnd;
+    }
+  }
+
+  if (maxEnd <= minBase) {
+    return EFI_LOAD_ERROR;
+  }
+
+  UINT64 totalBytes = maxEnd - minBase;
+  UINTN  totalPages = EFI_SIZE_TO_PAGES(totalBytes);
+
+  DEBUG((DEBUG_INFO, "[ELF] Reserve range base=%lx end=%lx bytes=%lu pages=%u\n",
+         minBase, maxEnd, totalBytes, (UINT32)totalPages));
+
+  EFI_PHYSICAL_ADDRESS dst = (EFI_PHYSICAL_ADDRESS)minBase;
+  EFI_STATUS st = gBS->AllocatePages(AllocateAddress, EfiLoaderData, totalPages, &dst);
+  if (EFI_ERROR(st)) {
+    DEBUG((DEBUG_ERROR, "[ELF] AllocatePages failed: %r\n", st));
+    return st;
+  }
+
+  Kernel->Base  = minBase;
+  Kernel->Pages = totalPages;
+  return EFI_SUCCESS;
+}
+
+typedef struct {
+  UINT8  *Addr;
+  UINT32 Len;
+} MEM_CHUNK;
+
+#define BSS_CHUNK (64u * 1024)
+
+STATIC EFI_STATUS
+ZeroChunk(VOID *Ctx, UINTN Index)
+{
+  MEM_CHUNK *c = (MEM_CHUNK *)Ctx + Index;
+  SetMem(c->Addr, c->Len, 0);
+  return EFI_SUCCESS;
+}
+
+// Zeroes the memsz - filesz tail of every PT_LOAD, in BSS_CHUNK pieces spread
+// over the CPUs.
+STATIC VOID
+ZeroBss(CONST KERNEL_IMAGE *Kernel)
+{
+  UINTN n = 0;
+  for (UINTN i = 0; i < Kernel->SegCount; i++) {
+    CONST LOAD_SEG *s = &Kernel->Segs[i];
+    n += (UINTN)((s->MemSz - s->FileSz + BSS_CHUNK - 1) / BSS_CHUNK);
+  }
+  if (n == 0) {
+    return;
+  }
+
+  MEM_CHUNK *chunks = AllocatePool(n * sizeof(MEM_CHUNK));
+  UINTN      c      = 0;
+  for (UINTN i = 0; i < Kernel->SegCount; i++) {
+    CONST LOAD_SEG *s = &Kernel->Segs[i];
+    if (s->MemSz == s->FileSz) {
+      continue;
+    }
+
+    UINT8  *p    = (UINT8 *)(UINTN)(s->Paddr + s->FileSz);
+    UINT64 left  = s->MemSz - s->FileSz;
+    if (chunks == NULL) {
+      SetMem(p, (UINTN)left, 0);
+      continue;
+    }
+    while (left > 0) {
+      UINT32 len = (left < BSS_CHUNK) ? (UINT32)left : BSS_CHUNK;
+      chunks[c].Addr = p;
+      chunks[c].Len  = len;
+      c++;
+      p    += len;
+      left -= len;
+    }
+  }
+
+  if (chunks != NULL) {
+    ParallelFor("bss", c, ZeroChunk, chunks);
+    FreePool(chunks);
+  }
+}
+
+// Streams the kernel straight into its final pages: only the ELF and program
+// headers go through a pool buffer, each PT_LOAD is read to p_paddr and only
+// the memsz - filesz tail (.bss) is zeroed. Sections outside PT_LOAD (debug
+// info, symbols) are never read.
+STATIC EFI_STATUS
+LoadElfFromFile(EFI_FILE_PROTOCOL *File, UINTN Size, OUT KERNEL_IMAGE *Kernel)
+{
+  if (File == NULL || Kernel == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  union {
+    Elf32_Ehdr e32;
+    Elf64_Ehdr e64;
+  } Head;
+  UINTN headLen = (Size < sizeof(Head)) ? Size : sizeof(Head);
+
+  EFI_STATUS st = ReadFileAt(File, 0, &Head, headLen);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+  st = ParseElfHeader((CONST UINT8 *)&Head, headLen, Size, Kernel);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+
+  UINTN phBytes = Kernel->PhNum * Kernel->PhEntSize;
+  UINT8 *Phdrs = AllocatePool(phBytes);
+  if (Phdrs == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+  st = ReadFileAt(File, Kernel->PhOff, Phdrs, phBytes);
+  if (!EFI_ERROR(st)) {
+    st = CollectLoadSegments(Phdrs, Size, Kernel);
+  }
+  FreePool(Phdrs);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+
+  st = ReserveSegments(Kernel);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+
+  UINT64 fileBytes = 0;
+  for (UINTN i = 0; i < Kernel->SegCount; i++) {
+    CONST LOAD_SEG *s = &Kernel->Segs[i];
+    if (s->FileSz == 0) {
+      continue;
+    }
+
+    st = ReadFilePipelined(File, s->Offset, (VOID *)(UINTN)s->Paddr, (UINTN)s->FileSz,
+                           NULL, NULL, "segment");
+    if (EFI_ERROR(st)) {
+      DEBUG((DEBUG_ERROR, "[ELF] segment %u read failed: %r\n", (UINT32)i, st));
+      gBS->FreePages((EFI_PHYSICAL_ADDRESS)Kernel->Base, Kernel->Pages);
+      return st;
+    }
+    fileBytes += s->FileSz;
+  }
+
+  ZeroBss(Kernel);
+
+  DEBUG((DEBUG_INFO, "[ELF] ELF%u Entry=%lx, read %lu of %u file bytes\n",
+         Kernel->Is64 ? 64 : 32, Kernel->Entry, fileBytes, (UINT32)Size));
+  return EFI_SUCCESS;
+}
+
+STATIC UINT32
+Fnv1a32(CONST VOID *Data, UINTN Len)
+{
+  CONST UINT8 *p = (CONST UINT8 *)Data;
+  UINT32 h = 0x811C9DC5u;
+  for (UINTN i = 0; i < Len; i++) {
+    h = (h ^ p[i]) * 0x01000193u;
+  }
+  return h;
+}
+
+// Decodes one LZ4 block (raw sequences, no frame). The output must come out
+// at exactly DstLen bytes, and matches may only reach back into this block,
+// which is what kpack emits.
+STATIC EFI_STATUS
+Lz4DecodeBlock(CONST UINT8 *Src, UINTN SrcLen, UINT8 *Dst, UINTN DstLen)
+{
+  CONST UINT8 *ip   = Src;
+  CONST UINT8 *iend = Src + SrcLen;
+  UINT8       *op   = Dst;
+  UINT8       *oend = Dst + DstLen;
+
+  while (ip < iend) {
+    UINT8 token = *ip++;
+
+    UINTN lit = token >> 4;
+    if (lit == 15) {
+      UINT8 b;
+      do {
+        if (ip >= iend) {
+          return EFI_VOLUME_CORRUPTED;
+        }
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > (UINTN)(iend - ip) || lit > (UINTN)(oend - op)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+    CopyMem(op, ip, lit);
+    op += lit;
+    ip += lit;
+
+    // The last sequence carries literals only.
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+    UINTN offset = (UINTN)ip[0] | ((UINTN)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (UINTN)(op - Dst)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINTN mlen = token & 15;
+    if (mlen == 15) {
+      UINT8 b;
+      do {
+        if (ip >= iend) {
+          return EFI_VOLUME_CORRUPTED;
+        }
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+    mlen += 4;
+    if (mlen > (UINTN)(oend - op)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    CONST UINT8 *m = op - offset;
+    if (offset >= mlen) {
+      CopyMem(op, m, mlen);
+      op += mlen;
+    } else {
+      // Overlapping match (run-length style), must go byte by byte.
+      while (mlen-- > 0) {
+        *op++ = *m++;
+      }
+    }
+  }
+
+  return (op == oend) ? EFI_SUCCESS : EFI_VOLUME_CORRUPTED;
+}
+
+typedef struct {
+  CONST KPK_HEADER *Hdr;
+  CONST KPK_BLOCK  *Blocks;
+  UINT32           *SrcOff;   // offset of each block's data in Buf
+  UINT8            *Buf;      // the whole container as read from disk
+  UINTN            Size;
+} KPK_IMAGE;
+
+STATIC UINT32
+KpkBlockRawLen(CONST KPK_IMAGE *Img, UINTN k)
+{
+  UINT32 lo = (UINT32)k * Img->Hdr->block_size;
+  UINT32 left = Img->Hdr->raw_size - lo;
+  return (left < Img->Hdr->block_size) ? left : Img->Hdr->block_size;
+}
+
+STATIC EFI_STATUS
+KpkOpen(UINT8 *Buf, UINTN Size, OUT KPK_IMAGE *Img)
+{
+  ZeroMem(Img, sizeof(*Img));
+  if (Size < sizeof(KPK_HEADER)) {
+    return EFI_LOAD_ERROR;
+  }
+
+  CONST KPK_HEADER *h = (CONST KPK_HEADER *)Buf;
+  if (h->magic != KPK_MAGIC) {
+    return EFI_UNSUPPORTED;
+  }
+  if (h->algo != KPK_ALGO_STORE && h->algo != KPK_ALGO_LZ4) {
+    return EFI_UNSUPPORTED;
+  }
+  if (h->block_size < KPK_MIN_BLOCK || h->raw_size == 0 ||
+      h->block_count != (h->raw_size + h->block_size - 1) / h->block_size) {
+    return EFI_COMPROMISED_DATA;
+  }
+  if ((UINT64)h->header_size != sizeof(KPK_HEADER) + (UINT64)h->block_count * sizeof(KPK_BLOCK) ||
+      h->header_size > Size) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  CONST KPK_BLOCK *blocks = (CONST KPK_BLOCK *)(Buf + sizeof(KPK_HEADER));
+  if (Fnv1a32(blocks, (UINTN)h->block_count * sizeof(KPK_BLOCK)) != h->checksum) {
+    return EFI_CRC_ERROR;
+  }
+
+  UINT32 *srcOff = AllocatePool((UINTN)h->block_count * sizeof(UINT32));
+  if (srcOff == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Img->Hdr    = h;
+  Img->Blocks = blocks;
+  Img->Buf    = Buf;
+  Img->Size   = Size;
+  Img->SrcOff = srcOff;
+
+  UINT64 off = h->header_size;
+  for (UINTN k = 0; k < h->block_count; k++) {
+    if (blocks[k].comp_size > KpkBlockRawLen(Img, k) || off + blocks[k].comp_size > Size) {
+      FreePool(srcOff);
+      return EFI_COMPROMISED_DATA;
+    }
+    srcOff[k] = (UINT32)off;
+    off += blocks[k].comp_size;
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS
+KpkDecodeBlock(CONST KPK_IMAGE *Img, UINTN k, UINT8 *Dst)
+{
+  UINT32      rawLen = KpkBlockRawLen(Img, k);
+  UINT32      comp   = Img->Blocks[k].comp_size;
+  CONST UINT8 *src   = Img->Buf + Img->SrcOff[k];
+
+  if (comp == rawLen) {
+    CopyMem(Dst, src, rawLen);
+  } else if (Img->Hdr->algo == KPK_ALGO_LZ4) {
+    EFI_STATUS st = Lz4DecodeBlock(src, comp, Dst, rawLen);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+  } else {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  return (Fnv1a32(Dst, rawLen) == Img->Blocks[k].raw_hash) ? EFI_SUCCESS : EFI_CRC_ERROR;
+}
+
+typedef struct {
+  CONST KPK_IMAGE    *Img;
+  CONST KERNEL_IMAGE *Kernel;
+  UINT8              **Dst;     // per block: final address, staging buffer or NULL
+  BOOLEAN            *Staged;
+  UINTN              First;     // ParallelFor index 0 is this block
+} KPK_SCATTER;
+
+// One block: decode (and hash-check) it, then for a staged block copy the
+// pieces that belong to each segment. Blocks cover disjoint file ranges, so
+// they land on disjoint memory and can run on any CPU in any order.
+STATIC EFI_STATUS
+KpkScatterOne(VOID *Ctx, UINTN Index)
+{
+  KPK_SCATTER *sc = (KPK_SCATTER *)Ctx;
+  UINTN k = sc->First + Index;
+  if (sc->Dst[k] == NULL) {
+    return EFI_SUCCESS;
+  }
+
+  // Block 0 was decoded up front to get at the headers.
+  if (k != 0) {
+    EFI_STATUS st = KpkDecodeBlock(sc->Img, k, sc->Dst[k]);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+  }
+  if (!sc->Staged[k]) {
+    return EFI_SUCCESS;
+  }
+
+  UINT64 lo = (UINT64)k * sc->Img->Hdr->block_size;
+  UINT64 hi = lo + KpkBlockRawLen(sc->Img, k);
+  for (UINTN i = 0; i < sc->Kernel->SegCount; i++) {
+    CONST LOAD_SEG *seg = &sc->Kernel->Segs[i];
+    UINT64 s = seg->Offset, e = seg->Offset + seg->FileSz;
+    UINT64 a = (lo > s) ? lo : s;
+    UINT64 b = (hi < e) ? hi : e;
+    if (a < b) {
+      CopyMem((UINT8 *)(UINTN)(seg->Paddr + (a - s)), sc->Dst[k] + (a - lo), (UINTN)(b - a));
+    }
+  }
+  return EFI_SUCCESS;
+}
+
+STATIC VOID
+KpkFreeScatter(KPK_SCATTER *Sc)
+{
+  if (Sc->Dst != NULL && Sc->Staged != NULL) {
+    for (UINTN k = 1; k < Sc->Img->Hdr->block_count; k++) {
+      if (Sc->Staged[k] && Sc->Dst[k] != NULL) {
+        FreePool(Sc->Dst[k]);
+      }
+    }
+  }
+  if (Sc->Staged != NULL) {
+    FreePool(Sc->Staged);
+  }
+  if (Sc->Dst != NULL) {
+    FreePool(Sc->Dst);
+  }
+  ZeroMem(Sc, sizeof(*Sc));
+}
+
+// Decides where every block that overlaps a PT_LOAD is decoded to. A block
+// lying inside one segment's file bytes goes straight to its destination;
+// blocks that straddle headers or segment boundaries get a staging buffer
+// and are copied out piecewise; blocks outside every segment are skipped.
+// Block 0 is already decoded in Scratch.
+STATIC EFI_STATUS
+KpkPlanScatter(CONST KPK_IMAGE *Img, CONST KERNEL_IMAGE *Kernel, UINT8 *Scratch, OUT KPK_SCATTER *Sc)
+{
+  UINT32 bs = Img->Hdr->block_size;
+  UINTN  nb = Img->Hdr->block_count;
+  UINT32 direct = 0, staged = 0, skipped = 0;
+
+  ZeroMem(Sc, sizeof(*Sc));
+  Sc->Img    = Img;
+  Sc->Kernel = Kernel;
+  Sc->Dst    = AllocateZeroPool(nb * sizeof(UINT8 *));
+  Sc->Staged = AllocateZeroPool(nb * sizeof(BOOLEAN));
+  if (Sc->Dst == NULL || Sc->Staged == NULL) {
+    KpkFreeScatter(Sc);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (UINTN k = 0; k < nb; k++) {
+    UINT64 lo = (UINT64)k * bs;
+    UINT64 hi = lo + KpkBlockRawLen(Img, k);
+
+    UINTN overlaps = 0;
+    UINT8 *dst = NULL;
+    for (UINTN i = 0; i < Kernel->SegCount; i++) {
+      CONST LOAD_SEG *seg = &Kernel->Segs[i];
+      UINT64 s = seg->Offset, e = seg->Offset + seg->FileSz;
+      if (hi <= s || lo >= e) {
+        continue;
+      }
+      overlaps++;
+      if (lo >= s && hi <= e) {
+        dst = (UINT8 *)(UINTN)(seg->Paddr + (lo - s));
+      }
+    }
+
+    if (overlaps == 0) {
+      skipped++;
+    } else if (dst != NULL && k != 0) {
+      Sc->Dst[k] = dst;
+      direct++;
+    } else {
+      Sc->Dst[k]    = (k == 0) ? Scratch : AllocatePool(bs);
+      Sc->Staged[k] = TRUE;
+      staged++;
+      if (Sc->Dst[k] == NULL) {
+        KpkFreeScatter(Sc);
+        return EFI_OUT_OF_RESOURCES;
+      }
+    }
+  }
+
+  DEBUG((DEBUG_INFO, "[KPK] blocks: %u direct, %u staged, %u skipped\n", direct, staged, skipped));
+  return EFI_SUCCESS;
+}
+
+// Block 0 holds the ELF header, the program headers and the MB2 header:
+// decode it into Scratch, check the MB2 header, collect the PT_LOADs and
+// reserve their pages.
+STATIC EFI_STATUS
+KpkLoadHeaders(CONST KPK_IMAGE *Img, UINT8 *Scratch, OUT KERNEL_IMAGE *Kernel)
+{
+  UINT32 headLen = KpkBlockRawLen(Img, 0);
+  EFI_STATUS st = KpkDecodeBlock(Img, 0, Scratch);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+
+  st = ValidateMb2Header(Scratch, (headLen < 32768) ? headLen : 32768, &Kernel->Mb2);
+  if (EFI_ERROR(st)) {
+    DEBUG((DEBUG_ERROR, "[BL] MB2 header invalid: %r\n", st));
+    return st;
+  }
+  TimelineMark(BL_STAGE_MB2_VALID);
+
+  st = ParseElfHeader(Scratch, headLen, headLen, Kernel);
+  if (!EFI_ERROR(st)) {
+    st = CollectLoadSegments(Scratch + Kernel->PhOff, Img->Hdr->raw_size, Kernel);
+  }
+  if (!EFI_ERROR(st)) {
+    st = ReserveSegments(Kernel);
+  }
+  return st;
+}
+
+// State of a KPK container that is decoded while it is being read. The
+// header and block table are checked once they are in; block 0 (headers)
+// follows, and from then on each block whose compressed bytes are complete
+// is decoded on the BSP while the next chunks are still in flight. What is
+// left when the read ends goes to ParallelFor.
+typedef struct {
+  UINT8        *Buf;
+  UINTN        Size;
+  BOOLEAN      Overlap;     // decode during the read (only worth it with ReadEx)
+  KPK_IMAGE    Img;
+  BOOLEAN      Opened;
+  UINT8        *Scratch;
+  KERNEL_IMAGE *Kernel;
+  BOOLEAN      Reserved;    // Kernel's pages are allocated
+  KPK_SCATTER  Sc;
+  UINTN        Next;        // first block not decoded yet
+} KPK_STREAM;
+
+STATIC EFI_STATUS
+KpkOnChunk(VOID *Ctx, UINTN Done)
+{
+  KPK_STREAM *ks = (KPK_STREAM *)Ctx;
+  EFI_STATUS st;
+
+  if (!ks->Opened) {
+    CONST KPK_HEADER *h = (CONST KPK_HEADER *)ks->Buf;
+    if (Done < sizeof(KPK_HEADER) || (h->header_size <= ks->Size && Done < h->header_size)) {
+      return EFI_SUCCESS;
+    }
+    st = KpkOpen(ks->Buf, ks->Size, &ks->Img);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+    ks->Opened  = TRUE;
+    ks->Scratch = AllocatePool(ks->Img.Hdr->block_size);
+    if (ks->Scratch == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
+
+  CONST KPK_IMAGE *img = &ks->Img;
+  UINTN nb = img->Hdr->block_count;
+
+  if (ks->Sc.Dst == NULL) {
+    if (Done < (UINTN)img->SrcOff[0] + img->Blocks[0].comp_size) {
+      return EFI_SUCCESS;
+    }
+    st = KpkLoadHeaders(img, ks->Scratch, ks->Kernel);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+    ks->Reserved = TRUE;
+    st = KpkPlanScatter(img, ks->Kernel, ks->Scratch, &ks->Sc);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+  }
+
+  if (!ks->Overlap || Done == ks->Size) {
     return EFI_SUCCESS;
   }
-
-  FreePool(Handles);
-  return EFI_NOT_FOUND;
+  while (ks->Next < nb && (UINTN)img->SrcOff[ks->Next] + img->Blocks[ks->Next].comp_size <= Done) {
+    st = KpkScatterOne(&ks->Sc, ks->Next);
+    if (EFI_ERROR(st)) {
+      return st;
+    }
+    ks->Next++;
+  }
+  return EFI_SUCCESS;
 }
 
+// Reads the container through the pipelined reader and decodes it into the
+// segments' final pages as it arrives.
 STATIC EFI_STATUS
-ValidateMb2Header(VOID *Kernel, UINTN Size)
+LoadElfFromKpkFile(EFI_FILE_PROTOCOL *File, UINTN Size, OUT KERNEL_IMAGE *Kernel)
 {
-  UINT8 *p   = (UINT8 *)Kernel;
-  UINTN max  = (Size < 32768) ? Size : 32768;
+  KPK_STREAM ks;
+  ZeroMem(&ks, sizeof(ks));
+  ks.Buf     = AllocatePool(Size);
+  ks.Size    = Size;
+  ks.Overlap = FileCanReadAsync(File);
+  ks.Kernel  = Kernel;
+  if (ks.Buf == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
 
-  for (UINTN off = 0; off + sizeof(MB2_HEADER) <= max; off += 8) {
-    MB2_HEADER *h = (MB2_HEADER *)(p + off);
-    if (h->magic != MB2_HEADER_MAGIC) {
-      continue;
-    }
+  UINT64 t0 = AsmReadTsc();
+  EFI_STATUS st = ReadFilePipelined(File, 0, ks.Buf, Size, KpkOnChunk, &ks, "kpk");
+  if (!EFI_ERROR(st) && ks.Sc.Dst == NULL) {
+    st = EFI_LOAD_ERROR;      // the file ended before block 0
+  }
+  UINT64 t1 = AsmReadTsc();
+  UINTN early = ks.Next;
 
-    UINT32 sum = h->magic + h->architecture + h->header_length + h->checksum;
-    if (sum != 0) {
-      return EFI_COMPROMISED_DATA;
-    }
-    if (h->architecture != 0) {
-      return EFI_UNSUPPORTED;
-    }
-    if (h->header_length < sizeof(MB2_HEADER) || off + h->header_length > max) {
-      return EFI_COMPROMISED_DATA;
+  if (!EFI_ERROR(st) && ks.Next < ks.Img.Hdr->block_count) {
+    ks.Sc.First = ks.Next;
+    st = ParallelFor("kpk", ks.Img.Hdr->block_count - ks.Next, KpkScatterOne, &ks.Sc);
+    if (EFI_ERROR(st)) {
+      DEBUG((DEBUG_ERROR, "[KPK] decode failed: %r\n", st));
     }
+  }
+  if (!EFI_ERROR(st)) {
+    ZeroBss(Kernel);
+    DEBUG((DEBUG_INFO, "[ELF] ELF%u Entry=%lx\n", Kernel->Is64 ? 64 : 32, Kernel->Entry));
+  } else if (ks.Reserved) {
+    gBS->FreePages((EFI_PHYSICAL_ADDRESS)Kernel->Base, Kernel->Pages);
+  }
+  UINT64 t2 = AsmReadTsc();
+
+  if (ks.Opened) {
+    DEBUG((DEBUG_INFO, "[KPK] %a %u -> %u bytes, read %lu us (%u blocks decoded meanwhile), unpack %lu us\n",
+           (ks.Img.Hdr->algo == KPK_ALGO_LZ4) ? "lz4" : "store",
+           (UINT32)Size, ks.Img.Hdr->raw_size, TscToUs(t1 - t0), (UINT32)early, TscToUs(t2 - t1)));
+    KpkFreeScatter(&ks.Sc);
+    FreePool(ks.Img.SrcOff);
+  }
+  if (ks.Scratch != NULL) {
+    FreePool(ks.Scratch);
+  }
+  FreePool(ks.Buf);
+  return st;
+}
 
-    UINT8   *t     = (UINT8 *)h + sizeof(MB2_HEADER);
-    UINT8   *tend  = (UINT8 *)h + h->header_length;
-    BOOLEAN hasEnd = FALSE;
+// Loads kernel.bin whether it is a plain ELF (either class) or a KPK
+// container. On success Kernel describes the loaded image (class,
+// entry, reserved range); the segment list itself is not kept.
+STATIC EFI_STATUS
+LoadKernelImage(EFI_FILE_PROTOCOL *File, UINTN Size, OUT KERNEL_IMAGE *Kernel)
+{
+  ZeroMem(Kernel, sizeof(*Kernel));
 
-    while (t + sizeof(MB2_HEADER_TAG) <= tend) {
-      MB2_HEADER_TAG *tag = (MB2_HEADER_TAG *)t;
-      if (tag->type == 0 && tag->size == 8) {
-        hasEnd = TRUE;
-        break;
-      }
-      if (tag->size < sizeof(MB2_HEADER_TAG)) {
-        return EFI_COMPROMISED_DATA;
-      }
-      t += MB2_ALIGN8(tag->size);
-    }
+  UINT32 magic = 0;
+  EFI_STATUS st = ReadFileAt(File, 0, &magic, (Size < sizeof(magic)) ? Size : sizeof(magic));
+  if (EFI_ERROR(st)) {
+    return st;
+  }
 
-    return hasEnd ? EFI_SUCCESS : EFI_COMPROMISED_DATA;
+  if (magic != KPK_MAGIC) {
+    st = ValidateMb2HeaderInFile(File, Size, &Kernel->Mb2);
+    if (EFI_ERROR(st)) {
+      DEBUG((DEBUG_ERROR, "[BL] MB2 header invalid: %r\n", st));
+      return st;
+    }
+    TimelineMark(BL_STAGE_MB2_VALID);
+    st = LoadElfFromFile(File, Size, Kernel);
+  } else {
+    st = LoadElfFromKpkFile(File, Size, Kernel);
   }
 
-  return EFI_NOT_FOUND;
+  if (Kernel->Segs != NULL) {
+    FreePool(Kernel->Segs);
+    Kernel->Segs     = NULL;
+    Kernel->SegCount = 0;
+  }
+  return st;
 }
 
-#define PAGE_4K 4096u
-#define ALIGN_DOWN(x,a) ((UINT32)((x) & ~((a)-1)))
-#define ALIGN_UP(x,a)   ((UINT32)(((x) + ((a)-1)) & ~((a)-1)))
+// A boot module as handed to the kernel: page-aligned below 4 GiB so the
+// 32-bit fields of the MB2 module tag can hold it, which also satisfies a
+// module-align header tag.
+typedef struct {
+  UINT64 Start;
+  UINT64 Size;
+  CHAR8  *Cmdline;        // the whole spec, path included, in ASCII
+} BOOT_MODULE;
+
+STATIC CHAR8 *
+Char16ToAsciiDup(CONST CHAR16 *s)
+{
+  UINTN n = StrLen(s);
+  CHAR8 *a = AllocatePool(n + 1);
+  if (a == NULL) {
+    return NULL;
+  }
+  for (UINTN i = 0; i < n; i++) {
+    a[i] = (s[i] < 0x80) ? (CHAR8)s[i] : '?';
+  }
+  a[n] = 0;
+  return a;
+}
 
 STATIC EFI_STATUS
-LoadElf32SegmentsBelow4G(VOID *Kernel, UINTN Size, UINT32 *OutEntry)
+LoadModule(EFI_LOADED_IMAGE_PROTOCOL *Loaded, CHAR16 *DeviceHint,
+           CONST CHAR16 *Spec, OUT BOOT_MODULE *Mod)
 {
-  if (Kernel == NULL || OutEntry == NULL) {
-    return EFI_INVALID_PARAMETER;
+  ZeroMem(Mod, sizeof(*Mod));
+
+  // The path ends at the first space; the rest are the module's arguments.
+  UINTN plen = 0;
+  while (Spec[plen] != 0 && Spec[plen] != L' ' && Spec[plen] != L'\t') {
+    plen++;
   }
-  if (Size < sizeof(Elf32_Ehdr)) {
-    return EFI_LOAD_ERROR;
+  CHAR16 *Path = AllocateZeroPool((plen + 1) * sizeof(CHAR16));
+  if (Path == NULL) {
+    return EFI_OUT_OF_RESOURCES;
   }
+  CopyMem(Path, Spec, plen * sizeof(CHAR16));
 
-  Elf32_Ehdr *eh = (Elf32_Ehdr *)Kernel;
+  EFI_FILE_PROTOCOL *Root = NULL;
+  EFI_FILE_PROTOCOL *File = NULL;
+  UINTN Size = 0;
+  EFI_STATUS st = OpenFileAnyFs(Loaded, DeviceHint, Path, &Root, &File, &Size);
+  if (EFI_ERROR(st)) {
+    FreePool(Path);
+    return st;
+  }
 
-  if (eh->e_ident[0] != 0x7F || eh->e_ident[1] != 'E' || eh->e_ident[2] != 'L' || eh->e_ident[3] != 'F') {
-    return EFI_UNSUPPORTED;
+  UINTN pages = EFI_SIZE_TO_PAGES(Size);
+  if (pages == 0) {
+    pages = 1;
   }
-  if (eh->e_ident[4] != ELFCLASS32) {
-    return EFI_UNSUPPORTED;
+  EFI_PHYSICAL_ADDRESS base = 0xFFFFFFFFull;
+  st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, pages, &base);
+  if (EFI_ERROR(st)) {
+    CloseFileAnyFs(Root, File);
+    FreePool(Path);
+    return st;
   }
-  if (eh->e_ident[5] != ELFDATA2LSB) {
-    return EFI_UNSUPPORTED;
+
+  UINT8 *dst = (UINT8 *)(UINTN)base;
+  st = ReadFilePipelined(File, 0, dst, Size, NULL, NULL, "module");
+  CloseFileAnyFs(Root, File);
+
+  if (EFI_ERROR(st)) {
+    gBS->FreePages(base, pages);
+    FreePool(Path);
+    return st;
   }
-  if (eh->e_machine != EM_386) {
-    return EFI_UNSUPPORTED;
+  // The tail of the last page is the kernel's, not stale firmware data.
+  SetMem(dst + Size, EFI_PAGES_TO_SIZE(pages) - Size, 0);
+
+  Mod->Start   = base;
+  Mod->Size    = Size;
+  Mod->Cmdline = Char16ToAsciiDup(Spec);
+  if (Mod->Cmdline == NULL) {
+    gBS->FreePages(base, pages);
+    FreePool(Path);
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  if (eh->e_phoff + (UINTN)eh->e_phnum * eh->e_phentsize > Size) {
-    return EFI_COMPROMISED_DATA;
+  DEBUG((DEBUG_INFO, "[BL] module %s: %lu bytes at %lx\n", Path, (UINT64)Size, (UINT64)base));
+  FreePool(Path);
+  return EFI_SUCCESS;
+}
+
+// Bits per pixel of a GOP mode: the four 8-bit formats are 32 bpp, a
+// PixelBitMask mode is as wide as its highest mask bit.
+STATIC UINT32
+GopModeBpp(CONST EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *Info)
+{
+  if (Info->PixelFormat != PixelBitMask) {
+    return 32;
   }
 
-  UINT32 minBase = 0xFFFFFFFFu;
-  UINT32 maxEnd  = 0;
+  CONST EFI_PIXEL_BITMASK *m = &Info->PixelInformation;
+  UINT32 all = m->RedMask | m->GreenMask | m->BlueMask | m->ReservedMask;
+  UINT32 bpp = 0;
+  while (all != 0) {
+    bpp++;
+    all >>= 1;
+  }
+  return bpp;
+}
 
-  for (UINTN i = 0; i < eh->e_phnum; i++) {
-    Elf32_Phdr *ph = (Elf32_Phdr *)((UINT8 *)Kernel + eh->e_phoff + i * eh->e_phentsize);
-    if (ph->p_type != PT_LOAD) {
-      continue;
-    }
+STATIC UINT32
+AbsDiff32(UINT32 a, UINT32 b)
+{
+  return (a > b) ? a - b : b - a;
+}
 
-    if ((UINT64)ph->p_paddr + (UINT64)ph->p_memsz > 0xFFFFFFFFull) {
-      return EFI_UNSUPPORTED;
-    }
-    if ((UINT64)ph->p_offset + (UINT64)ph->p_filesz > (UINT64)Size) {
-      return EFI_COMPROMISED_DATA;
-    }
+// Switches GOP to the mode closest to the kernel's framebuffer header tag:
+// the sum of the width and height differences decides, depth breaks ties,
+// and a zero field in the tag matches anything. The current mode wins a tie,
+// so an exact or indifferent request costs no SetMode. Modes without a
+// linear framebuffer (PixelBltOnly) are never picked.
+STATIC VOID
+SelectGopMode(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, CONST MB2_REQUEST *Req)
+{
+  if (!Req->HasFramebuffer) {
+    return;
+  }
 
-    UINT32 segBase = ALIGN_DOWN((UINT32)ph->p_paddr, PAGE_4K);
-    UINT32 segEnd  = ALIGN_UP((UINT32)ph->p_paddr + (UINT32)ph->p_memsz, PAGE_4K);
+  UINT32 cur       = Gop->Mode->Mode;
+  UINT32 best      = cur;
+  UINT64 bestScore = MAX_UINT64;
 
-    if (segBase < minBase) {
-      minBase = segBase;
-    }
-    if (segEnd > maxEnd) {
-      maxEnd = segEnd;
+  for (UINT32 m = 0; m < Gop->Mode->MaxMode; m++) {
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info = NULL;
+    UINTN infoSize = 0;
+    if (EFI_ERROR(Gop->QueryMode(Gop, m, &infoSize, &info)) || info == NULL) {
+      continue;
     }
 
-    DEBUG((DEBUG_INFO, "[ELF] PH%u LOAD paddr=%08x mem=%08x file=%08x off=%08x\n",
-           (UINT32)i, (UINT32)ph->p_paddr, (UINT32)ph->p_memsz, (UINT32)ph->p_filesz, (UINT32)ph->p_offset));
-  }
+    if (info->PixelFormat != PixelBltOnly) {
+      UINT64 dw = Req->FbWidth  ? AbsDiff32(Req->FbWidth, info->HorizontalResolution) : 0;
+      UINT64 dh = Req->FbHeight ? AbsDiff32(Req->FbHeight, info->VerticalResolution) : 0;
+      UINT64 dd = Req->FbDepth  ? AbsDiff32(Req->FbDepth, GopModeBpp(info)) : 0;
+      UINT64 score = (dw + dh) * 64 + dd;
 
-  if (minBase == 0xFFFFFFFFu || maxEnd <= minBase) {
-    return EFI_LOAD_ERROR;
+      if (score < bestScore || (score == bestScore && m == cur)) {
+        best      = m;
+        bestScore = score;
+      }
+    }
+    FreePool(info);
   }
 
-  UINT32 totalBytes = maxEnd - minBase;
-  UINTN  totalPages = EFI_SIZE_TO_PAGES(totalBytes);
-
-  DEBUG((DEBUG_INFO, "[ELF] Reserve range base=%08x end=%08x bytes=%u pages=%u\n",
-         minBase, maxEnd, totalBytes, (UINT32)totalPages));
+  if (best == cur) {
+    DEBUG((DEBUG_INFO, "[BL] GOP: keeping mode %u for fb request %ux%ux%u\n",
+           cur, Req->FbWidth, Req->FbHeight, Req->FbDepth));
+    return;
+  }
 
-  EFI_PHYSICAL_ADDRESS dst = (EFI_PHYSICAL_ADDRESS)minBase;
-  EFI_STATUS st = gBS->AllocatePages(AllocateAddress, EfiLoaderData, totalPages, &dst);
+  UINT64 t0 = AsmReadTsc();
+  EFI_STATUS st = Gop->SetMode(Gop, best);
+  UINT64 t1 = AsmReadTsc();
   if (EFI_ERROR(st)) {
-    DEBUG((DEBUG_ERROR, "[ELF] AllocatePages failed: %r\n", st));
-    return st;
+    DEBUG((DEBUG_ERROR, "[BL] GOP: SetMode(%u) failed: %r, keeping mode %u\n", best, st, cur));
+    return;
   }
 
-  for (UINTN i = 0; i < eh->e_phnum; i++) {
-    Elf32_Phdr *ph = (Elf32_Phdr *)((UINT8 *)Kernel + eh->e_phoff + i * eh->e_phentsize);
-    if (ph->p_type != PT_LOAD) {
-      continue;
+  DEBUG((DEBUG_INFO, "[BL] GOP: mode %u -> %u (%ux%u) for fb request %ux%ux%u, SetMode %lu us\n",
+         cur, best, Gop->Mode->Info->HorizontalResolution, Gop->Mode->Info->VerticalResolution,
+         Req->FbWidth, Req->FbHeight, Req->FbDepth, TscToUs(t1 - t0)));
+}
+
+STATIC VOID
+MaskToField(UINT32 Mask, UINT8 *Pos, UINT8 *Size)
+{
+  UINT8 p = 0, n = 0;
+  if (Mask != 0) {
+    while ((Mask & 1) == 0) {
+      Mask >>= 1;
+      p++;
+    }
+    while ((Mask & 1) != 0) {
+      Mask >>= 1;
+      n++;
     }
+  }
+  *Pos  = p;
+  *Size = n;
+}
 
-    UINT32 paddr = (UINT32)ph->p_paddr;
+// Fills the framebuffer info tag from the current GOP mode. Returns FALSE
+// for a mode without a linear framebuffer.
+STATIC BOOLEAN
+FillFramebufferTag(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, MB2_TAG_FRAMEBUFFER *t)
+{
+  CONST EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info = Gop->Mode->Info;
+  UINT32 bpp = GopModeBpp(info);
 
-    SetMem((VOID *)(UINTN)paddr, ph->p_memsz, 0);
-    CopyMem((VOID *)(UINTN)paddr, (UINT8 *)Kernel + ph->p_offset, ph->p_filesz);
+  switch (info->PixelFormat) {
+  case PixelRedGreenBlueReserved8BitPerColor:
+    t->red_field_position   = 0;  t->red_mask_size   = 8;
+    t->green_field_position = 8;  t->green_mask_size = 8;
+    t->blue_field_position  = 16; t->blue_mask_size  = 8;
+    break;
+  case PixelBlueGreenRedReserved8BitPerColor:
+    t->red_field_position   = 16; t->red_mask_size   = 8;
+    t->green_field_position = 8;  t->green_mask_size = 8;
+    t->blue_field_position  = 0;  t->blue_mask_size  = 8;
+    break;
+  case PixelBitMask:
+    MaskToField(info->PixelInformation.RedMask, &t->red_field_position, &t->red_mask_size);
+    MaskToField(info->PixelInformation.GreenMask, &t->green_field_position, &t->green_mask_size);
+    MaskToField(info->PixelInformation.BlueMask, &t->blue_field_position, &t->blue_mask_size);
+    break;
+  default:
+    return FALSE;
   }
 
-  *OutEntry = eh->e_entry;
-  DEBUG((DEBUG_INFO, "[ELF] Entry=%08x\n", *OutEntry));
-  return EFI_SUCCESS;
+  t->framebuffer_addr   = (UINT64)Gop->Mode->FrameBufferBase;
+  t->framebuffer_pitch  = info->PixelsPerScanLine * ((bpp + 7) / 8);
+  t->framebuffer_width  = info->HorizontalResolution;
+  t->framebuffer_height = info->VerticalResolution;
+  t->framebuffer_bpp    = (UINT8)bpp;
+  t->framebuffer_type   = MB2_FB_TYPE_RGB;
+  return TRUE;
+}
+
+// The info block and what is still missing from it. The memory map tags can
+// only be written once ExitBootServices has fixed the map, so space for them
+// is reserved at MapOff and the final map is fetched into Map, a buffer
+// allocated up front: allocating after the last GetMemoryMap would change
+// the map and invalidate its key.
+typedef struct {
+  UINT8   *Buf;
+  UINT32  Phys;
+  UINTN   Size;           // bytes reserved for the block
+  UINT32  MapOff;         // where tags 6/17 and the end tag go
+  BOOLEAN WantMmap;
+  BOOLEAN WantEfiMmap;
+  VOID    *Map;           // below 4 GiB, MapCap bytes
+  UINTN   MapCap;
+} MB2_BUILD;
+
+// Room for descriptors that appear between sizing the map and the final
+// GetMemoryMap (page tables, trampoline, stack, pool growth).
+#define MMAP_SLACK_DESC 32
+
+// Fixed tags (name, framebuffer, ACPI, timeline) fit well within this; the
+// command line and the modules are sized on top.
+#define MB2_FIXED_MAX   4096u
+
+STATIC UINT32
+Mb2ModuleTagSize(CONST BOOT_MODULE *Mod)
+{
+  return (UINT32)(OFFSET_OF(MB2_TAG_MODULE, cmdline) + AsciiStrLen(Mod->Cmdline) + 1);
 }
 
 STATIC EFI_STATUS
-BuildMb2InfoBelow4G(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, VOID **OutMb, UINT32 *OutMbPhys)
+BuildMb2InfoBelow4G(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, CONST MB2_REQUEST *Req,
+                    CONST CHAR8 *Cmdline, CONST BOOT_MODULE *Mods, UINTN ModCount,
+                    OUT MB2_BUILD *Mb)
 {
-  if (Gop == NULL || OutMb == NULL || OutMbPhys == NULL) {
+  if (Gop == NULL || Req == NULL || Mb == NULL) {
     return EFI_INVALID_PARAMETER;
   }
+  if (Cmdline == NULL) {
+    Cmdline = "";
+  }
+  ZeroMem(Mb, sizeof(*Mb));
 
   EFI_CONFIGURATION_TABLE *ct = gST->ConfigurationTable;
   UINTN n = gST->NumberOfTableEntries;
@@ -376,22 +1950,70 @@ BuildMb2InfoBelow4G(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, VOID **OutMb, UINT32 *Out
 
   UINTN rsdpLen = Acpi2 ? 36 : 20;
 
+  // Size the final map from the current one, plus slack.
+  UINTN  mapSize = 0, mapKey = 0, descSize = 0;
+  UINT32 descVer = 0;
+  EFI_STATUS st = gBS->GetMemoryMap(&mapSize, NULL, &mapKey, &descSize, &descVer);
+  if (st != EFI_BUFFER_TOO_SMALL || descSize == 0) {
+    return EFI_ERROR(st) ? st : EFI_DEVICE_ERROR;
+  }
+  Mb->MapCap      = mapSize + MMAP_SLACK_DESC * descSize;
+  Mb->WantMmap    = Mb2Wants(Req, MB2_TAG_TYPE_MMAP);
+  Mb->WantEfiMmap = Mb2Wants(Req, MB2_TAG_TYPE_EFI_MMAP);
+
+  BOOLEAN wantCmdline = Mb2Wants(Req, MB2_TAG_TYPE_CMDLINE);
+  UINTN reserve = 0;
+  if (wantCmdline) {
+    reserve += MB2_ALIGN8(sizeof(MB2_TAG) + AsciiStrLen(Cmdline) + 1);
+  }
+  if (Mb->WantEfiMmap) {
+    reserve += sizeof(MB2_TAG_EFI_MMAP) + Mb->MapCap + 8;
+  }
+  if (Mb->WantMmap) {
+    reserve += sizeof(MB2_TAG_MMAP) + (Mb->MapCap / descSize) * sizeof(MB2_MMAP_ENTRY);
+  }
+  BOOLEAN wantMods = Mb2Wants(Req, MB2_TAG_TYPE_MODULE);
+  if (wantMods) {
+    for (UINTN i = 0; i < ModCount; i++) {
+      reserve += MB2_ALIGN8(Mb2ModuleTagSize(&Mods[i]));
+    }
+  }
+  Mb->Size = MB2_FIXED_MAX + reserve;
+
+  EFI_PHYSICAL_ADDRESS mapPhys = 0xFFFFFFFFull;
+  st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(Mb->MapCap), &mapPhys);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+  Mb->Map = (VOID *)(UINTN)mapPhys;
+
   EFI_PHYSICAL_ADDRESS max = 0xFFFFFFFFull;
-  EFI_STATUS st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(4096), &max);
+  st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(Mb->Size), &max);
   if (EFI_ERROR(st)) {
+    gBS->FreePages(mapPhys, EFI_SIZE_TO_PAGES(Mb->MapCap));
     return st;
   }
 
   UINT8 *buf = (UINT8 *)(UINTN)max;
-  SetMem(buf, 4096, 0);
+  SetMem(buf, Mb->Size, 0);
 
   MB2_INFO *info = (MB2_INFO *)buf;
   UINT32 off = sizeof(MB2_INFO);
 
+  // Command line tag (type=1), empty when no parameters were given
+  if (wantCmdline) {
+    MB2_TAG_STRING *t = (MB2_TAG_STRING *)(buf + off);
+    t->tag.type = MB2_TAG_TYPE_CMDLINE;
+    UINT32 sl = (UINT32)AsciiStrLen(Cmdline) + 1;
+    t->tag.size = sizeof(MB2_TAG) + sl;
+    CopyMem(t->string, Cmdline, sl);
+    off += MB2_ALIGN8(t->tag.size);
+  }
+
   // Bootloader name tag (type=2)
-  {
+  if (Mb2Wants(Req, MB2_TAG_TYPE_BOOT_LOADER_NAME)) {
     MB2_TAG_STRING *t = (MB2_TAG_STRING *)(buf + off);
-    t->tag.type = 2;
+    t->tag.type = MB2_TAG_TYPE_BOOT_LOADER_NAME;
     CONST CHAR8 *name = "Lab4BootLoader";
     UINT32 sl = (UINT32)AsciiStrLen(name) + 1;
     t->tag.size = sizeof(MB2_TAG) + sl;
@@ -399,39 +2021,56 @@ BuildMb2InfoBelow4G(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, VOID **OutMb, UINT32 *Out
     off += MB2_ALIGN8(t->tag.size);
   }
 
+  // Module tags (type=3), in command line order
+  for (UINTN i = 0; wantMods && i < ModCount; i++) {
+    MB2_TAG_MODULE *t = (MB2_TAG_MODULE *)(buf + off);
+    t->tag.type  = MB2_TAG_TYPE_MODULE;
+    t->tag.size  = Mb2ModuleTagSize(&Mods[i]);
+    t->mod_start = (UINT32)Mods[i].Start;
+    t->mod_end   = (UINT32)(Mods[i].Start + Mods[i].Size);
+    CopyMem(t->cmdline, Mods[i].Cmdline, AsciiStrLen(Mods[i].Cmdline) + 1);
+    off += MB2_ALIGN8(t->tag.size);
+  }
+
   // Framebuffer tag (type=8)
-  {
+  if (Mb2Wants(Req, MB2_TAG_TYPE_FRAMEBUFFER)) {
     MB2_TAG_FRAMEBUFFER *t = (MB2_TAG_FRAMEBUFFER *)(buf + off);
-    t->tag.type = 8;
-    t->tag.size = sizeof(MB2_TAG_FRAMEBUFFER);
-
-    t->framebuffer_addr   = (UINT64)Gop->Mode->FrameBufferBase;
-    t->framebuffer_pitch  = (UINT32)(Gop->Mode->Info->PixelsPerScanLine * 4);
-    t->framebuffer_width  = (UINT32)Gop->Mode->Info->HorizontalResolution;
-    t->framebuffer_height = (UINT32)Gop->Mode->Info->VerticalResolution;
-    t->framebuffer_bpp    = 32;
-    t->framebuffer_type   = 1;
-
-    t->red_field_position   = 16; t->red_mask_size   = 8;
-    t->green_field_position = 8;  t->green_mask_size = 8;
-    t->blue_field_position  = 0;  t->blue_mask_size  = 8;
-
-    off += MB2_ALIGN8(t->tag.size);
+    if (FillFramebufferTag(Gop, t)) {
+      t->tag.type = MB2_TAG_TYPE_FRAMEBUFFER;
+      t->tag.size = sizeof(MB2_TAG_FRAMEBUFFER);
+      off += MB2_ALIGN8(t->tag.size);
+    } else {
+      SetMem(t, sizeof(*t), 0);
+      DEBUG((DEBUG_ERROR, "[BL] GOP mode has no linear framebuffer, no fb tag\n"));
+    }
   }
 
   // ACPI tag (type=14 or 15)
-  {
+  if (Mb2Wants(Req, Acpi2 ? MB2_TAG_TYPE_ACPI_NEW : MB2_TAG_TYPE_ACPI_OLD)) {
     MB2_TAG *t = (MB2_TAG *)(buf + off);
-    t->type = Acpi2 ? 15 : 14;
+    t->type = Acpi2 ? MB2_TAG_TYPE_ACPI_NEW : MB2_TAG_TYPE_ACPI_OLD;
     t->size = (UINT32)(sizeof(MB2_TAG) + rsdpLen);
     CopyMem((UINT8 *)t + sizeof(MB2_TAG), Rsdp, rsdpLen);
     off += MB2_ALIGN8(t->size);
   }
 
-  // End tag
+  // Boot timeline (vendor tag)
+  if (Mb2Wants(Req, MB2_TAG_BOOT_TIMELINE)) {
+    MB2_TAG_TIMELINE *t = (MB2_TAG_TIMELINE *)(buf + off);
+    t->tag.type = MB2_TAG_BOOT_TIMELINE;
+    t->tag.size = sizeof(MB2_TAG_TIMELINE);
+    t->tsc_khz  = (UINT32)TscKhz();
+    t->count    = BL_STAGE_COUNT;
+    CopyMem(t->tsc, mStamps, sizeof(t->tsc));
+    mStamps = t->tsc;
+    off += MB2_ALIGN8(t->tag.size);
+  }
+
+  // End tag; Mb2FinishMemoryMap moves it behind the map tags.
+  Mb->MapOff = off;
   {
     MB2_TAG *t = (MB2_TAG *)(buf + off);
-    t->type = 0;
+    t->type = MB2_TAG_TYPE_END;
     t->size = 8;
     off += 8;
   }
@@ -439,48 +2078,246 @@ BuildMb2InfoBelow4G(EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, VOID **OutMb, UINT32 *Out
   info->total_size = off;
   info->reserved   = 0;
 
-  *OutMb     = buf;
-  *OutMbPhys = (UINT32)(UINTN)max;
+  Mb->Buf  = buf;
+  Mb->Phys = (UINT32)(UINTN)max;
+
+  DEBUG((DEBUG_INFO, "[BL] MB2 info at %08x: %u bytes reserved, map buffer %u bytes (%u descriptors now)\n",
+         Mb->Phys, (UINT32)Mb->Size, (UINT32)Mb->MapCap, (UINT32)(mapSize / descSize)));
   return EFI_SUCCESS;
 }
 
-STATIC EFI_STATUS
-ExitBootServicesSafe(EFI_HANDLE ImageHandle)
+// Loader code and data stay reserved: they hold the kernel, the info block,
+// the page tables and the boot stack. Boot services memory is free once
+// ExitBootServices has returned.
+STATIC UINT32
+Mb2MmapType(UINT32 EfiType)
 {
-  EFI_STATUS st;
-  UINTN mapKey = 0, descSize = 0, mapSize = 0;
+  switch (EfiType) {
+  case EfiConventionalMemory:
+  case EfiBootServicesCode:
+  case EfiBootServicesData:
+    return MB2_MMAP_AVAILABLE;
+  case EfiACPIReclaimMemory:
+    return MB2_MMAP_ACPI_RECLAIMABLE;
+  case EfiACPIMemoryNVS:
+    return MB2_MMAP_NVS;
+  case EfiUnusableMemory:
+    return MB2_MMAP_BADRAM;
+  default:
+    return MB2_MMAP_RESERVED;
+  }
+}
+
+// Sorts the descriptors by address, so neighbours can be merged.
+STATIC VOID
+SortMemoryMap(UINT8 *Map, UINTN Count, UINTN DescSize)
+{
+  UINT8 tmp[128];
+  if (DescSize > sizeof(tmp)) {
+    return;
+  }
+
+  for (UINTN i = 1; i < Count; i++) {
+    CopyMem(tmp, Map + i * DescSize, DescSize);
+    UINT64 key = ((EFI_MEMORY_DESCRIPTOR *)tmp)->PhysicalStart;
+    UINTN  j   = i;
+    while (j > 0 && ((EFI_MEMORY_DESCRIPTOR *)(Map + (j - 1) * DescSize))->PhysicalStart > key) {
+      CopyMem(Map + j * DescSize, Map + (j - 1) * DescSize, DescSize);
+      j--;
+    }
+    CopyMem(Map + j * DescSize, tmp, DescSize);
+  }
+}
+
+// Writes the requested memory map tags from the final map and closes the
+// block. Runs after ExitBootServices: no boot services, no DEBUG output.
+STATIC VOID
+Mb2FinishMemoryMap(MB2_BUILD *Mb, UINTN MapSize, UINTN DescSize, UINT32 DescVer)
+{
+  UINT8  *buf = Mb->Buf;
+  UINT32 off  = Mb->MapOff;
+  UINTN  n    = MapSize / DescSize;
+
+  // Tag 17: the descriptors exactly as the firmware returned them.
+  if (Mb->WantEfiMmap) {
+    MB2_TAG_EFI_MMAP *t = (MB2_TAG_EFI_MMAP *)(buf + off);
+    t->tag.type   = MB2_TAG_TYPE_EFI_MMAP;
+    t->tag.size   = (UINT32)(sizeof(*t) + MapSize);
+    t->descr_size = (UINT32)DescSize;
+    t->descr_vers = DescVer;
+    CopyMem(t + 1, Mb->Map, MapSize);
+    off += MB2_ALIGN8(t->tag.size);
+  }
+
+  // Tag 6: sorted, with neighbours of the same kind merged.
+  if (Mb->WantMmap) {
+    MB2_TAG_MMAP   *t = (MB2_TAG_MMAP *)(buf + off);
+    MB2_MMAP_ENTRY *e = (MB2_MMAP_ENTRY *)(t + 1);
+    UINTN          m  = 0;
+
+    SortMemoryMap(Mb->Map, n, DescSize);
+    for (UINTN i = 0; i < n; i++) {
+      EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)Mb->Map + i * DescSize);
+      UINT32 type = Mb2MmapType(d->Type);
+      UINT64 len  = d->NumberOfPages * EFI_PAGE_SIZE;
+
+      if (m > 0 && e[m - 1].type == type && e[m - 1].base_addr + e[m - 1].length == d->PhysicalStart) {
+        e[m - 1].length += len;
+        continue;
+      }
+      e[m].base_addr = d->PhysicalStart;
+      e[m].length    = len;
+      e[m].type      = type;
+      e[m].zero      = 0;
+      m++;
+    }
+
+    t->tag.type      = MB2_TAG_TYPE_MMAP;
+    t->tag.size      = (UINT32)(sizeof(*t) + m * sizeof(MB2_MMAP_ENTRY));
+    t->entry_size    = sizeof(MB2_MMAP_ENTRY);
+    t->entry_version = 0;
+    off += MB2_ALIGN8(t->tag.size);
+  }
+
+  MB2_TAG *end = (MB2_TAG *)(buf + off);
+  end->type = MB2_TAG_TYPE_END;
+  end->size = 8;
+  off += 8;
+
+  ((MB2_INFO *)buf)->total_size = off;
+}
+
+// Highest address the firmware memory map describes (RAM and MMIO alike).
+STATIC UINT64
+MemoryMapTop(VOID)
+{
+  UINTN  mapSize = 0, mapKey = 0, descSize = 0;
   UINT32 descVer = 0;
 
-  for (UINTN attempt = 0; attempt < 16; attempt++) {
-    mapSize = 0;
-    st = gBS->GetMemoryMap(&mapSize, NULL, &mapKey, &descSize, &descVer);
-    if (st != EFI_BUFFER_TOO_SMALL) {
-      return st;
+  EFI_STATUS st = gBS->GetMemoryMap(&mapSize, NULL, &mapKey, &descSize, &descVer);
+  if (st != EFI_BUFFER_TOO_SMALL) {
+    return 0;
+  }
+
+  mapSize += 2 * descSize;
+  UINT8 *map = AllocatePool(mapSize);
+  if (map == NULL) {
+    return 0;
+  }
+
+  UINT64 top = 0;
+  st = gBS->GetMemoryMap(&mapSize, (EFI_MEMORY_DESCRIPTOR *)map, &mapKey, &descSize, &descVer);
+  if (!EFI_ERROR(st)) {
+    for (UINTN off = 0; off + descSize <= mapSize; off += descSize) {
+      EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + off);
+      UINT64 end = d->PhysicalStart + d->NumberOfPages * EFI_PAGE_SIZE;
+      if (end > top) {
+        top = end;
+      }
     }
+  }
 
-    mapSize += 2 * descSize;
-    VOID *map = AllocatePool(mapSize);
-    if (map == NULL) {
-      return EFI_OUT_OF_RESOURCES;
+  FreePool(map);
+  return top;
+}
+
+#define PTE_P    0x001ull
+#define PTE_RW   0x002ull
+#define PTE_PS   0x080ull
+#define SIZE_2M  (1ull << 21)
+#define SIZE_1G  (1ull << 30)
+
+// Identity map for a 64-bit kernel, which is entered with paging on. It is
+// built in loader pages below 4 GiB, so it survives ExitBootServices and CR3
+// can take it from the trampoline. The map covers at least 4 GiB (MMIO, the
+// framebuffer, ACPI tables) and up to Limit, with 1 GiB pages when the CPU
+// has them (CPUID 8000_0001h EDX.26) and 2 MiB pages otherwise. If the
+// firmware runs with 5-level paging, which cannot be switched off in long
+// mode, a PML5 with a single entry goes on top.
+STATIC EFI_STATUS
+BuildIdentityPageTables(UINT64 Limit, OUT UINT64 *OutRoot)
+{
+  UINT32 maxExt = 0, edx = 0;
+  AsmCpuid(0x80000000, &maxExt, NULL, NULL, NULL);
+  if (maxExt >= 0x80000001) {
+    AsmCpuid(0x80000001, NULL, NULL, NULL, &edx);
+  }
+  BOOLEAN gib = (edx & (1u << 26)) != 0;
+  BOOLEAN la57 = (AsmReadCr4() & (1u << 12)) != 0;
+
+  if (Limit < 4 * SIZE_1G) {
+    Limit = 4 * SIZE_1G;
+  }
+  UINT64 nGiB  = (Limit + SIZE_1G - 1) / SIZE_1G;
+  UINTN  nPdpt = (UINTN)((nGiB + 511) / 512);
+  if (nPdpt > 512) {
+    return EFI_UNSUPPORTED;
+  }
+  UINTN pages = (la57 ? 2 : 1) + nPdpt + (gib ? 0 : (UINTN)nGiB);
+
+  EFI_PHYSICAL_ADDRESS base = 0xFFFFFFFFull;
+  EFI_STATUS st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, pages, &base);
+  if (EFI_ERROR(st)) {
+    return st;
+  }
+  SetMem((VOID *)(UINTN)base, pages * EFI_PAGE_SIZE, 0);
+
+  UINT64 *root = (UINT64 *)(UINTN)base;
+  UINT64 *pml4 = la57 ? root + 512 : root;
+  UINT64 *pdpt = pml4 + 512;
+  UINT64 *pd   = pdpt + nPdpt * 512;
+
+  if (la57) {
+    root[0] = (UINT64)(UINTN)pml4 | PTE_P | PTE_RW;
+  }
+  for (UINTN i = 0; i < nPdpt; i++) {
+    pml4[i] = (UINT64)(UINTN)(pdpt + i * 512) | PTE_P | PTE_RW;
+  }
+  for (UINT64 g = 0; g < nGiB; g++) {
+    if (gib) {
+      pdpt[g] = (g * SIZE_1G) | PTE_P | PTE_RW | PTE_PS;
+      continue;
     }
+    UINT64 *dir = pd + g * 512;
+    pdpt[g] = (UINT64)(UINTN)dir | PTE_P | PTE_RW;
+    for (UINTN j = 0; j < 512; j++) {
+      dir[j] = (g * SIZE_1G + j * SIZE_2M) | PTE_P | PTE_RW | PTE_PS;
+    }
+  }
+
+  DEBUG((DEBUG_INFO, "[BL] identity map: %lu GiB in %a pages, %u table pages at %lx%a\n",
+         nGiB, gib ? "1G" : "2M", (UINT32)pages, (UINT64)base, la57 ? " (5-level)" : ""));
+
+  *OutRoot = base;
+  return EFI_SUCCESS;
+}
 
-    st = gBS->GetMemoryMap(&mapSize, map, &mapKey, &descSize, &descVer);
+// Map is a pre-sized buffer of MapCap bytes: nothing may be allocated
+// between the last GetMemoryMap and ExitBootServices. On success it holds
+// the final memory map.
+STATIC EFI_STATUS
+ExitBootServicesSafe(EFI_HANDLE ImageHandle, VOID *Map, UINTN MapCap,
+                     OUT UINTN *MapSize, OUT UINTN *DescSize, OUT UINT32 *DescVer)
+{
+  EFI_STATUS st;
+  UINTN mapKey = 0;
+
+  for (UINTN attempt = 0; attempt < 16; attempt++) {
+    *MapSize = MapCap;
+    st = gBS->GetMemoryMap(MapSize, (EFI_MEMORY_DESCRIPTOR *)Map, &mapKey, DescSize, DescVer);
     if (EFI_ERROR(st)) {
-      FreePool(map);
+      DEBUG((DEBUG_ERROR, "[BL] GetMemoryMap: %r (need %u, have %u)\n", st, (UINT32)*MapSize, (UINT32)MapCap));
       return st;
     }
 
     st = gBS->ExitBootServices(ImageHandle, mapKey);
 
-    // ВАЖНО: если ExitBootServices успешен — НЕ вызываем FreePool!
-    // После успешного ExitBootServices все Boot Services недоступны
+    // ВАЖНО: после успешного ExitBootServices все Boot Services недоступны
     if (!EFI_ERROR(st)) {
       return EFI_SUCCESS;
     }
 
-    // Если неудача — можно освобождать память и пробовать снова
-    FreePool(map);
-
+    // Если неудача (карта успела измениться) — читаем карту заново в тот же буфер
     if (st != EFI_INVALID_PARAMETER) {
       return st;
     }
@@ -496,6 +2333,7 @@ UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
 {
   (void)SystemTable;
 
+  TimelineMark(BL_STAGE_ENTRY);
   DEBUG((DEBUG_INFO, "\n=== LAB4 BootLoader start ===\n"));
 
   EFI_LOADED_IMAGE_PROTOCOL *Loaded = NULL;
@@ -505,37 +2343,56 @@ UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     return st;
   }
 
-  CHAR16 *KernelPath = GetKernelPathFromLoadOptions(Loaded);
+  BOOT_OPTIONS Opts;
+  ParseLoadOptions(Loaded, &Opts);
+  InitMpServices(!Opts.NoMp);
+  TimelineMark(BL_STAGE_OPTIONS);
+
+  CHAR16 *KernelPath = Opts.KernelPath;
   if (KernelPath == NULL) {
     KernelPath = L"\\kernel.bin";
   }
 
   Print(L"BootLoader: kernel path: %s\n", KernelPath);
   DEBUG((DEBUG_INFO, "[BL] kernel path: %s\n", KernelPath));
+  if (Opts.Cmdline != NULL && Opts.Cmdline[0] != 0) {
+    DEBUG((DEBUG_INFO, "[BL] kernel command line: %a\n", Opts.Cmdline));
+  }
 
-  VOID *KernelBuf = NULL;
+  EFI_FILE_PROTOCOL *KernelRoot = NULL;
+  EFI_FILE_PROTOCOL *KernelFile = NULL;
   UINTN KernelSize = 0;
 
-  st = ReadFileToBufferAnyFs(KernelPath, &KernelBuf, &KernelSize);
+  st = OpenFileAnyFs(Loaded, Opts.DeviceHint, KernelPath, &KernelRoot, &KernelFile, &KernelSize);
   if (EFI_ERROR(st)) {
     Print(L"[BL][FATAL] can't read kernel.bin: %r\n", st);
     DEBUG((DEBUG_ERROR, "[BL] can't read kernel.bin: %r\n", st));
     return st;
   }
+  TimelineMark(BL_STAGE_FILE_OPEN);
 
-  st = ValidateMb2Header(KernelBuf, KernelSize);
+  KERNEL_IMAGE Kernel;
+  st = LoadKernelImage(KernelFile, KernelSize, &Kernel);
+  CloseFileAnyFs(KernelRoot, KernelFile);
   if (EFI_ERROR(st)) {
-    Print(L"[BL][FATAL] MB2 header invalid: %r\n", st);
-    DEBUG((DEBUG_ERROR, "[BL] MB2 header invalid: %r\n", st));
+    Print(L"[BL][FATAL] kernel load failed: %r\n", st);
+    DEBUG((DEBUG_ERROR, "[BL] kernel load failed: %r\n", st));
     return st;
   }
+  TimelineMark(BL_STAGE_ELF_LOADED);
 
-  UINT32 Entry = 0;
-  st = LoadElf32SegmentsBelow4G(KernelBuf, KernelSize, &Entry);
-  if (EFI_ERROR(st)) {
-    Print(L"[BL][FATAL] ELF load failed: %r\n", st);
-    DEBUG((DEBUG_ERROR, "[BL] ELF load failed: %r\n", st));
-    return st;
+  BOOT_MODULE Mods[BL_MAX_MODULES];
+  for (UINTN i = 0; i < Opts.ModuleCount; i++) {
+    st = LoadModule(Loaded, Opts.DeviceHint, Opts.Modules[i], &Mods[i]);
+    if (EFI_ERROR(st)) {
+      Print(L"[BL][FATAL] module %s: %r\n", Opts.Modules[i], st);
+      DEBUG((DEBUG_ERROR, "[BL] module %s: %r\n", Opts.Modules[i], st));
+      return st;
+    }
+  }
+  if (Opts.ModuleCount != 0 && !Mb2Wants(&Kernel.Mb2, MB2_TAG_TYPE_MODULE)) {
+    DEBUG((DEBUG_WARN, "[BL] kernel does not request module tags, %u module(s) unused\n",
+           (UINT32)Opts.ModuleCount));
   }
 
   EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop = NULL;
@@ -545,30 +2402,49 @@ UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     DEBUG((DEBUG_ERROR, "[BL] GOP not found: %r\n", st));
     return st;
   }
+  SelectGopMode(Gop, &Kernel.Mb2);
+  TimelineMark(BL_STAGE_GOP);
 
   Print(L"[BL] GOP: %ux%u fb=%lx\n",
         (UINT32)Gop->Mode->Info->HorizontalResolution,
         (UINT32)Gop->Mode->Info->VerticalResolution,
         (UINT64)Gop->Mode->FrameBufferBase);
 
-  VOID  *MbInfo = NULL;
-  UINT32 MbInfoPhys = 0;
-
-  st = BuildMb2InfoBelow4G(Gop, &MbInfo, &MbInfoPhys);
+  MB2_BUILD Mb;
+  st = BuildMb2InfoBelow4G(Gop, &Kernel.Mb2, Opts.Cmdline, Mods, Opts.ModuleCount, &Mb);
   if (EFI_ERROR(st)) {
     Print(L"[BL][FATAL] BuildMb2Info failed: %r\n", st);
     DEBUG((DEBUG_ERROR, "[BL] BuildMb2Info failed: %r\n", st));
     return st;
   }
+  TimelineMark(BL_STAGE_MB2_BUILT);
 
-  DEBUG((DEBUG_INFO, "[BL] Entry=%08x MbInfo=%08x\n", Entry, MbInfoPhys));
+  DEBUG((DEBUG_INFO, "[BL] Entry=%lx MbInfo=%08x\n", Kernel.Entry, Mb.Phys));
+
+  // A 64-bit kernel needs every address it may touch mapped: RAM, the
+  // framebuffer, and its own segments wherever they were linked.
+  UINT64 PageTables = 0;
+  if (Kernel.Is64) {
+    UINT64 limit = MemoryMapTop();
+    UINT64 kend  = Kernel.Base + EFI_PAGES_TO_SIZE(Kernel.Pages);
+    UINT64 fbend = Gop->Mode->FrameBufferBase + Gop->Mode->FrameBufferSize;
+    limit = (kend > limit) ? kend : limit;
+    limit = (fbend > limit) ? fbend : limit;
+
+    st = BuildIdentityPageTables(limit, &PageTables);
+    if (EFI_ERROR(st)) {
+      Print(L"[BL][FATAL] page tables failed: %r\n", st);
+      DEBUG((DEBUG_ERROR, "[BL] page tables failed: %r\n", st));
+      return st;
+    }
+  }
 
   EFI_PHYSICAL_ADDRESS paddrParams = 0xFFFFFFFFull;
   st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(4096), &paddrParams);
   if (EFI_ERROR(st)) {
     return st;
   }
-  TRAMPOLINE_PARAMS *Params = (TRAMPOLINE_PARAMS *)(UINTN)paddrParams;
+  VOID *Params = (VOID *)(UINTN)paddrParams;
 
   EFI_PHYSICAL_ADDRESS paddrStack = 0xFFFFFFFFull;
   st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(16384), &paddrStack);
@@ -576,11 +2452,24 @@ UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     return st;
   }
 
-  Params->KernelEntry = Entry;
-  Params->MbInfo      = MbInfoPhys;
-  Params->StackTop    = (UINT32)((UINTN)paddrStack + 16384);
+  UINT8 *trampStart = &TrampolineStart;
+  UINT8 *trampEnd   = &TrampolineEnd;
+  if (Kernel.Is64) {
+    TRAMPOLINE64_PARAMS *p = (TRAMPOLINE64_PARAMS *)Params;
+    p->KernelEntry = Kernel.Entry;
+    p->MbInfo      = Mb.Phys;
+    p->StackTop    = (UINT64)paddrStack + 16384;
+    p->PageTables  = PageTables;
+    trampStart     = &Trampoline64Start;
+    trampEnd       = &Trampoline64End;
+  } else {
+    TRAMPOLINE_PARAMS *p = (TRAMPOLINE_PARAMS *)Params;
+    p->KernelEntry = (UINT32)Kernel.Entry;
+    p->MbInfo      = Mb.Phys;
+    p->StackTop    = (UINT32)((UINTN)paddrStack + 16384);
+  }
 
-  UINTN trampSize = (UINTN)(&TrampolineEnd - &TrampolineStart);
+  UINTN trampSize = (UINTN)(trampEnd - trampStart);
 
   EFI_PHYSICAL_ADDRESS paddrTramp = 0xFFFFFFFFull;
   st = gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(trampSize), &paddrTramp);
@@ -588,14 +2477,14 @@ UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     return st;
   }
 
-  CopyMem((VOID *)(UINTN)paddrTramp, &TrampolineStart, trampSize);
+  CopyMem((VOID *)(UINTN)paddrTramp, trampStart, trampSize);
 
   DEBUG((DEBUG_INFO, "[BL] Trampoline copied to %lx (size=%u)\n", (UINT64)paddrTramp, (UINT32)trampSize));
   DEBUG((DEBUG_INFO, "[BL] ExitBootServices...\n"));
 
-  Print(L"[BL] Entry=%08x MbInfo=%08x\n", Entry, MbInfoPhys);
+  Print(L"[BL] Entry=%lx MbInfo=%08x (ELF%u)\n", Kernel.Entry, Mb.Phys, Kernel.Is64 ? 64 : 32);
   Print(L"[BL] TrampolineStart=%p End=%p size=%u\n",
-      &TrampolineStart, &TrampolineEnd, (UINT32)trampSize);
+      trampStart, trampEnd, (UINT32)trampSize);
   Print(L"[BL] paddrTramp=%lx\n", (UINT64)paddrTramp);
 
   UINT8 *tb = (UINT8 *)(UINTN)paddrTramp;
@@ -605,14 +2494,19 @@ UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
   }
   Print(L"\n");
 
-  st = ExitBootServicesSafe(ImageHandle);
+  UINTN  mapSize = 0, descSize = 0;
+  UINT32 descVer = 0;
+  st = ExitBootServicesSafe(ImageHandle, Mb.Map, Mb.MapCap, &mapSize, &descSize, &descVer);
   if (EFI_ERROR(st)) {
     Print(L"[BL][FATAL] ExitBootServices failed: %r\n", st);
     DEBUG((DEBUG_ERROR, "[BL] ExitBootServices failed: %r\n", st));
     return st;
   }
+  Mb2FinishMemoryMap(&Mb, mapSize, descSize, descVer);
+  TimelineMark(BL_STAGE_EXIT_BS);
 
   TRAMP_FUNC Tramp = (TRAMP_FUNC)(UINTN)paddrTramp;
+  TimelineMark(BL_STAGE_JUMP);
   Tramp(Params);
 
   // This code should never be reached - trampoline doesn't return
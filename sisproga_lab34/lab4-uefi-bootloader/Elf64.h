@@ -0,0 +1,36 @@
+#pragma once
+#include <Uefi.h>
+
+#include "Elf32.h"
+
+#define ELFCLASS64 2
+
+typedef struct {
+  UINT8  e_ident[EI_NIDENT];
+  UINT16 e_type;
+  UINT16 e_machine;
+  UINT32 e_version;
+  UINT64 e_entry;
+  UINT64 e_phoff;
+  UINT64 e_shoff;
+  UINT32 e_flags;
+  UINT16 e_ehsize;
+  UINT16 e_phentsize;
+  UINT16 e_phnum;
+  UINT16 e_shentsize;
+  UINT16 e_shnum;
+  UINT16 e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+  UINT32 p_type;
+  UINT32 p_flags;
+  UINT64 p_offset;
+  UINT64 p_vaddr;
+  UINT64 p_paddr;
+  UINT64 p_filesz;
+  UINT64 p_memsz;
+  UINT64 p_align;
+} Elf64_Phdr;
+
+#define EM_X86_64 62
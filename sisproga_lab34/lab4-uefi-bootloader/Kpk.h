@@ -0,0 +1,36 @@
+#pragma once
+#include <Uefi.h>
+
+// Compressed kernel container produced by lab3-kernel/tools/kpack.c.
+//
+//   KPK_HEADER | KPK_BLOCK[block_count] | block data...
+//
+// The raw image (an ELF) is cut into block_size pieces that are compressed
+// independently, so any block can be decoded on its own, straight into its
+// destination. A block whose comp_size equals its raw length is stored.
+
+#define KPK_MAGIC       0x314B504Bu   // "KPK1"
+#define KPK_ALGO_STORE  0
+#define KPK_ALGO_LZ4    1             // LZ4 block format, no frame
+
+// Block 0 must cover the 32 KiB window the MB2 header is searched in, so the
+// headers are available after decoding a single block.
+#define KPK_MIN_BLOCK   32768u
+
+#pragma pack(push,1)
+typedef struct {
+  UINT32 magic;
+  UINT16 algo;
+  UINT16 reserved;
+  UINT32 header_size;   // header plus block table
+  UINT32 raw_size;
+  UINT32 block_size;
+  UINT32 block_count;
+  UINT32 checksum;      // FNV-1a of the block table
+} KPK_HEADER;
+
+typedef struct {
+  UINT32 comp_size;
+  UINT32 raw_hash;      // FNV-1a of the decoded block
+} KPK_BLOCK;
+#pragma pack(pop)
@@ -4,6 +4,33 @@
 #define MB2_HEADER_MAGIC        0xE85250D6u
 #define MB2_BOOTLOADER_MAGIC    0x36d76289u
 
+// Header (kernel -> loader) tag types.
+#define MB2_HEADER_TAG_END             0
+#define MB2_HEADER_TAG_INFO_REQUEST    1
+#define MB2_HEADER_TAG_FRAMEBUFFER     5
+#define MB2_HEADER_TAG_MODULE_ALIGN    6
+#define MB2_HEADER_TAG_OPTIONAL        1   // flags bit 0
+
+// Info (loader -> kernel) tag types.
+#define MB2_TAG_TYPE_END               0
+#define MB2_TAG_TYPE_CMDLINE           1
+#define MB2_TAG_TYPE_BOOT_LOADER_NAME  2
+#define MB2_TAG_TYPE_MODULE            3
+#define MB2_TAG_TYPE_MMAP              6
+#define MB2_TAG_TYPE_FRAMEBUFFER       8
+#define MB2_TAG_TYPE_ACPI_OLD          14
+#define MB2_TAG_TYPE_ACPI_NEW          15
+#define MB2_TAG_TYPE_EFI_MMAP          17
+
+#define MB2_FB_TYPE_RGB                1
+
+// Memory map (tag 6) entry types.
+#define MB2_MMAP_AVAILABLE             1
+#define MB2_MMAP_RESERVED              2
+#define MB2_MMAP_ACPI_RECLAIMABLE      3
+#define MB2_MMAP_NVS                   4
+#define MB2_MMAP_BADRAM                5
+
 #pragma pack(push,1)
 typedef struct {
   UINT32 magic;
@@ -18,6 +45,18 @@ typedef struct {
   UINT32 size;
 } MB2_HEADER_TAG;
 
+typedef struct {
+  MB2_HEADER_TAG tag;
+  UINT32 mbi_tag_types[1];
+} MB2_HEADER_TAG_INFO_REQ;
+
+typedef struct {
+  MB2_HEADER_TAG tag;
+  UINT32 width;         // 0 means no preference
+  UINT32 height;
+  UINT32 depth;
+} MB2_HEADER_TAG_FB;
+
 typedef struct {
   UINT32 total_size;
   UINT32 reserved;
@@ -49,6 +88,56 @@ typedef struct {
   UINT8  blue_field_position;
   UINT8  blue_mask_size;
 } MB2_TAG_FRAMEBUFFER;
+
+typedef struct {
+  UINT64 base_addr;
+  UINT64 length;
+  UINT32 type;
+  UINT32 zero;
+} MB2_MMAP_ENTRY;
+
+typedef struct {
+  MB2_TAG tag;
+  UINT32  mod_start;
+  UINT32  mod_end;      // exclusive
+  CHAR8   cmdline[1];   // NUL-terminated, tag is sized to fit
+} MB2_TAG_MODULE;
+
+typedef struct {
+  MB2_TAG tag;
+  UINT32  entry_size;
+  UINT32  entry_version;
+  // MB2_MMAP_ENTRY entries[] follow
+} MB2_TAG_MMAP;
+
+typedef struct {
+  MB2_TAG tag;
+  UINT32  descr_size;
+  UINT32  descr_vers;
+  // raw EFI_MEMORY_DESCRIPTORs follow, descr_size apart
+} MB2_TAG_EFI_MMAP;
+
+// Vendor tag (outside the range the spec assigns) with the loader's rdtsc
+// stamps, one slot per BL_STAGE_*; 0 means the stage was not reached.
+#define MB2_TAG_BOOT_TIMELINE   0x80000001u
+
+#define BL_STAGE_ENTRY       0
+#define BL_STAGE_OPTIONS     1
+#define BL_STAGE_FILE_OPEN   2
+#define BL_STAGE_MB2_VALID   3
+#define BL_STAGE_ELF_LOADED  4
+#define BL_STAGE_GOP         5
+#define BL_STAGE_MB2_BUILT   6
+#define BL_STAGE_EXIT_BS     7
+#define BL_STAGE_JUMP        8
+#define BL_STAGE_COUNT       9
+
+typedef struct {
+  MB2_TAG tag;
+  UINT32  tsc_khz;      // loader's own calibration against Stall()
+  UINT32  count;
+  UINT64  tsc[BL_STAGE_COUNT];
+} MB2_TAG_TIMELINE;
 #pragma pack(pop)
 
 static inline UINT32 MB2_ALIGN8(UINT32 x) { return (x + 7u) & ~7u; }
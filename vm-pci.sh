@@ -12,6 +12,13 @@ OVMF_FW="$HOSTDIR/OVMF.fd"
 
 CPU="-smp 2,sockets=1,cores=2,threads=1"
 RAM="-m 2G"
+# NUMA=1: two sockets, 1 GiB and two CPUs on each, SLIT distance 21 between them.
+if [ "${NUMA:-0}" = 1 ]; then
+  CPU="-smp 4,sockets=2,cores=2,threads=1"
+  RAM="$RAM -object memory-backend-ram,size=1G,id=ram0 -object memory-backend-ram,size=1G,id=ram1
+    -numa node,nodeid=0,cpus=0-1,memdev=ram0 -numa node,nodeid=1,cpus=2-3,memdev=ram1
+    -numa dist,src=0,dst=1,val=21"
+fi
 NET="-net nic -net user,hostfwd=tcp::2222-:22"
 BAROPTS="-object memory-backend-file,size=64K,share=on,mem-path=$BAR,id=membar2 -device pci-testdev,membar=64K,memdev=membar2"
 FS9P="-fsdev local,id=fsdev0,path=$HOSTDIR,security_model=none,readonly=off -device virtio-9p-pci,fsdev=fsdev0,mount_tag=hostshare"